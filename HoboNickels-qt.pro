@@ -176,6 +176,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/util.h \
     src/uint256.h \
     src/kernel.h \
+    src/secp256k1.h \
     src/pbkdf2.h \
     src/serialize.h \
     src/strlcpy.h \
@@ -190,6 +191,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/init.h \
     src/irc.h \
     src/mruset.h \
+    src/blockindexmap.h \
+    src/blockstore.h \
     src/json/json_spirit_writer_template.h \
     src/json/json_spirit_writer.h \
     src/json/json_spirit_value.h \
@@ -243,6 +246,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/scrypt.h \
     src/hash.h \
     src/checkqueue.h \
+    src/scriptstack.h \
     src/qt/dialogwindowflags.h
 
 SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
@@ -312,7 +316,9 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/qtipcserver.cpp \
     src/qt/rpcconsole.cpp \
     src/noui.cpp \
+    src/blockstore.cpp \
     src/kernel.cpp \
+    src/secp256k1.cpp \
     src/scrypt-arm.S \
     src/scrypt-x86.S \
     src/scrypt-x86_64.S \
@@ -0,0 +1,217 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Script verification queue benchmark.
+//
+// Runs the verifications of a simulated block through a CCheckQueue with 1 to
+// -maxthreads threads, doubling the thread count each time. The block is added
+// one transaction at a time, as ConnectBlock does. The checks are either the
+// signature checks of pay-to-pubkey-hash inputs, or hashes of a few bytes to
+// show the cost of the queue itself. A block with one invalid input is run
+// with every thread count too, the exit code is 1 if any result is wrong.
+
+#include "checkqueue.h"
+#include "main.h"
+#include "script.h"
+#include "keystore.h"
+#include "util.h"
+#include "wallet.h"
+
+#include <boost/thread.hpp>
+
+using namespace std;
+
+CWalletManager* pWalletManager;
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+extern void noui_connect();
+
+void Shutdown(void* parg)
+{
+  exit(0);
+}
+
+void StartShutdown()
+{
+  exit(0);
+}
+
+// Hash of a buffer, as cheap a check as the queue is likely to see
+class CHashCheck
+{
+private:
+    const vector<unsigned char>* pvch;
+    bool fValid;
+
+public:
+    CHashCheck() : pvch(NULL), fValid(true) {}
+    CHashCheck(const vector<unsigned char>& vch, bool fValidIn) : pvch(&vch), fValid(fValidIn) {}
+
+    bool operator()() const
+    {
+        return Hash(pvch->begin(), pvch->end()) != 0 && fValid;
+    }
+
+    void swap(CHashCheck& check)
+    {
+        std::swap(pvch, check.pvch);
+        std::swap(fValid, check.fValid);
+    }
+};
+
+// Verify vvChecks, one vector per transaction, on nThreads threads nRounds
+// times. Returns the elapsed milliseconds, fOk is whether every round passed.
+template<typename T>
+static int64_t RunQueue(const vector<vector<T> >& vvChecks, int nThreads, int nRounds, bool& fOk)
+{
+    CCheckQueue<T>* pqueue = new CCheckQueue<T>(128);
+    boost::thread_group threads;
+    for (int i = 1; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<T>::Thread, pqueue));
+
+    fOk = true;
+    int64_t nStart = GetTimeMillis();
+    for (int nRound = 0; nRound < nRounds; nRound++)
+    {
+        CCheckQueueControl<T> control(pqueue);
+        for (unsigned int i = 0; i < vvChecks.size(); i++)
+        {
+            vector<T> vChecks = vvChecks[i];
+            control.Add(vChecks);
+        }
+        fOk &= control.Wait();
+    }
+    int64_t nElapsed = GetTimeMillis() - nStart;
+
+    pqueue->Quit();
+    threads.join_all();
+    delete pqueue;
+    return nElapsed;
+}
+
+template<typename T>
+static bool RunScaling(const char* pszName, const vector<vector<T> >& vvChecks, const vector<vector<T> >& vvInvalid, int nMaxThreads, int nRounds)
+{
+    uint64_t nChecks = 0;
+    for (unsigned int i = 0; i < vvChecks.size(); i++)
+        nChecks += vvChecks[i].size();
+    nChecks *= nRounds;
+
+    printf("%s: %u transactions, %u checks per round, %d rounds\n", pszName, (unsigned int)vvChecks.size(), (unsigned int)(nChecks / nRounds), nRounds);
+    bool fPassed = true;
+    double dRateSingle = 0;
+    for (int nThreads = 1; ; nThreads = min(nThreads * 2, nMaxThreads))
+    {
+        bool fOk, fInvalidOk;
+        int64_t nElapsed = RunQueue(vvChecks, nThreads, nRounds, fOk);
+        RunQueue(vvInvalid, nThreads, 1, fInvalidOk);
+        if (!fOk || fInvalidOk)
+        {
+            printf("MISMATCH: %d threads, valid block %s, invalid block %s\n", nThreads, fOk ? "passed" : "failed", fInvalidOk ? "passed" : "failed");
+            fPassed = false;
+        }
+
+        double dRate = nChecks * 1000.0 / max(nElapsed, (int64_t)1);
+        if (nThreads == 1)
+            dRateSingle = dRate;
+        printf("%s", strprintf("  %2d threads %8d ms %12.0f checks/s %6.2fx\n",
+            nThreads, nElapsed, dRate, dRateSingle > 0 ? dRate / dRateSingle : 0.0).c_str());
+        if (nThreads == nMaxThreads)
+            break;
+    }
+    return fPassed;
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    if (mapArgs.count("-?") || mapArgs.count("--help"))
+    {
+        printf("Usage: bench_checkqueue [options]\n"
+               "  -check=<script|hash> Checks to run, or both if not given\n"
+               "  -txs=<n>             Transactions in the block (default: 500)\n"
+               "  -inputs=<n>          Inputs per transaction (default: 4)\n"
+               "  -hashsize=<n>        Bytes hashed by a hash check (default: 64)\n"
+               "  -rounds=<n>          Times the block is verified per thread count (default: 5)\n"
+               "  -maxthreads=<n>      Largest number of threads, at most 65 (default: 32)\n");
+        return 0;
+    }
+
+    fPrintToConsole = true;
+    noui_connect();
+
+    unsigned int nTxs = max((int64_t)1, GetArg("-txs", 500));
+    unsigned int nInputs = max((int64_t)1, GetArg("-inputs", 4));
+    int nRounds = max((int64_t)1, GetArg("-rounds", 5));
+    int nMaxThreads = min((int64_t)MAX_CHECKQUEUE_WORKERS + 1, max((int64_t)1, GetArg("-maxthreads", 32)));
+    string strCheck = GetArg("-check", "");
+    bool fPassed = true;
+
+    if (strCheck.empty() || strCheck == "hash")
+    {
+        vector<unsigned char> vch(max((int64_t)1, GetArg("-hashsize", 64)), 0x5a);
+        vector<vector<CHashCheck> > vvChecks(nTxs, vector<CHashCheck>(nInputs, CHashCheck(vch, true)));
+        vector<vector<CHashCheck> > vvInvalid = vvChecks;
+        vvInvalid[nTxs / 2][nInputs - 1] = CHashCheck(vch, false);
+        fPassed &= RunScaling("hash", vvChecks, vvInvalid, nMaxThreads, nRounds);
+    }
+
+    if (strCheck.empty() || strCheck == "script")
+    {
+        // Every input spends its own output of one funding transaction
+        CBasicKeyStore keystore;
+        vector<CKey> vKeys(16);
+        CTransaction txFrom;
+        txFrom.vout.resize(nTxs * nInputs);
+        for (unsigned int i = 0; i < vKeys.size(); i++)
+        {
+            vKeys[i].MakeNewKey(true);
+            keystore.AddKey(vKeys[i]);
+        }
+        for (unsigned int i = 0; i < txFrom.vout.size(); i++)
+        {
+            txFrom.vout[i].nValue = COIN;
+            txFrom.vout[i].scriptPubKey.SetDestination(vKeys[i % vKeys.size()].GetPubKey().GetID());
+        }
+
+        printf("signing %u inputs\n", nTxs * nInputs);
+        uint256 hashFrom = txFrom.GetHash();
+        vector<CTransaction> vtx(nTxs);
+        for (unsigned int i = 0; i < nTxs; i++)
+        {
+            vtx[i].vin.resize(nInputs);
+            vtx[i].vout.resize(1);
+            vtx[i].vout[0].nValue = nInputs * COIN;
+            vtx[i].vout[0].scriptPubKey = txFrom.vout[i].scriptPubKey;
+            for (unsigned int j = 0; j < nInputs; j++)
+                vtx[i].vin[j].prevout = COutPoint(hashFrom, i * nInputs + j);
+            for (unsigned int j = 0; j < nInputs; j++)
+                if (!SignSignature(keystore, txFrom, vtx[i], j))
+                {
+                    fprintf(stderr, "Error: unable to sign input %u of transaction %u\n", j, i);
+                    return 1;
+                }
+        }
+
+        // The invalid block has a transaction changed after it was signed
+        CTransaction txInvalid = vtx[nTxs / 2];
+        txInvalid.vout[0].nValue++;
+
+        // Signatures are verified, not found in the cache
+        InitSignatureCache(0);
+
+        vector<vector<CScriptCheck> > vvChecks(nTxs), vvInvalid(nTxs);
+        for (unsigned int i = 0; i < nTxs; i++)
+            for (unsigned int j = 0; j < nInputs; j++)
+            {
+                vvChecks[i].push_back(CScriptCheck(txFrom, vtx[i], j, SCRIPT_VERIFY_NOCACHE | SCRIPT_VERIFY_P2SH, 0));
+                vvInvalid[i].push_back(CScriptCheck(txFrom, i == nTxs / 2 ? txInvalid : vtx[i], j, SCRIPT_VERIFY_NOCACHE | SCRIPT_VERIFY_P2SH, 0));
+            }
+        fPassed &= RunScaling("script", vvChecks, vvInvalid, nMaxThreads, nRounds);
+    }
+
+    printf("%s\n", fPassed ? "OK" : "FAILED");
+    return fPassed ? 0 : 1;
+}
@@ -0,0 +1,226 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Script interpreter opcode throughput benchmark.
+//
+// Verifies the scripts of script_valid.json and script_invalid.json, as the
+// script_valid and script_invalid unit tests do, -rounds times and reports the
+// scripts and opcodes run per second. A few generated scripts that stay within
+// the opcode limit follow: numeric opcodes, stack opcodes moving pubkey and
+// signature sized elements, and OP_PICK/OP_ROLL. The json files have few
+// signature checks, so the time is spent in the interpreter itself. The exit
+// code is 1 if any script gives the wrong result.
+
+#include "main.h"
+#include "script.h"
+#include "util.h"
+#include "wallet.h"
+#include "json/json_spirit_reader_template.h"
+
+#include <fstream>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/replace.hpp>
+#include <boost/algorithm/string/split.hpp>
+
+using namespace std;
+using namespace json_spirit;
+using namespace boost::algorithm;
+
+CWalletManager* pWalletManager;
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+extern void noui_connect();
+
+void Shutdown(void* parg)
+{
+  exit(0);
+}
+
+void StartShutdown()
+{
+  exit(0);
+}
+
+// Same syntax as ParseScript in test/script_tests.cpp
+static bool ParseScript(const string& s, CScript& result)
+{
+    static map<string, opcodetype> mapOpNames;
+
+    if (mapOpNames.size() == 0)
+    {
+        for (int op = OP_NOP; op <= OP_NOP10; op++)
+        {
+            const char* name = GetOpName((opcodetype)op);
+            if (strcmp(name, "OP_UNKNOWN") == 0)
+                continue;
+            string strName(name);
+            mapOpNames[strName] = (opcodetype)op;
+            replace_first(strName, "OP_", "");
+            mapOpNames[strName] = (opcodetype)op;
+        }
+    }
+
+    vector<string> words;
+    split(words, s, is_any_of(" \t\n"), token_compress_on);
+
+    result = CScript();
+    BOOST_FOREACH(string w, words)
+    {
+        if (all(w, is_digit()) ||
+            (starts_with(w, "-") && all(string(w.begin()+1, w.end()), is_digit())))
+            result << atoi64(w);
+        else if (starts_with(w, "0x") && IsHex(string(w.begin()+2, w.end())))
+        {
+            vector<unsigned char> raw = ParseHex(string(w.begin()+2, w.end()));
+            result.insert(result.end(), raw.begin(), raw.end());
+        }
+        else if (w.size() >= 2 && starts_with(w, "'") && ends_with(w, "'"))
+            result << vector<unsigned char>(w.begin()+1, w.end()-1);
+        else if (mapOpNames.count(w))
+            result << mapOpNames[w];
+        else
+            return false;
+    }
+    return true;
+}
+
+struct CScriptCase
+{
+    CScript scriptSig;
+    CScript scriptPubKey;
+    bool fValid;
+};
+
+static unsigned int CountOps(const CScript& script)
+{
+    unsigned int nOps = 0;
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    while (pc < script.end() && script.GetOp(pc, opcode))
+        nOps++;
+    return nOps;
+}
+
+static bool LoadCases(const string& strFile, bool fValid, vector<CScriptCase>& vCases)
+{
+    ifstream file(strFile.c_str());
+    Value v;
+    if (!read_stream(file, v) || v.type() != array_type)
+        return false;
+
+    BOOST_FOREACH(const Value& tv, v.get_array())
+    {
+        const Array& test = tv.get_array();
+        if (test.size() < 2)
+            continue;
+        CScriptCase testcase;
+        testcase.fValid = fValid;
+        if (!ParseScript(test[0].get_str(), testcase.scriptSig) || !ParseScript(test[1].get_str(), testcase.scriptPubKey))
+            return false;
+        vCases.push_back(testcase);
+    }
+    return true;
+}
+
+// Verify every case nRounds times, print the rates and return whether every
+// result was as expected
+static bool RunCases(const char* pszName, const vector<CScriptCase>& vCases, int nRounds)
+{
+    uint64_t nOps = 0;
+    for (unsigned int i = 0; i < vCases.size(); i++)
+        nOps += CountOps(vCases[i].scriptSig) + CountOps(vCases[i].scriptPubKey);
+
+    CTransaction tx;
+    bool fPassed = true;
+    int64_t nStart = GetTimeMicros();
+    for (int nRound = 0; nRound < nRounds; nRound++)
+        for (unsigned int i = 0; i < vCases.size(); i++)
+            if (VerifyScript(vCases[i].scriptSig, vCases[i].scriptPubKey, tx, 0, SCRIPT_VERIFY_P2SH, SIGHASH_NONE) != vCases[i].fValid)
+            {
+                if (nRound == 0)
+                    printf("MISMATCH: %s script %u\n", pszName, i);
+                fPassed = false;
+            }
+    int64_t nElapsed = max(GetTimeMicros() - nStart, (int64_t)1);
+
+    double dScripts = (double)vCases.size() * nRounds;
+    printf("%s", strprintf("%-10s %6u scripts %8d ms %12.0f scripts/s %12.0f opcodes/s %8.0f ns/opcode\n",
+        pszName, (unsigned int)vCases.size(), (int)(nElapsed / 1000), dScripts * 1000000 / nElapsed,
+        nOps * nRounds * 1000000.0 / nElapsed, nElapsed * 1000.0 / max(nOps * nRounds, (uint64_t)1)).c_str());
+    return fPassed;
+}
+
+static void AddGeneratedCases(vector<CScriptCase>& vNumeric, vector<CScriptCase>& vStack, vector<CScriptCase>& vPick)
+{
+    CScriptCase testcase;
+    testcase.fValid = true;
+
+    // Counts to 49 by 1 ADD 1ADD 2 SUB 1ADD
+    testcase.scriptPubKey = CScript() << OP_0;
+    for (int i = 0; i < 49; i++)
+        testcase.scriptPubKey << OP_1 << OP_ADD << OP_1ADD << OP_2 << OP_SUB << OP_1ADD;
+    testcase.scriptPubKey << (int64_t)49 << OP_NUMEQUAL;
+    vNumeric.push_back(testcase);
+
+    // A signature and an uncompressed pubkey moved around the stacks
+    vector<unsigned char> vchSig(72, 0x30), vchPubKey(65, 0x04);
+    testcase.scriptPubKey = CScript() << vchSig << vchPubKey;
+    for (int i = 0; i < 19; i++)
+        testcase.scriptPubKey << OP_2DUP << OP_2DROP << OP_DUP << OP_DROP << OP_OVER << OP_SWAP << OP_NIP
+                              << OP_TOALTSTACK << OP_FROMALTSTACK << OP_SWAP;
+    testcase.scriptPubKey << OP_DEPTH << OP_2 << OP_EQUAL;
+    vStack.push_back(testcase);
+
+    // Compressed pubkeys picked and rolled from deep in the stack
+    vector<unsigned char> vchKey(33, 0x02);
+    testcase.scriptPubKey = CScript();
+    for (int i = 0; i < 16; i++)
+        testcase.scriptPubKey << vchKey;
+    for (int i = 0; i < 66; i++)
+        testcase.scriptPubKey << OP_15 << OP_ROLL << OP_9 << OP_PICK << OP_DROP;
+    testcase.scriptPubKey << OP_SIZE << (int64_t)33 << OP_EQUAL;
+    vPick.push_back(testcase);
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    if (mapArgs.count("-?") || mapArgs.count("--help"))
+    {
+        printf("Usage: bench_script [options]\n"
+               "  -testdata=<dir>      Directory of script_valid.json and script_invalid.json (default: test/data)\n"
+               "  -rounds=<n>          Times each json file is verified (default: 200)\n"
+               "  -genrounds=<n>       Times each generated script is verified (default: 20000)\n");
+        return 0;
+    }
+
+    fPrintToConsole = true;
+    noui_connect();
+
+    string strDir = GetArg("-testdata", "test/data");
+    int nRounds = max((int64_t)1, GetArg("-rounds", 200));
+    int nGenRounds = max((int64_t)1, GetArg("-genrounds", 20000));
+
+    vector<CScriptCase> vValid, vInvalid;
+    if (!LoadCases(strDir + "/script_valid.json", true, vValid) || !LoadCases(strDir + "/script_invalid.json", false, vInvalid))
+    {
+        fprintf(stderr, "Error: unable to read the script tests in %s\n", strDir.c_str());
+        return 1;
+    }
+
+    vector<CScriptCase> vNumeric, vStack, vPick;
+    AddGeneratedCases(vNumeric, vStack, vPick);
+
+    bool fPassed = true;
+    fPassed &= RunCases("valid", vValid, nRounds);
+    fPassed &= RunCases("invalid", vInvalid, nRounds);
+    fPassed &= RunCases("numeric", vNumeric, nGenRounds);
+    fPassed &= RunCases("stack", vStack, nGenRounds);
+    fPassed &= RunCases("pickroll", vPick, nGenRounds);
+
+    printf("%s\n", fPassed ? "OK" : "FAILED");
+    return fPassed ? 0 : 1;
+}
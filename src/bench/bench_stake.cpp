@@ -0,0 +1,240 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Offline stake kernel search benchmark.
+//
+// Replays the kernel search of a set of stake candidates over a simulated time
+// range, without a network or block chain. The candidates are generated, or
+// read from a file with one candidate per line:
+//
+//     nTxTime nBlockTime nTxOffset nOut nValue nStakeModifier(hex)
+//
+// The hits of the reference path (CDataStream hashing and CBigNum targets, as
+// CheckStakeKernelHash does) are compared with those of the look-ahead planner
+// and of ScanForStakeKernelHash, the exit code is 1 on any difference.
+
+#include "bignum.h"
+#include "kernel.h"
+#include "main.h"
+#include "util.h"
+#include "wallet.h"
+
+#include <fstream>
+#include <sys/resource.h>
+
+using namespace std;
+
+CWalletManager* pWalletManager;
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+extern void noui_connect();
+
+void Shutdown(void* parg)
+{
+  exit(0);
+}
+
+void StartShutdown()
+{
+  exit(0);
+}
+
+static bool LoadCandidates(const string& strFile, vector<CWalletTx>& vtx, vector<unsigned int>& vnBlockTime,
+                           vector<unsigned int>& vnTxOffset, vector<uint64_t>& vnStakeModifier)
+{
+    ifstream file(strFile.c_str());
+    if (!file.is_open())
+        return false;
+
+    unsigned int nTxTime, nBlockTime, nTxOffset, nOut;
+    int64_t nValue;
+    string strModifier;
+    while (file >> nTxTime >> nBlockTime >> nTxOffset >> nOut >> nValue >> strModifier)
+    {
+        CWalletTx wtx;
+        wtx.nTime = nTxTime;
+        wtx.vout.resize(nOut + 1);
+        wtx.vout[nOut].nValue = nValue;
+        vtx.push_back(wtx);
+        vnBlockTime.push_back(nBlockTime);
+        vnTxOffset.push_back(nTxOffset);
+        vnStakeModifier.push_back(strtoull(strModifier.c_str(), NULL, 16));
+    }
+    return true;
+}
+
+static void GenerateCandidates(unsigned int nCount, unsigned int nTimeStart, vector<CWalletTx>& vtx, vector<unsigned int>& vnBlockTime,
+                               vector<unsigned int>& vnTxOffset, vector<uint64_t>& vnStakeModifier)
+{
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        // Outputs of 1 to 10000 coins aged between the min age and the max age
+        CWalletTx wtx;
+        wtx.nTime = nTimeStart - GetStakeMinAge() - GetRand(nStakeMaxAge - GetStakeMinAge());
+        wtx.vout.resize(1 + GetRand(3));
+        wtx.vout.back().nValue = (1 + GetRand(10000)) * COIN + GetRand(COIN);
+        vtx.push_back(wtx);
+        vnBlockTime.push_back(wtx.nTime + GetRand(60));
+        vnTxOffset.push_back(81 + GetRand(100000));
+        vnStakeModifier.push_back(GetRand(std::numeric_limits<uint64_t>::max()));
+    }
+}
+
+// Reference kernel check, as done by CheckStakeKernelHash
+static bool CheckReferenceKernel(const CStakeCandidates& candidates, unsigned int nPos, unsigned int nBits, unsigned int nTimeTx)
+{
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    CBigNum bnCoinDayWeight = CBigNum(candidates.vnValue[nPos]) * GetWeight((int64_t)candidates.vnTxTime[nPos], (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
+
+    CDataStream ss(SER_GETHASH, 0);
+    ss << candidates.vnStakeModifier[nPos];
+    ss << candidates.vnBlockTime[nPos] << candidates.vnTxOffset[nPos] << candidates.vnTxTime[nPos] << candidates.vnOut[nPos] << nTimeTx;
+    uint256 hashProofOfStake = Hash(ss.begin(), ss.end());
+
+    return !(CBigNum(hashProofOfStake) > bnCoinDayWeight * bnTargetPerCoinDay);
+}
+
+static void PrintRate(const char* pszName, uint64_t nChecks, int64_t nElapsed, size_t nHits)
+{
+    printf("%s", strprintf("%-24s %12d kernels %8d ms %12.0f kernels/s %8d hits\n",
+        pszName, nChecks, nElapsed, nChecks * 1000.0 / max(nElapsed, (int64_t)1), nHits).c_str());
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    if (mapArgs.count("-?") || mapArgs.count("--help"))
+    {
+        printf("Usage: bench_stake [options]\n"
+               "  -candidates=<file>  Read stake candidates from <file> instead of generating them\n"
+               "  -coins=<n>          Number of generated stake candidates (default: 10000)\n"
+               "  -bits=<hex>         Compact stake target (default: 1c0fffff)\n"
+               "  -start=<time>       First simulated timestamp (default: now)\n"
+               "  -seconds=<n>        Length of the simulated time range (default: 600)\n"
+               "  -interval=<n>       Coinstake search interval, at most 60 (default: 16)\n"
+               "  -stakethreads=<n>   Stake kernel search threads (default: 1)\n"
+               "  -reference=<0|1>    Run the reference path and compare hits (default: 1)\n");
+        return 0;
+    }
+
+    fPrintToConsole = true;
+    noui_connect();
+
+    unsigned int nBits = strtoul(GetArg("-bits", "1c0fffff").c_str(), NULL, 16);
+    unsigned int nTimeStart = GetArg("-start", GetTime());
+    unsigned int nSeconds = max((int64_t)1, GetArg("-seconds", 600));
+    unsigned int nInterval = min((int64_t)60, max((int64_t)1, GetArg("-interval", 16)));
+    bool fReference = GetBoolArg("-reference", true);
+
+    // Candidate table, as loaded by CWallet::CacheStakeCandidates
+    vector<CWalletTx> vtx;
+    vector<unsigned int> vnBlockTime, vnTxOffset;
+    vector<uint64_t> vnStakeModifier;
+    if (mapArgs.count("-candidates"))
+    {
+        if (!LoadCandidates(GetArg("-candidates", ""), vtx, vnBlockTime, vnTxOffset, vnStakeModifier))
+        {
+            fprintf(stderr, "Error: unable to read %s\n", GetArg("-candidates", "").c_str());
+            return 1;
+        }
+    }
+    else
+        GenerateCandidates(GetArg("-coins", 10000), nTimeStart, vtx, vnBlockTime, vnTxOffset, vnStakeModifier);
+
+    CStakeCandidates candidates;
+    candidates.reserve(vtx.size());
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        candidates.push_back(&vtx[i], vtx[i].vout.size() - 1, vnBlockTime[i], vnTxOffset[i], vnStakeModifier[i]);
+
+    nStakeKernelThreads = min(MAX_STAKE_KERNEL_THREADS, max(1, (int)GetArg("-stakethreads", 1)));
+    for (int i = 1; i < nStakeKernelThreads; i++)
+        NewThread(ThreadStakeKernelSearch, NULL);
+
+    printf("%u candidates (%u bytes), nBits=%08x, %u seconds from %u, %d threads\n",
+        candidates.size(), (unsigned int)candidates.GetMemoryUsage(), nBits, nSeconds, nTimeStart, nStakeKernelThreads);
+
+    unsigned int nTimeEnd = nTimeStart + nSeconds - 1;
+    bool fMismatch = false;
+
+    // Look-ahead planner, every hit of every coin in the range
+    multimap<unsigned int, unsigned int> mapHits;
+    int64_t nStart = GetTimeMillis();
+    PlanStakeKernelHits(candidates, nBits, nTimeStart, nTimeEnd, mapHits);
+    PrintRate("PlanStakeKernelHits", (uint64_t)candidates.size() * nSeconds, GetTimeMillis() - nStart, mapHits.size());
+
+    if (fReference)
+    {
+        set<pair<unsigned int, unsigned int> > setReference;
+        uint64_t nChecks = 0;
+        nStart = GetTimeMillis();
+        for (unsigned int nPos = 0; nPos < candidates.size(); nPos++)
+        {
+            unsigned int nTimeBegin = max(nTimeStart, max(candidates.vnBlockTime[nPos] + GetStakeMinAge(), candidates.vnTxTime[nPos]));
+            for (unsigned int nTimeTx = nTimeBegin; nTimeTx <= nTimeEnd; nTimeTx++, nChecks++)
+                if (CheckReferenceKernel(candidates, nPos, nBits, nTimeTx))
+                    setReference.insert(make_pair(nTimeTx, nPos));
+        }
+        PrintRate("reference", nChecks, GetTimeMillis() - nStart, setReference.size());
+
+        set<pair<unsigned int, unsigned int> > setPlanned(mapHits.begin(), mapHits.end());
+        if (setPlanned != setReference)
+        {
+            printf("MISMATCH: planner and reference hits differ\n");
+            fMismatch = true;
+        }
+    }
+
+    // Coinstake search, as the stake miner runs it every nInterval seconds
+    CWallet wallet;
+    wallet.SetCoinsDataActual(true);
+    KernelSearchSettings settings;
+    settings.nBits = nBits;
+    settings.nOffset = 0;
+    settings.nLimit = candidates.size();
+    settings.nSearchInterval = nInterval;
+
+    unsigned int nFound = 0;
+    nStart = GetTimeMillis();
+    for (unsigned int nTime = nTimeStart + nInterval - 1; nTime <= nTimeEnd; nTime += nInterval)
+    {
+        settings.nTime = nTime;
+        CoinsSet::value_type kernelcoin;
+        unsigned int nTimeTx, nBlockTime;
+        bool fFound = ScanForStakeKernelHash(candidates, settings, kernelcoin, nTimeTx, nBlockTime, &wallet);
+        nFound += fFound;
+
+        // The search returns the first coin with a hit, at its latest hit time
+        bool fExpected = false;
+        unsigned int nPosExpected = 0, nTimeExpected = 0;
+        for (multimap<unsigned int, unsigned int>::iterator it = mapHits.lower_bound(nTime - nInterval + 1); it != mapHits.upper_bound(nTime); ++it)
+        {
+            // ScanForStakeKernelHash skips coins within a minute of the min age
+            if (GetStakeMinAge() + candidates.vnBlockTime[it->second] > nTime - 60)
+                continue;
+            if (!fExpected || it->second < nPosExpected || (it->second == nPosExpected && it->first > nTimeExpected))
+            {
+                fExpected = true;
+                nPosExpected = it->second;
+                nTimeExpected = it->first;
+            }
+        }
+        if (fFound != fExpected || (fFound && (kernelcoin != candidates.GetCoin(nPosExpected) || nTimeTx != nTimeExpected)))
+        {
+            printf("MISMATCH: ScanForStakeKernelHash at %u\n", nTime);
+            fMismatch = true;
+        }
+    }
+    PrintRate("ScanForStakeKernelHash", (uint64_t)candidates.size() * (nSeconds / nInterval) * nInterval, GetTimeMillis() - nStart, nFound);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        printf("peak memory %ld kB\n", usage.ru_maxrss);
+
+    ThreadStakeKernelSearchQuit();
+
+    printf("%s\n", fMismatch ? "FAILED" : "OK");
+    return fMismatch ? 1 : 0;
+}
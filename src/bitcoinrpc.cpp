@@ -236,7 +236,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getdifficulty",          &getdifficulty,          true,   false,    false },
     { "getsubsidy",             &getsubsidy,             true,   false,    false },
     { "getinfo",                &getinfo,                true,   false,    true  },
-    { "getmininginfo",          &getmininginfo,          true,   false,    true  },
+    { "getmininginfo",          &getmininginfo,          true,   true,     true  },
     { "getnewaddress",          &getnewaddress,          true,   false,    true  },
     { "getaccountaddress",      &getaccountaddress,      true,   false,    true  },
     { "setaccount",             &setaccount,             true,   false,    true  },
@@ -296,6 +296,9 @@ static const CRPCCommand vRPCCommands[] =
     { "getblockbynumber",       &getblockbynumber,       false,  false,    false },
     { "getworkex",              &getworkex,              true,   false,    false },
     { "getcheckpoint",          &getcheckpoint,          true,   false,    false },
+    { "getblockindexinfo",      &getblockindexinfo,      true,   false,    false },
+    { "getblockfileinfo",       &getblockfileinfo,       true,   false,    false },
+    { "getsigcacheinfo",        &getsigcacheinfo,        true,   false,    false },
     { "reservebalance",         &reservebalance,         false,  true,     true  },
     { "splitthreshold",         &splitthreshold,         false,  true,     false },
     { "combinethreshold",       &combinethreshold,       false,  true,     false },
@@ -236,6 +236,9 @@ extern json_spirit::Value gettxoutsetinfo(CWallet* pWallet, const json_spirit::A
 extern json_spirit::Value gettxout(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockbynumber(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getcheckpoint(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getblockindexinfo(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getblockfileinfo(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getsigcacheinfo(CWallet* pWallet, const json_spirit::Array& params, bool fHelp);
 
 
 #endif
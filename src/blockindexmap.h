@@ -0,0 +1,328 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKINDEXMAP_H
+#define BITCOIN_BLOCKINDEXMAP_H
+
+#include "sync.h"
+#include "uint256.h"
+#include "util.h"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <utility>
+#include <vector>
+
+class CBlockIndex;
+
+/** Smallest hash table size of CBlockIndexMap */
+static const size_t BLOCKINDEXMAP_MIN_BUCKETS = 1024;
+
+/** Pool of fixed size objects carved out of large chunks.
+  * Objects keep their address for their whole life and freed objects are
+  * recycled through a free list, so long lived nodes like the block index
+  * neither fragment the heap nor pay the per-allocation malloc overhead.
+  */
+class CSlabAllocator
+{
+private:
+    mutable CCriticalSection cs;
+    size_t nObjectSize;
+    size_t nObjectsPerChunk;
+    std::vector<char*> vChunks;
+    size_t nChunkUsed;  // objects handed out of the last chunk
+    void* pFree;        // free list, linked through the freed objects
+    size_t nAllocated;
+
+    CSlabAllocator(const CSlabAllocator&);
+    CSlabAllocator& operator=(const CSlabAllocator&);
+
+public:
+    CSlabAllocator(size_t nObjectSizeIn, size_t nObjectsPerChunkIn = 4096)
+    {
+        // Round up to keep every object 8-byte aligned and big enough for the free list link
+        nObjectSize = (std::max(nObjectSizeIn, sizeof(void*)) + 7) & ~(size_t)7;
+        nObjectsPerChunk = nObjectsPerChunkIn;
+        nChunkUsed = nObjectsPerChunk;
+        pFree = NULL;
+        nAllocated = 0;
+    }
+
+    ~CSlabAllocator()
+    {
+        Clear();
+    }
+
+    void* Allocate()
+    {
+        LOCK(cs);
+        void* p;
+        if (pFree != NULL)
+        {
+            p = pFree;
+            pFree = *(void**)pFree;
+        }
+        else
+        {
+            if (nChunkUsed == nObjectsPerChunk)
+            {
+                char* pchunk = (char*)malloc(nObjectSize * nObjectsPerChunk);
+                if (pchunk == NULL)
+                    throw std::bad_alloc();
+                vChunks.push_back(pchunk);
+                nChunkUsed = 0;
+            }
+            p = vChunks.back() + nObjectSize * nChunkUsed++;
+        }
+        nAllocated++;
+        return p;
+    }
+
+    void Deallocate(void* p)
+    {
+        if (p == NULL)
+            return;
+        LOCK(cs);
+        *(void**)p = pFree;
+        pFree = p;
+        nAllocated--;
+    }
+
+    // Release all chunks, every object handed out becomes invalid
+    void Clear()
+    {
+        LOCK(cs);
+        for (unsigned int i = 0; i < vChunks.size(); i++)
+            free(vChunks[i]);
+        vChunks.clear();
+        nChunkUsed = nObjectsPerChunk;
+        pFree = NULL;
+        nAllocated = 0;
+    }
+
+    size_t GetObjectSize() const { return nObjectSize; }
+    size_t GetAllocated() const { LOCK(cs); return nAllocated; }
+    size_t GetReservedBytes() const { LOCK(cs); return vChunks.size() * nObjectsPerChunk * nObjectSize; }
+    size_t GetUsedBytes() const { LOCK(cs); return nAllocated * nObjectSize; }
+};
+
+/** Map from block hash to block index, with the subset of the std::map
+  * interface the block index code uses.
+  *
+  * Entries live in a slab, so references to them (CBlockIndex::phashBlock
+  * points to the key) stay valid until they are erased. The table is an open
+  * addressing hash table with linear probing holding pointers to the entries.
+  * Block hashes are already random, the table index is taken from their low
+  * 64 bits mixed with a per-process salt so that peers cannot aim at one
+  * bucket. Iteration order is unspecified, and inserts invalidate iterators
+  * (but not references).
+  */
+class CBlockIndexMap
+{
+public:
+    typedef uint256 key_type;
+    typedef CBlockIndex* mapped_type;
+    typedef std::pair<const uint256, CBlockIndex*> value_type;
+    typedef size_t size_type;
+    typedef value_type* slot_type;
+
+    template<typename V> class iterator_base
+    {
+    private:
+        friend class CBlockIndexMap;
+        template<typename W> friend class iterator_base;
+        const slot_type* p;
+        const slot_type* pend;
+
+        iterator_base(const slot_type* pIn, const slot_type* pendIn) : p(pIn), pend(pendIn)
+        {
+            while (p != pend && *p == NULL)
+                ++p;
+        }
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef V value_type;
+        typedef ptrdiff_t difference_type;
+        typedef V* pointer;
+        typedef V& reference;
+
+        iterator_base() : p(NULL), pend(NULL) {}
+        template<typename W> iterator_base(const iterator_base<W>& it) : p(it.p), pend(it.pend) {}
+
+        V& operator*() const { return **p; }
+        V* operator->() const { return *p; }
+        iterator_base& operator++()
+        {
+            do
+                ++p;
+            while (p != pend && *p == NULL);
+            return *this;
+        }
+        iterator_base operator++(int) { iterator_base it = *this; ++*this; return it; }
+        bool operator==(const iterator_base& it) const { return p == it.p; }
+        bool operator!=(const iterator_base& it) const { return p != it.p; }
+    };
+    typedef iterator_base<value_type> iterator;
+    typedef iterator_base<const value_type> const_iterator;
+
+private:
+    std::vector<slot_type> vTable;
+    size_type nSize;
+    unsigned int nBits;
+    uint64_t nSalt;
+    CSlabAllocator slab;
+
+    CBlockIndexMap(const CBlockIndexMap&);
+    CBlockIndexMap& operator=(const CBlockIndexMap&);
+
+    size_type Bucket(const uint256& hash) const
+    {
+        // Fibonacci hashing, the top bits of the product are the best mixed
+        return (size_type)(((hash.Get64(0) ^ nSalt) * 0x9e3779b97f4a7c15ULL) >> (64 - nBits));
+    }
+
+    // Slot holding hash, or the empty slot it would go to
+    size_type Probe(const uint256& hash) const
+    {
+        size_type nMask = vTable.size() - 1;
+        size_type i = Bucket(hash);
+        while (vTable[i] != NULL && vTable[i]->first != hash)
+            i = (i + 1) & nMask;
+        return i;
+    }
+
+    void Rehash(size_type nBuckets)
+    {
+        if (vTable.empty())
+            nSalt = GetRand(std::numeric_limits<uint64_t>::max());
+        std::vector<slot_type> vOld;
+        vOld.swap(vTable);
+        vTable.assign(nBuckets, NULL);
+        for (nBits = 0; ((size_type)1 << nBits) < nBuckets; nBits++);
+        for (size_type i = 0; i < vOld.size(); i++)
+            if (vOld[i] != NULL)
+                vTable[Probe(vOld[i]->first)] = vOld[i];
+    }
+
+    iterator MakeIterator(size_type i)
+    {
+        const slot_type* pbegin = vTable.empty() ? NULL : &vTable[0];
+        return iterator(pbegin + i, pbegin + vTable.size());
+    }
+
+    const_iterator MakeIterator(size_type i) const
+    {
+        const slot_type* pbegin = vTable.empty() ? NULL : &vTable[0];
+        return const_iterator(pbegin + i, pbegin + vTable.size());
+    }
+
+public:
+    CBlockIndexMap() : nSize(0), nBits(0), nSalt(0), slab(sizeof(value_type)) {}
+
+    ~CBlockIndexMap()
+    {
+        clear();
+    }
+
+    iterator begin() { return MakeIterator(0); }
+    iterator end() { return MakeIterator(vTable.size()); }
+    const_iterator begin() const { return MakeIterator(0); }
+    const_iterator end() const { return MakeIterator(vTable.size()); }
+    size_type size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const uint256& hash)
+    {
+        if (nSize == 0)
+            return end();
+        size_type i = Probe(hash);
+        return vTable[i] != NULL ? MakeIterator(i) : end();
+    }
+
+    const_iterator find(const uint256& hash) const
+    {
+        if (nSize == 0)
+            return end();
+        size_type i = Probe(hash);
+        return vTable[i] != NULL ? MakeIterator(i) : end();
+    }
+
+    size_type count(const uint256& hash) const
+    {
+        return find(hash) != end() ? 1 : 0;
+    }
+
+    std::pair<iterator, bool> insert(const value_type& value)
+    {
+        // Keep the load factor under 3/4
+        if ((nSize + 1) * 4 > vTable.size() * 3)
+            Rehash(vTable.empty() ? BLOCKINDEXMAP_MIN_BUCKETS : vTable.size() * 2);
+        size_type i = Probe(value.first);
+        if (vTable[i] != NULL)
+            return std::make_pair(MakeIterator(i), false);
+        vTable[i] = new (slab.Allocate()) value_type(value);
+        nSize++;
+        return std::make_pair(MakeIterator(i), true);
+    }
+
+    CBlockIndex*& operator[](const uint256& hash)
+    {
+        return insert(value_type(hash, NULL)).first->second;
+    }
+
+    size_type erase(const uint256& hash)
+    {
+        if (nSize == 0)
+            return 0;
+        size_type nMask = vTable.size() - 1;
+        size_type i = Probe(hash);
+        if (vTable[i] == NULL)
+            return 0;
+        vTable[i]->~value_type();
+        slab.Deallocate(vTable[i]);
+        nSize--;
+
+        // Shift back the entries of the probe run that would not be found past the hole
+        for (size_type j = (i + 1) & nMask; vTable[j] != NULL; j = (j + 1) & nMask)
+        {
+            size_type k = Bucket(vTable[j]->first);
+            if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                continue;
+            vTable[i] = vTable[j];
+            i = j;
+        }
+        vTable[i] = NULL;
+        return 1;
+    }
+
+    void clear()
+    {
+        for (size_type i = 0; i < vTable.size(); i++)
+            if (vTable[i] != NULL)
+                vTable[i]->~value_type();
+        std::vector<slot_type>().swap(vTable);
+        slab.Clear();
+        nSize = 0;
+        nBits = 0;
+    }
+
+    // Size the table for n entries up front, as the block index loaders do
+    void reserve(size_type n)
+    {
+        size_type nBuckets = BLOCKINDEXMAP_MIN_BUCKETS;
+        while (n * 4 > nBuckets * 3)
+            nBuckets *= 2;
+        if (nBuckets > vTable.size())
+            Rehash(nBuckets);
+    }
+
+    size_type bucket_count() const { return vTable.size(); }
+    double load_factor() const { return vTable.empty() ? 0.0 : (double)nSize / vTable.size(); }
+    size_t GetTableBytes() const { return vTable.capacity() * sizeof(slot_type); }
+    const CSlabAllocator& GetAllocator() const { return slab; }
+};
+
+#endif
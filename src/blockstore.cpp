@@ -0,0 +1,223 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstore.h"
+#include "main.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+using namespace std;
+using namespace boost;
+
+CBlockFileReader blockFileReader;
+
+CBlockFileReader::CBlockFileReader(const filesystem::path& pathDirIn, unsigned int nMaxMappedFilesIn)
+{
+    pathDir = pathDirIn;
+    nMaxMappedFiles = min(nMaxMappedFilesIn, MAX_BLOCK_MAP_FILES);
+}
+
+filesystem::path CBlockFileReader::GetFilePath(unsigned int nFile) const
+{
+    string strBlockFn = strprintf("blk%04u.dat", nFile);
+    return (pathDir.empty() ? GetDataDir() : pathDir) / strBlockFn;
+}
+
+bool CBlockFileReader::GetMapping(unsigned int nFile, bool fRefresh, CMappedBlockFile& mappingRet)
+{
+    LOCK(cs);
+    if (nMaxMappedFiles == 0)
+        return false;
+
+    filesystem::path pathFile = GetFilePath(nFile);
+    for (list<CMappedBlockFile>::iterator it = lruFiles.begin(); it != lruFiles.end(); ++it)
+    {
+        if (it->nFile != nFile)
+            continue;
+        if (fRefresh)
+        {
+            system::error_code ec;
+            uintmax_t nFileSize = filesystem::file_size(pathFile, ec);
+            if (!ec && nFileSize > it->nSize)
+            {
+                lruFiles.erase(it);
+                break;
+            }
+        }
+        lruFiles.splice(lruFiles.begin(), lruFiles, it);
+        mappingRet = lruFiles.front();
+        return true;
+    }
+
+    CMappedBlockFile mapping;
+    try {
+        system::error_code ec;
+        uintmax_t nFileSize = filesystem::file_size(pathFile, ec);
+        if (ec || nFileSize == 0)
+            return false;
+        interprocess::file_mapping file(pathFile.string().c_str(), interprocess::read_only);
+        boost::shared_ptr<interprocess::mapped_region> region(new interprocess::mapped_region(file, interprocess::read_only, 0, nFileSize));
+        mapping.nFile = nFile;
+        mapping.pbegin = (const char*)region->get_address();
+        mapping.nSize = region->get_size();
+        mapping.pregion = region;
+    }
+    catch (std::exception &e) {
+        LogPrintf("CBlockFileReader::GetMapping() : unable to map %s : %s\n", pathFile.string(), e.what());
+        return false;
+    }
+
+    lruFiles.push_front(mapping);
+    while (lruFiles.size() > nMaxMappedFiles)
+        lruFiles.pop_back();
+    stats.nMaps++;
+    mappingRet = mapping;
+    return true;
+}
+
+FILE* CBlockFileReader::OpenFile(unsigned int nFile, unsigned int nPos) const
+{
+    FILE* file = fopen(GetFilePath(nFile).string().c_str(), "rb");
+    if (!file)
+        return NULL;
+    if (nPos != 0 && fseek(file, nPos, SEEK_SET) != 0)
+    {
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+void CBlockFileReader::RecordRead(size_t nBytes, int64_t nMicros, bool fFileRead)
+{
+    LOCK(cs);
+    stats.nReads++;
+    stats.nBytesRead += nBytes;
+    stats.nReadMicros += nMicros;
+    if (fFileRead)
+        stats.nFileReads++;
+}
+
+void CBlockFileReader::SetMaxMappedFiles(unsigned int nMax)
+{
+    LOCK(cs);
+    nMaxMappedFiles = min(nMax, MAX_BLOCK_MAP_FILES);
+    while (lruFiles.size() > nMaxMappedFiles)
+        lruFiles.pop_back();
+}
+
+void CBlockFileReader::Clear()
+{
+    LOCK(cs);
+    lruFiles.clear();
+}
+
+CBlockFileReaderStats CBlockFileReader::GetStats() const
+{
+    LOCK(cs);
+    CBlockFileReaderStats statsRet = stats;
+    statsRet.nMappedFiles = lruFiles.size();
+    BOOST_FOREACH(const CMappedBlockFile& mapping, lruFiles)
+        statsRet.nMappedBytes += mapping.nSize;
+    return statsRet;
+}
+
+CBlockFileScanner::CBlockFileScanner(uint64_t nWindowSizeIn)
+{
+    nWindowSize = nWindowSizeIn;
+    nWindowOffset = 0;
+    pwindowBegin = NULL;
+    nWindowLength = 0;
+    nFileSize = 0;
+    nPos = 0;
+}
+
+bool CBlockFileScanner::Open(const filesystem::path& pathFile)
+{
+    pwindow.reset();
+    pwindowBegin = NULL;
+    nWindowLength = 0;
+    nPos = 0;
+    try {
+        nFileSize = filesystem::file_size(pathFile);
+        pfile.reset(new interprocess::file_mapping(pathFile.string().c_str(), interprocess::read_only));
+    }
+    catch (std::exception &e) {
+        pfile.reset();
+        nFileSize = 0;
+        return error("CBlockFileScanner::Open() : unable to open %s : %s", pathFile.string(), e.what());
+    }
+    return true;
+}
+
+bool CBlockFileScanner::Map(uint64_t nBegin, uint64_t nLength)
+{
+    if (pwindow && nBegin >= nWindowOffset && nBegin + nLength <= nWindowOffset + nWindowLength)
+        return true;
+    if (!pfile || nBegin + nLength > nFileSize)
+        return false;
+
+    // Windows start on a page boundary and hold at least the requested range
+    uint64_t nOffset = nBegin - nBegin % interprocess::mapped_region::get_page_size();
+    uint64_t nMapLength = min(max(nWindowSize, nBegin + nLength - nOffset), nFileSize - nOffset);
+    try {
+        pwindow.reset(new interprocess::mapped_region(*pfile, interprocess::read_only, nOffset, nMapLength));
+    }
+    catch (std::exception &e) {
+        pwindow.reset();
+        pwindowBegin = NULL;
+        nWindowLength = 0;
+        return error("CBlockFileScanner::Map() : unable to map %u bytes at %u : %s", nMapLength, nOffset, e.what());
+    }
+    nWindowOffset = nOffset;
+    pwindowBegin = (const char*)pwindow->get_address();
+    nWindowLength = pwindow->get_size();
+    return true;
+}
+
+bool CBlockFileScanner::Next(const char*& pblockRet, unsigned int& nSizeRet, uint64_t& nPosRet, boost::shared_ptr<void>& pwindowRet)
+{
+    while (nPos + sizeof(pchMessageStart) + sizeof(unsigned int) <= nFileSize && !fRequestShutdown)
+    {
+        if (!Map(nPos, sizeof(pchMessageStart) + sizeof(unsigned int)))
+            return false;
+
+        // Look for the message start up to the end of the window
+        const char* pbegin = pwindowBegin + (nPos - nWindowOffset);
+        size_t nAvailable = nWindowLength - (nPos - nWindowOffset);
+        const char* pfind = (const char*)memchr(pbegin, pchMessageStart[0], nAvailable + 1 - sizeof(pchMessageStart));
+        if (!pfind)
+        {
+            nPos += nAvailable + 1 - sizeof(pchMessageStart);
+            continue;
+        }
+        nPos += pfind - pbegin;
+        if (memcmp(pfind, pchMessageStart, sizeof(pchMessageStart)) != 0)
+        {
+            nPos++;
+            continue;
+        }
+        nPos += sizeof(pchMessageStart);
+
+        if (!Map(nPos, sizeof(unsigned int)))
+            return false;
+        unsigned int nSize;
+        memcpy(&nSize, pwindowBegin + (nPos - nWindowOffset), sizeof(nSize));
+        if (nSize == 0 || nSize > MAX_BLOCK_SIZE || nPos + sizeof(nSize) + nSize > nFileSize)
+            continue;
+        if (!Map(nPos + sizeof(nSize), nSize))
+            return false;
+
+        nPosRet = nPos + sizeof(nSize);
+        pblockRet = pwindowBegin + (nPosRet - nWindowOffset);
+        nSizeRet = nSize;
+        pwindowRet = pwindow;
+        nPos = nPosRet + nSize;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,189 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKSTORE_H
+#define BITCOIN_BLOCKSTORE_H
+
+#include "serialize.h"
+#include "sync.h"
+#include "util.h"
+#include "version.h"
+
+#include <limits>
+#include <list>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace boost {
+namespace interprocess {
+class file_mapping;
+class mapped_region;
+}
+}
+
+/** Default number of block files kept memory mapped, address space is too
+ *  scarce on 32-bit systems so they read through stdio */
+static const unsigned int DEFAULT_BLOCK_MAP_FILES = sizeof(void*) >= 8 ? 8 : 0;
+static const unsigned int MAX_BLOCK_MAP_FILES = 64;
+
+/** Read-only mapping of a whole blk000N.dat file */
+struct CMappedBlockFile
+{
+    unsigned int nFile;
+    const char* pbegin;
+    size_t nSize;
+    boost::shared_ptr<void> pregion;  // keeps the mapping alive while it is read
+
+    CMappedBlockFile() : nFile(0), pbegin(NULL), nSize(0) {}
+};
+
+/** Counters of a CBlockFileReader */
+struct CBlockFileReaderStats
+{
+    uint64_t nReads;        // objects read
+    uint64_t nBytesRead;    // bytes unserialized
+    uint64_t nReadMicros;   // time spent in reads
+    uint64_t nFileReads;    // reads done through stdio
+    uint64_t nMaps;         // files mapped, again when they grew
+    unsigned int nMappedFiles;
+    uint64_t nMappedBytes;
+
+    CBlockFileReaderStats() : nReads(0), nBytesRead(0), nReadMicros(0), nFileReads(0), nMaps(0), nMappedFiles(0), nMappedBytes(0) {}
+};
+
+/** Reads blocks and transactions from the block files.
+ *
+ * The most recently used files are memory mapped and objects are unserialized
+ * straight from the mapped bytes, so a read costs neither an fopen and fseek
+ * nor a copy through the stdio buffer. A file is mapped again when an object
+ * appended after it was mapped is read. Files that cannot be mapped, and all
+ * files when mapping is disabled, are read through stdio as before.
+ */
+class CBlockFileReader
+{
+private:
+    mutable CCriticalSection cs;
+    boost::filesystem::path pathDir;  // empty for the data directory
+    unsigned int nMaxMappedFiles;
+    std::list<CMappedBlockFile> lruFiles;  // most recently used first
+    CBlockFileReaderStats stats;
+
+    CBlockFileReader(const CBlockFileReader&);
+    CBlockFileReader& operator=(const CBlockFileReader&);
+
+    boost::filesystem::path GetFilePath(unsigned int nFile) const;
+
+    // Mapping of file nFile, mapped again if fRefresh is set and the file grew
+    bool GetMapping(unsigned int nFile, bool fRefresh, CMappedBlockFile& mappingRet);
+
+    FILE* OpenFile(unsigned int nFile, unsigned int nPos) const;
+
+    void RecordRead(size_t nBytes, int64_t nMicros, bool fFileRead);
+
+public:
+    CBlockFileReader(const boost::filesystem::path& pathDirIn = boost::filesystem::path(), unsigned int nMaxMappedFilesIn = DEFAULT_BLOCK_MAP_FILES);
+
+    // Unmaps the least recently used files above the new limit, 0 disables mapping
+    void SetMaxMappedFiles(unsigned int nMax);
+
+    // Unmaps all files, mappings still being read stay valid until they are done
+    void Clear();
+
+    CBlockFileReaderStats GetStats() const;
+
+    // Unserialize obj from block file nFile at position nPos
+    template<typename T>
+    bool Read(unsigned int nFile, unsigned int nPos, T& obj, int nType = SER_DISK, int nVersion = CLIENT_VERSION)
+    {
+        if ((nFile < 1) || (nFile == (unsigned int) -1))
+            return false;
+        int64_t nStart = GetTimeMicros();
+
+        CMappedBlockFile mapping;
+        if (GetMapping(nFile, false, mapping))
+        {
+            // An object past the end may have been appended after the file was mapped
+            for (size_t nSizeTried = 0; mapping.nSize > nSizeTried; )
+            {
+                if (nPos < mapping.nSize)
+                {
+                    CBufferReader reader(mapping.pbegin + nPos, mapping.pbegin + mapping.nSize, nType, nVersion);
+                    try {
+                        reader >> obj;
+                        RecordRead(reader.GetReadPos(), GetTimeMicros() - nStart, false);
+                        return true;
+                    }
+                    catch (std::exception &e) {
+                    }
+                }
+                nSizeTried = mapping.nSize;
+                if (!GetMapping(nFile, true, mapping))
+                    return false;
+            }
+            return false;
+        }
+
+        CAutoFile filein = CAutoFile(OpenFile(nFile, nPos), nType, nVersion);
+        if (!filein)
+            return false;
+        try {
+            filein >> obj;
+        }
+        catch (std::exception &e) {
+            return false;
+        }
+        long nEnd = ftell(filein);
+        RecordRead(nEnd > (long)nPos ? nEnd - nPos : 0, GetTimeMicros() - nStart, true);
+        return true;
+    }
+};
+
+extern CBlockFileReader blockFileReader;
+
+/** Part of an external block file mapped at once by CBlockFileScanner, the
+ *  whole file on 64-bit systems */
+static const uint64_t DEFAULT_SCAN_WINDOW = sizeof(void*) >= 8 ? std::numeric_limits<uint64_t>::max() : 64 * 1024 * 1024;
+
+/** Finds the blocks of an external block file such as bootstrap.dat.
+ *
+ * Blocks are framed by the message start and their size, as in the block
+ * files. The file is memory mapped in windows and the blocks are returned as
+ * pointers into the mapping, which stays valid as long as the window handed
+ * out with it is held, so they can be unserialized later on other threads.
+ * Bytes that are not a block are skipped.
+ */
+class CBlockFileScanner
+{
+private:
+    boost::shared_ptr<boost::interprocess::file_mapping> pfile;
+    boost::shared_ptr<boost::interprocess::mapped_region> pwindow;
+    uint64_t nWindowSize;
+    uint64_t nWindowOffset;
+    const char* pwindowBegin;
+    uint64_t nWindowLength;
+    uint64_t nFileSize;
+    uint64_t nPos;
+
+    CBlockFileScanner(const CBlockFileScanner&);
+    CBlockFileScanner& operator=(const CBlockFileScanner&);
+
+    // Map a window holding [nBegin, nBegin + nLength)
+    bool Map(uint64_t nBegin, uint64_t nLength);
+
+public:
+    CBlockFileScanner(uint64_t nWindowSizeIn = DEFAULT_SCAN_WINDOW);
+
+    bool Open(const boost::filesystem::path& pathFile);
+
+    uint64_t GetFileSize() const { return nFileSize; }
+
+    // Position of the next message start to look at
+    uint64_t GetPos() const { return nPos; }
+    void Seek(uint64_t nPosIn) { nPos = nPosIn; }
+
+    // Next block, at position nPosRet in the file
+    bool Next(const char*& pblockRet, unsigned int& nSizeRet, uint64_t& nPosRet, boost::shared_ptr<void>& pwindowRet);
+};
+
+#endif
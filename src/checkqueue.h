@@ -6,15 +6,22 @@
 #define CHECKQUEUE_H
 
 #include <algorithm>
+#include <assert.h>
+#include <deque>
 #include <vector>
 
+#include <boost/atomic.hpp>
 #include <boost/foreach.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 template<typename T> class CCheckQueueControl;
 
+/** Largest number of worker threads of a queue, besides the master */
+static const int MAX_CHECKQUEUE_WORKERS = 64;
+
 /** Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
@@ -23,139 +30,218 @@ template<typename T> class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every thread has its own deque of verifications. The master adds to its
+  * own deque, whose mutex is only contended by a worker stealing from it,
+  * and wakes workers only when some are asleep. A thread takes from the back of its own deque,
+  * newest first, and when it is empty steals the older half of the deque of
+  * another thread, so work spreads to idle threads without them all waiting
+  * on one mutex. The batch a thread takes from its own deque shrinks as the
+  * deque empties, leaving the rest to be stolen.
+  *
+  * Only one master uses the queue at a time, a CCheckQueueControl waits for
+  * the Wait of the previous one.
   */
 template<typename T> class CCheckQueue {
 private:
-    // Mutex to protect the inner state
-    boost::mutex mutex;
+    // Verifications of one thread
+    struct CWorkerQueue {
+        boost::mutex mutex;
+        std::deque<T> queue;
+    };
+
+    // The master's deque, then those of the workers in the order they started
+    CWorkerQueue vWorkerQueues[MAX_CHECKQUEUE_WORKERS + 1];
+
+    // Number of workers that have a deque
+    boost::atomic<int> nWorkers;
+
+    // Number of verifications that haven't completed yet.
+    // This includes elements that are not anymore in a deque, but still in
+    // a thread's own batch.
+    boost::atomic<unsigned int> nTodo;
+
+    // Number of verifications in the deques or being moved between them
+    boost::atomic<unsigned int> nPending;
+
+    // The temporary evaluation result.
+    boost::atomic<bool> fAllOk;
+
+    // Whether we're shutting down.
+    boost::atomic<bool> fQuit;
+
+    // Number of workers going to sleep or asleep
+    boost::atomic<int> nSleeping;
+
+    // Protects the sleeping and waking of the threads, and nTotal
+    boost::mutex mutexSleep;
 
     // Worker threads block on this when out of work
     boost::condition_variable condWorker;
 
-    // Master thread blocks on this when out of work
+    // Master thread blocks on this while the last verifications finish
     boost::condition_variable condMaster;
 
     // Quit method blocks on this until all workers are gone
     boost::condition_variable condQuit;
 
-    // The queue of elements to be processed.
-    // As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
-
-    // The number of workers (including the master) that are idle.
-    int nIdle;
-
-    // The total number of workers (including the master).
+    // The number of running workers.
     int nTotal;
 
-    // The temporary evaluation result.
-    bool fAllOk;
+    // Held by the current master, see CCheckQueueControl
+    boost::mutex mutexControl;
 
-    // Number of verifications that haven't completed yet.
-    // This includes elements that are not anymore in queue, but still in
-    // worker's own batches.
-    unsigned int nTodo;
+    // The maximum number of elements a thread takes from its own deque at once
+    unsigned int nBatchSize;
 
-    // Whether we're shutting down.
-    bool fQuit;
+    // Take a batch of verifications from the deque at nSlot, or steal from
+    // another one into it
+    bool Take(int nSlot, std::vector<T> &vChecks) {
+        CWorkerQueue &own = vWorkerQueues[nSlot];
+        int nSlots = nWorkers + 1;
+        for (int i = 0; i < nSlots; i++) {
+            if (i > 0) {
+                CWorkerQueue &victim = vWorkerQueues[(nSlot + i) % nSlots];
+                std::vector<T> vStolen;
+                {
+                    boost::unique_lock<boost::mutex> lock(victim.mutex);
+                    if (victim.queue.empty())
+                        continue;
+                    vStolen.resize((victim.queue.size() + 1) / 2);
+                    for (unsigned int j = 0; j < vStolen.size(); j++) {
+                        vStolen[j].swap(victim.queue.front());
+                        victim.queue.pop_front();
+                    }
+                }
+                boost::unique_lock<boost::mutex> lock(own.mutex);
+                for (typename std::vector<T>::reverse_iterator it = vStolen.rbegin(); it != vStolen.rend(); ++it) {
+                    own.queue.push_front(T());
+                    it->swap(own.queue.front());
+                }
+            }
 
-    // The maximum number of elements to be processed in one batch
-    unsigned int nBatchSize;
+            boost::unique_lock<boost::mutex> lock(own.mutex);
+            if (own.queue.empty())
+                continue;
+            // Leave a share of the deque to the other threads
+            unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)own.queue.size() / nSlots));
+            vChecks.resize(nNow);
+            for (unsigned int j = 0; j < nNow; j++) {
+                vChecks[j].swap(own.queue.back());
+                own.queue.pop_back();
+            }
+            nPending -= nNow;
+            return true;
+        }
+        return false;
+    }
 
     // Internal function that does bulk of the verification work.
-    bool Loop(bool fMaster = false) {
-        boost::condition_variable &cond = fMaster ? condMaster : condWorker;
+    bool Loop(int nSlot, bool fMaster = false) {
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        if (nTotal==0)
-                            condQuit.notify_one();
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
+            if (Take(nSlot, vChecks)) {
+                // Check whether we need to do work at all
+                bool fOk = fAllOk;
+                BOOST_FOREACH(T &check, vChecks)
+                    if (fOk)
+                        fOk = check();
+                if (!fOk)
+                    fAllOk = false;
+                unsigned int nNow = vChecks.size();
+                vChecks.clear();
+                if ((nTodo -= nNow) == 0) {
+                    // We processed the last element; inform the master he can exit and return the result
+                    boost::unique_lock<boost::mutex> lock(mutexSleep);
+                    condMaster.notify_one();
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                     // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                     // queue to the local batch vector instead of copying.
-                     vChecks[i].swap(queue.back());
-                     queue.pop_back();
+                continue;
+            }
+
+            // Verifications being stolen will show up in a deque
+            if (nPending > 0) {
+                boost::this_thread::yield();
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutexSleep);
+            if (fMaster) {
+                // Nothing is left but the batches of other threads
+                while (nTodo > 0)
+                    condMaster.wait(lock);
+                bool fRet = fAllOk;
+                // reset the status for new work later
+                fAllOk = true;
+                // return the current status
+                return fRet;
+            }
+            // Add sees either nSleeping or we see its nPending
+            nSleeping++;
+            if (nPending == 0) {
+                if (fQuit) {
+                    nSleeping--;
+                    nTotal--;
+                    if (nTotal == 0)
+                        condQuit.notify_one();
+                    return fAllOk;
                 }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                condWorker.wait(lock); // wait
             }
-            // execute work
-            BOOST_FOREACH(T &check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
+            nSleeping--;
         } while(true);
     }
 
 public:
     // Create a new check queue
     CCheckQueue(unsigned int nBatchSizeIn) :
-        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+        nWorkers(0), nTodo(0), nPending(0), fAllOk(true), fQuit(false), nSleeping(0), nTotal(0), nBatchSize(nBatchSizeIn) {}
 
     // Worker thread
     void Thread() {
-        Loop();
+        int nSlot;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexSleep);
+            if (nWorkers >= MAX_CHECKQUEUE_WORKERS)
+                return;
+            nSlot = nWorkers + 1;
+            nTotal++;
+            nWorkers++;
+        }
+        Loop(nSlot);
     }
 
     // Wait until execution finishes, and return whether all evaluations where succesful.
     bool Wait() {
-        return Loop(true);
+        return Loop(0, true);
     }
 
     // Add a batch of checks to the queue
     void Add(std::vector<T> &vChecks) {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH(T &check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+        {
+            CWorkerQueue &master = vWorkerQueues[0];
+            boost::unique_lock<boost::mutex> lock(master.mutex);
+            BOOST_FOREACH(T &check, vChecks) {
+                master.queue.push_back(T());
+                check.swap(master.queue.back());
+            }
+        }
+        nPending += vChecks.size();
+        if (nSleeping > 0) {
+            boost::unique_lock<boost::mutex> lock(mutexSleep);
+            if (vChecks.size() == 1)
+                condWorker.notify_one();
+            else
+                condWorker.notify_all();
+        }
     }
 
     // Shut the queue down
     void Quit() {
-        boost::unique_lock<boost::mutex> lock(mutex);
+        boost::unique_lock<boost::mutex> lock(mutexSleep);
         fQuit = true;
         // No need to wake the master, as he will quit automatically when all jobs are
         // done.
@@ -175,12 +261,13 @@ template<typename T> class CCheckQueueControl {
 private:
     CCheckQueue<T> *pqueue;
     bool fDone;
+    bool fResult;   // result of the Wait that released the queue
 
 public:
-    CCheckQueueControl(CCheckQueue<T> *pqueueIn) : pqueue(pqueueIn), fDone(false) {
-        // passed queue is supposed to be unused, or NULL
+    CCheckQueueControl(CCheckQueue<T> *pqueueIn) : pqueue(pqueueIn), fDone(false), fResult(true) {
+        // passed queue is supposed to be unused once we hold it until Wait, or NULL
         if (pqueue != NULL) {
-            assert(pqueue->nTotal == pqueue->nIdle);
+            pqueue->mutexControl.lock();
             assert(pqueue->nTodo == 0);
             assert(pqueue->fAllOk == true);
         }
@@ -189,9 +276,13 @@ public:
     bool Wait() {
         if (pqueue == NULL)
             return true;
-        bool fRet = pqueue->Wait();
+        // The queue was released by an earlier Wait
+        if (fDone)
+            return fResult;
+        fResult = pqueue->Wait();
         fDone = true;
-        return fRet;
+        pqueue->mutexControl.unlock();
+        return fResult;
     }
 
     void Add(std::vector<T> &vChecks) {
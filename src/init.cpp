@@ -13,6 +13,7 @@
 #include "ui_interface.h"
 #include "timer.h"
 #include "checkpoints.h"
+#include "kernel.h"
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/convenience.hpp>
@@ -88,6 +89,14 @@ void Shutdown(void* parg)
         //        CTxDB().Close();
         bitdb.Flush(false);
         StopNode();
+#ifdef USE_LEVELDB
+        {
+            LOCK(cs_main);
+            CTxDB txdb;
+            if (txdb.Flush())
+                txdb.WriteBlockIndexSnapshot();
+        }
+#endif
         UnregisterNodeSignals(GetNodeSignals());
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
@@ -237,7 +246,7 @@ std::string HelpMessage()
         strUsage += "  -conf=<file>           " + _("Specify configuration file (default: HoboNickels.conf)") + "\n";
         strUsage += "  -pid=<file>            " + _("Specify pid file (default: HoboNickelsd.pid)") + "\n";
         strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
-        strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
+        strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 100)") + "\n";
         strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
         strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
         strUsage += "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n";
@@ -322,6 +331,12 @@ std::string HelpMessage()
         strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n";
         strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
         strUsage += "  -par=N                 " + _("Set the number of script verification threads (1-16, 0=auto, default: 0)") + "\n";
+        strUsage += "  -stakethreads=N        " + _("Set the number of stake kernel search threads (1-16, 0=auto, default: 1)") + "\n";
+        strUsage += "  -prefetchthreads=N     " + _("Set the number of threads reading transaction inputs from disk (1-16, default: 4)") + "\n";
+        strUsage += "  -blockcheckthreads=N   " + _("Set the number of threads checking blocks during initial download (0-16, -1=auto, default: -1)") + "\n";
+        strUsage += "  -blockmapfiles=<n>     " + _("Keep up to <n> block files memory mapped for reading (0-64, 0 = read through stdio, default: 8 on 64-bit systems, 0 otherwise)") + "\n";
+        strUsage += "  -sigcachesize=<n>      " + _("Keep verified signatures in a cache of up to <n> megabytes (0-4096, default: 32)") + "\n";
+        strUsage += "  -nativeecdsa           " + _("Verify signatures with the built-in secp256k1 code, OpenSSL only verifying other encodings (default: 1)") + "\n";
         strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
 
         strUsage += "\n" + _("Block creation options:") + "\n" +
@@ -428,6 +443,11 @@ bool InitSanityCheck(void)
         return false;
     }
 
+    if (!ECC_NativeSanityCheck()) {
+        InitError(_("The built-in signature verification disagrees with OpenSSL, start with -nativeecdsa=0 to use OpenSSL only."));
+        return false;
+    }
+
     // TODO: remaining sanity checks, see #4081
 
     return true;
@@ -554,6 +574,46 @@ bool AppInit2()
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    // -stakethreads=0 means autodetect, nStakeKernelThreads<=1 searches on the miner thread only
+    nStakeKernelThreads = GetArg("-stakethreads", 1);
+    if (nStakeKernelThreads == 0)
+       nStakeKernelThreads = boost::thread::hardware_concurrency();
+    if (nStakeKernelThreads <= 1)
+       nStakeKernelThreads = 0;
+    else if (nStakeKernelThreads > MAX_STAKE_KERNEL_THREADS)
+       nStakeKernelThreads = MAX_STAKE_KERNEL_THREADS;
+
+    // nPrefetchThreads<=1 reads inputs on the validating thread only
+    nPrefetchThreads = GetArg("-prefetchthreads", 4);
+    if (nPrefetchThreads <= 1)
+       nPrefetchThreads = 0;
+    else if (nPrefetchThreads > MAX_PREFETCH_THREADS)
+       nPrefetchThreads = MAX_PREFETCH_THREADS;
+
+    // -blockcheckthreads=-1 means autodetect, 0 checks blocks on the message handler thread
+    nBlockCheckThreads = GetArg("-blockcheckthreads", -1);
+    if (nBlockCheckThreads < 0)
+       nBlockCheckThreads = max((int)boost::thread::hardware_concurrency() - 1, 0);
+    if (nBlockCheckThreads > MAX_BLOCKCHECK_THREADS)
+       nBlockCheckThreads = MAX_BLOCKCHECK_THREADS;
+
+    blockFileReader.SetMaxMappedFiles(max((int)GetArg("-blockmapfiles", DEFAULT_BLOCK_MAP_FILES), 0));
+
+    // -sigcachesize is in megabytes, the deprecated -maxsigcachesize counted
+    // signatures and still does, so old configurations keep their cache size
+    int64_t nSigCacheBytes = (int64_t)DEFAULT_MAX_SIG_CACHE_SIZE << 20;
+    if (mapArgs.count("-sigcachesize"))
+        nSigCacheBytes = min(max(GetArg("-sigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE), (int64_t)0), (int64_t)MAX_MAX_SIG_CACHE_SIZE) << 20;
+    else if (mapArgs.count("-maxsigcachesize"))
+    {
+        int64_t nSigCacheEntries = min(max(GetArg("-maxsigcachesize", 0), (int64_t)0), (int64_t)MAX_MAX_SIG_CACHE_SIZE << 15);
+        nSigCacheBytes = nSigCacheEntries * (int64_t)sizeof(uint256);
+        InitWarning(_("Warning: Deprecated argument -maxsigcachesize counts signatures, use -sigcachesize=<n> to give the cache size in megabytes"));
+    }
+    InitSignatureCache((size_t)min(nSigCacheBytes, (int64_t)(std::numeric_limits<size_t>::max() / 2)));
+
+    SetNativeECDSA(GetBoolArg("-nativeecdsa", true));
+
 
     fDebug = !mapMultiArgs["-debug"].empty();
     // Special-case: if -debug=0/-nodebug is set, turn off debugging messages
@@ -667,6 +727,24 @@ bool AppInit2()
           NewThread(ThreadScriptCheck, NULL);
     }
 
+    if (nStakeKernelThreads) {
+       LogPrintf("Using %u threads for stake kernel search\n", nStakeKernelThreads);
+       for (int i=0; i<nStakeKernelThreads-1; i++)
+          NewThread(ThreadStakeKernelSearch, NULL);
+    }
+
+    if (nPrefetchThreads) {
+       LogPrintf("Using %u threads for input prefetch\n", nPrefetchThreads);
+       for (int i=0; i<nPrefetchThreads-1; i++)
+          NewThread(ThreadTxPrefetch, NULL);
+    }
+
+    if (nBlockCheckThreads) {
+       LogPrintf("Using %u threads for block checks\n", nBlockCheckThreads);
+       for (int i=0; i<nBlockCheckThreads; i++)
+          NewThread(ThreadBlockCheck, NULL);
+    }
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -878,7 +956,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -937,11 +1015,7 @@ bool AppInit2()
         uiInterface.InitMessage(_("Importing blockchain data file."));
 
         BOOST_FOREACH(string strFile, mapMultiArgs["-loadblock"])
-        {
-            FILE *file = fopen(strFile.c_str(), "rb");
-            if (file)
-                LoadExternalBlockFile(file);
-        }
+            LoadExternalBlockFile(strFile);
         StartShutdown();
     }
 
@@ -949,12 +1023,10 @@ bool AppInit2()
     if (filesystem::exists(pathBootstrap)) {
         uiInterface.InitMessage(_("Importing bootstrap blockchain data file."));
 
-        FILE *file = fopen(pathBootstrap.string().c_str(), "rb");
-        if (file) {
-            filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
-            LoadExternalBlockFile(file);
+        // An interrupted import resumes on the next start
+        filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
+        if (LoadExternalBlockFile(pathBootstrap))
             RenameOver(pathBootstrap, pathBootstrapOld);
-        }
         exit(0);
     }
 
@@ -4,6 +4,7 @@
 
 #include <boost/assign/list_of.hpp>
 
+#include "checkqueue.h"
 #include "kernel.h"
 #include "txdb.h"
 
@@ -83,48 +84,57 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
+// A candidate block of the stake modifier selection. The selection hash only
+// depends on the block and the previous modifier, so it is computed once for
+// all 64 rounds.
+struct CModifierCandidate
+{
+    int64_t nTime;
+    uint256 hashBlock;
+    const CBlockIndex* pindex;
+    uint256 hashSelection;
+    bool fSelected;
+
+    CModifierCandidate(const CBlockIndex* pindexIn) : nTime(pindexIn->GetBlockTime()), hashBlock(pindexIn->GetBlockHash()), pindex(pindexIn), fSelected(false) {}
+
+    bool operator<(const CModifierCandidate& b) const
+    {
+        return nTime < b.nTime || (nTime == b.nTime && hashBlock < b.hashBlock);
+    }
+};
+
 // select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
-// nSelectionIntervalStop.
-static bool SelectBlockFromCandidates(vector<pair<int64_t, uint256> >& vSortedByTimestamp, map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64_t nSelectionIntervalStop, uint64_t nStakeModifierPrev, const CBlockIndex** pindexSelected)
+// already selected blocks, and with timestamp up to nSelectionIntervalStop.
+static bool SelectBlockFromCandidates(vector<CModifierCandidate>& vSortedByTimestamp, int64_t nSelectionIntervalStop, const CBlockIndex** pindexSelected)
 {
     bool fSelected = false;
     uint256 hashBest = 0;
+    CModifierCandidate* pcandidateBest = NULL;
     *pindexSelected = (const CBlockIndex*) 0;
-    BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, vSortedByTimestamp)
+    BOOST_FOREACH(CModifierCandidate& candidate, vSortedByTimestamp)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+        if (fSelected && candidate.nTime > nSelectionIntervalStop)
             break;
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+        if (candidate.fSelected)
             continue;
-        // compute the selection hash by hashing its proof-hash and the
-        // previous proof-of-stake modifier
-        uint256 hashProof = pindex->IsProofOfStake()? pindex->hashProofOfStake : pindex->GetBlockHash();
-        CDataStream ss(SER_GETHASH, 0);
-        ss << hashProof << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection >>= 32;
-        if (fSelected && hashSelection < hashBest)
+        if (fSelected && candidate.hashSelection < hashBest)
         {
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
+            hashBest = candidate.hashSelection;
+            pcandidateBest = &candidate;
         }
         else if (!fSelected)
         {
             fSelected = true;
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
+            hashBest = candidate.hashSelection;
+            pcandidateBest = &candidate;
         }
     }
     LogPrint("stakemodifier", "SelectBlockFromCandidates: selection hash=%s\n", hashBest.ToString());
+    if (fSelected)
+    {
+        pcandidateBest->fSelected = true;
+        *pindexSelected = pcandidateBest->pindex;
+    }
     return fSelected;
 }
 
@@ -163,35 +173,50 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
         return true;
 
     // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
+    vector<CModifierCandidate> vSortedByTimestamp;
     vSortedByTimestamp.reserve(64 * nStakeModifierInterval / GetTargetSpacing());
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nStakeModifierInterval) * nStakeModifierInterval - nSelectionInterval;
     const CBlockIndex* pindex = pindexPrev;
     while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
     {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        vSortedByTimestamp.push_back(CModifierCandidate(pindex));
         pindex = pindex->pprev;
     }
     int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
     reverse(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
     sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
 
+    // compute the selection hash by hashing its proof-hash and the
+    // previous proof-of-stake modifier
+    BOOST_FOREACH(CModifierCandidate& candidate, vSortedByTimestamp)
+    {
+        uint256 hashProof = candidate.pindex->IsProofOfStake()? candidate.pindex->hashProofOfStake : candidate.hashBlock;
+        CDataStream ss(SER_GETHASH, 0);
+        ss << hashProof << nStakeModifier;
+        candidate.hashSelection = Hash(ss.begin(), ss.end());
+        // the selection hash is divided by 2**32 so that proof-of-stake block
+        // is always favored over proof-of-work block. this is to preserve
+        // the energy efficiency property
+        if (candidate.pindex->IsProofOfStake())
+            candidate.hashSelection >>= 32;
+    }
+
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64_t nStakeModifierNew = 0;
     int64_t nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
+    vector<const CBlockIndex*> vSelectedBlocks;
     for (int nRound=0; nRound<min(64, (int)vSortedByTimestamp.size()); nRound++)
     {
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        if (!SelectBlockFromCandidates(vSortedByTimestamp, nSelectionIntervalStop, &pindex))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64_t)pindex->GetStakeEntropyBit()) << nRound);
         // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
+        vSelectedBlocks.push_back(pindex);
         LogPrint("stakemodifier", "ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n",
             nRound, DateTimeStrFormat(nSelectionIntervalStop), pindex->nHeight, pindex->GetStakeEntropyBit());
     }
@@ -210,11 +235,11 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        BOOST_FOREACH(const PAIRTYPE(uint256, const CBlockIndex*)& item, mapSelectedBlocks)
+        BOOST_FOREACH(const CBlockIndex* pindexSelected, vSelectedBlocks)
         {
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake()? "S" : "W");
+            strSelectionMap.replace(pindexSelected->nHeight - nHeightFirstCandidate, 1, pindexSelected->IsProofOfStake()? "S" : "W");
         }
         LogPrintf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap);
     }
@@ -225,38 +250,101 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+// Main chain blocks that generated a stake modifier, in height order. The
+// index follows the main chain lazily: blocks disconnected since the last
+// lookup are dropped and newly connected ones appended.
+static CCriticalSection cs_modifierindex;
+static vector<const CBlockIndex*> vModifierBlocks;
+static const CBlockIndex* pindexModifierTip = NULL;
+
+// Block whose modifier a coin's block uses. The entry stays valid as long as
+// both blocks are in the main chain, since the blocks in between are then too.
+static map<const CBlockIndex*, const CBlockIndex*> mapKernelModifierCache;
+static const unsigned int MAX_KERNEL_MODIFIER_CACHE = 100000;
+
+static bool HeightLess(const CBlockIndex* pindexA, const CBlockIndex* pindexB)
+{
+    return pindexA->nHeight < pindexB->nHeight;
+}
+
+static void SyncModifierIndex()
+{
+    AssertLockHeld(cs_modifierindex);
+
+    // Drop the blocks of a disconnected branch
+    while (pindexModifierTip && !pindexModifierTip->IsInMainChain())
+        pindexModifierTip = pindexModifierTip->pprev;
+    int nHeightTip = pindexModifierTip ? pindexModifierTip->nHeight : -1;
+    while (!vModifierBlocks.empty() && vModifierBlocks.back()->nHeight > nHeightTip)
+        vModifierBlocks.pop_back();
+
+    // Append the blocks connected since
+    const CBlockIndex* pindex = pindexModifierTip ? pindexModifierTip->pnext : pindexGenesisBlock;
+    for (; pindex; pindex = pindex->pnext)
+    {
+        if (pindex->GeneratedStakeModifier())
+            vModifierBlocks.push_back(pindex);
+        pindexModifierTip = pindex;
+    }
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
 static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
-    if (!mapBlockIndex.count(hashBlockFrom))
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlockFrom);
+    if (mi == mapBlockIndex.end())
         return error("GetKernelStakeModifier() : block not indexed");
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
+    const CBlockIndex* pindexFrom = mi->second;
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
     const CBlockIndex* pindex = pindexFrom;
-    // loop to find the stake modifier later by a selection interval
-    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
+
+    // find the first stake modifier later by a selection interval
+    if (pindexFrom->IsInMainChain())
     {
-        if (!pindex->pnext)
-        {   // reached best block; may happen if node is behind on block chain
-            if (fPrintProofOfStake || (pindex->GetBlockTime() + GetStakeMinAge() - nStakeModifierSelectionInterval > GetAdjustedTime()))
-                return error("GetKernelStakeModifier() : reached best block %s at height %d from block %s",
-                    pindex->GetBlockHash().ToString(), pindex->nHeight, hashBlockFrom.ToString());
-            else
-                return false;
+        LOCK(cs_modifierindex);
+        const CBlockIndex* pindexModifier = NULL;
+        map<const CBlockIndex*, const CBlockIndex*>::iterator mc = mapKernelModifierCache.find(pindexFrom);
+        if (mc != mapKernelModifierCache.end() && mc->second->IsInMainChain())
+            pindexModifier = mc->second;
+        else
+        {
+            SyncModifierIndex();
+            vector<const CBlockIndex*>::iterator it = upper_bound(vModifierBlocks.begin(), vModifierBlocks.end(), pindexFrom, HeightLess);
+            for (; it != vModifierBlocks.end(); ++it)
+            {
+                if ((*it)->GetBlockTime() >= pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
+                {
+                    pindexModifier = *it;
+                    break;
+                }
+            }
+            if (pindexModifier)
+            {
+                if (mapKernelModifierCache.size() >= MAX_KERNEL_MODIFIER_CACHE)
+                    mapKernelModifierCache.clear();
+                mapKernelModifierCache[pindexFrom] = pindexModifier;
+            }
+            else if (pindexModifierTip)
+                pindex = pindexModifierTip;
         }
-        pindex = pindex->pnext;
-        if (pindex->GeneratedStakeModifier())
+        if (pindexModifier)
         {
-            nStakeModifierHeight = pindex->nHeight;
-            nStakeModifierTime = pindex->GetBlockTime();
+            nStakeModifierHeight = pindexModifier->nHeight;
+            nStakeModifierTime = pindexModifier->GetBlockTime();
+            nStakeModifier = pindexModifier->nStakeModifier;
+            return true;
         }
     }
-    nStakeModifier = pindex->nStakeModifier;
-    return true;
+
+    // reached best block; may happen if node is behind on block chain
+    if (fPrintProofOfStake || (pindex->GetBlockTime() + GetStakeMinAge() - nStakeModifierSelectionInterval > GetAdjustedTime()))
+        return error("GetKernelStakeModifier() : reached best block %s at height %d from block %s",
+            pindex->GetBlockHash().ToString(), pindex->nHeight, hashBlockFrom.ToString());
+    return false;
 }
 
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier)
@@ -267,6 +355,13 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier)
     return GetKernelStakeModifier(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false);
 }
 
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight)
+{
+    int64_t nStakeModifierTime;
+
+    return GetKernelStakeModifier(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false);
+}
+
 // ppcoin kernel protocol
 // coinstake must meet hash target according to the protocol:
 // kernel (input 0) must meet the formula
@@ -352,72 +447,460 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     return true;
 }
 
-// Scan given coins set for kernel solution
-bool ScanForStakeKernelHash(MetaMap &mapMeta, KernelSearchSettings &settings, CoinsSet::value_type &kernelcoin, unsigned int &nTimeTx, unsigned int &nBlockTime, CWallet* pwallet)
+static const uint32_t pSHA256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const uint32_t pSHA256Init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static inline uint32_t KernelRotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+static inline uint32_t KernelSigma0(uint32_t x) { return KernelRotr(x, 7) ^ KernelRotr(x, 18) ^ (x >> 3); }
+static inline uint32_t KernelSigma1(uint32_t x) { return KernelRotr(x, 17) ^ KernelRotr(x, 19) ^ (x >> 10); }
+
+// Serialized (little endian) 32-bit field as a big endian SHA-256 message word
+static inline uint32_t KernelWord(uint32_t x)
 {
-    uint256 hashProofOfStake = 0;
+    return (x >> 24) | ((x >> 8) & 0x0000ff00) | ((x << 8) & 0x00ff0000) | (x << 24);
+}
 
-    // (txid, vout.n) => ((txindex, (tx, vout.n)), (block, modifier))
-    for(MetaMap::const_iterator meta_item = mapMeta.begin(); meta_item != mapMeta.end(); meta_item++)
+// Expand the message schedule from word nBegin on
+static inline void KernelExpand(uint32_t* pW, int nBegin)
+{
+    for (int i = nBegin; i < 64; i++)
+        pW[i] = KernelSigma1(pW[i-2]) + pW[i-7] + KernelSigma0(pW[i-15]) + pW[i-16];
+}
+
+// Run SHA-256 compression rounds [nBegin, nEnd) on pstate
+static inline void KernelRounds(uint32_t* pstate, const uint32_t* pW, int nBegin, int nEnd)
+{
+    uint32_t a = pstate[0], b = pstate[1], c = pstate[2], d = pstate[3];
+    uint32_t e = pstate[4], f = pstate[5], g = pstate[6], h = pstate[7];
+    for (int i = nBegin; i < nEnd; i++)
     {
-        if (!pwallet->GetCoinsDataActual())
-            break;
+        uint32_t t1 = h + (KernelRotr(e, 6) ^ KernelRotr(e, 11) ^ KernelRotr(e, 25)) + ((e & f) ^ (~e & g)) + pSHA256K[i] + pW[i];
+        uint32_t t2 = (KernelRotr(a, 2) ^ KernelRotr(a, 13) ^ KernelRotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    pstate[0] = a; pstate[1] = b; pstate[2] = c; pstate[3] = d;
+    pstate[4] = e; pstate[5] = f; pstate[6] = g; pstate[7] = h;
+}
 
-        CTxIndex txindex = (*meta_item).second.first.first;
-        CBlock block = (*meta_item).second.second.first;
-        uint64_t nStakeModifier = (*meta_item).second.second.second;
+// (a * b) / d for d < 2^47, assuming the quotient fits into 64 bits
+static uint64_t KernelMulDiv(uint64_t a, uint64_t b, uint64_t d)
+{
+    uint64_t a0 = (uint32_t)a, a1 = a >> 32, b0 = (uint32_t)b, b1 = b >> 32;
+    uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    uint64_t nMid = (p00 >> 32) + (uint32_t)p01 + (uint32_t)p10;
+    uint64_t nLow = (nMid << 32) | (uint32_t)p00;
+    uint64_t nHigh = p11 + (p01 >> 32) + (p10 >> 32) + (nMid >> 32);
+
+    // long division in 16-bit digits, the remainder stays below 2^47
+    uint64_t nQuotient = 0, nRemainder = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+        uint64_t nDigit = ((i >= 4 ? nHigh : nLow) >> (16 * (i & 3))) & 0xffff;
+        uint64_t nCurrent = (nRemainder << 16) | nDigit;
+        nQuotient = (nQuotient << 16) | (nCurrent / d);
+        nRemainder = nCurrent % d;
+    }
+    return nQuotient;
+}
 
-        // Get coin
-        CoinsSet::value_type pcoin = meta_item->second.first.second;
+CStakeKernel::CStakeKernel(unsigned int nBits, uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset,
+                           unsigned int nTimeTxPrevIn, unsigned int nPrevout, int64_t nValueInIn)
+{
+    nValueIn = nValueInIn;
+    nTimeTxPrev = nTimeTxPrevIn;
+
+    // Padded single block message: 24 constant bytes, nTimeTx, 0x80 and the bit length (224)
+    memset(pnSchedule, 0, sizeof(pnSchedule));
+    pnSchedule[0] = KernelWord((uint32_t)nStakeModifier);
+    pnSchedule[1] = KernelWord((uint32_t)(nStakeModifier >> 32));
+    pnSchedule[2] = KernelWord(nTimeBlockFrom);
+    pnSchedule[3] = KernelWord(nTxPrevOffset);
+    pnSchedule[4] = KernelWord(nTimeTxPrev);
+    pnSchedule[5] = KernelWord(nPrevout);
+    pnSchedule[7] = 0x80000000;
+    pnSchedule[15] = 28 * 8;
+
+    // W16..W20 do not depend on W6 yet
+    for (int i = 16; i < 21; i++)
+        pnSchedule[i] = KernelSigma1(pnSchedule[i-2]) + pnSchedule[i-7] + KernelSigma0(pnSchedule[i-15]) + pnSchedule[i-16];
+
+    memcpy(pnMidstate, pSHA256Init, sizeof(pnMidstate));
+    KernelRounds(pnMidstate, pnSchedule, 0, 6);
+
+    // Same decoding as CBigNum::SetCompact
+    memset(pnTargetPerCoinDay, 0, sizeof(pnTargetPerCoinDay));
+    fTargetOverflow = false;
+    unsigned int nSize = nBits >> 24;
+    uint32_t nWord = nBits & 0x007fffff;
+    if (nSize <= 3)
+        pnTargetPerCoinDay[0] = nWord >> (8 * (3 - nSize));
+    else if (nWord != 0)
+    {
+        unsigned int nShift = 8 * (nSize - 3);
+        uint64_t nShifted = (uint64_t)nWord << (nShift % 32);
+        for (unsigned int i = nShift / 32, j = 0; j < 2; i++, j++)
+        {
+            uint32_t nPart = (uint32_t)(nShifted >> (32 * j));
+            if (i < 8)
+                pnTargetPerCoinDay[i] = nPart;
+            else if (nPart != 0)
+                fTargetOverflow = true;
+        }
+    }
+    fTargetZero = !fTargetOverflow;
+    for (int i = 0; i < 8 && fTargetZero; i++)
+        fTargetZero = (pnTargetPerCoinDay[i] == 0);
+    fTargetNegative = (nBits & 0x00800000) != 0 && !fTargetZero;
+
+    nLastCoinDayWeight = 0;
+    fLastOverflow = false;
+    memset(pnLastTarget, 0, sizeof(pnLastTarget));
+}
 
-        static int nMaxStakeSearchInterval = 60;
+uint256 CStakeKernel::GetHash(unsigned int nTimeTx) const
+{
+    uint32_t pW[64];
+    uint32_t pstate[8];
+
+    // First pass over the kernel, resuming after the constant rounds
+    memcpy(pW, pnSchedule, sizeof(pnSchedule));
+    pW[6] = KernelWord(nTimeTx);
+    KernelExpand(pW, 21);
+    memcpy(pstate, pnMidstate, sizeof(pstate));
+    KernelRounds(pstate, pW, 6, 64);
+    for (int i = 0; i < 8; i++)
+        pW[i] = pstate[i] + pSHA256Init[i];
+
+    // Second pass over the 32-byte digest
+    pW[8] = 0x80000000;
+    for (int i = 9; i < 15; i++)
+        pW[i] = 0;
+    pW[15] = 32 * 8;
+    KernelExpand(pW, 16);
+    memcpy(pstate, pSHA256Init, sizeof(pstate));
+    KernelRounds(pstate, pW, 0, 64);
+
+    uint256 hash;
+    unsigned char* p = hash.begin();
+    for (int i = 0; i < 8; i++)
+    {
+        uint32_t n = pstate[i] + pSHA256Init[i];
+        p[4*i] = n >> 24;
+        p[4*i+1] = n >> 16;
+        p[4*i+2] = n >> 8;
+        p[4*i+3] = n;
+    }
+    return hash;
+}
 
-        // only count coins meeting min age requirement
-        if (GetStakeMinAge() + block.nTime > settings.nTime - nMaxStakeSearchInterval)
-            continue;
+bool CStakeKernel::CheckTarget(const uint256& hashProofOfStake, unsigned int nTimeTx) const
+{
+    // bnCoinDayWeight = nValueIn * nTimeWeight / COIN / (24 * 60 * 60), truncated toward zero
+    int64_t nTimeWeight = GetWeight((int64_t)nTimeTxPrev, (int64_t)nTimeTx);
+    uint64_t nAbsValue = nValueIn < 0 ? (uint64_t)(-(nValueIn + 1)) + 1 : (uint64_t)nValueIn;
+    uint64_t nAbsWeight = nTimeWeight < 0 ? (uint64_t)(-(nTimeWeight + 1)) + 1 : (uint64_t)nTimeWeight;
+    uint64_t nCoinDayWeight = KernelMulDiv(nAbsValue, nAbsWeight, (uint64_t)COIN * (24 * 60 * 60));
+    bool fNegative = (nValueIn < 0) != (nTimeWeight < 0);
+
+    // A zero target is only met by a zero hash, a negative one never
+    if (nCoinDayWeight == 0 || fTargetZero)
+        return hashProofOfStake == 0;
+    if (fNegative != fTargetNegative)
+        return false;
+    if (fTargetOverflow)
+        return true;
 
-        // Transaction offset inside block
-        unsigned int nTxOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+    if (nCoinDayWeight != nLastCoinDayWeight)
+    {
+        uint32_t pnProduct[10];
+        memset(pnProduct, 0, sizeof(pnProduct));
+        uint64_t nCarry = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            uint64_t n = (uint64_t)pnTargetPerCoinDay[i] * (uint32_t)nCoinDayWeight + nCarry;
+            pnProduct[i] = (uint32_t)n;
+            nCarry = n >> 32;
+        }
+        pnProduct[8] = (uint32_t)nCarry;
+        nCarry = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            uint64_t n = (uint64_t)pnTargetPerCoinDay[i] * (uint32_t)(nCoinDayWeight >> 32) + pnProduct[i+1] + nCarry;
+            pnProduct[i+1] = (uint32_t)n;
+            nCarry = n >> 32;
+        }
+        pnProduct[9] = (uint32_t)nCarry;
 
-        // Current timestamp scanning interval
-        unsigned int nCurrentSearchInterval = min((int64_t)settings.nSearchInterval, (int64_t)nMaxStakeSearchInterval);
+        nLastCoinDayWeight = nCoinDayWeight;
+        fLastOverflow = (pnProduct[8] != 0 || pnProduct[9] != 0);
+        memcpy(pnLastTarget, pnProduct, sizeof(pnLastTarget));
+    }
+    if (fLastOverflow)
+        return true;
 
-        nBlockTime = block.nTime;
-        CBigNum bnTargetPerCoinDay;
-        bnTargetPerCoinDay.SetCompact(settings.nBits);
-        int64_t nValueIn = pcoin.first->vout[pcoin.second].nValue;
+    for (int i = 3; i >= 0; i--)
+    {
+        uint64_t nHash = hashProofOfStake.Get64(i);
+        uint64_t nTarget = pnLastTarget[2*i] | ((uint64_t)pnLastTarget[2*i+1] << 32);
+        if (nHash != nTarget)
+            return nHash < nTarget;
+    }
+    return true;
+}
+
+// Scan a single coin for kernel solution
+// Searches backward in time from settings.nTime, up to nMaxStakeSearchInterval seconds
+static bool ScanCoinForStakeKernelHash(const CStakeCandidates& candidates, unsigned int nPos, const KernelSearchSettings& settings, unsigned int& nTimeTx, uint256& hashProofOfStake)
+{
+    static const int nMaxStakeSearchInterval = 60;
+
+    unsigned int nBlockTime = candidates.vnBlockTime[nPos];
+
+    // only count coins meeting min age requirement
+    if (GetStakeMinAge() + nBlockTime > settings.nTime - nMaxStakeSearchInterval)
+        return false;
+
+    uint64_t nStakeModifier = candidates.vnStakeModifier[nPos];
+    unsigned int nTxOffset = candidates.vnTxOffset[nPos];
+    unsigned int nTxPrevTime = candidates.vnTxTime[nPos];
+    unsigned int nOut = candidates.vnOut[nPos];
+
+    // Current timestamp scanning interval
+    unsigned int nCurrentSearchInterval = min((int64_t)settings.nSearchInterval, (int64_t)nMaxStakeSearchInterval);
+
+    // Kernel prefix and target are fixed for the coin, only nTimeTx varies
+    CStakeKernel kernel(settings.nBits, nStakeModifier, nBlockTime, nTxOffset, nTxPrevTime, nOut, candidates.vnValue[nPos]);
+
+    for (unsigned int n=0; n<nCurrentSearchInterval && !fShutdown; n++)
+    {
+        nTimeTx = settings.nTime - n;
 
-        // Search backward in time from the given timestamp
-        // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-        // Stopping search in case of shutting down or cache invalidation
-        for (unsigned int n=0; n<nCurrentSearchInterval && pwallet->GetCoinsDataActual() && !fShutdown; n++)
+        if (kernel.CheckHash(nTimeTx, hashProofOfStake))
         {
-            nTimeTx = settings.nTime - n;
-            CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)pcoin.first->nTime, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
-            CBigNum bnTargetProofOfStake = bnCoinDayWeight * bnTargetPerCoinDay;
+            LogPrint("coinstake", "nStakeModifier=0x%016x, nBlockTime=%u nTxOffset=%u nTxPrevTime=%u nVout=%u nTimeTx=%u hashProofOfStake=%s Success=true\n",
+                nStakeModifier, nBlockTime, nTxOffset, nTxPrevTime, nOut, nTimeTx, hashProofOfStake.GetHex().c_str());
+            return true;
+        }
+    }
 
-            // Build kernel
-            CDataStream ss(SER_GETHASH, 0);
-            ss << nStakeModifier;
-            ss << nBlockTime << nTxOffset << pcoin.first->nTime << pcoin.second << nTimeTx;
+    return false;
+}
 
-            // Calculate kernel hash
-            hashProofOfStake = Hash(ss.begin(), ss.end());
+int nStakeKernelThreads = 0;
 
-            if (bnTargetProofOfStake >= CBigNum(hashProofOfStake))
-            {
-                LogPrint("coinstake", "nStakeModifier=0x%016x, nBlockTime=%u nTxOffset=%u nTxPrevTime=%u nVout=%u nTimeTx=%u hashProofOfStake=%s Success=true\n",
-                    nStakeModifier, nBlockTime, nTxOffset, pcoin.first->nTime, pcoin.second, nTimeTx, hashProofOfStake.GetHex().c_str());
+/** Work on a range of stake candidates, run by the stake kernel search threads */
+class CStakeKernelJob
+{
+public:
+    virtual ~CStakeKernelJob() {}
+    virtual void Scan(unsigned int nBegin, unsigned int nEnd) = 0;
+};
+
+// Kernel search shared by the search threads.
+// Holds the hit on the lowest coin position, which is the one a serial scan returns.
+class CStakeKernelSearch : public CStakeKernelJob
+{
+private:
+    const CStakeCandidates& candidates;
+    const KernelSearchSettings& settings;
+    CWallet* pwallet;
+
+    mutable CCriticalSection cs;
+    unsigned int nBestPos;
+    unsigned int nBestTimeTx;
+
+public:
+    CStakeKernelSearch(const CStakeCandidates& candidatesIn, const KernelSearchSettings& settingsIn, CWallet* pwalletIn) :
+        candidates(candidatesIn), settings(settingsIn), pwallet(pwalletIn), nBestPos(candidatesIn.size()), nBestTimeTx(0) {}
+
+    unsigned int GetBestPos() const
+    {
+        LOCK(cs);
+        return nBestPos;
+    }
+
+    unsigned int GetBestTimeTx() const
+    {
+        LOCK(cs);
+        return nBestTimeTx;
+    }
 
-                kernelcoin = pcoin;
-                return true;
+    void Found(unsigned int nPos, unsigned int nTimeTx)
+    {
+        LOCK(cs);
+        if (nPos < nBestPos)
+        {
+            nBestPos = nPos;
+            nBestTimeTx = nTimeTx;
+        }
+    }
+
+    void Scan(unsigned int nBegin, unsigned int nEnd)
+    {
+        unsigned int nTimeTx;
+        uint256 hashProofOfStake;
+        for (unsigned int nPos = nBegin; nPos < nEnd; nPos++)
+        {
+            // Stop once a coin in front of this one has a kernel, or on shutdown and cache invalidation
+            if (nPos > GetBestPos() || fShutdown || !pwallet->GetCoinsDataActual())
+                break;
+            if (ScanCoinForStakeKernelHash(candidates, nPos, settings, nTimeTx, hashProofOfStake))
+            {
+                Found(nPos, nTimeTx);
+                break;
             }
-            //LogPrint("coinstakedeep", "n=%d,nStakeModifier=0x%016x, nBlockTime=%u nTxOffset=%u nTxPrevTime=%u nVout=%u nTimeTx=%u hashProofOfStake=%s wallet=%s Success=false\n",
-            //    n, nStakeModifier, nBlockTime, nTxOffset, pcoin.first->nTime, pcoin.second, nTimeTx, hashProofOfStake.GetHex().c_str(),pwallet->strWalletFile.c_str());
         }
     }
+};
 
-    return false;
+// Kernel hits of a timestamp interval, collected from all coins
+class CStakeKernelPlan : public CStakeKernelJob
+{
+private:
+    const CStakeCandidates& candidates;
+    unsigned int nBits;
+    unsigned int nTimeFrom;
+    unsigned int nTimeTo;
+
+    CCriticalSection cs;
+    std::multimap<unsigned int, unsigned int>& mapHits;
+
+public:
+    CStakeKernelPlan(const CStakeCandidates& candidatesIn, unsigned int nBitsIn, unsigned int nTimeFromIn, unsigned int nTimeToIn,
+                     std::multimap<unsigned int, unsigned int>& mapHitsIn) :
+        candidates(candidatesIn), nBits(nBitsIn), nTimeFrom(nTimeFromIn), nTimeTo(nTimeToIn), mapHits(mapHitsIn) {}
+
+    void Scan(unsigned int nBegin, unsigned int nEnd)
+    {
+        std::vector<std::pair<unsigned int, unsigned int> > vHits;
+        for (unsigned int nPos = nBegin; nPos < nEnd && !fShutdown; nPos++)
+        {
+            // Min age and transaction timestamp requirements
+            unsigned int nTimeBegin = max(nTimeFrom, max(candidates.vnBlockTime[nPos] + GetStakeMinAge(), candidates.vnTxTime[nPos]));
+
+            CStakeKernel kernel(nBits, candidates.vnStakeModifier[nPos], candidates.vnBlockTime[nPos], candidates.vnTxOffset[nPos],
+                                candidates.vnTxTime[nPos], candidates.vnOut[nPos], candidates.vnValue[nPos]);
+
+            uint256 hashProofOfStake;
+            for (unsigned int nTimeTx = nTimeBegin; nTimeTx <= nTimeTo; nTimeTx++)
+                if (kernel.CheckHash(nTimeTx, hashProofOfStake))
+                    vHits.push_back(std::make_pair(nTimeTx, nPos));
+        }
+
+        LOCK(cs);
+        mapHits.insert(vHits.begin(), vHits.end());
+    }
+};
+
+/** A consecutive range of coins handled by one stake kernel search thread */
+class CStakeKernelCheck
+{
+private:
+    CStakeKernelJob* pjob;
+    unsigned int nBegin;
+    unsigned int nEnd;
+
+public:
+    CStakeKernelCheck() : pjob(NULL), nBegin(0), nEnd(0) {}
+    CStakeKernelCheck(CStakeKernelJob* pjobIn, unsigned int nBeginIn, unsigned int nEndIn) :
+        pjob(pjobIn), nBegin(nBeginIn), nEnd(nEndIn) {}
+
+    // Always succeeds, results are collected by the job
+    bool operator()()
+    {
+        pjob->Scan(nBegin, nEnd);
+        return true;
+    }
+
+    void swap(CStakeKernelCheck& check)
+    {
+        std::swap(pjob, check.pjob);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+    }
+};
+
+static CCheckQueue<CStakeKernelCheck> stakekernelqueue(1);
+
+void ThreadStakeKernelSearch(void*)
+{
+    vnThreadsRunning[THREAD_STAKEKERNEL]++;
+    RenameThread("hobocoin-stakekernel");
+    stakekernelqueue.Thread();
+    vnThreadsRunning[THREAD_STAKEKERNEL]--;
+}
+
+void ThreadStakeKernelSearchQuit()
+{
+    stakekernelqueue.Quit();
+}
+
+// Coins are split into chunks several times the number of threads, so that
+// early chunks are done first and a search can stop once a kernel is known
+static unsigned int GetStakeKernelChunkSize(unsigned int nCoins)
+{
+    static const unsigned int nMinChunkSize = 16;
+    return max(nMinChunkSize, nCoins / (max(nStakeKernelThreads, 1) * 8));
+}
+
+// Run job over nCoins coins on the stake kernel search threads
+static void RunStakeKernelJob(CStakeKernelJob& job, unsigned int nCoins)
+{
+    unsigned int nChunkSize = GetStakeKernelChunkSize(nCoins);
+
+    CCheckQueueControl<CStakeKernelCheck> control(&stakekernelqueue);
+
+    // The queue hands out its last element first, so add the chunks back to front
+    std::vector<CStakeKernelCheck> vChecks;
+    for (unsigned int nEnd = nCoins; nEnd > 0; )
+    {
+        unsigned int nBegin = nEnd > nChunkSize ? nEnd - nChunkSize : 0;
+        vChecks.push_back(CStakeKernelCheck(&job, nBegin, nEnd));
+        nEnd = nBegin;
+    }
+    control.Add(vChecks);
+    control.Wait();
+}
+
+// Scan given coins set for kernel solution
+bool ScanForStakeKernelHash(const CStakeCandidates& candidates, const KernelSearchSettings& settings, CoinsSet::value_type& kernelcoin, unsigned int& nTimeTx, unsigned int& nBlockTime, CWallet* pwallet)
+{
+    CStakeKernelSearch search(candidates, settings, pwallet);
+    if (nStakeKernelThreads <= 1 || candidates.size() <= GetStakeKernelChunkSize(candidates.size()))
+        search.Scan(0, candidates.size());
+    else
+        RunStakeKernelJob(search, candidates.size());
+
+    unsigned int nPos = search.GetBestPos();
+    if (nPos >= candidates.size() || !pwallet->GetCoinsDataActual())
+        return false;
+
+    LogPrint("coinstake", "ScanForStakeKernelHash : kernel found at coin %u of %u\n", nPos, candidates.size());
+    kernelcoin = candidates.GetCoin(nPos);
+    nBlockTime = candidates.vnBlockTime[nPos];
+    nTimeTx = search.GetBestTimeTx();
+    return true;
+}
+
+// Find the coins of candidates meeting the kernel target at timestamps within [nTimeFrom, nTimeTo]
+void PlanStakeKernelHits(const CStakeCandidates& candidates, unsigned int nBits, unsigned int nTimeFrom, unsigned int nTimeTo, std::multimap<unsigned int, unsigned int>& mapHits)
+{
+    CStakeKernelPlan plan(candidates, nBits, nTimeFrom, nTimeTo, mapHits);
+    if (nStakeKernelThreads <= 1 || candidates.size() <= GetStakeKernelChunkSize(candidates.size()))
+        plan.Scan(0, candidates.size());
+    else
+        RunStakeKernelJob(plan, candidates.size());
 }
 
 // Check kernel hash target and coinstake signature
@@ -19,11 +19,56 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier);
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight);
 
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
+/** Stake kernel hashing engine for a single coin.
+ *
+ * The kernel preimage is always 28 bytes: nStakeModifier, nTimeBlockFrom,
+ * nTxPrevOffset, txPrev.nTime and prevout.n form a constant 24-byte prefix
+ * and only nTimeTx changes while searching.  The padded SHA-256 block, the
+ * first six compression rounds and the per-coin target are therefore set up
+ * once, and every candidate timestamp costs two SHA-256 compressions and a
+ * native 256-bit compare.  Results are identical to CheckStakeKernelHash.
+ */
+class CStakeKernel
+{
+private:
+    uint32_t pnSchedule[21];  // message schedule words W0..W20, W6 (nTimeTx) left zero
+    uint32_t pnMidstate[8];   // compression state after the six constant rounds
+
+    int64_t nValueIn;
+    unsigned int nTimeTxPrev;
+    bool fTargetZero;         // nBits decoded to zero
+    bool fTargetNegative;     // nBits decoded to a negative target
+    bool fTargetOverflow;     // nBits decoded to a target of 2^256 or more
+    uint32_t pnTargetPerCoinDay[8];
+
+    // last coin day weight and its target, the weight changes at most once a second
+    mutable uint64_t nLastCoinDayWeight;
+    mutable bool fLastOverflow;
+    mutable uint32_t pnLastTarget[8];
+
+public:
+    CStakeKernel(unsigned int nBits, uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset,
+                 unsigned int nTimeTxPrevIn, unsigned int nPrevout, int64_t nValueInIn);
+
+    // Kernel hash for the given coinstake timestamp
+    uint256 GetHash(unsigned int nTimeTx) const;
+
+    // Whether hashProofOfStake meets the coin day weighted target at nTimeTx
+    bool CheckTarget(const uint256& hashProofOfStake, unsigned int nTimeTx) const;
+
+    bool CheckHash(unsigned int nTimeTx, uint256& hashProofOfStake) const
+    {
+        hashProofOfStake = GetHash(nTimeTx);
+        return CheckTarget(hashProofOfStake, nTimeTx);
+    }
+};
+
 // Coins scanning options
 typedef struct KernelSearchSettings {
     unsigned int nBits;           // Packed difficulty
@@ -35,12 +80,25 @@ typedef struct KernelSearchSettings {
 
 typedef std::set<std::pair<const CWalletTx*,unsigned int> > CoinsSet;
 
-// Preloaded coins metadata
-// (txid, vout.n) => ((txindex, (tx, vout.n)), (block, modifier))
-typedef std::map<std::pair<uint256, unsigned int>, std::pair<std::pair<CTxIndex, std::pair<const CWalletTx*,unsigned int> >, std::pair<CBlock, uint64_t> > > MetaMap;
+// Maximum number of threads searching for a stake kernel
+static const int MAX_STAKE_KERNEL_THREADS = 16;
+
+// Number of threads searching for a stake kernel, 0 or 1 searches on the miner thread only
+extern int nStakeKernelThreads;
 
 // Scan given coins set for kernel solution
-bool ScanForStakeKernelHash(MetaMap &mapMeta, KernelSearchSettings &settings, CoinsSet::value_type &kernelcoin, unsigned int &nTimeTx, unsigned int &nBlockTime, CWallet* pwallet);
+// With nStakeKernelThreads > 1 the coins are searched concurrently, the kernel
+// returned is still the one a serial scan in candidates order would find
+bool ScanForStakeKernelHash(const CStakeCandidates& candidates, const KernelSearchSettings& settings, CoinsSet::value_type& kernelcoin, unsigned int& nTimeTx, unsigned int& nBlockTime, CWallet* pwallet);
+
+// Find the coins of candidates meeting the kernel target at timestamps within [nTimeFrom, nTimeTo]
+// Hits are returned as nTimeTx => candidate position
+void PlanStakeKernelHits(const CStakeCandidates& candidates, unsigned int nBits, unsigned int nTimeFrom, unsigned int nTimeTo, std::multimap<unsigned int, unsigned int>& mapHits);
+
+// Run an instance of the stake kernel search thread
+void ThreadStakeKernelSearch(void* parg);
+// Stop the stake kernel search threads
+void ThreadStakeKernelSearchQuit();
 
 
 // Check kernel hash target and coinstake signature
@@ -8,6 +8,15 @@
 #include <openssl/obj_mac.h>
 
 #include "key.h"
+#include "secp256k1.h"
+
+// Whether signatures are verified with the built-in code where it can
+static bool fNativeECDSA = true;
+
+void SetNativeECDSA(bool fEnable)
+{
+    fNativeECDSA = fEnable;
+}
 
 // Generate a private key from just the secret parameter
 int EC_KEY_regenerate_key(EC_KEY *eckey, BIGNUM *priv_key)
@@ -448,6 +457,17 @@ bool CKey::SetCompactSignature(uint256 hash, const std::vector<unsigned char>& v
 
 bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
 {
+    if (vchSig.empty())
+        return false;
+
+    if (fNativeECDSA && fSet)
+    {
+        CPubKey pubkey = GetPubKey();
+        int nRet = Secp256k1Verify((unsigned char*)&hash, &vchSig[0], vchSig.size(), &pubkey.vchPubKey[0], pubkey.vchPubKey.size());
+        if (nRet >= 0)
+            return nRet == 1;
+    }
+
     // -1 = error, 0 = bad sig, 1 = good
     if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) != 1)
         return false;
@@ -455,6 +475,25 @@ bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
     return true;
 }
 
+bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const
+{
+    if (!IsValid() || vchSig.empty())
+        return false;
+
+    if (fNativeECDSA)
+    {
+        int nRet = Secp256k1Verify((const unsigned char*)&hash, &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size());
+        if (nRet >= 0)
+            return nRet == 1;
+    }
+
+    // Encodings only OpenSSL takes
+    CKey key;
+    if (!key.SetPubKey(*this))
+        return false;
+    return key.Verify(hash, vchSig);
+}
+
 bool CKey::IsValid()
 {
     if (!fSet)
@@ -480,3 +519,32 @@ bool ECC_InitSanityCheck() {
   return true;
 
 }
+
+bool ECC_NativeSanityCheck() {
+    if (!fNativeECDSA || !Secp256k1Available())
+        return true;
+
+    // A fresh signature, valid and then altered, of both key forms
+    for (int i = 0; i < 2; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i == 1);
+        std::vector<unsigned char> vchPubKey = key.GetPubKey().Raw();
+        uint256 hash = Hash(vchPubKey.begin(), vchPubKey.end());
+        std::vector<unsigned char> vchSig;
+        if (!key.Sign(hash, vchSig))
+            return false;
+        for (int j = 0; j < 2; j++)
+        {
+            if (j == 1)
+                hash ^= 1;
+            int nNative = Secp256k1Verify((unsigned char*)&hash, &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size());
+            fNativeECDSA = false;
+            bool fOpenSSL = key.Verify(hash, vchSig);
+            fNativeECDSA = true;
+            if (nNative != (j == 0 ? 1 : 0) || (nNative == 1) != fOpenSSL)
+                return false;
+        }
+    }
+    return true;
+}
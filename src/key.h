@@ -97,6 +97,10 @@ public:
     std::vector<unsigned char> Raw() const {
         return vchPubKey;
     }
+
+    // Verify a DER signature of hash with this key, without an OpenSSL key
+    // for the encodings the built-in verifier handles
+    bool Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
 };
 
 
@@ -163,4 +167,10 @@ public:
 /** Check that required EC support is available at runtime */
 bool ECC_InitSanityCheck(void);
 
+/** Verify signatures with the built-in secp256k1 code (default) or only with OpenSSL */
+void SetNativeECDSA(bool fEnable);
+
+/** Check that the built-in verifier, when used, agrees with OpenSSL */
+bool ECC_NativeSanityCheck(void);
+
 #endif
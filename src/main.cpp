@@ -31,15 +31,15 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+CBlockIndexMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 uint256 hashGenesisBlock = hashGenesisBlockOfficial;
-static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20);
-static CBigNum bnProofOfStakeLimit(~uint256(0) >> 24);
-static CBigNum bnProofOfStakeHardLimit(~uint256(0) >> 30);
+static uint256 bnProofOfWorkLimit(~uint256(0) >> 20);
+static uint256 bnProofOfStakeLimit(~uint256(0) >> 24);
+static uint256 bnProofOfStakeHardLimit(~uint256(0) >> 30);
 
-static CBigNum bnProofOfWorkLimitTestNet(~uint256(0) >> 16);
-static CBigNum bnProofOfStakeLimitTestNet(~uint256(0) >> 20);
+static uint256 bnProofOfWorkLimitTestNet(~uint256(0) >> 16);
+static uint256 bnProofOfStakeLimitTestNet(~uint256(0) >> 20);
 
 unsigned int nStakeMaxAge = 60 * 60 * 24 * 30; // stake age of full weight - 30 days
 
@@ -52,6 +52,9 @@ uint256 nBestInvalidTrust = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
 int64_t nTimeBestReceived = 0;
+
+boost::atomic<uint64_t> nBlockHashComputed(0);  // scrypt evaluations by CBlock::GetHash
+boost::atomic<uint64_t> nBlockHashCached(0);    // CBlock::GetHash calls answered from the cache
 int nScriptCheckThreads = 0;
 bool fHaveGUI = false;
 bool fImporting = false; //Tranz need to fix this 66b02c93
@@ -161,24 +164,27 @@ void SyncWithWallets(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
 {
     if (!fConnect)
     {
-        // ppcoin: wallets need to refund inputs when disconnecting coinstake
-        if (tx.IsCoinStake())
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(pblock->GetHash());
+        int nHeight = mi != mapBlockIndex.end() ? mi->second->nHeight : 0;
+
+        LOCK(cs_setpwalletRegistered);
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
         {
-            LOCK(cs_setpwalletRegistered);
-            BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-                if (pwallet->IsFromMe(tx))
-                    pwallet->DisableTransaction(tx);
+            // ppcoin: wallets need to refund inputs when disconnecting coinstake
+            if (tx.IsCoinStake() && pwallet->IsFromMe(tx))
+                pwallet->DisableTransaction(tx);
+            // Preloaded stake coins of the block, or with a modifier from it
+            pwallet->DisconnectStakeCoins(tx, nHeight);
         }
         return;
     }
 
     {
         LOCK(cs_setpwalletRegistered);
-        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered) {
+        // Preloaded stake coins are updated by the wallet for the transactions
+        // it adds, coins passing maturity are picked up by the stake miner
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
            pwallet->AddToWalletIfInvolvingMe(tx, pblock, fUpdate);
-           // Preloaded coins cache invalidation
-           pwallet->SetCoinsDataActual(false);
-        }
     }
 }
 
@@ -639,7 +645,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     vMerkleBranch = pblock->GetMerkleBranch(nIndex);
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -746,6 +752,133 @@ int64_t CTransaction::GetMinFee(unsigned int nBlockSize, bool fAllowFree,
 }
 
 
+int nPrefetchThreads = 0;
+
+// Previous transactions read by one input prefetch job
+static const unsigned int PREFETCH_RUN_SIZE = 16;
+
+/** A run of previous transactions from one block file, sorted by position,
+ *  read by an input prefetch thread
+ */
+class CTxPrefetch
+{
+private:
+    std::vector<std::pair<CDiskTxPos, CTransaction*> > vRead;
+
+public:
+    CTxPrefetch() {}
+    CTxPrefetch(const std::vector<std::pair<CDiskTxPos, CTransaction*> >& vReadIn) : vRead(vReadIn) {}
+
+    // Always succeeds, transactions that cannot be read are left null
+    bool operator()()
+    {
+        if (vRead.empty())
+            return true;
+        for (unsigned int i = 0; i < vRead.size(); i++)
+        {
+            if (!blockFileReader.Read(vRead[i].first.nFile, vRead[i].first.nTxPos, *vRead[i].second))
+            {
+                vRead[i].second->SetNull();
+                break;
+            }
+        }
+        return true;
+    }
+
+    void swap(CTxPrefetch& check)
+    {
+        vRead.swap(check.vRead);
+    }
+};
+
+static CCheckQueue<CTxPrefetch> prefetchqueue(1);
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadTxPrefetch(void*) {
+    vnThreadsRunning[THREAD_PREFETCH]++;
+    RenameThread("hobocoin-prefetch");
+    prefetchqueue.Thread();
+    vnThreadsRunning[THREAD_PREFETCH]--;
+}
+
+void ThreadTxPrefetchQuit() {
+    prefetchqueue.Quit();
+}
+
+static bool SortByDiskPos(const std::pair<CDiskTxPos, CTransaction*>& a, const std::pair<CDiskTxPos, CTransaction*>& b)
+{
+    if (a.first.nFile != b.first.nFile)
+        return a.first.nFile < b.first.nFile;
+    return a.first.nTxPos < b.first.nTxPos;
+}
+
+// Read the index records and previous transactions of the inputs of [pbegin, pend)
+// ahead of FetchInputs: index lookups in key order, then the disk reads in file
+// order on the prefetch threads. Inputs spending a transaction of the range, kept
+// in the memory pool or not readable are left out, FetchInputs handles them.
+static void PrefetchInputs(CTxDB& txdb, const CTransaction* pbegin, const CTransaction* pend, MapPrevTx& mapPrefetched)
+{
+    set<uint256> setHashTx;
+    vector<uint256> vHashPrev;
+    for (const CTransaction* ptx = pbegin; ptx != pend; ptx++)
+    {
+        setHashTx.insert(ptx->GetHash());
+        if (ptx->IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, ptx->vin)
+            vHashPrev.push_back(txin.prevout.hash);
+    }
+    sort(vHashPrev.begin(), vHashPrev.end());
+    vHashPrev.erase(unique(vHashPrev.begin(), vHashPrev.end()), vHashPrev.end());
+
+    vector<pair<CDiskTxPos, CTransaction*> > vRead;
+    BOOST_FOREACH(const uint256& hash, vHashPrev)
+    {
+        if (setHashTx.count(hash) || mapPrefetched.count(hash))
+            continue;
+        CTxIndex txindex;
+        if (!txdb.ReadTxIndex(hash, txindex) || txindex.pos == CDiskTxPos(1,1,1))
+            continue;
+        pair<CTxIndex, CTransaction>& entry = mapPrefetched[hash];
+        entry.first = txindex;
+        vRead.push_back(make_pair(txindex.pos, &entry.second));
+    }
+    sort(vRead.begin(), vRead.end(), SortByDiskPos);
+
+    vector<CTxPrefetch> vChecks;
+    for (unsigned int nBegin = 0; nBegin < vRead.size(); )
+    {
+        unsigned int nEnd = nBegin + 1;
+        while (nEnd < vRead.size() && nEnd - nBegin < PREFETCH_RUN_SIZE && vRead[nEnd].first.nFile == vRead[nBegin].first.nFile)
+            nEnd++;
+        vChecks.push_back(CTxPrefetch(vector<pair<CDiskTxPos, CTransaction*> >(vRead.begin() + nBegin, vRead.begin() + nEnd)));
+        nBegin = nEnd;
+    }
+
+    if (nPrefetchThreads <= 1 || vChecks.size() <= 1)
+    {
+        BOOST_FOREACH(CTxPrefetch& check, vChecks)
+            check();
+    }
+    else
+    {
+        // The queue hands out its last element first
+        reverse(vChecks.begin(), vChecks.end());
+        CCheckQueueControl<CTxPrefetch> control(&prefetchqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    for (MapPrevTx::iterator mi = mapPrefetched.begin(); mi != mapPrefetched.end(); )
+    {
+        if (mi->second.second.IsNull())
+            mapPrefetched.erase(mi++);
+        else
+            ++mi;
+    }
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx,
                         bool* pfMissingInputs)
 {
@@ -796,6 +929,9 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx,
              return false;
 
         MapPrevTx mapInputs;
+        if (tx.vin.size() > 1)
+            PrefetchInputs(txdb, &tx, &tx + 1, mapInputs);
+
         map<uint256, CTxIndex> mapUnused;
         bool fInvalid = false;
         if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
@@ -852,7 +988,20 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx,
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, true, VERSION_2_0_SWITCH_TIME < tx.nTime ? STRICT_FLAGS : SOFT_FLAGS))
+        unsigned int flags = VERSION_2_0_SWITCH_TIME < tx.nTime ? STRICT_FLAGS : SOFT_FLAGS;
+        bool fScriptsChecked = false;
+        if (nScriptCheckThreads && tx.vin.size() > 1)
+        {
+            // Verify the inputs on the script check threads. On a failure they
+            // are verified again in order below, to report it the same way.
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, true, flags, &vChecks))
+                return error("AcceptToMemoryPool : ConnectInputs failed %s", hash.ToString().substr(0,10));
+            CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+            control.Add(vChecks);
+            fScriptsChecked = control.Wait();
+        }
+        if (!fScriptsChecked && !tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, true, flags))
         {
             return error("AcceptToMemoryPool : ConnectInputs failed %s", hash.ToString().substr(0,10));
         }
@@ -931,7 +1080,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1005,7 +1154,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1066,6 +1215,34 @@ CBlockIndex* FindBlockByHeight(int nHeight)
     return pblockindex;
 }
 
+// Guards the memory only hash cache of every CBlock, as const GetHash calls
+// from several threads may share one block. It is never held while hashing.
+static CCriticalSection cs_blockhash;
+
+uint256 CBlock::GetHash() const
+{
+    {
+        LOCK(cs_blockhash);
+        if (fHashCached && memcmp(pchHeaderHashed, BEGIN(nVersion), sizeof(pchHeaderHashed)) == 0)
+        {
+            nBlockHashCached++;
+            return hashCached;
+        }
+    }
+    uint256 hash = scrypt_blockhash(CVOIDBEGIN(nVersion));
+    SetCachedHash(hash);
+    nBlockHashComputed++;
+    return hash;
+}
+
+void CBlock::SetCachedHash(const uint256& hash) const
+{
+    LOCK(cs_blockhash);
+    memcpy(pchHeaderHashed, BEGIN(nVersion), sizeof(pchHeaderHashed));
+    hashCached = hash;
+    fHashCached = true;
+}
+
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
 {
     if (!fReadTransactions)
@@ -1151,7 +1328,7 @@ int64_t GetProofOfStakeRewardV1(int64_t nCoinAge, unsigned int nBits, unsigned i
 
         bnTarget.SetCompact(nBits);
 
-        CBigNum bnTargetLimit = bnProofOfStakeLimit;
+        CBigNum bnTargetLimit(bnProofOfStakeLimit);
 
         bnTargetLimit.SetCompact(bnTargetLimit.GetCompact());
 
@@ -1217,7 +1394,7 @@ int64_t GetProofOfStakeRewardV2(int64_t nCoinAge, unsigned int nBits, unsigned i
     int64_t nRewardCoinYearLimit = MAX_MINT_PROOF_OF_STAKE_FIX2;
     CBigNum bnTarget;
     bnTarget.SetCompact(nBits);
-    CBigNum bnTargetLimit = bnProofOfStakeLimit;
+    CBigNum bnTargetLimit(bnProofOfStakeLimit);
     bnTargetLimit.SetCompact(bnTargetLimit.GetCompact());
     int64_t nSubsidyLimit = 250 * COIN;
 
@@ -1264,7 +1441,7 @@ int64_t GetProofOfStakeRewardV3(int64_t nCoinAge, unsigned int nBits, unsigned i
     int64_t nRewardCoinYearLimit = MAX_MINT_PROOF_OF_STAKE_FIX2;
     CBigNum bnTarget;
     bnTarget.SetCompact(nBits);
-    CBigNum bnTargetLimit = bnProofOfStakeLimit;
+    CBigNum bnTargetLimit(bnProofOfStakeLimit);
     bnTargetLimit.SetCompact(bnTargetLimit.GetCompact());
     int64_t nSubsidyLimit = 250 * COIN;
 
@@ -1314,10 +1491,23 @@ static const int64_t nTargetTimespan = 0.16 * 24 * 60 * 60;  // 4-hour
 
 // maximum nBits value could possible be required nTime after
 //
-unsigned int ComputeMaxBits(CBigNum bnTargetLimit, unsigned int nBase, int64_t nTime)
+unsigned int ComputeMaxBits(const uint256& bnTargetLimit, unsigned int nBase, int64_t nTime)
 {
-    CBigNum bnResult;
-    bnResult.SetCompact(nBase);
+    bool fNegative, fOverflow;
+    uint256 bnResult;
+    bnResult.SetCompact(nBase, &fNegative, &fOverflow);
+    if (fNegative)
+    {
+        // Negative targets never reach the limit, keep the arbitrary precision result
+        CBigNum bn;
+        bn.SetCompact(nBase);
+        bn *= 2;
+        for (; nTime > 0; nTime -= 24 * 60 * 60)
+            bn *= 2;
+        return bn.GetCompact();
+    }
+    if (fOverflow || bnResult > bnTargetLimit)
+        return bnTargetLimit.GetCompact();
     bnResult *= 2;
     while (nTime > 0 && bnResult < bnTargetLimit)
     {
@@ -1356,6 +1546,35 @@ const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfSta
     return pindex;
 }
 
+// ppcoin: retarget with exponential moving toward target spacing
+// nBits * nNumerator / nDenominator, at most bnTargetLimit
+static unsigned int RetargetCompact(unsigned int nBits, int64_t nNumerator, int64_t nDenominator, const uint256& bnTargetLimit)
+{
+    bool fNegative, fOverflow;
+    uint256 bnNew;
+    bnNew.SetCompact(nBits, &fNegative, &fOverflow);
+    uint64_t nMultiplier = nNumerator < 0 ? -(uint64_t)nNumerator : nNumerator;
+    if (fOverflow || nDenominator <= 0 || bnNew.bits() + uint256(nMultiplier).bits() > 256)
+    {
+        // Far outside what a valid chain produces, keep the arbitrary precision result
+        CBigNum bn;
+        bn.SetCompact(nBits);
+        bn *= nNumerator;
+        bn /= nDenominator;
+        if (bn > CBigNum(bnTargetLimit))
+            bn = CBigNum(bnTargetLimit);
+        return bn.GetCompact();
+    }
+
+    // Division truncates toward zero, as CBigNum does for negative values
+    bnNew *= uint256(nMultiplier);
+    bnNew /= uint256((uint64_t)nDenominator);
+    fNegative = fNegative != (nNumerator < 0);
+    if (!fNegative && bnNew > bnTargetLimit)
+        bnNew = bnTargetLimit;
+    return bnNew.GetCompact(fNegative);
+}
+
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
 {
     if (pindexLast->nHeight + 1 > VERSION1_5_SWITCH_BLOCK)
@@ -1366,7 +1585,7 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 
 unsigned int GetNextTargetRequiredV1(const CBlockIndex* pindexLast, bool fProofOfStake)
 {
-  CBigNum bnTargetLimit = !fProofOfStake ? bnProofOfWorkLimit : bnProofOfStakeLimit;
+  uint256 bnTargetLimit = !fProofOfStake ? bnProofOfWorkLimit : bnProofOfStakeLimit;
   int64_t nTargetSpacingWorkMax = 12 * GetTargetSpacing(); // 2-hour
 
     if(fProofOfStake)
@@ -1397,23 +1616,16 @@ unsigned int GetNextTargetRequiredV1(const CBlockIndex* pindexLast, bool fProofO
 
     // ppcoin: target change every block
     // ppcoin: retarget with exponential moving toward target spacing
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexPrev->nBits);
     unsigned int nTargetStakeSpacing = GetTargetSpacing();
     int64_t nTargetSpacing = fProofOfStake ? nTargetStakeSpacing : min(nTargetSpacingWorkMax, (int64_t) nTargetStakeSpacing * (1 + pindexLast->nHeight - pindexPrev->nHeight));
     int64_t nInterval = nTargetTimespan / nTargetSpacing;
-    bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
-    bnNew /= ((nInterval + 1) * nTargetSpacing);
-
-    if (bnNew > bnTargetLimit)
-        bnNew = bnTargetLimit;
-
-    return bnNew.GetCompact();
+    return RetargetCompact(pindexPrev->nBits, (nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing,
+                           (nInterval + 1) * nTargetSpacing, bnTargetLimit);
 }
 
 unsigned int GetNextTargetRequiredV2(const CBlockIndex* pindexLast, bool fProofOfStake)
 {
-    CBigNum bnTargetLimit = !fProofOfStake ? bnProofOfWorkLimit : bnProofOfStakeLimit;
+    uint256 bnTargetLimit = !fProofOfStake ? bnProofOfWorkLimit : bnProofOfStakeLimit;
     int64_t nTargetSpacingWorkMax = 12 * GetTargetSpacing(); // 2-hour
 
     if (pindexLast == NULL)
@@ -1433,30 +1645,23 @@ unsigned int GetNextTargetRequiredV2(const CBlockIndex* pindexLast, bool fProofO
     if (nActualSpacing < 0)
         nActualSpacing = nTargetSpacing;
 
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexPrev->nBits);
-
     int64_t nInterval = nTargetTimespan / nTargetSpacing;
-    bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
-    bnNew /= ((nInterval + 1) * nTargetSpacing);
-
-    if (bnNew > bnTargetLimit)
-        bnNew = bnTargetLimit;
-
-    return bnNew.GetCompact();
+    return RetargetCompact(pindexPrev->nBits, (nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing,
+                           (nInterval + 1) * nTargetSpacing, bnTargetLimit);
 }
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative, fOverflow;
+    uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimit)
+    if (fNegative || fOverflow || bnTarget == 0 || bnTarget > bnProofOfWorkLimit)
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > bnTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -1679,7 +1884,7 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, ptxContext.get()))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().substr(0,10).c_str());
     return true;
 }
@@ -1731,6 +1936,11 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
         if (pvChecks)
            pvChecks->reserve(vin.size());
 
+        // The signature hashes of the inputs share one serialization
+        boost::shared_ptr<const CSignatureHashContext> ptxContext;
+        if (fScriptChecks)
+            ptxContext.reset(new CSignatureHashContext(*this));
+
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
@@ -1756,7 +1966,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             if (fScriptChecks)
             {
                 // Verify signature
-                CScriptCheck check(txPrev, *this, i, flags, 0);
+                CScriptCheck check(txPrev, *this, i, flags, 0, ptxContext);
                 if (pvChecks)
                 {
                     pvChecks->push_back(CScriptCheck());
@@ -1767,7 +1977,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                     if (flags & STRICT_FLAGS)
                     {
                         // Don't trigger DoS code in case of STRICT_FLAGS caused failure.
-                        CScriptCheck check(txPrev, *this, i, flags & ~STRICT_FLAGS, 0);
+                        CScriptCheck check(txPrev, *this, i, flags & ~STRICT_FLAGS, 0, ptxContext);
                         if (check())
                            return error("ConnectInputs() : %s strict VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
                     }
@@ -1844,8 +2054,6 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck(void*) {
     vnThreadsRunning[THREAD_SCRIPTCHECK]++;
     RenameThread("novacoin-scriptch");
@@ -1857,6 +2065,7 @@ void ThreadScriptCheckQuit() {
     scriptcheckqueue.Quit();
 }
 
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
@@ -1887,6 +2096,11 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapQueuedChanges;
+
+    MapPrevTx mapPrefetched;
+    if (!vtx.empty())
+        PrefetchInputs(txdb, &vtx[0], &vtx[0] + vtx.size(), mapPrefetched);
+
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nFees = 0;
@@ -1917,6 +2131,16 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             nValueOut += tx.GetValueOut();
         else
         {
+            // Inputs read ahead, with the index records as updated by this block so far
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                MapPrevTx::const_iterator mi = mapPrefetched.find(txin.prevout.hash);
+                if (mi == mapPrefetched.end() || mapInputs.count(txin.prevout.hash))
+                    continue;
+                map<uint256, CTxIndex>::const_iterator miQueued = mapQueuedChanges.find(txin.prevout.hash);
+                mapInputs[txin.prevout.hash] = make_pair(miQueued != mapQueuedChanges.end() ? miQueued->second : mi->second.first, mi->second.second);
+            }
+
             bool fInvalid;
             if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
                 return false;
@@ -2306,7 +2530,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     if (!pindexNew)
         return error("AddToBlockIndex() : new CBlockIndex failed");
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndexMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2334,7 +2558,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=0x%016x", pindexNew->nHeight, nStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    CBlockIndexMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2375,6 +2599,10 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
 
+    // Already checked in full, by a block check thread for instance
+    if (hashChecked != 0 && hashChecked == GetHash())
+        return true;
+
     // Size limits
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return DoS(100, error("CheckBlock() : size limits failed"));
@@ -2472,6 +2700,8 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
         return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
+    if (fCheckPOW && fCheckMerkleRoot && fCheckSig)
+        hashChecked = GetHash();
     return true;
 }
 
@@ -2485,7 +2715,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2573,6 +2803,29 @@ bool CBlock::AcceptBlock()
     return true;
 }
 
+static CSlabAllocator slabBlockIndex(sizeof(CBlockIndex));
+
+void* CBlockIndex::operator new(size_t nSize)
+{
+    // Derived classes are not pooled
+    if (nSize != sizeof(CBlockIndex))
+        return ::operator new(nSize);
+    return slabBlockIndex.Allocate();
+}
+
+void CBlockIndex::operator delete(void* p, size_t nSize)
+{
+    if (nSize != sizeof(CBlockIndex))
+        ::operator delete(p);
+    else
+        slabBlockIndex.Deallocate(p);
+}
+
+const CSlabAllocator& CBlockIndex::GetAllocator()
+{
+    return slabBlockIndex;
+}
+
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
 {
     unsigned int nFound = 0;
@@ -2605,20 +2858,24 @@ void Misbehaving(NodeId pnode, int howmuch)
 
 uint256 CBlockIndex::GetBlockTrust() const
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
-    if (bnTarget <= 0)
+    bool fNegative, fOverflow;
+    uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+    if (fNegative || bnTarget == 0)
         return 0;
 
     if (IsProofOfStake())
     {
         // Return trust score as usual
-        return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+        // 2**256 / (bnTarget+1) does not fit in 256 bits, but it is equal to (~bnTarget / (bnTarget+1)) + 1
+        if (fOverflow)
+            return 0;
+        return (~bnTarget / (bnTarget + 1)) + 1;
     }
     else
     {
         // Calculate work amount for block
-        uint256 nPoWTrust = (CBigNum(bnProofOfWorkLimit) / (bnTarget+1)).getuint256();
+        uint256 nPoWTrust = fOverflow ? 0 : bnProofOfWorkLimit / (bnTarget + 1);
         return nPoWTrust > 1 ? nPoWTrust : 1;
     }
 }
@@ -2736,6 +2993,182 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     return true;
 }
 
+int nBlockCheckThreads = 0;
+
+/** A block received during initial download, waiting for the block check
+ *  threads and then for ProcessBlock. The hash is set by the check thread.
+ */
+class CPendingBlock
+{
+public:
+    CBlock block;
+    uint256 hash;
+    CNode* pfrom;
+    bool fChecked;
+
+    CPendingBlock(const CBlock& blockIn, CNode* pfromIn) : block(blockIn), hash(0), pfrom(pfromIn), fChecked(false) {}
+};
+
+static boost::mutex mutexPendingBlocks;
+static boost::condition_variable condPendingBlocks;
+static std::deque<CPendingBlock*> vPendingBlocks;   // in the order received
+static std::deque<CPendingBlock*> vBlocksToCheck;   // not picked up by a block check thread yet
+static std::set<uint256> setPendingBlocks;          // hashed by a block check thread
+// Set when a check thread finishes a block, cleared when none can be processed,
+// so the message handler only takes cs_main for ProcessCheckedBlocks when needed
+static boost::atomic<bool> fBlocksChecked(false);
+
+// Context-free checks of received blocks: proof-of-work, merkle root,
+// transactions and block signature. The result is kept by CheckBlock, so
+// ProcessBlock and ConnectBlock do not check the block again. The headers
+// are hashed first, as many at once as scrypt_blockhash_multi handles.
+void ThreadBlockCheck(void*)
+{
+    vnThreadsRunning[THREAD_BLOCKCHECK]++;
+    RenameThread("hobocoin-blockcheck");
+
+    unsigned int nLanes = scrypt_blockhash_lanes();
+    vector<CPendingBlock*> vBatch;
+    vector<const void*> vpHeaders;
+    vector<uint256> vHashes;
+    while (true)
+    {
+        vBatch.clear();
+        {
+            boost::unique_lock<boost::mutex> lock(mutexPendingBlocks);
+            while (vBlocksToCheck.empty() && !fShutdown)
+                condPendingBlocks.wait(lock);
+            if (fShutdown)
+                break;
+            while (!vBlocksToCheck.empty() && vBatch.size() < nLanes)
+            {
+                vBatch.push_back(vBlocksToCheck.front());
+                vBlocksToCheck.pop_front();
+            }
+        }
+
+        vpHeaders.clear();
+        BOOST_FOREACH(CPendingBlock* ppending, vBatch)
+            vpHeaders.push_back(CVOIDBEGIN(ppending->block.nVersion));
+        vHashes.resize(vBatch.size());
+        scrypt_blockhash_multi(&vpHeaders[0], &vHashes[0], vBatch.size(), nLanes);
+        {
+            boost::unique_lock<boost::mutex> lock(mutexPendingBlocks);
+            for (unsigned int i = 0; i < vBatch.size(); i++)
+            {
+                vBatch[i]->block.SetCachedHash(vHashes[i]);
+                vBatch[i]->hash = vHashes[i];
+                setPendingBlocks.insert(vHashes[i]);
+            }
+        }
+
+        BOOST_FOREACH(CPendingBlock* ppending, vBatch)
+        {
+            LogPrint("net", "received block %s sent from %s\n", ppending->hash.ToString().substr(0,20), ppending->pfrom->addr.ToString());
+            ppending->block.CheckBlock();
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutexPendingBlocks);
+        BOOST_FOREACH(CPendingBlock* ppending, vBatch)
+            ppending->fChecked = true;
+        fBlocksChecked = true;
+    }
+    vnThreadsRunning[THREAD_BLOCKCHECK]--;
+}
+
+void ThreadBlockCheckQuit()
+{
+    boost::unique_lock<boost::mutex> lock(mutexPendingBlocks);
+    condPendingBlocks.notify_all();
+}
+
+// Drop the blocks left in the queue at shutdown, once the block check threads
+// and the message handler have stopped
+void FreePendingBlocks()
+{
+    std::deque<CPendingBlock*> vFree;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexPendingBlocks);
+        vFree.swap(vPendingBlocks);
+        vBlocksToCheck.clear();
+        setPendingBlocks.clear();
+        fBlocksChecked = false;
+    }
+    BOOST_FOREACH(CPendingBlock* ppending, vFree)
+    {
+        {
+            LOCK(cs_vNodes);
+            ppending->pfrom->Release();
+        }
+        delete ppending;
+    }
+}
+
+// Queue a received block for the block check threads, false if the block is
+// to be processed right away. Besides the blocks of initial download, orphans
+// are queued: they cannot be connected before their parent arrives anyway.
+// The block is not hashed yet, so a duplicate is only found by ProcessBlock.
+static bool QueueBlockCheck(CNode* pfrom, const CBlock& block)
+{
+    if (nBlockCheckThreads == 0)
+        return false;
+    if (!IsInitialBlockDownload() && mapBlockIndex.count(block.hashPrevBlock))
+        return false;
+
+    boost::unique_lock<boost::mutex> lock(mutexPendingBlocks);
+    if (vPendingBlocks.size() >= MAX_PENDING_BLOCKS)
+        return false;
+
+    CPendingBlock* ppending = new CPendingBlock(block, pfrom->AddRef());
+    vPendingBlocks.push_back(ppending);
+    vBlocksToCheck.push_back(ppending);
+    condPendingBlocks.notify_one();
+    return true;
+}
+
+static bool IsBlockPending(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(mutexPendingBlocks);
+    return setPendingBlocks.count(hash) > 0;
+}
+
+// Process the checked blocks at the front of the queue in the order they were
+// received, a block still being checked holds back the ones behind it
+static void ProcessCheckedBlocks()
+{
+    AssertLockHeld(cs_main);
+    while (!fShutdown)
+    {
+        CPendingBlock* ppending;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexPendingBlocks);
+            if (vPendingBlocks.empty() || !vPendingBlocks.front()->fChecked)
+            {
+                fBlocksChecked = false;
+                break;
+            }
+            ppending = vPendingBlocks.front();
+            vPendingBlocks.pop_front();
+            setPendingBlocks.erase(ppending->hash);
+        }
+
+        // A block failing the checks is checked again by ProcessBlock, count its DoS score once
+        CNode* pfrom = ppending->pfrom;
+        ppending->block.nDoS = 0;
+        CInv inv(MSG_BLOCK, ppending->hash);
+        pfrom->AddInventoryKnown(inv);
+        if (ProcessBlock(pfrom, &ppending->block))
+            mapAlreadyAskedFor.erase(inv);
+        if (ppending->block.nDoS)
+            Misbehaving(pfrom->GetId(), ppending->block.nDoS);
+        {
+            LOCK(cs_vNodes);
+            pfrom->Release();
+        }
+        delete ppending;
+    }
+}
+
 // novacoin: attempt to generate suitable proof-of-stake
 bool CBlock::SignPoSBlock(CWallet& wallet)
 {
@@ -2749,15 +3182,17 @@ bool CBlock::SignPoSBlock(CWallet& wallet)
     if (IsProofOfStake())
         return true;
 
-    static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // startup timestamp
+    // each wallet searches from its own last search time, startup on first use
+    if (wallet.nLastCoinStakeSearchTime == 0)
+        wallet.nLastCoinStakeSearchTime = GetAdjustedTime();
 
     CKey key;
     CTransaction txCoinStake;
     int64_t nSearchTime = txCoinStake.nTime; // search to current time
 
-    if (nSearchTime > nLastCoinStakeSearchTime)
+    if (nSearchTime > wallet.nLastCoinStakeSearchTime)
     {
-        if (wallet.CreateCoinStake(wallet, nBits, nSearchTime-nLastCoinStakeSearchTime, txCoinStake, key))
+        if (wallet.CreateCoinStake(wallet, nBits, nSearchTime-wallet.nLastCoinStakeSearchTime, txCoinStake, key))
         {
             if (txCoinStake.nTime >= max(pindexBest->GetPastTimeLimit()+1, PastDrift(pindexBest->GetBlockTime())))
             {
@@ -2776,11 +3211,13 @@ bool CBlock::SignPoSBlock(CWallet& wallet)
                 hashMerkleRoot = BuildMerkleTree();
 
                 // append a signature to our block
+                wallet.ConsumeStakePlan(nSearchTime);
                 return key.Sign(GetHash(), vchBlockSig);
             }
         }
-        nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
-        nLastCoinStakeSearchTime = nSearchTime;
+        nLastCoinStakeSearchInterval = nSearchTime - wallet.nLastCoinStakeSearchTime;
+        wallet.nLastCoinStakeSearchTime = nSearchTime;
+        wallet.ConsumeStakePlan(nSearchTime);
     }
 
     return false;
@@ -3071,7 +3508,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3137,64 +3574,304 @@ void PrintBlockTree()
             vStack.push_back(make_pair(nCol+i, vNext[i]));
     }
 }
-bool LoadExternalBlockFile(FILE* fileIn)
+// Blocks found in an external block file ahead of the one being connected
+static const unsigned int MAX_IMPORT_PENDING = 4096;
+static const uint64_t MAX_IMPORT_PENDING_BYTES = 64 * 1024 * 1024;
+
+/** A block of an external block file, from the scanner through the import
+ *  threads to ProcessBlock
+ */
+class CImportBlock
+{
+public:
+    const char* pbegin;
+    unsigned int nSize;
+    uint64_t nPos;
+    boost::shared_ptr<void> pwindow;  // keeps pbegin mapped until the block is read
+    CBlock block;
+    bool fRead;   // unserialized, hashed and checked
+    bool fValid;  // unserialized
+
+    CImportBlock() : pbegin(NULL), nSize(0), nPos(0), fRead(false), fValid(false) {}
+};
+
+/** Blocks waiting for the import threads, which unserialize them, compute
+ *  their scrypt hashes several at a time and run the context-free checks
+ */
+class CImportQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condRead;
+    std::deque<CImportBlock*> vToRead;
+    bool fQuit;
+
+public:
+    CImportQueue() : fQuit(false) {}
+
+    void Thread()
+    {
+        RenameThread("hobocoin-import");
+        const unsigned int nLanes = max(1U, scrypt_blockhash_lanes());
+        vector<CImportBlock*> vBatch;
+        vector<const void*> vpHeaders;
+        vector<uint256> vHashes;
+        while (true)
+        {
+            vBatch.clear();
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (vToRead.empty() && !fQuit)
+                    condWorker.wait(lock);
+                if (fQuit)
+                    return;
+                while (!vToRead.empty() && vBatch.size() < nLanes)
+                {
+                    vBatch.push_back(vToRead.front());
+                    vToRead.pop_front();
+                }
+            }
+
+            vpHeaders.clear();
+            BOOST_FOREACH(CImportBlock* pimport, vBatch)
+            {
+                CBufferReader reader(pimport->pbegin, pimport->pbegin + pimport->nSize, SER_DISK, CLIENT_VERSION);
+                try {
+                    reader >> pimport->block;
+                    pimport->fValid = true;
+                    vpHeaders.push_back(CVOIDBEGIN(pimport->block.nVersion));
+                }
+                catch (std::exception &e) {
+                    pimport->fValid = false;
+                }
+                pimport->pwindow.reset();
+            }
+            vHashes.resize(vpHeaders.size());
+            scrypt_blockhash_multi(vpHeaders.empty() ? NULL : &vpHeaders[0], vHashes.empty() ? NULL : &vHashes[0], vpHeaders.size(), nLanes);
+            unsigned int nHash = 0;
+            BOOST_FOREACH(CImportBlock* pimport, vBatch)
+                if (pimport->fValid)
+                {
+                    pimport->block.SetCachedHash(vHashes[nHash++]);
+                    // The result is kept by the block, ProcessBlock reports failures
+                    pimport->block.CheckBlock();
+                }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            BOOST_FOREACH(CImportBlock* pimport, vBatch)
+                pimport->fRead = true;
+            condRead.notify_all();
+        }
+    }
+
+    void Add(const vector<CImportBlock*>& vBlocks)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        vToRead.insert(vToRead.end(), vBlocks.begin(), vBlocks.end());
+        condWorker.notify_all();
+    }
+
+    bool IsRead(const CImportBlock* pimport)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return pimport->fRead;
+    }
+
+    void WaitRead(const CImportBlock* pimport)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!pimport->fRead && !fQuit)
+            condRead.wait(lock);
+    }
+
+    void Quit()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+        condWorker.notify_all();
+        condRead.notify_all();
+    }
+};
+
+/** How far an external block file was imported, to resume an interrupted import */
+class CImportProgress
+{
+public:
+    std::string strFile;
+    uint64_t nFileSize;
+    uint64_t nPos;            // blocks before are processed
+    uint256 hashLastBlock;    // last block processed, must still be known to resume
+
+    CImportProgress()
+    {
+        nFileSize = 0;
+        nPos = 0;
+        hashLastBlock = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(strFile);
+        READWRITE(nFileSize);
+        READWRITE(nPos);
+        READWRITE(hashLastBlock);
+    )
+};
+
+static filesystem::path GetImportProgressFile()
+{
+    return GetDataDir() / "import.progress";
+}
+
+static bool ReadImportProgress(CImportProgress& progress)
+{
+    CAutoFile filein = CAutoFile(fopen(GetImportProgressFile().string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+    try {
+        filein >> progress;
+    }
+    catch (std::exception &e) {
+        return false;
+    }
+    return true;
+}
+
+static bool WriteImportProgress(const CImportProgress& progress)
+{
+    filesystem::path pathTmp = GetDataDir() / "import.progress.new";
+    CAutoFile fileout = CAutoFile(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteImportProgress() : open failed");
+    try {
+        fileout << progress;
+    }
+    catch (std::exception &e) {
+        return error("WriteImportProgress() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    return RenameOver(pathTmp, GetImportProgressFile());
+}
+
+// Import the blocks of an external block file. The file is memory mapped and
+// the blocks found in it are unserialized, hashed and checked by the import
+// threads while the blocks before them are processed in file order. Progress
+// is saved as the import goes, an interrupted import of the same file resumes
+// where it stopped. Returns true when the file was read to the end.
+bool LoadExternalBlockFile(const filesystem::path& pathFile)
 {
     int64_t nStart = GetTimeMillis();
 
-    int nLoaded = 0;
+    CBlockFileScanner scanner;
+    if (!scanner.Open(pathFile))
+        return false;
+
+    // Resume after the blocks processed by an earlier import of the file. They
+    // are only skipped if the last of them made it to the block index.
+    CImportProgress progress;
+    string strFile = filesystem::absolute(pathFile).string();
     {
         LOCK(cs_main);
-        try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good() && !fRequestShutdown)
+        if (ReadImportProgress(progress) && progress.strFile == strFile && progress.nFileSize == scanner.GetFileSize() &&
+            progress.nPos <= scanner.GetFileSize() && (progress.hashLastBlock == 0 || mapBlockIndex.count(progress.hashLastBlock)))
+        {
+            LogPrintf("LoadExternalBlockFile() : resuming import of %s at %u\n", strFile, progress.nPos);
+            scanner.Seek(progress.nPos);
+        }
+        else
+        {
+            progress = CImportProgress();
+            progress.strFile = strFile;
+            progress.nFileSize = scanner.GetFileSize();
+        }
+    }
+    uint64_t nPosStart = progress.nPos;
+
+    CImportQueue queue;
+    boost::thread_group threadGroup;
+    int nThreads = max(nBlockCheckThreads, 1);
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CImportQueue::Thread, &queue));
+
+    int nLoaded = 0;
+    int nRead = 0;
+    bool fEnd = false;
+    deque<CImportBlock*> vPending;
+    uint64_t nPendingBytes = 0;
+    vector<CImportBlock*> vFound;
+    int64_t nLastReport = GetTimeMillis();
+    while (!fRequestShutdown)
+    {
+        // Hand the blocks ahead to the import threads
+        vFound.clear();
+        while (!fEnd && vPending.size() < MAX_IMPORT_PENDING && nPendingBytes < MAX_IMPORT_PENDING_BYTES)
+        {
+            CImportBlock* pimport = new CImportBlock();
+            if (!scanner.Next(pimport->pbegin, pimport->nSize, pimport->nPos, pimport->pwindow))
             {
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
-                        break;
-                    }
-                    void* nFind = memchr(pchData, pchMessageStart[0], nRead+1-sizeof(pchMessageStart));
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, pchMessageStart, sizeof(pchMessageStart))==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + sizeof(pchMessageStart);
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - sizeof(pchMessageStart) + 1;
-                } while(!fRequestShutdown);
-                if (nPos == (unsigned int)-1)
-                    break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                delete pimport;
+                fEnd = true;
+                break;
+            }
+            vPending.push_back(pimport);
+            vFound.push_back(pimport);
+            nPendingBytes += pimport->nSize;
+        }
+        queue.Add(vFound);
+        if (vPending.empty())
+            break;
+
+        // Process the blocks read so far in file order
+        queue.WaitRead(vPending.front());
+        {
+            LOCK(cs_main);
+            while (!vPending.empty() && queue.IsRead(vPending.front()) && !fRequestShutdown)
+            {
+                CImportBlock* pimport = vPending.front();
+                vPending.pop_front();
+                nPendingBytes -= pimport->nSize;
+                nRead++;
+                if (pimport->fValid)
                 {
-                    CBlock block;
-                    blkdat >> block;
-                    if (ProcessBlock(NULL,&block))
-                    {
+                    // Blocks we already have are common when a bootstrap file is imported again
+                    uint256 hash = pimport->block.GetHash();
+                    if (!mapBlockIndex.count(hash) && !mapOrphanBlocks.count(hash) && ProcessBlock(NULL, &pimport->block))
                         nLoaded++;
-                        nPos += 4 + nSize;
-                    }
+                    if (mapBlockIndex.count(hash))
+                        progress.hashLastBlock = hash;
                 }
+                // Orphans are only kept in memory, resume before them
+                if (mapOrphanBlocks.empty())
+                    progress.nPos = pimport->nPos + pimport->nSize;
+                delete pimport;
             }
         }
-        catch (std::exception &e) {
-            LogPrintf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
+
+        // Report progress and save it
+        if (GetTimeMillis() - nLastReport >= 10000 || (fEnd && vPending.empty()))
+        {
+            nLastReport = GetTimeMillis();
+            double dProgress = scanner.GetFileSize() ? (double)progress.nPos / scanner.GetFileSize() : 1.0;
+            double dRate = (double)(progress.nPos - nPosStart) * 1000 / max(nLastReport - nStart, (int64_t)1);
+            int64_t nLeft = dRate > 0 ? (int64_t)((scanner.GetFileSize() - progress.nPos) / dRate) : -1;
+            LogPrintf("LoadExternalBlockFile() : %.1f%% of %s, %d blocks read, %d new, %.1f MB/s, %d s left\n",
+                dProgress * 100, strFile, nRead, nLoaded, dRate / 1000000, nLeft);
+            uiInterface.InitMessage(strprintf("%s %d%%", _("Importing blockchain data file."), (int)(dProgress * 100)));
+            WriteImportProgress(progress);
         }
     }
+
+    bool fComplete = fEnd && vPending.empty();
+    queue.Quit();
+    threadGroup.join_all();
+    BOOST_FOREACH(CImportBlock* pimport, vPending)
+        delete pimport;
+    WriteImportProgress(progress);
+
     LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
-    return nLoaded > 0;
+    return fComplete;
 }
 
 
@@ -3301,7 +3978,8 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+               mapOrphanBlocks.count(inv.hash) ||
+               IsBlockPending(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -3563,7 +4241,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 pfrom->AskFor(inv);
             else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
                 pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
-            } else if (nInv == nLastBlock) {
+            } else if (nInv == nLastBlock && mapBlockIndex.count(inv.hash)) {
                 // In case we are on a very long side-chain, it is possible that we already have
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
                 // this situation and push another getblocks to continue.
@@ -3601,7 +4279,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                CBlockIndexMap::iterator mi = mapBlockIndex.find(inv.hash);
                 pfrom->nBlocksRequested++;
                 if (mi != mapBlockIndex.end())
                 {
@@ -3712,7 +4390,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3806,16 +4484,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     {
         CBlock block;
         vRecv >> block;
-        uint256 hashBlock = block.GetHash();
 
-        LogPrint("net", "received block %s sent from %s\n", hashBlock.ToString().substr(0,20), pfrom->addr.ToString());
+        // During initial download the block is hashed and checked on the block check threads first
+        if (!QueueBlockCheck(pfrom, block))
+        {
+            uint256 hashBlock = block.GetHash();
+
+            LogPrint("net", "received block %s sent from %s\n", hashBlock.ToString().substr(0,20), pfrom->addr.ToString());
 
-        CInv inv(MSG_BLOCK, hashBlock);
-        pfrom->AddInventoryKnown(inv);
+            CInv inv(MSG_BLOCK, hashBlock);
+            pfrom->AddInventoryKnown(inv);
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) Misbehaving(pfrom->GetId(), block.nDoS);
+            if (ProcessBlock(pfrom, &block))
+                mapAlreadyAskedFor.erase(inv);
+            if (block.nDoS) Misbehaving(pfrom->GetId(), block.nDoS);
+        }
     }
 
 
@@ -4033,6 +4716,13 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
+    // Blocks received earlier and checked since
+    if (fBlocksChecked)
+    {
+        LOCK(cs_main);
+        ProcessCheckedBlocks();
+    }
+
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
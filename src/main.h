@@ -6,6 +6,8 @@
 #define BITCOIN_MAIN_H
 
 #include "bignum.h"
+#include "blockindexmap.h"
+#include "blockstore.h"
 #include "sync.h"
 #include "net.h"
 #include "script.h"
@@ -13,7 +15,11 @@
 
 #include <list>
 
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+
 class CWallet;
+class CWalletManager;
 class CBlock;
 class CBlockIndex;
 class CKeyItem;
@@ -88,6 +94,12 @@ inline bool MoneyRange(int64_t nValue) { return (nValue >= 0 && nValue <= MAX_MO
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 // Maximum number of script-checking threads allowed
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+// Maximum number of input prefetch threads
+static const int MAX_PREFETCH_THREADS = 16;
+// Maximum number of block check threads
+static const int MAX_BLOCKCHECK_THREADS = 16;
+// Maximum number of received blocks waiting for the block check threads
+static const unsigned int MAX_PENDING_BLOCKS = 1000;
 
 static const uint256 hashGenesisBlockOfficial("0x000009ea5ef5019446b315e7e581fc2ea184315ed46c9ddeadc8aa9442deedc9");
 static const uint256 hashGenesisBlockTestNet("0x0000f9e0292f278190e4d58cd1e1e9a32b7466c8092bd2371ffc80b06f8eca4a");
@@ -112,7 +124,7 @@ extern CScript COINBASE_FLAGS;
 
 
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern CBlockIndexMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
@@ -129,6 +141,9 @@ extern unsigned int nTransactionsUpdated;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
 extern int64_t nLastCoinStakeSearchInterval;
+extern int64_t nLastStakePlanInterval;
+extern boost::atomic<uint64_t> nBlockHashComputed;
+extern boost::atomic<uint64_t> nBlockHashCached;
 extern const std::string strMessageMagic;
 extern double dHashesPerSec;
 extern int64_t nHPSTimerStart;
@@ -148,6 +163,8 @@ extern int64_t nCombineThreshold;
 extern int64_t nSplitThreshold;
 extern bool fUseFastIndex;
 extern int nScriptCheckThreads;
+extern int nPrefetchThreads;
+extern int nBlockCheckThreads;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 1073741824;
@@ -179,12 +196,22 @@ void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
-bool LoadExternalBlockFile(FILE* fileIn);
+bool LoadExternalBlockFile(const boost::filesystem::path& pathFile);
 
 // Run an instance of the script checking thread
 void ThreadScriptCheck(void* parg);
 // Stop the script checking threads
 void ThreadScriptCheckQuit();
+// Run an instance of the input prefetch thread
+void ThreadTxPrefetch(void* parg);
+// Stop the input prefetch threads
+void ThreadTxPrefetchQuit();
+// Run an instance of the block check thread
+void ThreadBlockCheck(void* parg);
+// Stop the block check threads
+void ThreadBlockCheckQuit();
+// Free the blocks left for the block check threads once they have stopped
+void FreePendingBlocks();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -205,7 +232,7 @@ std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 uint256 WantedByOrphan(const CBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
-void StakeMiner(CWallet *pwallet);
+void StakeMiner(CWalletManager *pwalletManager);
 void ResendWalletTransactions(bool fForce = false);
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
@@ -600,6 +627,13 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet)
+        {
+            if (!blockFileReader.Read(pos.nFile, pos.nTxPos, *this))
+                return error("CTransaction::ReadFromDisk() : unable to read %u:%u", pos.nFile, pos.nTxPos);
+            return true;
+        }
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -710,17 +744,21 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    // Shared by the checks of the inputs of ptxTo, may be empty
+    boost::shared_ptr<const CSignatureHashContext> ptxContext;
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashContext>& ptxContextIn = boost::shared_ptr<const CSignatureHashContext>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), ptxContext(ptxContextIn) { }
 
     bool operator()() const;
 
     void swap(CScriptCheck &check) {
         scriptPubKey.swap(check.scriptPubKey);
+        ptxContext.swap(check.ptxContext);
         std::swap(ptxTo, check.ptxTo);
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
@@ -883,6 +921,14 @@ public:
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // memory only: scrypt hash of the header it was computed from, see GetHash
+    mutable unsigned char pchHeaderHashed[80];
+    mutable uint256 hashCached;
+    mutable bool fHashCached;
+
+    // memory only: hash of the block when it last passed all of CheckBlock
+    mutable uint256 hashChecked;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -894,6 +940,8 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
+        if (fRead)
+            const_cast<CBlock*>(this)->hashChecked = 0;
         READWRITE(this->nVersion);
         nVersion = this->nVersion;
         READWRITE(hashPrevBlock);
@@ -926,6 +974,8 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        fHashCached = false;
+        hashChecked = 0;
         nDoS = 0;
     }
 
@@ -934,10 +984,13 @@ public:
         return (nBits == 0);
     }
 
-    uint256 GetHash() const
-    {
-        return scrypt_blockhash(CVOIDBEGIN(nVersion));
-    }
+    // The scrypt hash is kept along with a copy of the header it was computed
+    // from, changing any header field (nonce, merkle root, time...) makes the
+    // next call hash again
+    uint256 GetHash() const;
+
+    // Use a hash computed elsewhere (batch hashing) for the current header
+    void SetCachedHash(const uint256& hash) const;
 
     int64_t GetBlockTime() const
     {
@@ -1072,20 +1125,9 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
         // Read block
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-        }
+        if (!blockFileReader.Read(nFile, nBlockPos, *this, SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY)))
+            return error("CBlock::ReadFromDisk() : unable to read %u:%u", nFile, nBlockPos);
 
         // Check the header
         if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetHash(), nBits))
@@ -1243,6 +1285,11 @@ public:
         nNonce         = block.nNonce;
     }
 
+    // Block index entries are never freed while running, they are carved out of a slab
+    static void* operator new(size_t nSize);
+    static void operator delete(void* p, size_t nSize);
+    static const CSlabAllocator& GetAllocator();
+
     CBlock GetBlockHeader() const
     {
         CBlock block;
@@ -1479,7 +1526,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1530,7 +1577,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1549,7 +1596,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1565,7 +1612,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
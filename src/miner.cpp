@@ -9,6 +9,7 @@
 #include "txdb.h"
 #include "miner.h"
 #include "kernel.h"
+#include "bitcoinrpc.h"
 #include <boost/algorithm/string/replace.hpp>
 
 using namespace std;
@@ -78,6 +79,7 @@ public:
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
+int64_t nLastStakePlanInterval = 0;
 
 // We want to sort transactions by priority and fee, so:
 typedef boost::tuple<double, double, CTransaction*> TxPriority;
@@ -511,7 +513,55 @@ bool CheckStake(CBlock* pblock, CWallet& wallet)
     return true;
 }
 
-void StakeMiner(CWallet *pwallet)
+static CCriticalSection cs_miningsnapshot;
+static CMiningSnapshot miningSnapshot;
+
+CMiningSnapshot GetMiningSnapshot()
+{
+    LOCK(cs_miningsnapshot);
+    return miningSnapshot;
+}
+
+// Recomputes the mining snapshot when the best block has changed. Only the
+// stake miner thread calls this, the RPC just copies the result.
+static void UpdateMiningSnapshot()
+{
+    static const CBlockIndex* pindexSnapshot = NULL;
+    if (pindexSnapshot == pindexBest)
+        return;
+
+    CMiningSnapshot snapshot;
+    {
+        LOCK(cs_main);
+        pindexSnapshot = pindexBest;
+        const CBlockIndex* pindexLastPoS = GetLastBlockIndex(pindexBest, true);
+        snapshot.nHeight = nBestHeight;
+        snapshot.dPoWDifficulty = GetDifficulty();
+        snapshot.dPoSDifficulty = GetDifficulty(pindexLastPoS);
+        snapshot.dNetMHashPS = GetPoWMHashPS();
+        snapshot.dNetStakeWeight = GetPoSKernelPS();
+        snapshot.nStakeInterest = GetProofOfStakeReward(0, pindexLastPoS->nBits, pindexLastPoS->nTime, true);
+        snapshot.nTargetSpacing = GetTargetSpacing();
+    }
+    snapshot.nTime = GetTime();
+
+    LOCK(cs_miningsnapshot);
+    miningSnapshot = snapshot;
+}
+
+// Whether the stake candidates of all wallets are still loaded
+static bool StakeCoinsDataActual(const vector<boost::shared_ptr<CWallet> >& vpwallets)
+{
+    BOOST_FOREACH(const boost::shared_ptr<CWallet>& pwallet, vpwallets)
+        if (!pwallet->GetCoinsDataActual())
+            return false;
+    return true;
+}
+
+// hbn: a single stake miner serves every loaded wallet. The kernel schedules of
+// all unlocked wallets are extended on the stake kernel search threads, and one
+// block template is built whenever a hit of any wallet is due.
+void StakeMiner(CWalletManager *pwalletManager)
 {
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
@@ -520,7 +570,6 @@ void StakeMiner(CWallet *pwallet)
 
     bool fTryToSync = true;
 
-    // Each thread has its own counter
     unsigned int nExtraNonce = 0;
 
     while (!fStopStaking)
@@ -528,13 +577,6 @@ void StakeMiner(CWallet *pwallet)
         if (fShutdown)
             return;
 
-        while (pwallet->IsLocked())
-        {
-            MilliSleep(1000);
-            if (fShutdown)
-                return;
-        }
-
         while (vNodes.empty() || IsInitialBlockDownload())
         {
             fTryToSync = true;
@@ -555,25 +597,74 @@ void StakeMiner(CWallet *pwallet)
             continue;
         }
 
+        UpdateMiningSnapshot();
+
+        // Wallets able to stake this round
+        vector<boost::shared_ptr<CWallet> > vpwallets;
+        BOOST_FOREACH(const wallet_map::value_type& item, pwalletManager->GetWalletMap())
+            if (!item.second->IsLocked())
+                vpwallets.push_back(item.second);
+
+        if (vpwallets.empty())
+        {
+            MilliSleep(1000);
+            continue;
+        }
+
         //
-        // Create new block
+        // Wait for the next planned kernel hit of any wallet
         //
-        CBlockIndex* pindexPrev = pindexBest;
+        CBlockIndex* pindexPrev;
+        unsigned int nBits;
+        {
+            LOCK(cs_main);
+            pindexPrev = pindexBest;
+            nBits = GetNextTargetRequired(pindexPrev, true);
+        }
 
-        auto_ptr<CBlock> pblock(CreateNewBlock(pwallet, true));
+        int64_t nTimeWake = std::numeric_limits<int64_t>::max();
+        vector<CWallet*> vpwalletsDue;
+        BOOST_FOREACH(const boost::shared_ptr<CWallet>& pwallet, vpwallets)
+        {
+            int64_t nWalletWake;
+            if (pwallet->GetStakePlanDue(nBits, nWalletWake))
+                vpwalletsDue.push_back(pwallet.get());
+            else
+                nTimeWake = min(nTimeWake, nWalletWake);
+        }
+
+        if (vpwalletsDue.empty())
+        {
+            // Replan as soon as the best block or the coins of a wallet change
+            do
+                MilliSleep(nMinerSleep);
+            while (GetAdjustedTime() < nTimeWake && pindexPrev == pindexBest && StakeCoinsDataActual(vpwallets) && !fShutdown && !fStopStaking);
+            continue;
+        }
+
+        //
+        // Create new block
+        //
+        auto_ptr<CBlock> pblock(CreateNewBlock(vpwalletsDue[0], true));
         if (!pblock.get())
             return;
         IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce);
 
-        // Trying to sign a block
-        if (pblock->SignPoSBlock(*pwallet))
+        // Trying to sign the block with each wallet that has a kernel due
+        bool fSigned = false;
+        BOOST_FOREACH(CWallet* pwallet, vpwalletsDue)
         {
-            SetThreadPriority(THREAD_PRIORITY_NORMAL);
-            CheckStake(pblock.get(), *pwallet);
-            SetThreadPriority(THREAD_PRIORITY_LOWEST);
-            MilliSleep(30000);
+            if (pblock->SignPoSBlock(*pwallet))
+            {
+                SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                CheckStake(pblock.get(), *pwallet);
+                SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                MilliSleep(30000);
+                fSigned = true;
+                break;
+            }
         }
-        else
+        if (!fSigned)
             MilliSleep(nMinerSleep);
     }
 }
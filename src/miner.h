@@ -29,4 +29,31 @@ bool CheckStake(CBlock* pblock, CWallet& wallet);
 /** Base sha256 mining transform */
 void SHA256Transform(void* pstate, void* pinput, const void* pinit);
 
+/** Chain figures of getmininginfo, published by the stake miner */
+class CMiningSnapshot
+{
+public:
+    int64_t nTime;
+    int nHeight;
+    double dPoWDifficulty;
+    double dPoSDifficulty;
+    double dNetMHashPS;
+    double dNetStakeWeight;
+    int64_t nStakeInterest;
+    int64_t nTargetSpacing;
+
+    CMiningSnapshot()
+    {
+        nTime = 0;
+        nHeight = 0;
+        dPoWDifficulty = dPoSDifficulty = 0;
+        dNetMHashPS = dNetStakeWeight = 0;
+        nStakeInterest = 0;
+        nTargetSpacing = 0;
+    }
+};
+
+/** Last published mining snapshot, never blocks on cs_main */
+CMiningSnapshot GetMiningSnapshot();
+
 #endif // MINER_H
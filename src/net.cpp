@@ -8,6 +8,7 @@
 #include "net.h"
 #include "init.h"
 #include "main.h"
+#include "kernel.h"
 #include "strlcpy.h"
 #include "addrman.h"
 #include "ui_interface.h"
@@ -1423,19 +1424,23 @@ void static ProcessOneShot()
 
 void ThreadStakeMinter(void* parg)
 {
-    CWallet* pwallet = (CWallet*)parg;
-    LogPrintf("ThreadStakeMinter started for wallet: %s\n", pwallet->strWalletFile );
+    CWalletManager* pwalletManager = (CWalletManager*)parg;
+    LogPrintf("ThreadStakeMinter started\n");
     try
     {
         vnThreadsRunning[THREAD_MINTER]++;
-        StakeMiner(pwallet);
+        do
+            StakeMiner(pwalletManager);
+        while (!pwalletManager->StakeMinerExiting());
         vnThreadsRunning[THREAD_MINTER]--;
     }
     catch (std::exception& e) {
         vnThreadsRunning[THREAD_MINTER]--;
+        pwalletManager->StakeMinerExiting(true);
         PrintException(&e, "ThreadStakeMinter()");
     } catch (...) {
         vnThreadsRunning[THREAD_MINTER]--;
+        pwalletManager->StakeMinerExiting(true);
         PrintException(NULL, "ThreadStakeMinter()");
     }
     LogPrintf("ThreadStakeMinter exiting, %d threads remaining\n", vnThreadsRunning[THREAD_MINTER]);
@@ -2042,7 +2047,7 @@ void StartNode(void* parg)
         LogPrintf("Error; NewThread(ThreadDumpAddress) failed\n");
 
     // ppcoin: mint proof-of-stake blocks in the background
-    // hbn: each wallet gets its own thread.
+    // hbn: one thread stakes for all loaded wallets.
     // staking argument applies to all wallets
 
     bool fStaking = GetBoolArg("-staking",true);
@@ -2066,7 +2071,10 @@ bool StopNode()
     {
        LOCK(cs_main);
        ThreadScriptCheckQuit();
+       ThreadTxPrefetchQuit();
     }
+    ThreadStakeKernelSearchQuit();
+    ThreadBlockCheckQuit();
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
             semOutbound->post();
@@ -2094,8 +2102,13 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) LogPrintf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_MINTER] > 0) LogPrintf("ThreadStakeMinter still running\n");
     if (vnThreadsRunning[THREAD_SCRIPTCHECK] > 0) LogPrintf("ThreadScriptCheck still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 || vnThreadsRunning[THREAD_SCRIPTCHECK] > 0)
+    if (vnThreadsRunning[THREAD_STAKEKERNEL] > 0) LogPrintf("ThreadStakeKernelSearch still running\n");
+    if (vnThreadsRunning[THREAD_PREFETCH] > 0) LogPrintf("ThreadTxPrefetch still running\n");
+    if (vnThreadsRunning[THREAD_BLOCKCHECK] > 0) LogPrintf("ThreadBlockCheck still running\n");
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 || vnThreadsRunning[THREAD_SCRIPTCHECK] > 0 ||
+           vnThreadsRunning[THREAD_BLOCKCHECK] > 0)
         MilliSleep(20);
+    FreePendingBlocks();
     MilliSleep(50);
     DumpAddresses();
     return true;
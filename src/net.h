@@ -129,6 +129,9 @@ enum threadId
     THREAD_RPCHANDLER,
     THREAD_MINTER,
     THREAD_SCRIPTCHECK,
+    THREAD_STAKEKERNEL,
+    THREAD_PREFETCH,
+    THREAD_BLOCKCHECK,
 
     THREAD_MAX
 };
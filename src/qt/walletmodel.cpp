@@ -346,7 +346,7 @@ bool WalletModel::setWalletLocked(bool locked, const SecureString &passPhrase, b
         rc = wallet->Unlock(passPhrase);
         if (rc && formint)
         {
-            if (!NewThread(ThreadStakeMinter, wallet))
+            if (!pWalletManager->StartStakeMiner())
                 qDebug() << "setWalletLocked Error: NewThread(ThreadStakeMinter) failed\n";
             else
                 wallet->fWalletUnlockMintOnly=true;
@@ -462,15 +462,8 @@ bool WalletModel::importWallet(const QString &filename)
 
 void WalletModel::getStakeWeight(uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight)
 {
-    TRY_LOCK(cs_main, lockMain);
-    if (!lockMain)
-        return;
-
-    TRY_LOCK(wallet->cs_wallet, lockWallet);
-    if (!lockWallet)
-      return;
-
-    wallet->GetStakeWeight(*wallet, nMinWeight, nMaxWeight, nWeight);
+    // Kept current by the stake miner, reading it never blocks the UI
+    wallet->GetLastStakeWeight(nMinWeight, nMaxWeight, nWeight);
 }
 
 quint64 WalletModel::getReserveBalance()
@@ -486,7 +479,7 @@ quint64 WalletModel::getTotStakeWeight()
     {
         CWallet* pwallet = pWalletManager->GetWallet(item.first.c_str()).get();
         uint64_t nMinWeight = 0 ,nMaxWeight =  0, nWeight = 0;
-        pwallet->GetStakeWeight(*pwallet, nMinWeight,nMaxWeight,nWeight);
+        pwallet->GetLastStakeWeight(nMinWeight,nMaxWeight,nWeight);
 
         nTotWeight+=nWeight;
     }
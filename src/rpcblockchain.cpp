@@ -334,3 +334,71 @@ Value getcheckpoint(CWallet* pWallet, const Array& params, bool fHelp)
 
     return result;
 }
+
+Value getblockindexinfo(CWallet* pWallet, const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockindexinfo\n"
+            "Returns the memory used by the in-memory block index.");
+
+    const CSlabAllocator& slabEntries = mapBlockIndex.GetAllocator();
+    const CSlabAllocator& slabIndex = CBlockIndex::GetAllocator();
+    uint64_t nReserved = mapBlockIndex.GetTableBytes() + slabEntries.GetReservedBytes() + slabIndex.GetReservedBytes();
+    uint64_t nUsed = mapBlockIndex.size() * sizeof(CBlockIndexMap::slot_type) + slabEntries.GetUsedBytes() + slabIndex.GetUsedBytes();
+
+    Object obj;
+    obj.push_back(Pair("blocks",        (uint64_t)mapBlockIndex.size()));
+    obj.push_back(Pair("buckets",       (uint64_t)mapBlockIndex.bucket_count()));
+    obj.push_back(Pair("loadfactor",    mapBlockIndex.load_factor()));
+    obj.push_back(Pair("tablebytes",    (uint64_t)mapBlockIndex.GetTableBytes()));
+    obj.push_back(Pair("entrybytes",    (uint64_t)slabEntries.GetReservedBytes()));
+    obj.push_back(Pair("indexbytes",    (uint64_t)slabIndex.GetReservedBytes()));
+    obj.push_back(Pair("usedbytes",     nUsed));
+    obj.push_back(Pair("overheadbytes", nReserved - nUsed));
+    obj.push_back(Pair("fragmentation", nReserved > 0 ? (double)(nReserved - nUsed) / nReserved : 0.0));
+    return obj;
+}
+
+Value getblockfileinfo(CWallet* pWallet, const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockfileinfo\n"
+            "Returns counters of the blocks and transactions read from the block files.");
+
+    CBlockFileReaderStats stats = blockFileReader.GetStats();
+
+    Object obj;
+    obj.push_back(Pair("reads",         (uint64_t)stats.nReads));
+    obj.push_back(Pair("bytesread",     (uint64_t)stats.nBytesRead));
+    obj.push_back(Pair("filereads",     (uint64_t)stats.nFileReads));
+    obj.push_back(Pair("readtime",      (double)stats.nReadMicros / 1000000));
+    obj.push_back(Pair("avgreadtime",   stats.nReads > 0 ? (double)stats.nReadMicros / stats.nReads / 1000000 : 0.0));
+    obj.push_back(Pair("maps",          (uint64_t)stats.nMaps));
+    obj.push_back(Pair("mappedfiles",   (uint64_t)stats.nMappedFiles));
+    obj.push_back(Pair("mappedbytes",   (uint64_t)stats.nMappedBytes));
+    return obj;
+}
+
+Value getsigcacheinfo(CWallet* pWallet, const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns the size and hit rate of the signature cache.");
+
+    CSignatureCacheStats stats = GetSignatureCacheStats();
+    uint64_t nLookups = stats.nHits + stats.nMisses;
+
+    Object obj;
+    obj.push_back(Pair("entries",       (uint64_t)stats.nEntries));
+    obj.push_back(Pair("capacity",      (uint64_t)stats.nCapacity));
+    obj.push_back(Pair("bytes",         (uint64_t)stats.nBytes));
+    obj.push_back(Pair("hits",          (uint64_t)stats.nHits));
+    obj.push_back(Pair("misses",        (uint64_t)stats.nMisses));
+    obj.push_back(Pair("hitrate",       nLookups > 0 ? (double)stats.nHits / nLookups : 0.0));
+    obj.push_back(Pair("inserts",       (uint64_t)stats.nInserts));
+    obj.push_back(Pair("evictions",     (uint64_t)stats.nEvictions));
+    return obj;
+}
@@ -30,31 +30,47 @@ Value getmininginfo(CWallet* pWallet, const Array& params, bool fHelp)
             "getmininginfo\n"
             "Returns an object containing mining-related information.");
 
+    // Only snapshots published by the stake miner are read, so no cs_main or
+    // cs_wallet is taken here. They stay empty while the stake miner is off.
     uint64_t nMinWeight = 0, nMaxWeight = 0, nWeight = 0;
-    pWallet->GetStakeWeight(*pWallet, nMinWeight, nMaxWeight, nWeight);
+    pWallet->GetLastStakeWeight(nMinWeight, nMaxWeight, nWeight);
 
-    Object obj, diff, weight;
-    obj.push_back(Pair("blocks",        (int)nBestHeight));
+    unsigned int nCandidates = 0;
+    size_t nCandidatesMemory = 0;
+    pWallet->GetStakeCandidatesInfo(nCandidates, nCandidatesMemory);
+
+    CMiningSnapshot snapshot = GetMiningSnapshot();
+
+    Object obj, diff, weight, candidates, blockhashes;
+    obj.push_back(Pair("blocks",        nBestHeight));
     obj.push_back(Pair("currentblocksize",(uint64_t)nLastBlockSize));
     obj.push_back(Pair("currentblocktx",(uint64_t)nLastBlockTx));
 
-    diff.push_back(Pair("proof-of-work",        GetDifficulty()));
-    diff.push_back(Pair("proof-of-stake",       GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    diff.push_back(Pair("proof-of-work",        snapshot.dPoWDifficulty));
+    diff.push_back(Pair("proof-of-stake",       snapshot.dPoSDifficulty));
     diff.push_back(Pair("search-interval",      (int)nLastCoinStakeSearchInterval));
+    diff.push_back(Pair("plan-interval",        (int)nLastStakePlanInterval));
     obj.push_back(Pair("difficulty",    diff));
 
     obj.push_back(Pair("errors",        GetWarnings("statusbar")));
-    obj.push_back(Pair("netmhashps",     GetPoWMHashPS()));
-    obj.push_back(Pair("netstakeweight", GetPoSKernelPS()));
+    obj.push_back(Pair("netmhashps",     snapshot.dNetMHashPS));
+    obj.push_back(Pair("netstakeweight", snapshot.dNetStakeWeight));
 
     weight.push_back(Pair("minimum",    (uint64_t)nMinWeight));
     weight.push_back(Pair("maximum",    (uint64_t)nMaxWeight));
     weight.push_back(Pair("combined",  (uint64_t)nWeight));
     obj.push_back(Pair("stakeweight", weight));
-    obj.push_back(Pair("stakeinterest",    (uint64_t)GetProofOfStakeReward(0, GetLastBlockIndex(pindexBest, true)->nBits, GetLastBlockIndex(pindexBest, true)->nTime, true)));
+    obj.push_back(Pair("expectedtime", nWeight ? (int64_t)(snapshot.nTargetSpacing * snapshot.dNetStakeWeight / nWeight) : -1));
+    candidates.push_back(Pair("count",  (uint64_t)nCandidates));
+    candidates.push_back(Pair("bytes",  (uint64_t)nCandidatesMemory));
+    obj.push_back(Pair("stakecandidates", candidates));
+    obj.push_back(Pair("stakeinterest",    (uint64_t)snapshot.nStakeInterest));
 
 
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
+    blockhashes.push_back(Pair("computed", (uint64_t)nBlockHashComputed));
+    blockhashes.push_back(Pair("cached",   (uint64_t)nBlockHashCached));
+    obj.push_back(Pair("blockhashes",   blockhashes));
     obj.push_back(Pair("testnet",       fTestNet));
     return obj;
 }
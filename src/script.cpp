@@ -3,13 +3,12 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
 
 #include "script.h"
+#include "scriptstack.h"
 #include "keystore.h"
 #include "bignum.h"
 #include "key.h"
@@ -17,34 +16,29 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags,
+              const CSignatureHashContext* ptxContext = NULL);
 
-static const valtype vchFalse(0);
-static const valtype vchZero(0);
-static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nMaxNumSize = 4;
+static const CScriptValue vchFalse;
+static const CScriptValue vchTrue(CScriptNum(1));
+static const CScriptNum bnZero(0);
+static const CScriptNum bnOne(1);
 
 
-CBigNum CastToBigNum(const valtype& vch)
+static inline CScriptNum CastToNum(const CScriptValue& vch)
 {
-    if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
+    return CScriptNum(vch.begin(), vch.end());
 }
 
-bool CastToBool(const valtype& vch)
+bool CastToBool(const CScriptValue& vch)
 {
+    const unsigned char* pch = vch.begin();
     for (unsigned int i = 0; i < vch.size(); i++)
     {
-        if (vch[i] != 0)
+        if (pch[i] != 0)
         {
             // Can be negative zero
-            if (i == vch.size()-1 && vch[i] == 0x80)
+            if (i == vch.size()-1 && pch[i] == 0x80)
                 return false;
             return true;
         }
@@ -84,9 +78,9 @@ void MakeSameSize(valtype& vch1, valtype& vch2)
 // Script is a stack machine (like Forth) that evaluates a predicate
 // returning a bool indicating valid or not.  There are no loops.
 //
-#define stacktop(i)  (stack.at(stack.size()+(i)))
-#define altstacktop(i)  (altstack.at(altstack.size()+(i)))
-static inline void popstack(vector<valtype>& stack)
+#define stacktop(i)  (stack.top(i))
+#define altstacktop(i)  (altstack.top(i))
+static inline void popstack(CScriptStack& stack)
 {
     if (stack.empty())
         throw runtime_error("popstack() : stack empty");
@@ -328,16 +322,28 @@ bool IsCanonicalSignature(const valtype &vchSig, unsigned int flags) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                const CSignatureHashContext* ptxContext)
+{
+    // The stack is passed back as it was left, even on failure
+    CScriptArena arena;
+    CScriptStack stackEval(arena);
+    stackEval.assign(stack);
+    bool fResult = EvalScript(stackEval, script, txTo, nIn, flags, nHashType, ptxContext);
+    stackEval.get(stack);
+    return fResult;
+}
+
+bool EvalScript(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                const CSignatureHashContext* ptxContext)
 {
-    CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
     opcodetype opcode;
     valtype vchPushValue;
     vector<bool> vfExec;
-    vector<valtype> altstack;
+    CScriptStack altstack(stack.GetArena());
     if (script.size() > 10000)
         return false;
     int nOpCount = 0;
@@ -402,8 +408,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn((int)opcode - (int)(OP_1 - 1));
+                    stack.push_back(bn);
                 }
                 break;
 
@@ -425,7 +431,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     {
                         if (stack.size() < 1)
                             return false;
-                        valtype& vch = stacktop(-1);
+                        const CScriptValue& vch = stacktop(-1);
                         fValue = CastToBool(vch);
                         if (opcode == OP_NOTIF)
                             fValue = !fValue;
@@ -508,8 +514,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
+                    CScriptValue vch1 = stacktop(-2);
+                    CScriptValue vch2 = stacktop(-1);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                 }
@@ -520,9 +526,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
+                    CScriptValue vch1 = stacktop(-3);
+                    CScriptValue vch2 = stacktop(-2);
+                    CScriptValue vch3 = stacktop(-1);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                     stack.push_back(vch3);
@@ -534,8 +540,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
+                    CScriptValue vch1 = stacktop(-4);
+                    CScriptValue vch2 = stacktop(-3);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                 }
@@ -546,8 +552,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
                     if (stack.size() < 6)
                         return false;
-                    valtype vch1 = stacktop(-6);
-                    valtype vch2 = stacktop(-5);
+                    CScriptValue vch1 = stacktop(-6);
+                    CScriptValue vch2 = stacktop(-5);
                     stack.erase(stack.end()-6, stack.end()-4);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
@@ -569,7 +575,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CScriptValue vch = stacktop(-1);
                     if (CastToBool(vch))
                         stack.push_back(vch);
                 }
@@ -578,8 +584,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn(stack.size());
+                    stack.push_back(bn);
                 }
                 break;
 
@@ -597,7 +603,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CScriptValue vch = stacktop(-1);
                     stack.push_back(vch);
                 }
                 break;
@@ -616,7 +622,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
+                    CScriptValue vch = stacktop(-2);
                     stack.push_back(vch);
                 }
                 break;
@@ -628,11 +634,11 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = CastToNum(stacktop(-1)).getint();
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
-                    valtype vch = stacktop(-n-1);
+                    CScriptValue vch = stacktop(-n-1);
                     if (opcode == OP_ROLL)
                         stack.erase(stack.end()-n-1);
                     stack.push_back(vch);
@@ -665,7 +671,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CScriptValue vch = stacktop(-1);
                     stack.insert(stack.end()-2, vch);
                 }
                 break;
@@ -675,8 +681,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn(stacktop(-1).size());
+                    stack.push_back(bn);
                 }
                 break;
 
@@ -691,8 +697,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - bool)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
+                    const CScriptValue& vch1 = stacktop(-2);
+                    const CScriptValue& vch2 = stacktop(-1);
                     bool fEqual = (vch1 == vch2);
                     // OP_NOTEQUAL is disabled because it would be too easy to say
                     // something like n != 1 and have some wiseguy pass in 1 with extra
@@ -726,19 +732,19 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    CScriptNum bn = CastToNum(stacktop(-1));
                     switch (opcode)
                     {
                     case OP_1ADD:       bn += bnOne; break;
                     case OP_1SUB:       bn -= bnOne; break;
                     case OP_NEGATE:     bn = -bn; break;
                     case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_NOT:        bn = CScriptNum(bn == bnZero); break;
+                    case OP_0NOTEQUAL:  bn = CScriptNum(bn != bnZero); break;
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(bn);
                 }
                 break;
 
@@ -759,9 +765,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    CScriptNum bn1 = CastToNum(stacktop(-2));
+                    CScriptNum bn2 = CastToNum(stacktop(-1));
+                    CScriptNum bn(0);
                     switch (opcode)
                     {
                     case OP_ADD:
@@ -772,22 +778,22 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         bn = bn1 - bn2;
                         break;
 
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+                    case OP_BOOLAND:             bn = CScriptNum(bn1 != bnZero && bn2 != bnZero); break;
+                    case OP_BOOLOR:              bn = CScriptNum(bn1 != bnZero || bn2 != bnZero); break;
+                    case OP_NUMEQUAL:            bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMEQUALVERIFY:      bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMNOTEQUAL:         bn = CScriptNum(bn1 != bn2); break;
+                    case OP_LESSTHAN:            bn = CScriptNum(bn1 < bn2); break;
+                    case OP_GREATERTHAN:         bn = CScriptNum(bn1 > bn2); break;
+                    case OP_LESSTHANOREQUAL:     bn = CScriptNum(bn1 <= bn2); break;
+                    case OP_GREATERTHANOREQUAL:  bn = CScriptNum(bn1 >= bn2); break;
                     case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
                     case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
                     default:                     assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(bn);
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -804,9 +810,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    CScriptNum bn1 = CastToNum(stacktop(-3));
+                    CScriptNum bn2 = CastToNum(stacktop(-2));
+                    CScriptNum bn3 = CastToNum(stacktop(-1));
                     bool fValue = (bn2 <= bn1 && bn1 < bn3);
                     popstack(stack);
                     popstack(stack);
@@ -828,26 +834,27 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- hash)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    const CScriptValue& vch = stacktop(-1);
+                    unsigned char vchHash[32];
+                    unsigned int nHashSize = (opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32;
                     if (opcode == OP_RIPEMD160)
-                        RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                        RIPEMD160(vch.begin(), vch.size(), vchHash);
                     else if (opcode == OP_SHA1)
-                        SHA1(&vch[0], vch.size(), &vchHash[0]);
+                        SHA1(vch.begin(), vch.size(), vchHash);
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        SHA256(vch.begin(), vch.size(), vchHash);
                     else if (opcode == OP_HASH160)
                     {
-                        uint160 hash160 = Hash160(vch);
-                        memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                        uint160 hash160 = Hash160(vch.begin(), vch.end());
+                        memcpy(vchHash, &hash160, sizeof(hash160));
                     }
                     else if (opcode == OP_HASH256)
                     {
                         uint256 hash = Hash(vch.begin(), vch.end());
-                        memcpy(&vchHash[0], &hash, sizeof(hash));
+                        memcpy(vchHash, &hash, sizeof(hash));
                     }
                     popstack(stack);
-                    stack.push_back(vchHash);
+                    stack.push_back(vchHash, vchHash + nHashSize);
                 }
                 break;
 
@@ -865,8 +872,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
 
-                    valtype& vchSig    = stacktop(-2);
-                    valtype& vchPubKey = stacktop(-1);
+                    valtype vchSig    = stacktop(-2).getvch();
+                    valtype vchPubKey = stacktop(-1).getvch();
 
                     // Subset of script starting at the most recent codeseparator
                     CScript scriptCode(pbegincodehash, pend);
@@ -875,7 +882,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     scriptCode.FindAndDelete(CScript(vchSig));
 
                     bool fSuccess = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                       CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                       CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, ptxContext);
 
                     popstack(stack);
                     popstack(stack);
@@ -899,7 +906,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = CastToNum(stacktop(-i)).getint();
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -910,7 +917,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = CastToNum(stacktop(-i)).getint();
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -924,19 +931,18 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // Drop the signatures, since there's no way for a signature to sign itself
                     for (int k = 0; k < nSigsCount; k++)
                     {
-                        valtype& vchSig = stacktop(-isig-k);
-                        scriptCode.FindAndDelete(CScript(vchSig));
+                        scriptCode.FindAndDelete(CScript(stacktop(-isig-k).getvch()));
                     }
 
                     bool fSuccess = true;
                     while (fSuccess && nSigsCount > 0)
                     {
-                        valtype& vchSig    = stacktop(-isig);
-                        valtype& vchPubKey = stacktop(-ikey);
+                        valtype vchSig    = stacktop(-isig).getvch();
+                        valtype vchPubKey = stacktop(-ikey).getvch();
 
                         // Check signature
                         bool fOk = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                           CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                           CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, ptxContext);
 
                         if (fOk) {
                             isig++;
@@ -1007,137 +1013,288 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
 
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+// Serialize the script that stands for the input being signed
+static void SerializeScriptCode(CHashWriter& ss, const CScript& scriptCode)
+{
+    // In case concatenating two scripts ends up with two codeseparators,
+    // or an extra one at the end, this prevents all those possible incompatibilities.
+    if (scriptCode.Find(OP_CODESEPARATOR) == 0)
+    {
+        ss << scriptCode;
+        return;
+    }
+    CScript script(scriptCode);
+    script.FindAndDelete(CScript(OP_CODESEPARATOR));
+    ss << script;
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     if (nIn >= txTo.vin.size())
     {
         LogPrintf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
         return 1;
     }
-    CTransaction txTmp(txTo);
 
-    // In case concatenating two scripts ends up with two codeseparators,
-    // or an extra one at the end, this prevents all those possible incompatibilities.
-    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
-
-    // Blank out other inputs' signatures
-    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
-
-    // Blank out some of the outputs
-    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    // Only lock-in the txout payee at same index as txin
+    bool fHashNone = (nHashType & 0x1f) == SIGHASH_NONE;
+    bool fHashSingle = (nHashType & 0x1f) == SIGHASH_SINGLE;
+    if (fHashSingle && nIn >= txTo.vout.size())
     {
-        // Wildcard payee
-        txTmp.vout.clear();
-
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+        LogPrintf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+        return 1;
     }
-    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+
+    // Serialize the transaction as it is signed, without copying it
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion << txTo.nTime;
+
+    // Blank out other inputs completely, not recommended for open transactions
+    bool fAnyoneCanPay = nHashType & SIGHASH_ANYONECANPAY;
+    unsigned int nInputs = fAnyoneCanPay ? 1 : txTo.vin.size();
+    WriteCompactSize(ss, nInputs);
+    for (unsigned int i = 0; i < nInputs; i++)
     {
-        // Only lock-in the txout payee at same index as txin
-        unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
+        unsigned int nInput = fAnyoneCanPay ? nIn : i;
+        const CTxIn& txin = txTo.vin[nInput];
+        ss << txin.prevout;
+        if (nInput == nIn)
+        {
+            SerializeScriptCode(ss, scriptCode);
+            ss << txin.nSequence;
+        }
+        else
         {
-            LogPrintf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
-            return 1;
+            // Blank out other inputs' signatures, and with SIGHASH_NONE or
+            // SIGHASH_SINGLE let the others update at will
+            ss << CScript();
+            ss << ((fHashNone || fHashSingle) ? (unsigned int)0 : txin.nSequence);
         }
-        txTmp.vout.resize(nOut+1);
-        for (unsigned int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
-
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
     }
 
-    // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
+    // Blank out some of the outputs: all of them for a wildcard payee, those
+    // before the one of this input with SIGHASH_SINGLE
+    unsigned int nOutputs = fHashNone ? 0 : (fHashSingle ? nIn + 1 : txTo.vout.size());
+    WriteCompactSize(ss, nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++)
+    {
+        if (fHashSingle && i != nIn)
+            ss << CTxOut();
+        else
+            ss << txTo.vout[i];
+    }
+
+    ss << txTo.nLockTime << nHashType;
+    return ss.GetHash();
+}
+
+CSignatureHashContext::CSignatureHashContext(const CTransaction& txToIn) :
+    txTo(txToIn), ssInputs(SER_GETHASH, 0), ssOutputs(SER_GETHASH, 0)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(ss, txTo.vin.size());
+    vPrefix.reserve(txTo.vin.size());
+    vInputPos.reserve(txTo.vin.size() + 1);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
     {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
+        vPrefix.push_back(ss);
+        unsigned int nPos = ssInputs.size();
+        vInputPos.push_back(nPos);
+        ssInputs << txin.prevout << CScript() << txin.nSequence;
+        ss.write(&ssInputs.begin()[nPos], ssInputs.size() - nPos);
     }
+    vInputPos.push_back(ssInputs.size());
 
-    // Serialize and hash
-    CDataStream ss(SER_GETHASH, 0);
-    ss.reserve(10000);
-    ss << txTmp << nHashType;
-    return Hash(ss.begin(), ss.end());
+    ssOutputs << txTo.vout << txTo.nLockTime;
+}
+
+uint256 CSignatureHashContext::SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType) const
+{
+    if (nIn >= txTo.vin.size() || (nHashType & SIGHASH_ANYONECANPAY) ||
+        (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE)
+        return ::SignatureHash(scriptCode, txTo, nIn, nHashType);
+
+    // SIGHASH_ALL, which signs every input and output
+    CHashWriter ss(vPrefix[nIn]);
+    const CTxIn& txin = txTo.vin[nIn];
+    ss << txin.prevout;
+    SerializeScriptCode(ss, scriptCode);
+    ss << txin.nSequence;
+    ss.write(&ssInputs.begin()[0] + vInputPos[nIn + 1], ssInputs.size() - vInputPos[nIn + 1]);
+    ss.write(&ssOutputs.begin()[0], ssOutputs.size());
+    ss << nHashType;
+    return ss.GetHash();
 }
 
 
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
-
+//
+// Entries are salted hashes of (signature hash, signature, public key) held
+// in a table of fixed size, split in shards with a lock each so that the
+// script check threads seldom wait for each other. An entry goes to the
+// emptier of two buckets of four. When both are full, an entry picked by the
+// new entry's hash is evicted, which an attacker cannot predict without the
+// salt.
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey > sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    static const unsigned int SHARDS = 64;
+    static const unsigned int WAYS = 4;
+
+    class CShard
+    {
+    public:
+        boost::mutex mutex;
+        std::vector<uint256> vEntries;  // WAYS per bucket, 0 in an empty slot, allocated on first use
+        uint64_t nHits;
+        uint64_t nMisses;
+        uint64_t nInserts;
+        uint64_t nEvictions;
+        size_t nUsed;
+
+        CShard() : nHits(0), nMisses(0), nInserts(0), nEvictions(0), nUsed(0) {}
+    };
+
+    CShard vShards[SHARDS];
+    unsigned int nBuckets;  // per shard, only changed with all shards locked
+    uint256 hashSalt;
+
+    CShard& GetShard(const uint256& entry)
+    {
+        return vShards[entry.Get64(0) % SHARDS];
+    }
+
+    size_t GetSlot(const uint256& entry, int nChoice) const
+    {
+        return (entry.Get64(1 + nChoice) % nBuckets) * WAYS;
+    }
 
 public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CSignatureCache()
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        hashSalt = GetRandHash();
+        nBuckets = 0;
+        Resize((size_t)DEFAULT_MAX_SIG_CACHE_SIZE << 20);
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+    void Resize(size_t nMaxBytes)
+    {
+        for (unsigned int i = 0; i < SHARDS; i++)
+            vShards[i].mutex.lock();
+        nBuckets = nMaxBytes / (sizeof(uint256) * WAYS * SHARDS);
+        for (unsigned int i = 0; i < SHARDS; i++)
+        {
+            std::vector<uint256>().swap(vShards[i].vEntries);
+            vShards[i].nUsed = 0;
+            vShards[i].mutex.unlock();
+        }
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    uint256 GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& vchPubKey) const
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        unsigned char pchSalted[64];
+        memcpy(pchSalted, (const unsigned char*)&hashSalt, 32);
+        memcpy(pchSalted + 32, (const unsigned char*)&hash, 32);
+        return Hash(BEGIN(pchSalted), END(pchSalted), vchSig.begin(), vchSig.end(), vchPubKey.begin(), vchPubKey.end());
+    }
 
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+    bool Get(const uint256& entry)
+    {
+        CShard& shard = GetShard(entry);
+        boost::unique_lock<boost::mutex> lock(shard.mutex);
+        if (!shard.vEntries.empty())
+        {
+            for (int nChoice = 0; nChoice < 2; nChoice++)
+            {
+                size_t nSlot = GetSlot(entry, nChoice);
+                for (unsigned int i = 0; i < WAYS; i++)
+                    if (shard.vEntries[nSlot + i] == entry)
+                    {
+                        shard.nHits++;
+                        return true;
+                    }
+            }
+        }
+        shard.nMisses++;
+        return false;
+    }
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+    void Set(const uint256& entry)
+    {
+        CShard& shard = GetShard(entry);
+        boost::unique_lock<boost::mutex> lock(shard.mutex);
+        if (nBuckets == 0)
+            return;
+        if (shard.vEntries.empty())
+            shard.vEntries.resize(nBuckets * WAYS);
+
+        // Already there, or the free slot of the emptier bucket
+        size_t nFree[2];
+        unsigned int nFreeCount[2] = { 0, 0 };
+        for (int nChoice = 0; nChoice < 2; nChoice++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            size_t nSlot = GetSlot(entry, nChoice);
+            for (unsigned int i = 0; i < WAYS; i++)
+            {
+                if (shard.vEntries[nSlot + i] == entry)
+                    return;
+                if (shard.vEntries[nSlot + i] == 0 && nFreeCount[nChoice]++ == 0)
+                    nFree[nChoice] = nSlot + i;
+            }
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        size_t nSlot;
+        if (nFreeCount[0] > 0 || nFreeCount[1] > 0)
+        {
+            nSlot = nFree[nFreeCount[0] >= nFreeCount[1] ? 0 : 1];
+            shard.nUsed++;
+        }
+        else
+        {
+            uint64_t nRand = entry.Get64(3);
+            nSlot = GetSlot(entry, nRand & 1) + (nRand >> 1) % WAYS;
+            shard.nEvictions++;
+        }
+        shard.vEntries[nSlot] = entry;
+        shard.nInserts++;
+    }
+
+    CSignatureCacheStats GetStats()
+    {
+        CSignatureCacheStats stats;
+        for (unsigned int i = 0; i < SHARDS; i++)
+        {
+            boost::unique_lock<boost::mutex> lock(vShards[i].mutex);
+            stats.nHits += vShards[i].nHits;
+            stats.nMisses += vShards[i].nMisses;
+            stats.nInserts += vShards[i].nInserts;
+            stats.nEvictions += vShards[i].nEvictions;
+            stats.nEntries += vShards[i].nUsed;
+            stats.nCapacity += (uint64_t)nBuckets * WAYS;
+            stats.nBytes += vShards[i].vEntries.capacity() * sizeof(uint256);
+        }
+        return stats;
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+static CSignatureCache signatureCache;
+
+void InitSignatureCache(size_t nMaxBytes)
 {
-    static CSignatureCache signatureCache;
+    signatureCache.Resize(nMaxBytes);
+}
 
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-       return false;
-    CPubKey pubkey = key.GetPubKey();
-    if (!pubkey.IsValid())
-       return false;
+CSignatureCacheStats GetSignatureCacheStats()
+{
+    return signatureCache.GetStats();
+}
 
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashContext* ptxContext)
+{
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -1147,16 +1304,19 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = ptxContext ? ptxContext->SignatureHash(scriptCode, nIn, nHashType) : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    // Only signatures verified with these public key bytes are cached, so a
+    // hit needs no parsing of the key
+    uint256 entry = signatureCache.GetEntry(sighash, vchSig, vchPubKey);
+    if (signatureCache.Get(entry))
         return true;
 
-    if (!key.Verify(sighash, vchSig))
+    if (!CPubKey(vchPubKey).Verify(sighash, vchSig))
         return false;
 
     if (!(flags & SCRIPT_VERIFY_NOCACHE))
-       signatureCache.Set(sighash, vchSig, pubkey);
+       signatureCache.Set(entry);
 
     return true;
 }
@@ -1578,16 +1738,17 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSignatureHashContext* ptxContext)
 {
-    vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    CScriptArena arena;
+    CScriptStack stack(arena), stackCopy(arena);
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, ptxContext))
         return false;
 
     if (flags & SCRIPT_VERIFY_P2SH)
-       stackCopy = stack;
+       stackCopy.assign(stack);
 
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, ptxContext))
         return false;
     if (stack.empty())
         return false;
@@ -1606,11 +1767,12 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         // an empty stack and the EvalScript above would return false.
         assert(!stackCopy.empty());
 
-        const valtype& pubKeySerialized = stackCopy.back();
-        CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
+        const CScriptValue& pubKeySerialized = stackCopy.back();
+        CScript pubKey2;
+        pubKey2.insert(pubKey2.end(), pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, ptxContext))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1620,14 +1782,15 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
     return true;
 }
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSignatureHashContext* ptxContext)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = ptxContext ? ptxContext->SignatureHash(fromPubKey, nIn, nHashType) : SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -1641,7 +1804,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = ptxContext ? ptxContext->SignatureHash(subscript, nIn, nHashType) : SignatureHash(subscript, txTo, nIn, nHashType);
 
         txnouttype subType;
         bool fSolved =
@@ -1652,10 +1815,11 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, STRICT_FLAGS, 0);
+    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, STRICT_FLAGS, 0, ptxContext);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSignatureHashContext* ptxContext)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
@@ -1663,7 +1827,7 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
     assert(txin.prevout.hash == txFrom.GetHash());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, ptxContext);
 }
 
 static CScript PushAll(const vector<valtype>& values)
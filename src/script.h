@@ -20,6 +20,7 @@
 typedef std::vector<unsigned char> valtype;
 
 class CTransaction;
+class CScriptStack;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 
@@ -611,11 +612,75 @@ public:
     }
 };
 
+/** Default and largest size of the signature cache, in megabytes */
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+static const unsigned int MAX_MAX_SIG_CACHE_SIZE = 4096;
+
+/** Counters of the signature cache */
+struct CSignatureCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    uint64_t nEvictions;
+    uint64_t nEntries;
+    uint64_t nCapacity;
+    uint64_t nBytes;    // allocated so far
+
+    CSignatureCacheStats() : nHits(0), nMisses(0), nInserts(0), nEvictions(0), nEntries(0), nCapacity(0), nBytes(0) {}
+};
+
+// Size the signature cache to nMaxBytes (0 disables it), its entries are dropped
+void InitSignatureCache(size_t nMaxBytes);
+CSignatureCacheStats GetSignatureCacheStats();
+
+/** Signature hashes of the inputs of one transaction.
+ *
+ * SignatureHash serializes the transaction for every input it hashes. This
+ * serializes the parts shared by the SIGHASH_ALL hashes of all the inputs
+ * once: the hash of an input continues the hasher state after the blanked
+ * inputs before it, and streams only the input with its script substituted
+ * before the stored blanked inputs after it and the outputs. The other hash
+ * types are hashed as SignatureHash does.
+ *
+ * The transaction is referenced, not copied. It may have its scriptSigs
+ * changed while the context is used, as in signing, but nothing else.
+ */
+class CSignatureHashContext
+{
+private:
+    const CTransaction& txTo;
+
+    // Hasher after the version, time and the blanked inputs before each input
+    std::vector<CHashWriter> vPrefix;
+
+    // Every input serialized with an empty script, and where each starts
+    CDataStream ssInputs;
+    std::vector<unsigned int> vInputPos;
+
+    // The outputs and lock time
+    CDataStream ssOutputs;
+
+public:
+    explicit CSignatureHashContext(const CTransaction& txToIn);
+
+    const CTransaction& GetTransaction() const { return txTo; }
+
+    uint256 SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType) const;
+};
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey, unsigned int flags);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig, unsigned int flags);
 
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+// ptxContext, if given, is the signature hash context of txTo
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                const CSignatureHashContext* ptxContext = NULL);
+// Same as above on the interpreter's own stack, see scriptstack.h
+bool EvalScript(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                const CSignatureHashContext* ptxContext = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
@@ -624,9 +689,12 @@ isminetype IsMine(const CKeyStore& keystore, const CTxDestination& dest);
 void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey, std::vector<CKeyID> &vKeys);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CSignatureHashContext* ptxContext = NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CSignatureHashContext* ptxContext = NULL);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                  const CSignatureHashContext* ptxContext = NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
@@ -0,0 +1,377 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SCRIPTSTACK_H
+#define BITCOIN_SCRIPTSTACK_H
+
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+class scriptnum_error : public std::runtime_error
+{
+public:
+    explicit scriptnum_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+/** Numeric operand of the script interpreter.
+ *
+ * Stack elements used as numbers are little-endian sign and magnitude, at
+ * most nMaxNumSize bytes, as CBigNum's getvch/setvch read and write them.
+ * Results of arithmetic can be a byte longer than that, so they are held in
+ * 64 bits and written back in the shortest encoding, which is what getvch
+ * gives for the same CBigNum value.
+ */
+class CScriptNum
+{
+private:
+    int64_t nValue;
+
+public:
+    static const size_t nMaxNumSize = 4;
+
+    explicit CScriptNum(int64_t n) : nValue(n) {}
+
+    CScriptNum(const unsigned char* pbegin, const unsigned char* pend)
+    {
+        size_t nSize = pend - pbegin;
+        if (nSize > nMaxNumSize)
+            throw scriptnum_error("CScriptNum() : overflow");
+        nValue = 0;
+        if (nSize == 0)
+            return;
+        for (size_t i = 0; i < nSize; i++)
+            nValue |= (int64_t)pbegin[i] << (8 * i);
+        // The top bit of the last byte is the sign
+        if (pbegin[nSize - 1] & 0x80)
+            nValue = -(nValue & ~((int64_t)0x80 << (8 * (nSize - 1))));
+    }
+
+    explicit CScriptNum(const std::vector<unsigned char>& vch)
+    {
+        *this = vch.empty() ? CScriptNum(0) : CScriptNum(&vch[0], &vch[0] + vch.size());
+    }
+
+    int64_t getint64() const { return nValue; }
+
+    // Clamped to the range of int, as CBigNum::getint does
+    int getint() const
+    {
+        if (nValue > std::numeric_limits<int>::max())
+            return std::numeric_limits<int>::max();
+        if (nValue < std::numeric_limits<int>::min())
+            return std::numeric_limits<int>::min();
+        return (int)nValue;
+    }
+
+    // Write the shortest encoding to pch, which has room for 9 bytes, and
+    // return its size. Zero is the empty string.
+    unsigned int Encode(unsigned char* pch) const
+    {
+        if (nValue == 0)
+            return 0;
+        bool fNegative = nValue < 0;
+        uint64_t n = fNegative ? -(uint64_t)nValue : (uint64_t)nValue;
+        unsigned int nSize = 0;
+        while (n)
+        {
+            pch[nSize++] = n & 0xff;
+            n >>= 8;
+        }
+        // A set top bit needs a byte of its own to hold the sign
+        if (pch[nSize - 1] & 0x80)
+            pch[nSize++] = fNegative ? 0x80 : 0;
+        else if (fNegative)
+            pch[nSize - 1] |= 0x80;
+        return nSize;
+    }
+
+    std::vector<unsigned char> getvch() const
+    {
+        unsigned char pch[9];
+        return std::vector<unsigned char>(pch, pch + Encode(pch));
+    }
+
+    CScriptNum operator-() const { return CScriptNum(-nValue); }
+    CScriptNum& operator+=(const CScriptNum& b) { nValue += b.nValue; return *this; }
+    CScriptNum& operator-=(const CScriptNum& b) { nValue -= b.nValue; return *this; }
+
+    friend CScriptNum operator+(const CScriptNum& a, const CScriptNum& b) { return CScriptNum(a.nValue + b.nValue); }
+    friend CScriptNum operator-(const CScriptNum& a, const CScriptNum& b) { return CScriptNum(a.nValue - b.nValue); }
+    friend bool operator==(const CScriptNum& a, const CScriptNum& b) { return a.nValue == b.nValue; }
+    friend bool operator!=(const CScriptNum& a, const CScriptNum& b) { return a.nValue != b.nValue; }
+    friend bool operator<(const CScriptNum& a, const CScriptNum& b)  { return a.nValue < b.nValue; }
+    friend bool operator<=(const CScriptNum& a, const CScriptNum& b) { return a.nValue <= b.nValue; }
+    friend bool operator>(const CScriptNum& a, const CScriptNum& b)  { return a.nValue > b.nValue; }
+    friend bool operator>=(const CScriptNum& a, const CScriptNum& b) { return a.nValue >= b.nValue; }
+};
+
+/** Memory of one script evaluation.
+ *
+ * Hands out 8 byte aligned blocks from a buffer inside the arena, then from
+ * heap chunks when that runs out. Nothing is freed until the arena is
+ * destroyed, which is fine for the bounded sizes of a script evaluation.
+ */
+class CScriptArena
+{
+private:
+    enum { INLINE_SIZE = 8192, CHUNK_SIZE = 32768 };
+
+    // Heap chunks are linked through their first 8 bytes
+    void* pchunks;
+    unsigned char* pnext;
+    size_t nLeft;
+    union
+    {
+        unsigned char vch[INLINE_SIZE];
+        uint64_t nAlign;
+    } buffer;
+
+    // disallow copies
+    CScriptArena(const CScriptArena&);
+    CScriptArena& operator=(const CScriptArena&);
+
+public:
+    CScriptArena() : pchunks(NULL), pnext(buffer.vch), nLeft(INLINE_SIZE) {}
+
+    ~CScriptArena()
+    {
+        while (pchunks)
+        {
+            void* pchunk = pchunks;
+            pchunks = *(void**)pchunk;
+            free(pchunk);
+        }
+    }
+
+    void* Allocate(size_t nSize)
+    {
+        nSize = (nSize + 7) & ~(size_t)7;
+        if (nSize > nLeft)
+        {
+            size_t nChunk = 8 + (nSize > CHUNK_SIZE ? nSize : (size_t)CHUNK_SIZE);
+            void* pchunk = malloc(nChunk);
+            if (!pchunk)
+                throw std::bad_alloc();
+            *(void**)pchunk = pchunks;
+            pchunks = pchunk;
+            pnext = (unsigned char*)pchunk + 8;
+            nLeft = nChunk - 8;
+        }
+        void* p = pnext;
+        pnext += nSize;
+        nLeft -= nSize;
+        return p;
+    }
+};
+
+/** Element of the script interpreter stacks.
+ *
+ * Elements up to INLINE_SIZE bytes, which covers public keys and signatures
+ * with their hash type, are stored in the element. Longer ones point into the
+ * arena of the evaluation. Elements are never changed once pushed, so copies
+ * share the bytes of long elements and copying is a memcpy.
+ */
+class CScriptValue
+{
+public:
+    enum { INLINE_SIZE = 76 };
+
+private:
+    unsigned int nSize;
+    union
+    {
+        unsigned char vch[INLINE_SIZE];
+        const unsigned char* pch;
+    } data;
+
+public:
+    CScriptValue() : nSize(0) {}
+
+    CScriptValue(const unsigned char* pbegin, const unsigned char* pend, CScriptArena& arena)
+    {
+        nSize = pend - pbegin;
+        if (nSize <= INLINE_SIZE)
+        {
+            if (nSize)
+                memcpy(data.vch, pbegin, nSize);
+        }
+        else
+        {
+            unsigned char* p = (unsigned char*)arena.Allocate(nSize);
+            memcpy(p, pbegin, nSize);
+            data.pch = p;
+        }
+    }
+
+    explicit CScriptValue(const CScriptNum& bn)
+    {
+        nSize = bn.Encode(data.vch);
+    }
+
+    const unsigned char* begin() const { return nSize <= INLINE_SIZE ? data.vch : data.pch; }
+    const unsigned char* end() const { return begin() + nSize; }
+    unsigned int size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    std::vector<unsigned char> getvch() const { return std::vector<unsigned char>(begin(), end()); }
+
+    friend bool operator==(const CScriptValue& a, const CScriptValue& b)
+    {
+        return a.nSize == b.nSize && memcmp(a.begin(), b.begin(), a.nSize) == 0;
+    }
+    friend bool operator!=(const CScriptValue& a, const CScriptValue& b) { return !(a == b); }
+};
+
+/** Stack of the script interpreter.
+ *
+ * A vector of CScriptValue with its storage in the arena, so pushing, popping
+ * and duplicating elements does not touch the heap. Indexing and the
+ * iterators follow std::vector, top(i) is stack.at(stack.size()+(i)).
+ */
+class CScriptStack
+{
+public:
+    typedef CScriptValue* iterator;
+    typedef const CScriptValue* const_iterator;
+
+private:
+    enum { INITIAL_CAPACITY = 16 };
+
+    CScriptArena* parena;
+    CScriptValue* pvalues;
+    unsigned int nSize;
+    unsigned int nCapacity;
+
+    // disallow copies, elements are copied with assign
+    CScriptStack(const CScriptStack&);
+    CScriptStack& operator=(const CScriptStack&);
+
+    void Reserve(unsigned int nNeeded)
+    {
+        if (nNeeded <= nCapacity)
+            return;
+        unsigned int nNewCapacity = nCapacity ? nCapacity : (unsigned int)INITIAL_CAPACITY;
+        while (nNewCapacity < nNeeded)
+            nNewCapacity *= 2;
+        CScriptValue* pnew = (CScriptValue*)parena->Allocate(nNewCapacity * sizeof(CScriptValue));
+        if (nSize)
+            memcpy(pnew, pvalues, nSize * sizeof(CScriptValue));
+        pvalues = pnew;
+        nCapacity = nNewCapacity;
+    }
+
+public:
+    explicit CScriptStack(CScriptArena& arena) : parena(&arena), pvalues(NULL), nSize(0), nCapacity(0) {}
+
+    CScriptArena& GetArena() const { return *parena; }
+
+    unsigned int size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    void clear() { nSize = 0; }
+
+    iterator begin() { return pvalues; }
+    iterator end() { return pvalues + nSize; }
+    const_iterator begin() const { return pvalues; }
+    const_iterator end() const { return pvalues + nSize; }
+
+    CScriptValue& back() { assert(nSize); return pvalues[nSize - 1]; }
+    const CScriptValue& back() const { assert(nSize); return pvalues[nSize - 1]; }
+
+    CScriptValue& top(int i)
+    {
+        if (i >= 0 || (unsigned int)-i > nSize)
+            throw std::out_of_range("CScriptStack::top() : out of range");
+        return pvalues[nSize + i];
+    }
+
+    void push_back(const CScriptValue& value)
+    {
+        if (nSize == nCapacity)
+        {
+            // value may be an element of this stack
+            CScriptValue valueCopy = value;
+            Reserve(nSize + 1);
+            pvalues[nSize++] = valueCopy;
+        }
+        else
+            pvalues[nSize++] = value;
+    }
+
+    void push_back(const unsigned char* pbegin, const unsigned char* pend)
+    {
+        push_back(CScriptValue(pbegin, pend, *parena));
+    }
+
+    void push_back(const std::vector<unsigned char>& vch)
+    {
+        push_back(CScriptValue(vch.empty() ? NULL : &vch[0], vch.empty() ? NULL : &vch[0] + vch.size(), *parena));
+    }
+
+    void push_back(const CScriptNum& bn)
+    {
+        push_back(CScriptValue(bn));
+    }
+
+    void pop_back()
+    {
+        assert(nSize);
+        nSize--;
+    }
+
+    iterator erase(iterator first, iterator last)
+    {
+        memmove(first, last, (end() - last) * sizeof(CScriptValue));
+        nSize -= last - first;
+        return first;
+    }
+
+    iterator erase(iterator pos)
+    {
+        return erase(pos, pos + 1);
+    }
+
+    iterator insert(iterator pos, const CScriptValue& value)
+    {
+        unsigned int nPos = pos - pvalues;
+        CScriptValue valueCopy = value;
+        Reserve(nSize + 1);
+        memmove(pvalues + nPos + 1, pvalues + nPos, (nSize - nPos) * sizeof(CScriptValue));
+        pvalues[nPos] = valueCopy;
+        nSize++;
+        return pvalues + nPos;
+    }
+
+    // Copy the elements of a stack in the same arena
+    void assign(const CScriptStack& stack)
+    {
+        assert(stack.parena == parena);
+        Reserve(stack.nSize);
+        if (stack.nSize)
+            memcpy(pvalues, stack.pvalues, stack.nSize * sizeof(CScriptValue));
+        nSize = stack.nSize;
+    }
+
+    void assign(const std::vector<std::vector<unsigned char> >& stack)
+    {
+        clear();
+        Reserve(stack.size());
+        for (unsigned int i = 0; i < stack.size(); i++)
+            push_back(stack[i]);
+    }
+
+    void get(std::vector<std::vector<unsigned char> >& stack) const
+    {
+        stack.resize(nSize);
+        for (unsigned int i = 0; i < nSize; i++)
+            stack[i].assign(pvalues[i].begin(), pvalues[i].end());
+    }
+};
+
+#endif
@@ -36,6 +36,12 @@
 #include "util.h"
 #include "net.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SCRYPT_MULTI_LANE
+#include <immintrin.h>
+#endif
+
 #define SCRYPT_BUFFER_SIZE (131072 + 63)
 
 #if defined (OPTIMIZED_SALSA) && ( defined (__x86_64__) || defined (__i386__) || defined(__arm__) )
@@ -196,3 +202,208 @@ uint256 scrypt_blockhash(const void* input)
     return scrypt_nosalt(input, 80, scratchpad);
 }
 
+#ifdef SCRYPT_MULTI_LANE
+
+/* Multi-lane scrypt core. Word k of every lane is kept in one vector register,
+   so each Salsa20/8 operation works on 4 (SSE2) or 8 (AVX2) independent block
+   headers at once. Only the scratchpad reads of the second loop, which use a
+   different index per lane, are gathered lane by lane.
+ */
+
+#define SALSA_DOUBLEROUND(QR) \
+    /* Operate on columns. */ \
+    QR( 4, 0,12, 7); QR( 9, 5, 1, 7); QR(14,10, 6, 7); QR( 3,15,11, 7); \
+    QR( 8, 4, 0, 9); QR(13, 9, 5, 9); QR( 2,14,10, 9); QR( 7, 3,15, 9); \
+    QR(12, 8, 4,13); QR( 1,13, 9,13); QR( 6, 2,14,13); QR(11, 7, 3,13); \
+    QR( 0,12, 8,18); QR( 5, 1,13,18); QR(10, 6, 2,18); QR(15,11, 7,18); \
+    /* Operate on rows. */ \
+    QR( 1, 0, 3, 7); QR( 6, 5, 4, 7); QR(11,10, 9, 7); QR(12,15,14, 7); \
+    QR( 2, 1, 0, 9); QR( 7, 6, 5, 9); QR( 8,11,10, 9); QR(13,12,15, 9); \
+    QR( 3, 2, 1,13); QR( 4, 7, 6,13); QR( 9, 8,11,13); QR(14,13,12,13); \
+    QR( 0, 3, 2,18); QR( 5, 4, 7,18); QR(10, 9, 8,18); QR(15,14,13,18);
+
+#define QR_SSE2(a, b, c, s) { \
+    __m128i t = _mm_add_epi32(x[b], x[c]); \
+    x[a] = _mm_xor_si128(x[a], _mm_or_si128(_mm_slli_epi32(t, s), _mm_srli_epi32(t, 32 - (s)))); }
+
+#define QR_AVX2(a, b, c, s) { \
+    __m256i t = _mm256_add_epi32(x[b], x[c]); \
+    x[a] = _mm256_xor_si256(x[a], _mm256_or_si256(_mm256_slli_epi32(t, s), _mm256_srli_epi32(t, 32 - (s)))); }
+
+__attribute__((target("sse2")))
+static void xor_salsa8_sse2(__m128i B[16], const __m128i Bx[16])
+{
+    __m128i x[16];
+    int i;
+
+    for (i = 0; i < 16; i++)
+        x[i] = B[i] = _mm_xor_si128(B[i], Bx[i]);
+    for (i = 0; i < 8; i += 2) {
+        SALSA_DOUBLEROUND(QR_SSE2)
+    }
+    for (i = 0; i < 16; i++)
+        B[i] = _mm_add_epi32(B[i], x[i]);
+}
+
+__attribute__((target("sse2")))
+static void scrypt_core_sse2(__m128i *X, __m128i *V)
+{
+    unsigned int i, j[4], k, l;
+    const uint32_t *pV = (const uint32_t *)V;
+
+    for (i = 0; i < 1024; i++) {
+        memcpy(&V[i * 32], X, 32 * sizeof(__m128i));
+        xor_salsa8_sse2(&X[0], &X[16]);
+        xor_salsa8_sse2(&X[16], &X[0]);
+    }
+    for (i = 0; i < 1024; i++) {
+        _mm_storeu_si128((__m128i *)j, X[16]);
+        for (l = 0; l < 4; l++)
+            j[l] = (j[l] & 1023) * 32 * 4 + l;
+        for (k = 0; k < 32; k++)
+            X[k] = _mm_xor_si128(X[k], _mm_set_epi32(pV[j[3] + k * 4], pV[j[2] + k * 4], pV[j[1] + k * 4], pV[j[0] + k * 4]));
+        xor_salsa8_sse2(&X[0], &X[16]);
+        xor_salsa8_sse2(&X[16], &X[0]);
+    }
+}
+
+__attribute__((target("avx2")))
+static void xor_salsa8_avx2(__m256i B[16], const __m256i Bx[16])
+{
+    __m256i x[16];
+    int i;
+
+    for (i = 0; i < 16; i++)
+        x[i] = B[i] = _mm256_xor_si256(B[i], Bx[i]);
+    for (i = 0; i < 8; i += 2) {
+        SALSA_DOUBLEROUND(QR_AVX2)
+    }
+    for (i = 0; i < 16; i++)
+        B[i] = _mm256_add_epi32(B[i], x[i]);
+}
+
+__attribute__((target("avx2")))
+static void scrypt_core_avx2(__m256i *X, __m256i *V)
+{
+    unsigned int i, k;
+    const __m256i vLane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i vMask = _mm256_set1_epi32(1023);
+
+    for (i = 0; i < 1024; i++) {
+        memcpy(&V[i * 32], X, 32 * sizeof(__m256i));
+        xor_salsa8_avx2(&X[0], &X[16]);
+        xor_salsa8_avx2(&X[16], &X[0]);
+    }
+    for (i = 0; i < 1024; i++) {
+        // Index of word 0 of the selected scratchpad row, for every lane
+        __m256i vIndex = _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(X[16], vMask), 8), vLane);
+        for (k = 0; k < 32; k++) {
+            X[k] = _mm256_xor_si256(X[k], _mm256_i32gather_epi32((const int *)V, vIndex, 4));
+            vIndex = _mm256_add_epi32(vIndex, _mm256_set1_epi32(8));
+        }
+        xor_salsa8_avx2(&X[0], &X[16]);
+        xor_salsa8_avx2(&X[16], &X[0]);
+    }
+}
+
+__attribute__((target("sse2")))
+static void scrypt_blockhash_sse2(const void* const* pinput, uint256* poutput, void *scratchpad)
+{
+    uint32_t X[4][32];
+    __m128i XV[32];
+    __m128i *V = (__m128i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+    unsigned int k, l;
+
+    for (l = 0; l < 4; l++)
+        PBKDF2_SHA256((const uint8_t*)pinput[l], 80, (const uint8_t*)pinput[l], 80, 1, (uint8_t *)X[l], 128);
+    for (k = 0; k < 32; k++)
+        XV[k] = _mm_set_epi32(X[3][k], X[2][k], X[1][k], X[0][k]);
+
+    scrypt_core_sse2(XV, V);
+
+    for (k = 0; k < 32; k++) {
+        uint32_t w[4];
+        _mm_storeu_si128((__m128i *)w, XV[k]);
+        for (l = 0; l < 4; l++)
+            X[l][k] = w[l];
+    }
+    for (l = 0; l < 4; l++)
+        PBKDF2_SHA256((const uint8_t*)pinput[l], 80, (uint8_t *)X[l], 128, 1, (uint8_t*)&poutput[l], 32);
+}
+
+__attribute__((target("avx2")))
+static void scrypt_blockhash_avx2(const void* const* pinput, uint256* poutput, void *scratchpad)
+{
+    uint32_t X[8][32];
+    __m256i XV[32];
+    __m256i *V = (__m256i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+    unsigned int k, l;
+
+    for (l = 0; l < 8; l++)
+        PBKDF2_SHA256((const uint8_t*)pinput[l], 80, (const uint8_t*)pinput[l], 80, 1, (uint8_t *)X[l], 128);
+    for (k = 0; k < 32; k++)
+        XV[k] = _mm256_setr_epi32(X[0][k], X[1][k], X[2][k], X[3][k], X[4][k], X[5][k], X[6][k], X[7][k]);
+
+    scrypt_core_avx2(XV, V);
+
+    for (k = 0; k < 32; k++) {
+        uint32_t w[8];
+        _mm256_storeu_si256((__m256i *)w, XV[k]);
+        for (l = 0; l < 8; l++)
+            X[l][k] = w[l];
+    }
+    for (l = 0; l < 8; l++)
+        PBKDF2_SHA256((const uint8_t*)pinput[l], 80, (uint8_t *)X[l], 128, 1, (uint8_t*)&poutput[l], 32);
+}
+
+#endif // SCRYPT_MULTI_LANE
+
+unsigned int scrypt_blockhash_lanes()
+{
+#ifdef SCRYPT_MULTI_LANE
+    static const unsigned int nLanes = __builtin_cpu_supports("avx2") ? 8 : __builtin_cpu_supports("sse2") ? 4 : 1;
+    return nLanes;
+#else
+    return 1;
+#endif
+}
+
+void scrypt_blockhash_multi(const void* const* pinput, uint256* poutput, unsigned int nCount, unsigned int nLanes)
+{
+    unsigned int nBest = scrypt_blockhash_lanes();
+    if (nLanes == 0 || nLanes > nBest)
+        nLanes = nBest;
+
+    unsigned int i = 0;
+#ifdef SCRYPT_MULTI_LANE
+    if (nLanes >= 4 && nCount > 1)
+    {
+        if (nLanes > 4 && nCount <= 4)
+            nLanes = 4;
+
+        // One scratchpad shared by all lanes, the last group is padded with its last header
+        unsigned char *scratchpad = (unsigned char *)malloc(nLanes * (SCRYPT_BUFFER_SIZE - 63) + 63);
+        if (scratchpad)
+        {
+            for (; i < nCount; i += nLanes)
+            {
+                const void* pgroup[8];
+                uint256 hashes[8];
+                for (unsigned int l = 0; l < nLanes; l++)
+                    pgroup[l] = pinput[std::min(i + l, nCount - 1)];
+
+                if (nLanes == 8)
+                    scrypt_blockhash_avx2(pgroup, hashes, scratchpad);
+                else
+                    scrypt_blockhash_sse2(pgroup, hashes, scratchpad);
+
+                for (unsigned int l = 0; l < nLanes && i + l < nCount; l++)
+                    poutput[i + l] = hashes[l];
+            }
+            free(scratchpad);
+        }
+    }
+#endif
+    for (; i < nCount; i++)
+        poutput[i] = scrypt_blockhash(pinput[i]);
+}
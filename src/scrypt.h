@@ -10,4 +10,12 @@
 uint256 scrypt_hash(const void* input, size_t inputlen);
 uint256 scrypt_blockhash(const void* input);
 
+// Number of block headers hashed at once by scrypt_blockhash_multi on this CPU:
+// 8 with AVX2, 4 with SSE2, 1 otherwise
+unsigned int scrypt_blockhash_lanes();
+
+// Hash nCount 80 byte block headers, with the same results as scrypt_blockhash.
+// Up to nLanes headers are hashed at once, 0 selects scrypt_blockhash_lanes()
+void scrypt_blockhash_multi(const void* const* pinput, uint256* poutput, unsigned int nCount, unsigned int nLanes = 0);
+
 #endif // SCRYPT_H
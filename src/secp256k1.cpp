@@ -0,0 +1,945 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "secp256k1.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#ifdef __SIZEOF_INT128__
+
+// Field elements and scalars are four 64-bit limbs, least significant first,
+// and are always kept fully reduced. Their arithmetic has no branches or
+// memory accesses that depend on the values. Points are multiplied in
+// variable time, which is fine as verification only ever sees public data.
+//
+// u1*G + u2*Q is computed at once, with both scalars split in two halves of
+// 128 bits by the endomorphism lambda*(x, y) = (beta*x, y): the four halves
+// are walked in wNAF form, Q's odd multiples computed per signature and G's
+// taken from a table of affine odd multiples built at startup.
+
+namespace {
+
+__extension__ typedef unsigned __int128 uint128;
+
+struct CFieldElement
+{
+    uint64_t d[4];
+};
+
+struct CScalar
+{
+    uint64_t d[4];
+};
+
+struct CAffinePoint
+{
+    CFieldElement x, y;
+};
+
+struct CJacobianPoint
+{
+    CFieldElement x, y, z;
+    bool fInfinity;
+};
+
+}
+
+// 2^256 - p
+static const uint64_t FIELD_C = 0x1000003D1ULL;
+static const CFieldElement FIELD_P = {{ 0xFFFFFFFEFFFFFC2FULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL }};
+static const CFieldElement FIELD_ONE = {{ 1, 0, 0, 0 }};
+static const CFieldElement FIELD_SEVEN = {{ 7, 0, 0, 0 }};
+static const CFieldElement FIELD_BETA = {{ 0xC1396C28719501EEULL, 0x9CF0497512F58995ULL, 0x6E64479EAC3434E9ULL, 0x7AE96A2B657C0710ULL }};
+
+static const CScalar SCALAR_N = {{ 0xBFD25E8CD0364141ULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL }};
+static const CScalar SCALAR_HALF_N = {{ 0xDFE92F46681B20A0ULL, 0x5D576E7357A4501DULL, 0xFFFFFFFFFFFFFFFFULL, 0x7FFFFFFFFFFFFFFFULL }};
+// 2^256 - n
+static const uint64_t SCALAR_NC[3] = { 0x402DA1732FC9BEBFULL, 0x4551231950B75FC4ULL, 1 };
+static const CScalar SCALAR_N_MINUS_2 = {{ 0xBFD25E8CD036413FULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL }};
+
+// Endomorphism: lambda^3 = 1 mod n, beta^3 = 1 mod p. A scalar k is split as
+// k2 = round(k*b2/n)*(-b1) + round(k*(-b1)/n)*(-b2), k1 = k - k2*lambda, with
+// (a1, b1), (a2, b2) a short basis of the lattice of (x, y), x + y*lambda = 0,
+// and g1 = round(2^384*b2/n), g2 = round(2^384*(-b1)/n).
+static const CScalar SCALAR_LAMBDA = {{ 0xDF02967C1B23BD72ULL, 0x122E22EA20816678ULL, 0xA5261C028812645AULL, 0x5363AD4CC05C30E0ULL }};
+static const CScalar SCALAR_G1 = {{ 0xE893209A45DBB031ULL, 0x3DAA8A1471E8CA7FULL, 0xE86C90E49284EB15ULL, 0x3086D221A7D46BCDULL }};
+static const CScalar SCALAR_G2 = {{ 0x1571B4AE8AC47F71ULL, 0x221208AC9DF506C6ULL, 0x6F547FA90ABFE4C4ULL, 0xE4437ED6010E8828ULL }};
+static const CScalar SCALAR_MINUS_B1 = {{ 0x6F547FA90ABFE4C3ULL, 0xE4437ED6010E8828ULL, 0, 0 }};
+static const CScalar SCALAR_MINUS_B2 = {{ 0xD765CDA83DB1562CULL, 0x8A280AC50774346DULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL }};
+
+static const CAffinePoint GENERATOR = {
+    {{ 0x59F2815B16F81798ULL, 0x029BFCDB2DCE28D9ULL, 0x55A06295CE870B07ULL, 0x79BE667EF9DCBBACULL }},
+    {{ 0x9C47D08FFB10D4B8ULL, 0xFD17B448A6855419ULL, 0x5DA4FBFC0E1108A8ULL, 0x483ADA7726A3C465ULL }}
+};
+
+// Odd multiples of G in the table, and of Q computed per signature
+static const int WINDOW_G = 14;
+static const int WINDOW_A = 5;
+static const int TABLE_SIZE_G = 1 << (WINDOW_G - 2);
+static const int TABLE_SIZE_A = 1 << (WINDOW_A - 2);
+
+// Length of the wNAF of the halves of a split scalar, which are below 2^128
+static const int WNAF_BITS = 130;
+
+static void Mul256(uint64_t t[8], const uint64_t a[4], const uint64_t b[4])
+{
+    for (int i = 0; i < 8; i++)
+        t[i] = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint128 c = 0;
+        for (int j = 0; j < 4; j++)
+        {
+            c += (uint128)a[i] * b[j] + t[i + j];
+            t[i + j] = (uint64_t)c;
+            c >>= 64;
+        }
+        t[i + 4] = (uint64_t)c;
+    }
+}
+
+static void Select256(uint64_t r[4], const uint64_t a[4], const uint64_t b[4], uint64_t nMask)
+{
+    for (int i = 0; i < 4; i++)
+        r[i] = (a[i] & nMask) | (b[i] & ~nMask);
+}
+
+static void ReadBigEndian256(uint64_t r[4], const unsigned char* p)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t v = 0;
+        for (int j = 0; j < 8; j++)
+            v = (v << 8) | p[(3 - i) * 8 + j];
+        r[i] = v;
+    }
+}
+
+static bool LessThan256(const uint64_t a[4], const uint64_t b[4])
+{
+    for (int i = 3; i >= 0; i--)
+        if (a[i] != b[i])
+            return a[i] < b[i];
+    return false;
+}
+
+//
+// Field arithmetic modulo p = 2^256 - 2^32 - 977
+//
+
+// r = a mod p for a < 2^256
+static void FieldNormalize(CFieldElement& r, const uint64_t a[4])
+{
+    // a + 2^256 - p carries out exactly when a >= p, and is then a - p
+    uint64_t t[4];
+    uint128 c = (uint128)a[0] + FIELD_C;
+    t[0] = (uint64_t)c;
+    c >>= 64;
+    for (int i = 1; i < 4; i++)
+    {
+        c += a[i];
+        t[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    Select256(r.d, t, a, -(uint64_t)c);
+}
+
+// Add nCarry * 2^256, which is nCarry * (2^256 - p) mod p, to t
+static void FieldFoldCarry(uint64_t t[4], uint64_t nCarry)
+{
+    uint128 c = (uint128)t[0] + (uint128)nCarry * FIELD_C;
+    t[0] = (uint64_t)c;
+    c >>= 64;
+    for (int i = 1; i < 4; i++)
+    {
+        c += t[i];
+        t[i] = (uint64_t)c;
+        c >>= 64;
+    }
+}
+
+static void FieldAdd(CFieldElement& r, const CFieldElement& a, const CFieldElement& b)
+{
+    uint64_t t[4];
+    uint128 c = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        c += (uint128)a.d[i] + b.d[i];
+        t[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    // a + b < 2p, so this does not carry again
+    FieldFoldCarry(t, (uint64_t)c);
+    FieldNormalize(r, t);
+}
+
+static void FieldSub(CFieldElement& r, const CFieldElement& a, const CFieldElement& b)
+{
+    uint64_t t[4];
+    uint64_t nBorrow = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint128 d = (uint128)a.d[i] - b.d[i] - nBorrow;
+        t[i] = (uint64_t)d;
+        nBorrow = (uint64_t)(d >> 127);
+    }
+    // On a borrow t is a - b + 2^256, and a - b + p = t - (2^256 - p) does
+    // not borrow again
+    uint128 d = (uint128)t[0] - nBorrow * FIELD_C;
+    r.d[0] = (uint64_t)d;
+    nBorrow = (uint64_t)(d >> 127);
+    for (int i = 1; i < 4; i++)
+    {
+        d = (uint128)t[i] - nBorrow;
+        r.d[i] = (uint64_t)d;
+        nBorrow = (uint64_t)(d >> 127);
+    }
+}
+
+static void FieldNegate(CFieldElement& r, const CFieldElement& a)
+{
+    static const CFieldElement zero = {{ 0, 0, 0, 0 }};
+    FieldSub(r, zero, a);
+}
+
+static void FieldMul(CFieldElement& r, const CFieldElement& a, const CFieldElement& b)
+{
+    uint64_t t[8];
+    Mul256(t, a.d, b.d);
+
+    // t = lo + hi * 2^256 = lo + hi * (2^256 - p) mod p
+    uint64_t m[4];
+    uint128 c = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        c += (uint128)t[4 + i] * FIELD_C + t[i];
+        m[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    // The rest is below 2^34, folding it carries at most once more and
+    // leaves a small number
+    uint64_t nHigh = (uint64_t)c;
+    c = (uint128)m[0] + (uint128)nHigh * FIELD_C;
+    m[0] = (uint64_t)c;
+    c >>= 64;
+    for (int i = 1; i < 4; i++)
+    {
+        c += m[i];
+        m[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    FieldFoldCarry(m, (uint64_t)c);
+    FieldNormalize(r, m);
+}
+
+static void FieldSqr(CFieldElement& r, const CFieldElement& a)
+{
+    FieldMul(r, a, a);
+}
+
+static void FieldSqrN(CFieldElement& r, const CFieldElement& a, int n)
+{
+    r = a;
+    for (int i = 0; i < n; i++)
+        FieldSqr(r, r);
+}
+
+static bool FieldIsZero(const CFieldElement& a)
+{
+    return (a.d[0] | a.d[1] | a.d[2] | a.d[3]) == 0;
+}
+
+static bool FieldEqual(const CFieldElement& a, const CFieldElement& b)
+{
+    return ((a.d[0] ^ b.d[0]) | (a.d[1] ^ b.d[1]) | (a.d[2] ^ b.d[2]) | (a.d[3] ^ b.d[3])) == 0;
+}
+
+static bool FieldIsOdd(const CFieldElement& a)
+{
+    return a.d[0] & 1;
+}
+
+// Returns false if the bytes are not below p
+static bool FieldSetB32(CFieldElement& r, const unsigned char* p)
+{
+    ReadBigEndian256(r.d, p);
+    return LessThan256(r.d, FIELD_P.d);
+}
+
+// a^(2^k - 1) for the k of the addition chains of the inverse and square root
+struct CFieldPowers
+{
+    CFieldElement x2, x3, x22, x223;
+
+    CFieldPowers(const CFieldElement& a)
+    {
+        CFieldElement x6, x9, x11, x44, x88, x176, x220, t;
+        FieldSqr(t, a);
+        FieldMul(x2, t, a);
+        FieldSqr(t, x2);
+        FieldMul(x3, t, a);
+        FieldSqrN(t, x3, 3);
+        FieldMul(x6, t, x3);
+        FieldSqrN(t, x6, 3);
+        FieldMul(x9, t, x3);
+        FieldSqrN(t, x9, 2);
+        FieldMul(x11, t, x2);
+        FieldSqrN(t, x11, 11);
+        FieldMul(x22, t, x11);
+        FieldSqrN(t, x22, 22);
+        FieldMul(x44, t, x22);
+        FieldSqrN(t, x44, 44);
+        FieldMul(x88, t, x44);
+        FieldSqrN(t, x88, 88);
+        FieldMul(x176, t, x88);
+        FieldSqrN(t, x176, 44);
+        FieldMul(x220, t, x44);
+        FieldSqrN(t, x220, 3);
+        FieldMul(x223, t, x3);
+    }
+};
+
+// r = a^(p - 2) = 1/a
+static void FieldInverse(CFieldElement& r, const CFieldElement& a)
+{
+    CFieldPowers pow(a);
+    CFieldElement t;
+    FieldSqrN(t, pow.x223, 23);
+    FieldMul(t, t, pow.x22);
+    FieldSqrN(t, t, 5);
+    FieldMul(t, t, a);
+    FieldSqrN(t, t, 3);
+    FieldMul(t, t, pow.x2);
+    FieldSqrN(t, t, 2);
+    FieldMul(r, t, a);
+}
+
+// r = a^((p + 1) / 4), returns whether it is a square root of a
+static bool FieldSqrt(CFieldElement& r, const CFieldElement& a)
+{
+    CFieldPowers pow(a);
+    CFieldElement t;
+    FieldSqrN(t, pow.x223, 23);
+    FieldMul(t, t, pow.x22);
+    FieldSqrN(t, t, 6);
+    FieldMul(t, t, pow.x2);
+    FieldSqrN(r, t, 2);
+    FieldSqr(t, r);
+    return FieldEqual(t, a);
+}
+
+//
+// Scalar arithmetic modulo the group order n
+//
+
+// r = a mod n for a < 2^256
+static void ScalarNormalize(CScalar& r, const uint64_t a[4])
+{
+    uint64_t t[4];
+    uint64_t nBorrow = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint128 d = (uint128)a[i] - SCALAR_N.d[i] - nBorrow;
+        t[i] = (uint64_t)d;
+        nBorrow = (uint64_t)(d >> 127);
+    }
+    Select256(r.d, a, t, -nBorrow);
+}
+
+// a = lo + hi * 2^256 = lo + hi * (2^256 - n) mod n, for the nHigh limbs of
+// hi above the low four
+static void ScalarFold(uint64_t a[8], int nHigh)
+{
+    uint64_t b[8] = { a[0], a[1], a[2], a[3], 0, 0, 0, 0 };
+    for (int i = 0; i < nHigh; i++)
+    {
+        uint128 c = 0;
+        for (int j = 0; j < 3; j++)
+        {
+            c += (uint128)a[4 + i] * SCALAR_NC[j] + b[i + j];
+            b[i + j] = (uint64_t)c;
+            c >>= 64;
+        }
+        for (int k = i + 3; k < 8; k++)
+        {
+            c += b[k];
+            b[k] = (uint64_t)c;
+            c >>= 64;
+        }
+    }
+    memcpy(a, b, sizeof(b));
+}
+
+// r = t mod n for a 512-bit t
+static void ScalarReduce(CScalar& r, const uint64_t t[8])
+{
+    // 2^256 - n is below 2^129, so t shrinks to below 2^386, 2^260, and then
+    // 2^256 plus at most a carry that the last fold takes away
+    uint64_t a[8];
+    memcpy(a, t, sizeof(a));
+    ScalarFold(a, 4);
+    ScalarFold(a, 3);
+    ScalarFold(a, 1);
+    ScalarFold(a, 1);
+    ScalarNormalize(r, a);
+}
+
+static void ScalarAdd(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    uint64_t t[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    uint128 c = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        c += (uint128)a.d[i] + b.d[i];
+        t[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    t[4] = (uint64_t)c;
+    ScalarReduce(r, t);
+}
+
+static void ScalarMul(CScalar& r, const CScalar& a, const CScalar& b)
+{
+    uint64_t t[8];
+    Mul256(t, a.d, b.d);
+    ScalarReduce(r, t);
+}
+
+static bool ScalarIsZero(const CScalar& a)
+{
+    return (a.d[0] | a.d[1] | a.d[2] | a.d[3]) == 0;
+}
+
+static void ScalarNegate(CScalar& r, const CScalar& a)
+{
+    uint64_t t[4];
+    uint64_t nBorrow = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint128 d = (uint128)SCALAR_N.d[i] - a.d[i] - nBorrow;
+        t[i] = (uint64_t)d;
+        nBorrow = (uint64_t)(d >> 127);
+    }
+    // -0 is 0, not n
+    uint64_t nMask = -(uint64_t)!ScalarIsZero(a);
+    for (int i = 0; i < 4; i++)
+        r.d[i] = t[i] & nMask;
+}
+
+// Whether a is above n/2, so that -a is shorter
+static bool ScalarIsHigh(const CScalar& a)
+{
+    return LessThan256(SCALAR_HALF_N.d, a.d);
+}
+
+// r = a^(n - 2) = 1/a, four bits of the exponent at a time
+static void ScalarInverse(CScalar& r, const CScalar& a)
+{
+    CScalar vPowers[16];
+    vPowers[0].d[0] = 1;
+    vPowers[0].d[1] = vPowers[0].d[2] = vPowers[0].d[3] = 0;
+    for (int i = 1; i < 16; i++)
+        ScalarMul(vPowers[i], vPowers[i - 1], a);
+    CScalar t = vPowers[0];
+    for (int i = 63; i >= 0; i--)
+    {
+        for (int j = 0; j < 4; j++)
+            ScalarMul(t, t, t);
+        int nDigit = (SCALAR_N_MINUS_2.d[i >> 4] >> ((i & 15) * 4)) & 15;
+        if (nDigit != 0)
+            ScalarMul(t, t, vPowers[nDigit]);
+    }
+    r = t;
+}
+
+// Returns false if the bytes are not below n, r is then reduced
+static bool ScalarSetB32(CScalar& r, const unsigned char* p)
+{
+    uint64_t t[4];
+    ReadBigEndian256(t, p);
+    ScalarNormalize(r, t);
+    return LessThan256(t, SCALAR_N.d);
+}
+
+// r = round(a * g / 2^384)
+static void ScalarMulShift384(CScalar& r, const CScalar& a, const CScalar& g)
+{
+    uint64_t t[8];
+    Mul256(t, a.d, g.d);
+    uint128 c = (uint128)t[6] + (t[5] >> 63);
+    r.d[0] = (uint64_t)c;
+    c >>= 64;
+    c += t[7];
+    r.d[1] = (uint64_t)c;
+    c >>= 64;
+    r.d[2] = (uint64_t)c;
+    r.d[3] = 0;
+}
+
+// k = k1 + k2 * lambda mod n, with k1 and k2 or their negations below 2^128
+static void ScalarSplitLambda(CScalar& k1, CScalar& k2, const CScalar& k)
+{
+    CScalar c1, c2, t;
+    ScalarMulShift384(c1, k, SCALAR_G1);
+    ScalarMulShift384(c2, k, SCALAR_G2);
+    ScalarMul(c1, c1, SCALAR_MINUS_B1);
+    ScalarMul(c2, c2, SCALAR_MINUS_B2);
+    ScalarAdd(k2, c1, c2);
+    ScalarMul(t, k2, SCALAR_LAMBDA);
+    ScalarNegate(t, t);
+    ScalarAdd(k1, t, k);
+}
+
+static unsigned int ScalarGetBits(const CScalar& a, unsigned int nOffset, unsigned int nCount)
+{
+    unsigned int nLimb = nOffset >> 6, nShift = nOffset & 63;
+    uint64_t v = a.d[nLimb] >> nShift;
+    if (nShift + nCount > 64 && nLimb < 3)
+        v |= a.d[nLimb + 1] << (64 - nShift);
+    return (unsigned int)(v & ((1ULL << nCount) - 1));
+}
+
+// Width w NAF of a: digits that are 0 or odd and below 2^(w-1) in absolute
+// value, with at least w - 1 zeros between two non zero ones. Returns the
+// number of digits up to the last non zero one.
+static int ScalarWNAF(int* pnaf, int nLen, const CScalar& a, int w)
+{
+    memset(pnaf, 0, nLen * sizeof(pnaf[0]));
+    int nBit = 0, nLast = -1;
+    unsigned int nCarry = 0;
+    while (nBit < nLen)
+    {
+        if (ScalarGetBits(a, nBit, 1) == nCarry)
+        {
+            nBit++;
+            continue;
+        }
+        int nNow = w;
+        if (nNow > nLen - nBit)
+            nNow = nLen - nBit;
+        int nWord = ScalarGetBits(a, nBit, nNow) + nCarry;
+        nCarry = (nWord >> (w - 1)) & 1;
+        nWord -= nCarry << w;
+        pnaf[nBit] = nWord;
+        nLast = nBit;
+        nBit += nNow;
+    }
+    return nLast + 1;
+}
+
+//
+// Group operations on y^2 = x^3 + 7
+//
+
+static void PointDouble(CJacobianPoint& r, const CJacobianPoint& a)
+{
+    if (a.fInfinity)
+    {
+        r.fInfinity = true;
+        return;
+    }
+    CFieldElement A, B, C, D, E, F, t, x3, y3, z3;
+    FieldSqr(A, a.x);
+    FieldSqr(B, a.y);
+    FieldSqr(C, B);
+    // D = 2 * ((x + B)^2 - A - C)
+    FieldAdd(t, a.x, B);
+    FieldSqr(t, t);
+    FieldSub(t, t, A);
+    FieldSub(t, t, C);
+    FieldAdd(D, t, t);
+    // E = 3 * A, F = E^2
+    FieldAdd(E, A, A);
+    FieldAdd(E, E, A);
+    FieldSqr(F, E);
+    // x3 = F - 2 * D
+    FieldSub(x3, F, D);
+    FieldSub(x3, x3, D);
+    // y3 = E * (D - x3) - 8 * C
+    FieldSub(t, D, x3);
+    FieldMul(y3, E, t);
+    FieldAdd(C, C, C);
+    FieldAdd(C, C, C);
+    FieldAdd(C, C, C);
+    FieldSub(y3, y3, C);
+    // z3 = 2 * y * z
+    FieldMul(z3, a.y, a.z);
+    FieldAdd(z3, z3, z3);
+    r.x = x3;
+    r.y = y3;
+    r.z = z3;
+    r.fInfinity = false;
+}
+
+// r = a + b, with u2 = b.x * a.z^2 and s2 = b.y * a.z^3 given
+static void PointAddScaled(CJacobianPoint& r, const CJacobianPoint& a, const CFieldElement& u1, const CFieldElement& s1,
+                           const CFieldElement& u2, const CFieldElement& s2, const CFieldElement& z)
+{
+    CFieldElement H, R, HH, HHH, V, t, x3, y3;
+    FieldSub(H, u2, u1);
+    FieldSub(R, s2, s1);
+    if (FieldIsZero(H))
+    {
+        if (FieldIsZero(R))
+            PointDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    FieldSqr(HH, H);
+    FieldMul(HHH, H, HH);
+    FieldMul(V, u1, HH);
+    // x3 = R^2 - HHH - 2 * V
+    FieldSqr(x3, R);
+    FieldSub(x3, x3, HHH);
+    FieldSub(x3, x3, V);
+    FieldSub(x3, x3, V);
+    // y3 = R * (V - x3) - s1 * HHH
+    FieldSub(t, V, x3);
+    FieldMul(y3, R, t);
+    FieldMul(t, s1, HHH);
+    FieldSub(y3, y3, t);
+    // z3 = z * H
+    FieldMul(r.z, z, H);
+    r.x = x3;
+    r.y = y3;
+    r.fInfinity = false;
+}
+
+static void PointAddAffine(CJacobianPoint& r, const CJacobianPoint& a, const CAffinePoint& b)
+{
+    if (a.fInfinity)
+    {
+        r.x = b.x;
+        r.y = b.y;
+        r.z = FIELD_ONE;
+        r.fInfinity = false;
+        return;
+    }
+    CFieldElement zz, zzz, u2, s2;
+    FieldSqr(zz, a.z);
+    FieldMul(zzz, zz, a.z);
+    FieldMul(u2, b.x, zz);
+    FieldMul(s2, b.y, zzz);
+    CFieldElement u1 = a.x, s1 = a.y, z = a.z;
+    PointAddScaled(r, a, u1, s1, u2, s2, z);
+}
+
+static void PointAdd(CJacobianPoint& r, const CJacobianPoint& a, const CJacobianPoint& b)
+{
+    if (a.fInfinity)
+    {
+        r = b;
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    CFieldElement z1z1, z2z2, u1, u2, s1, s2, z;
+    FieldSqr(z1z1, a.z);
+    FieldSqr(z2z2, b.z);
+    FieldMul(u1, a.x, z2z2);
+    FieldMul(u2, b.x, z1z1);
+    FieldMul(s1, a.y, b.z);
+    FieldMul(s1, s1, z2z2);
+    FieldMul(s2, b.y, a.z);
+    FieldMul(s2, s2, z1z1);
+    FieldMul(z, a.z, b.z);
+    PointAddScaled(r, a, u1, s1, u2, s2, z);
+}
+
+// Affine points of the Jacobian points a, which are not at infinity, with one
+// inversion
+static void PointsToAffine(CAffinePoint* r, const CJacobianPoint* a, int n)
+{
+    std::vector<CFieldElement> vProducts(n);
+    vProducts[0] = a[0].z;
+    for (int i = 1; i < n; i++)
+        FieldMul(vProducts[i], vProducts[i - 1], a[i].z);
+    CFieldElement inv, zinv, zinv2, t;
+    FieldInverse(inv, vProducts[n - 1]);
+    for (int i = n - 1; i >= 0; i--)
+    {
+        if (i > 0)
+        {
+            FieldMul(zinv, inv, vProducts[i - 1]);
+            FieldMul(inv, inv, a[i].z);
+        }
+        else
+            zinv = inv;
+        FieldSqr(zinv2, zinv);
+        FieldMul(r[i].x, a[i].x, zinv2);
+        FieldMul(t, zinv2, zinv);
+        FieldMul(r[i].y, a[i].y, t);
+    }
+}
+
+static bool PointIsOnCurve(const CAffinePoint& a)
+{
+    CFieldElement y2, x3;
+    FieldSqr(y2, a.y);
+    FieldSqr(x3, a.x);
+    FieldMul(x3, x3, a.x);
+    FieldAdd(x3, x3, FIELD_SEVEN);
+    return FieldEqual(y2, x3);
+}
+
+// G, 3G, 5G, ... (2 * TABLE_SIZE_G - 1)G
+static CAffinePoint vGeneratorTable[TABLE_SIZE_G];
+
+static void BuildGeneratorTable()
+{
+    std::vector<CJacobianPoint> vPoints(TABLE_SIZE_G);
+    CJacobianPoint g, g2;
+    g.x = GENERATOR.x;
+    g.y = GENERATOR.y;
+    g.z = FIELD_ONE;
+    g.fInfinity = false;
+    PointDouble(g2, g);
+    vPoints[0] = g;
+    for (int i = 1; i < TABLE_SIZE_G; i++)
+        PointAdd(vPoints[i], vPoints[i - 1], g2);
+    PointsToAffine(vGeneratorTable, &vPoints[0], TABLE_SIZE_G);
+}
+
+static class CGeneratorTableInit
+{
+public:
+    CGeneratorTableInit()
+    {
+        BuildGeneratorTable();
+    }
+} generatorTableInit;
+
+// Affine point n * a for an odd wNAF digit n, from the table of odd multiples
+static void TableGetAffine(CAffinePoint& r, const CAffinePoint* pTable, int n, bool fNegate, bool fLambda)
+{
+    const CAffinePoint& p = pTable[((n < 0 ? -n : n) - 1) / 2];
+    if (fLambda)
+        FieldMul(r.x, p.x, FIELD_BETA);
+    else
+        r.x = p.x;
+    if ((n < 0) != fNegate)
+        FieldNegate(r.y, p.y);
+    else
+        r.y = p.y;
+}
+
+static void TableGetJacobian(CJacobianPoint& r, const CJacobianPoint* pTable, int n, bool fNegate)
+{
+    r = pTable[((n < 0 ? -n : n) - 1) / 2];
+    if ((n < 0) != fNegate)
+        FieldNegate(r.y, r.y);
+}
+
+// r = na * a + ng * G
+static void EcMult(CJacobianPoint& r, const CAffinePoint& a, const CScalar& na, const CScalar& ng)
+{
+    // The four halves of the split scalars, made short by negating them and
+    // their point if needed
+    CScalar vScalars[4];
+    ScalarSplitLambda(vScalars[0], vScalars[1], na);
+    ScalarSplitLambda(vScalars[2], vScalars[3], ng);
+    bool vfNegate[4];
+    int vnaf[4][WNAF_BITS];
+    int vnBits[4];
+    int nBits = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        vfNegate[i] = ScalarIsHigh(vScalars[i]);
+        if (vfNegate[i])
+            ScalarNegate(vScalars[i], vScalars[i]);
+        vnBits[i] = ScalarWNAF(vnaf[i], WNAF_BITS, vScalars[i], i < 2 ? WINDOW_A : WINDOW_G);
+        if (vnBits[i] > nBits)
+            nBits = vnBits[i];
+    }
+
+    // Odd multiples of a and of lambda * a
+    CJacobianPoint vTableA[TABLE_SIZE_A], vTableLambdaA[TABLE_SIZE_A], a2;
+    vTableA[0].x = a.x;
+    vTableA[0].y = a.y;
+    vTableA[0].z = FIELD_ONE;
+    vTableA[0].fInfinity = false;
+    PointDouble(a2, vTableA[0]);
+    for (int i = 1; i < TABLE_SIZE_A; i++)
+        PointAdd(vTableA[i], vTableA[i - 1], a2);
+    for (int i = 0; i < TABLE_SIZE_A; i++)
+    {
+        vTableLambdaA[i] = vTableA[i];
+        FieldMul(vTableLambdaA[i].x, vTableA[i].x, FIELD_BETA);
+    }
+
+    CJacobianPoint t;
+    CAffinePoint p;
+    r.fInfinity = true;
+    for (int i = nBits - 1; i >= 0; i--)
+    {
+        PointDouble(r, r);
+        int n;
+        if (i < vnBits[0] && (n = vnaf[0][i]) != 0)
+        {
+            TableGetJacobian(t, vTableA, n, vfNegate[0]);
+            PointAdd(r, r, t);
+        }
+        if (i < vnBits[1] && (n = vnaf[1][i]) != 0)
+        {
+            TableGetJacobian(t, vTableLambdaA, n, vfNegate[1]);
+            PointAdd(r, r, t);
+        }
+        if (i < vnBits[2] && (n = vnaf[2][i]) != 0)
+        {
+            TableGetAffine(p, vGeneratorTable, n, vfNegate[2], false);
+            PointAddAffine(r, r, p);
+        }
+        if (i < vnBits[3] && (n = vnaf[3][i]) != 0)
+        {
+            TableGetAffine(p, vGeneratorTable, n, vfNegate[3], true);
+            PointAddAffine(r, r, p);
+        }
+    }
+}
+
+// Compressed or uncompressed public key on the curve
+static bool ParsePubKey(CAffinePoint& r, const unsigned char* p, size_t nSize)
+{
+    if (nSize == 33 && (p[0] == 0x02 || p[0] == 0x03))
+    {
+        if (!FieldSetB32(r.x, p + 1))
+            return false;
+        CFieldElement y2;
+        FieldSqr(y2, r.x);
+        FieldMul(y2, y2, r.x);
+        FieldAdd(y2, y2, FIELD_SEVEN);
+        if (!FieldSqrt(r.y, y2))
+            return false;
+        if (FieldIsOdd(r.y) != (p[0] == 0x03))
+            FieldNegate(r.y, r.y);
+        return true;
+    }
+    if (nSize == 65 && p[0] == 0x04)
+        return FieldSetB32(r.x, p + 1) && FieldSetB32(r.y, p + 33) && PointIsOnCurve(r);
+    return false;
+}
+
+// Minimally encoded, non negative DER integer of at most 32 bytes of value
+static bool ParseDERInteger(CScalar& r, bool& fOverflow, const unsigned char* p, size_t nSize)
+{
+    if (nSize == 0 || nSize > 33 || (p[0] & 0x80))
+        return false;
+    if (nSize > 1 && p[0] == 0 && !(p[1] & 0x80))
+        return false;
+    if (nSize == 33)
+    {
+        // Only the 0x00 before a set top bit; any other value is 2^256 or
+        // more, which OpenSSL rejects as out of range
+        if (p[0] != 0)
+        {
+            fOverflow = true;
+            return true;
+        }
+        p++;
+        nSize--;
+    }
+    unsigned char vch[32];
+    memset(vch, 0, sizeof(vch));
+    memcpy(vch + 32 - nSize, p, nSize);
+    fOverflow = !ScalarSetB32(r, vch);
+    return true;
+}
+
+// Strict DER signature: 0x30 [total-length] 0x02 [R-length] [R] 0x02 [S-length] [S].
+// Returns -1 on any other encoding, 0 if r or s is out of range.
+static int ParseSignature(CScalar& r, CScalar& s, const unsigned char* p, size_t nSize)
+{
+    if (nSize < 8 || nSize > 72)
+        return -1;
+    if (p[0] != 0x30 || p[1] != nSize - 2 || p[2] != 0x02)
+        return -1;
+    size_t nLenR = p[3];
+    if (nLenR + 6 > nSize || p[4 + nLenR] != 0x02)
+        return -1;
+    size_t nLenS = p[5 + nLenR];
+    if (nLenR + nLenS + 6 != nSize)
+        return -1;
+    bool fOverflowR, fOverflowS;
+    if (!ParseDERInteger(r, fOverflowR, p + 4, nLenR) || !ParseDERInteger(s, fOverflowS, p + 6 + nLenR, nLenS))
+        return -1;
+    if (fOverflowR || fOverflowS || ScalarIsZero(r) || ScalarIsZero(s))
+        return 0;
+    return 1;
+}
+
+int Secp256k1Verify(const unsigned char* pchHash, const unsigned char* pchSig, size_t nSigSize,
+                    const unsigned char* pchPubKey, size_t nPubKeySize)
+{
+    CAffinePoint q;
+    if (!ParsePubKey(q, pchPubKey, nPubKeySize))
+        return -1;
+    CScalar r, s;
+    int nRet = ParseSignature(r, s, pchSig, nSigSize);
+    if (nRet != 1)
+        return nRet;
+
+    // The hash is a 256-bit number, the order of the curve being as long
+    CScalar z, w, u1, u2;
+    ScalarSetB32(z, pchHash);
+    ScalarInverse(w, s);
+    ScalarMul(u1, z, w);
+    ScalarMul(u2, r, w);
+
+    CJacobianPoint R;
+    EcMult(R, q, u2, u1);
+    if (R.fInfinity)
+        return 0;
+
+    // Valid if x(R) mod n = r, where x(R) = R.x / R.z^2 is below p. So it is
+    // r or, if r + n < p, r + n.
+    CFieldElement xr, zz, t;
+    FieldSqr(zz, R.z);
+    memcpy(xr.d, r.d, sizeof(xr.d));
+    FieldMul(t, xr, zz);
+    if (FieldEqual(t, R.x))
+        return 1;
+    uint64_t vrn[4];
+    uint128 c = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        c += (uint128)r.d[i] + SCALAR_N.d[i];
+        vrn[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    if (c == 0 && LessThan256(vrn, FIELD_P.d))
+    {
+        memcpy(xr.d, vrn, sizeof(xr.d));
+        FieldMul(t, xr, zz);
+        if (FieldEqual(t, R.x))
+            return 1;
+    }
+    return 0;
+}
+
+bool Secp256k1Available()
+{
+    return true;
+}
+
+#else
+
+int Secp256k1Verify(const unsigned char* pchHash, const unsigned char* pchSig, size_t nSigSize,
+                    const unsigned char* pchPubKey, size_t nPubKeySize)
+{
+    return -1;
+}
+
+bool Secp256k1Available()
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,25 @@
+// Copyright (c) 2014 The HoboNickels developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SECP256K1_H
+#define BITCOIN_SECP256K1_H
+
+#include <stddef.h>
+
+/** Verify an ECDSA signature over secp256k1 without OpenSSL.
+ *
+ * pchHash is the 32 byte hash as ECDSA_verify is given it, pchSig the DER
+ * encoded signature and pchPubKey a compressed or uncompressed public key.
+ * Returns 1 if the signature is valid, 0 if it is not, and -1 if the
+ * encodings are not ones handled here: signatures that are not strict DER,
+ * hybrid or malformed public keys, and every input on platforms without
+ * 128-bit integers. The caller leaves those to OpenSSL, which decides on
+ * them as it always did.
+ */
+int Secp256k1Verify(const unsigned char* pchHash, const unsigned char* pchSig, size_t nSigSize,
+                    const unsigned char* pchPubKey, size_t nPubKeySize);
+
+/** Whether Secp256k1Verify handles any input on this platform */
+bool Secp256k1Available();
+
+#endif
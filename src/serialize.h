@@ -1132,4 +1132,53 @@ public:
     }
 };
 
+/** Read-only stream over a range of bytes owned by someone else, such as a
+ *  memory mapped file. Unserializes straight from the range without copying it.
+ */
+class CBufferReader
+{
+private:
+    const char* pbegin;
+    const char* pread;
+    const char* pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    CBufferReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn)
+    {
+        pbegin = pread = pbeginIn;
+        pend = pendIn;
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+    }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    size_t GetReadPos() const    { return pread - pbegin; }
+    size_t size() const          { return pend - pread; }
+    bool empty() const           { return pread == pend; }
+
+    CBufferReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pread))
+            throw std::ios_base::failure("CBufferReader::read : end of data");
+        memcpy(pch, pread, nSize);
+        pread += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
@@ -0,0 +1,88 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockindexmap_tests)
+
+BOOST_AUTO_TEST_CASE(blockindexmap_matches_map)
+{
+    CBlockIndexMap mapTest;
+    map<uint256, CBlockIndex*> mapReference;
+    vector<CBlockIndex> vIndex(5000);
+    vector<const uint256*> vKeys;
+
+    BOOST_CHECK(mapTest.empty() && mapTest.find(1) == mapTest.end() && mapTest.begin() == mapTest.end());
+
+    // Grow through several rehashes, keys must keep their address
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        uint256 hash = GetRandHash();
+        pair<CBlockIndexMap::iterator, bool> ret = mapTest.insert(make_pair(hash, &vIndex[i]));
+        BOOST_CHECK(ret.second && ret.first->first == hash);
+        mapReference[hash] = &vIndex[i];
+        vKeys.push_back(&ret.first->first);
+    }
+    BOOST_CHECK(!mapTest.insert(make_pair(*vKeys[0], (CBlockIndex*)NULL)).second);
+    BOOST_CHECK(mapTest.size() == mapReference.size());
+    BOOST_CHECK(mapTest.load_factor() <= 0.75);
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+        BOOST_CHECK(mapTest.find(*vKeys[i])->second == &vIndex[i] && mapTest[*vKeys[i]] == &vIndex[i]);
+
+    // Missing keys are default inserted by operator[]
+    uint256 hashMissing = GetRandHash();
+    BOOST_CHECK(mapTest.count(hashMissing) == 0);
+    BOOST_CHECK(mapTest[hashMissing] == NULL);
+    BOOST_CHECK(mapTest.count(hashMissing) == 1);
+    BOOST_CHECK(mapTest.erase(hashMissing) == 1 && mapTest.erase(hashMissing) == 0);
+
+    // Erase every third entry, the probe runs behind them must stay reachable
+    for (map<uint256, CBlockIndex*>::iterator mi = mapReference.begin(); mi != mapReference.end(); )
+        if ((mi->second - &vIndex[0]) % 3 == 0)
+        {
+            BOOST_CHECK(mapTest.erase(mi->first) == 1);
+            mapReference.erase(mi++);
+        }
+        else
+            ++mi;
+
+    unsigned int nCount = 0;
+    const CBlockIndexMap& mapConst = mapTest;
+    for (CBlockIndexMap::const_iterator mi = mapConst.begin(); mi != mapConst.end(); ++mi, nCount++)
+        BOOST_CHECK(mapReference.count(mi->first) && mapReference[mi->first] == mi->second);
+    BOOST_CHECK(nCount == mapReference.size() && mapTest.size() == mapReference.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapReference)
+        BOOST_CHECK(mapTest.find(item.first) != mapTest.end() && mapTest.find(item.first)->second == item.second);
+
+    mapTest.clear();
+    BOOST_CHECK(mapTest.empty() && mapTest.begin() == mapTest.end() && mapTest.count(*vKeys[1]) == 0);
+    BOOST_CHECK(mapTest.GetAllocator().GetAllocated() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_slab)
+{
+    size_t nAllocated = CBlockIndex::GetAllocator().GetAllocated();
+    vector<CBlockIndex*> vpindex;
+    for (unsigned int i = 0; i < 10000; i++)
+    {
+        vpindex.push_back(new CBlockIndex());
+        vpindex.back()->nHeight = i;
+    }
+    BOOST_CHECK(CBlockIndex::GetAllocator().GetAllocated() == nAllocated + vpindex.size());
+    for (unsigned int i = 0; i < vpindex.size(); i++)
+        BOOST_CHECK(vpindex[i]->nHeight == (int)i && ((size_t)vpindex[i] & 7) == 0);
+
+    // Freed entries are handed out again
+    CBlockIndex* pindexFreed = vpindex.back();
+    delete pindexFreed;
+    vpindex.back() = new CBlockIndex();
+    BOOST_CHECK(vpindex.back() == pindexFreed);
+
+    BOOST_FOREACH(CBlockIndex* pindex, vpindex)
+        delete pindex;
+    BOOST_CHECK(CBlockIndex::GetAllocator().GetAllocated() == nAllocated);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,189 @@
+#include <boost/test/unit_test.hpp>
+
+#include <boost/filesystem.hpp>
+
+#include "blockstore.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockstore_tests)
+
+static CBlock RandomBlock(unsigned int nTx)
+{
+    CBlock block;
+    block.nTime = insecure_rand();
+    block.hashPrevBlock = GetRandHash();
+    block.vtx.resize(nTx);
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        block.vtx[i].nTime = insecure_rand();
+        block.vtx[i].vin.resize(1);
+        block.vtx[i].vin[0].prevout = COutPoint(GetRandHash(), i);
+        block.vtx[i].vout.resize(1 + i % 3);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+// Append the objects as CBlock::WriteToDisk does, returns their positions
+template<typename T>
+static unsigned int AppendToFile(const boost::filesystem::path& pathFile, const T& obj)
+{
+    FILE* file = fopen(pathFile.string().c_str(), "ab");
+    BOOST_REQUIRE(file != NULL);
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    fseek(fileout, 0, SEEK_END);
+    fileout << FLATDATA(pchMessageStart) << fileout.GetSerializeSize(obj);
+    unsigned int nPos = ftell(fileout);
+    fileout << obj;
+    return nPos;
+}
+
+BOOST_AUTO_TEST_CASE(blockstore_reads)
+{
+    boost::filesystem::path pathDir = boost::filesystem::temp_directory_path() / strprintf("test_blockstore_%08x", insecure_rand());
+    boost::filesystem::create_directories(pathDir);
+
+    CBlock block1 = RandomBlock(3), block2 = RandomBlock(5);
+    unsigned int nPos1 = AppendToFile(pathDir / "blk0001.dat", block1);
+    unsigned int nPosTx = AppendToFile(pathDir / "blk0001.dat", block1.vtx[2]);
+
+    CBlockFileReader reader(pathDir, 2);
+    CBlock blockRead;
+    BOOST_CHECK(reader.Read(1, nPos1, blockRead));
+    BOOST_CHECK(blockRead.GetHash() == block1.GetHash() && blockRead.vtx.size() == 3);
+    BOOST_CHECK(blockRead.BuildMerkleTree() == block1.hashMerkleRoot);
+    CTransaction txRead;
+    BOOST_CHECK(reader.Read(1, nPosTx, txRead) && txRead.GetHash() == block1.vtx[2].GetHash());
+
+    // Headers only
+    CBlock blockHeader;
+    BOOST_CHECK(reader.Read(1, nPos1, blockHeader, SER_DISK | SER_BLOCKHEADERONLY));
+    BOOST_CHECK(blockHeader.GetHash() == block1.GetHash() && blockHeader.vtx.empty());
+
+    CBlockFileReaderStats stats = reader.GetStats();
+    BOOST_CHECK(stats.nReads == 3 && stats.nMaps == 1 && stats.nMappedFiles == 1 && stats.nFileReads == 0);
+    BOOST_CHECK(stats.nBytesRead == ::GetSerializeSize(block1, SER_DISK, CLIENT_VERSION) + ::GetSerializeSize(block1.vtx[2], SER_DISK, CLIENT_VERSION) +
+                                    ::GetSerializeSize(block1, SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION));
+
+    // A block appended after the file was mapped is found by mapping it again
+    unsigned int nPos2 = AppendToFile(pathDir / "blk0001.dat", block2);
+    BOOST_CHECK(reader.Read(1, nPos2, blockRead) && blockRead.GetHash() == block2.GetHash());
+    BOOST_CHECK(reader.Read(1, nPos1, blockRead) && blockRead.GetHash() == block1.GetHash());
+    BOOST_CHECK(reader.GetStats().nMaps == 2);
+
+    // Truncated, missing and invalid positions fail without mapping again
+    unsigned int nSize = boost::filesystem::file_size(pathDir / "blk0001.dat");
+    BOOST_CHECK(!reader.Read(1, nSize - 2, blockRead));
+    BOOST_CHECK(!reader.Read(1, nSize + 100, blockRead));
+    BOOST_CHECK(!reader.Read(2, 8, blockRead));
+    BOOST_CHECK(!reader.Read(0, nPos1, blockRead) && !reader.Read((unsigned int)-1, nPos1, blockRead));
+    BOOST_CHECK(reader.GetStats().nMaps == 2);
+
+    // Only the most recently used files stay mapped
+    for (unsigned int nFile = 2; nFile <= 4; nFile++)
+    {
+        unsigned int nPos = AppendToFile(pathDir / strprintf("blk%04u.dat", nFile), block2);
+        BOOST_CHECK(reader.Read(nFile, nPos, blockRead) && blockRead.GetHash() == block2.GetHash());
+    }
+    stats = reader.GetStats();
+    BOOST_CHECK(stats.nMappedFiles == 2 && stats.nMappedBytes == 2 * boost::filesystem::file_size(pathDir / "blk0004.dat"));
+
+    // Reading through stdio gives the same results
+    CBlockFileReader readerFile(pathDir, 0);
+    BOOST_CHECK(readerFile.Read(1, nPos2, blockRead) && blockRead.GetHash() == block2.GetHash());
+    BOOST_CHECK(readerFile.Read(1, nPosTx, txRead) && txRead.GetHash() == block1.vtx[2].GetHash());
+    BOOST_CHECK(!readerFile.Read(1, nSize - 2, blockRead));
+    stats = readerFile.GetStats();
+    BOOST_CHECK(stats.nReads == 2 && stats.nFileReads == 2 && stats.nMaps == 0 && stats.nMappedFiles == 0);
+    BOOST_CHECK(stats.nBytesRead == ::GetSerializeSize(block2, SER_DISK, CLIENT_VERSION) + ::GetSerializeSize(block1.vtx[2], SER_DISK, CLIENT_VERSION));
+
+    reader.Clear();
+    BOOST_CHECK(reader.GetStats().nMappedFiles == 0);
+    boost::filesystem::remove_all(pathDir);
+}
+
+BOOST_AUTO_TEST_CASE(blockstore_scanner)
+{
+    boost::filesystem::path pathFile = boost::filesystem::temp_directory_path() / strprintf("test_scanner_%08x.dat", insecure_rand());
+
+    // Blocks framed as in the block files, between junk, partial message
+    // starts, records of impossible size and a truncated record at the end
+    vector<CBlock> vBlocks;
+    vector<uint64_t> vPos;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    for (int i = 0; i < 40; i++)
+    {
+        for (unsigned int j = insecure_rand() % 100; j > 0; j--)
+            ss << (unsigned char)(insecure_rand() % 4 ? insecure_rand() : pchMessageStart[0]);
+        switch (i % 5)
+        {
+        case 1:
+            ss << FLATDATA(pchMessageStart) << (unsigned int)0;
+            break;
+        case 2:
+            ss << FLATDATA(pchMessageStart) << (unsigned int)(MAX_BLOCK_SIZE + 1);
+            break;
+        case 3:
+            ss.write((const char*)pchMessageStart, 3);
+            break;
+        }
+        vBlocks.push_back(RandomBlock(1 + insecure_rand() % 100));
+        ss << FLATDATA(pchMessageStart) << (unsigned int)::GetSerializeSize(vBlocks.back(), SER_DISK, CLIENT_VERSION);
+        vPos.push_back(ss.size());
+        ss << vBlocks.back();
+    }
+    ss << FLATDATA(pchMessageStart) << (unsigned int)::GetSerializeSize(vBlocks[0], SER_DISK, CLIENT_VERSION) + 1;
+    ss << vBlocks[0];
+    {
+        FILE* file = fopen(pathFile.string().c_str(), "wb");
+        BOOST_REQUIRE(file != NULL);
+        BOOST_CHECK(fwrite(&ss[0], 1, ss.size(), file) == ss.size());
+        fclose(file);
+    }
+
+    // Windows smaller than most blocks as well as the whole file
+    const uint64_t vWindowSize[] = { 1, 4096, 65536, std::numeric_limits<uint64_t>::max() };
+    for (unsigned int i = 0; i < sizeof(vWindowSize) / sizeof(vWindowSize[0]); i++)
+    {
+        CBlockFileScanner scanner(vWindowSize[i]);
+        BOOST_REQUIRE(scanner.Open(pathFile));
+        BOOST_CHECK(scanner.GetFileSize() == ss.size());
+
+        const char* pblock;
+        unsigned int nSize;
+        uint64_t nPos;
+        boost::shared_ptr<void> pwindow;
+        vector<boost::shared_ptr<void> > vWindows;
+        vector<const char*> vpBlock;
+        unsigned int nFound = 0;
+        while (scanner.Next(pblock, nSize, nPos, pwindow))
+        {
+            BOOST_REQUIRE(nFound < vBlocks.size());
+            BOOST_CHECK(nPos == vPos[nFound] && nSize == ::GetSerializeSize(vBlocks[nFound], SER_DISK, CLIENT_VERSION));
+            vWindows.push_back(pwindow);
+            vpBlock.push_back(pblock);
+            nFound++;
+        }
+        BOOST_CHECK(nFound == vBlocks.size());
+
+        // Blocks stay readable while their window is held
+        for (unsigned int j = 0; j < vpBlock.size(); j++)
+        {
+            CBlock block;
+            CBufferReader reader(vpBlock[j], vpBlock[j] + ::GetSerializeSize(vBlocks[j], SER_DISK, CLIENT_VERSION), SER_DISK, CLIENT_VERSION);
+            reader >> block;
+            BOOST_CHECK(block.GetHash() == vBlocks[j].GetHash() && block.vtx.size() == vBlocks[j].vtx.size() && reader.empty());
+        }
+
+        // Resume from a block
+        scanner.Seek(vPos[30] - 8);
+        BOOST_CHECK(scanner.Next(pblock, nSize, nPos, pwindow) && nPos == vPos[30]);
+    }
+    BOOST_CHECK(!CBlockFileScanner().Open(pathFile.string() + ".missing"));
+    boost::filesystem::remove(pathFile);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,102 @@
+#include <boost/test/unit_test.hpp>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "../checkqueue.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+static boost::atomic<unsigned int> nChecksRun(0);
+
+// Counts its runs, fails when negative
+class CCountCheck
+{
+private:
+    int n;
+
+public:
+    CCountCheck() : n(0) {}
+    CCountCheck(int nIn) : n(nIn) {}
+
+    bool operator()() const
+    {
+        nChecksRun++;
+        return n >= 0;
+    }
+
+    void swap(CCountCheck& check)
+    {
+        std::swap(n, check.n);
+    }
+};
+
+static void RunRounds(CCheckQueue<CCountCheck>* pqueue, int nRounds, int nOffset, bool* pfOk)
+{
+    *pfOk = true;
+    for (int nRound = 0; nRound < nRounds; nRound++)
+    {
+        // Every seventh round has a failing check
+        bool fFail = (nRound + nOffset) % 7 == 3;
+        CCheckQueueControl<CCountCheck> control(pqueue);
+        for (int i = 0; i < nRound % 5 + 1; i++)
+        {
+            vector<CCountCheck> vChecks;
+            for (int j = 0; j < (nRound * 13 + i) % 200; j++)
+                vChecks.push_back(CCountCheck(j));
+            if (fFail && i == 0)
+                vChecks.push_back(CCountCheck(-1));
+            control.Add(vChecks);
+        }
+        if (control.Wait() == fFail)
+            *pfOk = false;
+        // Waiting again gives the same result and leaves the queue to the next master
+        if (control.Wait() == fFail)
+            *pfOk = false;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_results)
+{
+    const int vThreads[] = { 1, 2, 5 };
+    for (unsigned int i = 0; i < sizeof(vThreads) / sizeof(vThreads[0]); i++)
+    {
+        CCheckQueue<CCountCheck> queue(16);
+        boost::thread_group threads;
+        for (int j = 1; j < vThreads[i]; j++)
+            threads.create_thread(boost::bind(&CCheckQueue<CCountCheck>::Thread, &queue));
+
+        // Every check of a passing round runs
+        nChecksRun = 0;
+        {
+            CCheckQueueControl<CCountCheck> control(&queue);
+            for (int j = 0; j < 50; j++)
+            {
+                vector<CCountCheck> vChecks(j, CCountCheck(1));
+                control.Add(vChecks);
+            }
+            BOOST_CHECK(control.Wait());
+        }
+        BOOST_CHECK(nChecksRun == 50 * 49 / 2);
+
+        bool fOk;
+        RunRounds(&queue, 200, 0, &fOk);
+        BOOST_CHECK(fOk);
+
+        // Masters on several threads take turns
+        bool vfOk[3];
+        boost::thread_group masters;
+        for (int j = 0; j < 3; j++)
+            masters.create_thread(boost::bind(&RunRounds, &queue, 100, j, &vfOk[j]));
+        masters.join_all();
+        BOOST_CHECK(vfOk[0] && vfOk[1] && vfOk[2]);
+
+        queue.Quit();
+        threads.join_all();
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,306 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bignum.h"
+#include "kernel.h"
+#include "util.h"
+#include "wallet.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+// Reference kernel hash and target check, as done by CheckStakeKernelHash
+static bool ReferenceKernel(unsigned int nBits, uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset,
+                            unsigned int nTimeTxPrev, unsigned int nPrevout, int64_t nValueIn, unsigned int nTimeTx, uint256& hashProofOfStake)
+{
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)nTimeTxPrev, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
+
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier;
+    ss << nTimeBlockFrom << nTxPrevOffset << nTimeTxPrev << nPrevout << nTimeTx;
+    hashProofOfStake = Hash(ss.begin(), ss.end());
+
+    return !(CBigNum(hashProofOfStake) > bnCoinDayWeight * bnTargetPerCoinDay);
+}
+
+BOOST_AUTO_TEST_CASE(kernel_hash_matches_reference)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t nStakeModifier = ((uint64_t)insecure_rand() << 32) | insecure_rand();
+        unsigned int nTimeBlockFrom = insecure_rand();
+        unsigned int nTxPrevOffset = insecure_rand() % 1000000;
+        unsigned int nTimeTxPrev = nTimeBlockFrom - insecure_rand() % 3600;
+        unsigned int nPrevout = insecure_rand() % 20;
+
+        CStakeKernel kernel(0x1d00ffff, nStakeModifier, nTimeBlockFrom, nTxPrevOffset, nTimeTxPrev, nPrevout, COIN);
+        for (unsigned int nTimeTx = nTimeBlockFrom; nTimeTx < nTimeBlockFrom + 4; nTimeTx++)
+        {
+            CDataStream ss(SER_GETHASH, 0);
+            ss << nStakeModifier;
+            ss << nTimeBlockFrom << nTxPrevOffset << nTimeTxPrev << nPrevout << nTimeTx;
+            BOOST_CHECK(kernel.GetHash(nTimeTx) == Hash(ss.begin(), ss.end()));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(kernel_target_matches_reference)
+{
+    // Easy, realistic, zero, negative and overflowing compact targets
+    const unsigned int vBits[] = { 0x1f00ffff, 0x1e0fffff, 0x1d00ffff, 0x1c0a5d2b, 0x207fffff, 0x00000000,
+                                   0x03123456, 0x01003456, 0x1e8fffff, 0x22000001, 0x2100ffff, 0xff7fffff };
+    const int64_t vValue[] = { 0, 1, CENT, COIN, 1234 * COIN + 5678, MAX_MONEY, -COIN };
+    unsigned int nTimeTxPrev = VERSION1_5_SWITCH_TIME + 100000;
+    // Weight below zero, around the min age and up to the max age
+    const int64_t vAge[] = { 0, GetStakeMinAge() - 1, GetStakeMinAge(), GetStakeMinAge() + 1, GetStakeMinAge() + 86399,
+                             GetStakeMinAge() + 86400, GetStakeMinAge() + 10 * 86400 + 17, nStakeMaxAge + GetStakeMinAge() + 100 };
+
+    for (unsigned int i = 0; i < sizeof(vBits) / sizeof(vBits[0]); i++)
+        for (unsigned int j = 0; j < sizeof(vValue) / sizeof(vValue[0]); j++)
+        {
+            CStakeKernel kernel(vBits[i], 0x1234567890abcdefULL, nTimeTxPrev + 60, 81, nTimeTxPrev, 1, vValue[j]);
+            for (unsigned int k = 0; k < sizeof(vAge) / sizeof(vAge[0]); k++)
+            {
+                unsigned int nTimeTx = nTimeTxPrev + vAge[k];
+                uint256 hashReference;
+                bool fReference = ReferenceKernel(vBits[i], 0x1234567890abcdefULL, nTimeTxPrev + 60, 81, nTimeTxPrev, 1, vValue[j], nTimeTx, hashReference);
+
+                uint256 hashProofOfStake;
+                BOOST_CHECK(kernel.CheckHash(nTimeTx, hashProofOfStake) == fReference);
+                BOOST_CHECK(hashProofOfStake == hashReference);
+
+                // Hashes right at and around the target
+                CBigNum bnTarget;
+                bnTarget.SetCompact(vBits[i]);
+                bnTarget = bnTarget * (CBigNum(vValue[j]) * GetWeight((int64_t)nTimeTxPrev, (int64_t)nTimeTx) / COIN / (24 * 60 * 60));
+                if (bnTarget < 0 || CBigNum(bnTarget.getuint256()) != bnTarget)
+                    continue;
+                uint256 hashTarget = bnTarget.getuint256();
+                BOOST_CHECK(kernel.CheckTarget(hashTarget, nTimeTx));
+                BOOST_CHECK(kernel.CheckTarget(hashTarget + 1, nTimeTx) == (hashTarget + 1 == 0));
+                if (hashTarget != 0)
+                    BOOST_CHECK(kernel.CheckTarget(hashTarget - 1, nTimeTx));
+            }
+        }
+}
+
+BOOST_AUTO_TEST_CASE(kernel_plan_matches_scan)
+{
+    const unsigned int nBits = 0x1e0fffff;
+    unsigned int nBlockTime = VERSION1_5_SWITCH_TIME + 100000;
+
+    vector<CWalletTx> vtx(8);
+    CStakeCandidates candidates;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        vtx[i].nTime = nBlockTime - i;
+        vtx[i].vout.resize(2);
+        vtx[i].vout[1].nValue = (i + 1) * 1000 * COIN;
+    }
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        candidates.push_back(&vtx[i], 1, nBlockTime, 81 + i, ((uint64_t)insecure_rand() << 32) | insecure_rand());
+
+    // Interval starting before the coins reach the min age
+    unsigned int nTimeFrom = nBlockTime + GetStakeMinAge() - 100;
+    unsigned int nTimeTo = nTimeFrom + 3000;
+    multimap<unsigned int, unsigned int> mapHits;
+    PlanStakeKernelHits(candidates, nBits, nTimeFrom, nTimeTo, mapHits);
+
+    unsigned int nHits = 0;
+    for (unsigned int nPos = 0; nPos < candidates.size(); nPos++)
+    {
+        CStakeKernel kernel(nBits, candidates.vnStakeModifier[nPos], nBlockTime, candidates.vnTxOffset[nPos],
+                            candidates.vnTxTime[nPos], 1, candidates.vnValue[nPos]);
+        for (unsigned int nTimeTx = nTimeFrom; nTimeTx <= nTimeTo; nTimeTx++)
+        {
+            uint256 hashProofOfStake;
+            bool fHit = nTimeTx >= nBlockTime + GetStakeMinAge() && kernel.CheckHash(nTimeTx, hashProofOfStake);
+
+            bool fPlanned = false;
+            for (multimap<unsigned int, unsigned int>::iterator it = mapHits.lower_bound(nTimeTx); it != mapHits.upper_bound(nTimeTx); ++it)
+                fPlanned |= it->second == nPos;
+            BOOST_CHECK(fHit == fPlanned);
+            nHits += fHit;
+        }
+    }
+    BOOST_CHECK(nHits == mapHits.size());
+}
+
+// Reference stake modifier selection, as done before the selection hashes were kept per candidate
+static int64_t ReferenceSelectionIntervalSection(int nSection)
+{
+    return (GetModiferInterval() * 63 / (63 + ((63 - nSection) * (MODIFIER_INTERVAL_RATIO - 1))));
+}
+
+static int64_t ReferenceSelectionInterval()
+{
+    int64_t nSelectionInterval = 0;
+    for (int nSection = 0; nSection < 64; nSection++)
+        nSelectionInterval += ReferenceSelectionIntervalSection(nSection);
+    return nSelectionInterval;
+}
+
+static bool ReferenceNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier)
+{
+    unsigned int nStakeModifierInterval = GetModiferInterval();
+    const CBlockIndex* pindex = pindexPrev;
+    while (pindex->pprev && !pindex->GeneratedStakeModifier())
+        pindex = pindex->pprev;
+    nStakeModifier = pindex->nStakeModifier;
+    fGeneratedStakeModifier = false;
+    if (pindex->GetBlockTime() / nStakeModifierInterval >= pindexPrev->GetBlockTime() / nStakeModifierInterval)
+        return true;
+
+    vector<pair<int64_t, uint256> > vSortedByTimestamp;
+    int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nStakeModifierInterval) * nStakeModifierInterval - ReferenceSelectionInterval();
+    for (pindex = pindexPrev; pindex && pindex->GetBlockTime() >= nSelectionIntervalStart; pindex = pindex->pprev)
+        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+    reverse(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+    sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+
+    uint64_t nStakeModifierNew = 0;
+    int64_t nSelectionIntervalStop = nSelectionIntervalStart;
+    set<uint256> setSelected;
+    for (int nRound = 0; nRound < min(64, (int)vSortedByTimestamp.size()); nRound++)
+    {
+        nSelectionIntervalStop += ReferenceSelectionIntervalSection(nRound);
+        bool fSelected = false;
+        uint256 hashBest = 0;
+        const CBlockIndex* pindexSelected = NULL;
+        BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, vSortedByTimestamp)
+        {
+            const CBlockIndex* pindexCandidate = mapBlockIndex[item.second];
+            if (fSelected && pindexCandidate->GetBlockTime() > nSelectionIntervalStop)
+                break;
+            if (setSelected.count(item.second))
+                continue;
+            uint256 hashProof = pindexCandidate->IsProofOfStake() ? pindexCandidate->hashProofOfStake : pindexCandidate->GetBlockHash();
+            CDataStream ss(SER_GETHASH, 0);
+            ss << hashProof << nStakeModifier;
+            uint256 hashSelection = Hash(ss.begin(), ss.end());
+            if (pindexCandidate->IsProofOfStake())
+                hashSelection >>= 32;
+            if (!fSelected || hashSelection < hashBest)
+            {
+                fSelected = true;
+                hashBest = hashSelection;
+                pindexSelected = pindexCandidate;
+            }
+        }
+        if (!fSelected)
+            return false;
+        nStakeModifierNew |= (((uint64_t)pindexSelected->GetStakeEntropyBit()) << nRound);
+        setSelected.insert(pindexSelected->GetBlockHash());
+    }
+    nStakeModifier = nStakeModifierNew;
+    fGeneratedStakeModifier = true;
+    return true;
+}
+
+// Reference kernel modifier lookup, walking the main chain forward from the coin's block
+static bool ReferenceKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier)
+{
+    const CBlockIndex* pindex = pindexFrom;
+    int64_t nStakeModifierTime = pindexFrom->GetBlockTime();
+    while (nStakeModifierTime < pindexFrom->GetBlockTime() + ReferenceSelectionInterval())
+    {
+        if (!pindex->pnext)
+            return false;
+        pindex = pindex->pnext;
+        if (pindex->GeneratedStakeModifier())
+        {
+            nStakeModifierTime = pindex->GetBlockTime();
+            nStakeModifier = pindex->nStakeModifier;
+        }
+    }
+    return true;
+}
+
+// Append a block with random proof and entropy, its stake modifier checked against the reference
+static CBlockIndex* AddModifierTestBlock(CBlockIndex* pindexPrev, int64_t nSpacing)
+{
+    CBlockIndex* pindex = new CBlockIndex();
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = pindexPrev->nHeight + 1;
+    pindex->nTime = pindexPrev->nTime + nSpacing;
+    if (insecure_rand() % 2)
+    {
+        pindex->SetProofOfStake();
+        pindex->hashProofOfStake = GetRandHash();
+    }
+    pindex->SetStakeEntropyBit(insecure_rand() & 1);
+    pindex->phashBlock = &mapBlockIndex.insert(make_pair(GetRandHash(), pindex)).first->first;
+
+    uint64_t nStakeModifier = 0, nStakeModifierReference = 0;
+    bool fGenerated = false, fGeneratedReference = false;
+    BOOST_CHECK(ComputeNextStakeModifier(pindexPrev, nStakeModifier, fGenerated));
+    BOOST_CHECK(ReferenceNextStakeModifier(pindexPrev, nStakeModifierReference, fGeneratedReference));
+    BOOST_CHECK(nStakeModifier == nStakeModifierReference && fGenerated == fGeneratedReference);
+    pindex->SetStakeModifier(nStakeModifier, fGenerated);
+    return pindex;
+}
+
+static void CheckKernelStakeModifiers(const vector<CBlockIndex*>& vpindex)
+{
+    BOOST_FOREACH(const CBlockIndex* pindex, vpindex)
+    {
+        uint64_t nStakeModifier = 0, nStakeModifierReference = 0;
+        bool fFound = GetKernelStakeModifier(pindex->GetBlockHash(), nStakeModifier);
+        BOOST_CHECK(fFound == ReferenceKernelStakeModifier(pindex, nStakeModifierReference));
+        if (fFound)
+            BOOST_CHECK(nStakeModifier == nStakeModifierReference);
+    }
+}
+
+static void ConnectModifierTestBranch(CBlockIndex* pindexFork, const vector<CBlockIndex*>& vBranch)
+{
+    for (CBlockIndex* pindex = pindexFork->pnext; pindex; )
+    {
+        CBlockIndex* pindexNext = pindex->pnext;
+        pindex->pnext = NULL;
+        pindex = pindexNext;
+    }
+    pindexFork->pnext = vBranch.empty() ? NULL : vBranch[0];
+    for (unsigned int i = 0; i + 1 < vBranch.size(); i++)
+        vBranch[i]->pnext = vBranch[i + 1];
+    pindexBest = vBranch.empty() ? pindexFork : vBranch.back();
+}
+
+BOOST_AUTO_TEST_CASE(stake_modifier_matches_reference)
+{
+    CBlockIndex* pindexGenesis = pindexGenesisBlock;
+    BOOST_REQUIRE(pindexGenesis && pindexGenesis->GeneratedStakeModifier() && pindexBest == pindexGenesis);
+
+    // Main chain of about three weeks, the blocks are not freed as the modifier caches point to them
+    vector<CBlockIndex*> vMain;
+    for (int i = 0; i < 1000; i++)
+        vMain.push_back(AddModifierTestBlock(vMain.empty() ? pindexGenesis : vMain.back(), 1200 + insecure_rand() % 1200));
+    ConnectModifierTestBranch(pindexGenesis, vMain);
+    CheckKernelStakeModifiers(vMain);
+    CheckKernelStakeModifiers(vMain);
+
+    // Reorganize to a branch forking off in the middle, and back
+    vector<CBlockIndex*> vBranch;
+    for (int i = 0; i < 500; i++)
+        vBranch.push_back(AddModifierTestBlock(vBranch.empty() ? vMain[599] : vBranch.back(), 600 + insecure_rand() % 3000));
+    ConnectModifierTestBranch(vMain[599], vBranch);
+    CheckKernelStakeModifiers(vMain);
+    CheckKernelStakeModifiers(vBranch);
+
+    ConnectModifierTestBranch(vMain[599], vector<CBlockIndex*>(vMain.begin() + 600, vMain.end()));
+    CheckKernelStakeModifiers(vBranch);
+    CheckKernelStakeModifiers(vMain);
+
+    // Back to the genesis block alone
+    ConnectModifierTestBranch(pindexGenesis, vector<CBlockIndex*>());
+    uint64_t nStakeModifier;
+    BOOST_CHECK(!GetKernelStakeModifier(pindexGenesis->GetBlockHash(), nStakeModifier));
+    BOOST_FOREACH(CBlockIndex* pindex, vMain)
+        mapBlockIndex.erase(pindex->GetBlockHash());
+    BOOST_FOREACH(CBlockIndex* pindex, vBranch)
+        mapBlockIndex.erase(pindex->GetBlockHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
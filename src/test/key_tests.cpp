@@ -5,6 +5,7 @@
 
 #include "key.h"
 #include "base58.h"
+#include "secp256k1.h"
 #include "uint256.h"
 #include "util.h"
 
@@ -144,4 +145,136 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+// The built-in verifier agrees with OpenSSL wherever it decides
+static void CheckNativeVerify(CKey& key, const uint256& hash, const vector<unsigned char>& vchSig)
+{
+    vector<unsigned char> vchPubKey = key.GetPubKey().Raw();
+    SetNativeECDSA(false);
+    bool fOpenSSL = key.Verify(hash, vchSig);
+    SetNativeECDSA(true);
+    int nNative = vchSig.empty() ? -1 : Secp256k1Verify((const unsigned char*)&hash, &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size());
+    if (nNative >= 0)
+        BOOST_CHECK_EQUAL(nNative == 1, fOpenSSL);
+    BOOST_CHECK_EQUAL(key.Verify(hash, vchSig), fOpenSSL);
+    BOOST_CHECK_EQUAL(CPubKey(vchPubKey).Verify(hash, vchSig), fOpenSSL);
+}
+
+// vchSig with R, or S if fS, written as 33 bytes starting with 0x01, the
+// value plus 2^256
+static vector<unsigned char> WidenDERInteger(const vector<unsigned char>& vchSig, bool fS)
+{
+    unsigned int nLenR = vchSig[3];
+    vector<unsigned char> vchR(vchSig.begin() + 4, vchSig.begin() + 4 + nLenR);
+    vector<unsigned char> vchS(vchSig.begin() + 6 + nLenR, vchSig.begin() + 6 + nLenR + vchSig[5 + nLenR]);
+    vector<unsigned char>& vchWide = fS ? vchS : vchR;
+    while (!vchWide.empty() && vchWide[0] == 0)
+        vchWide.erase(vchWide.begin());
+    vchWide.insert(vchWide.begin(), 33 - vchWide.size(), 0);
+    vchWide[0] = 0x01;
+
+    vector<unsigned char> vchRet;
+    vchRet.push_back(0x30);
+    vchRet.push_back(4 + vchR.size() + vchS.size());
+    vchRet.push_back(0x02);
+    vchRet.push_back(vchR.size());
+    vchRet.insert(vchRet.end(), vchR.begin(), vchR.end());
+    vchRet.push_back(0x02);
+    vchRet.push_back(vchS.size());
+    vchRet.insert(vchRet.end(), vchS.begin(), vchS.end());
+    return vchRet;
+}
+
+BOOST_AUTO_TEST_CASE(key_native_verify)
+{
+    if (!Secp256k1Available())
+        return;
+
+    CBitcoinSecret bsecret1, bsecret2;
+    BOOST_CHECK(bsecret1.SetString(strSecret1));
+    BOOST_CHECK(bsecret2.SetString(strSecret2));
+    bool fCompressed;
+    vector<CKey> vKeys(8);
+    vKeys[0].SetSecret(bsecret1.GetSecret(fCompressed), false);
+    vKeys[1].SetSecret(bsecret2.GetSecret(fCompressed), false);
+    vKeys[2].SetSecret(bsecret1.GetSecret(fCompressed), true);
+    vKeys[3].SetSecret(bsecret2.GetSecret(fCompressed), true);
+    for (int i = 4; i < 8; i++)
+        vKeys[i].MakeNewKey(i % 2 == 0);
+
+    for (int n = 0; n < 16; n++)
+    {
+        string strMsg = strprintf("Very secret message %i: 11", n);
+        uint256 hashMsg = Hash(strMsg.begin(), strMsg.end());
+        for (unsigned int i = 0; i < vKeys.size(); i++)
+        {
+            vector<unsigned char> vchSig;
+            BOOST_CHECK(vKeys[i].Sign(hashMsg, vchSig));
+            vector<unsigned char> vchPubKey = vKeys[i].GetPubKey().Raw();
+            BOOST_CHECK(Secp256k1Verify((const unsigned char*)&hashMsg, &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size()) == 1);
+
+            CheckNativeVerify(vKeys[i], hashMsg, vchSig);
+            CheckNativeVerify(vKeys[(i + 1) % vKeys.size()], hashMsg, vchSig);
+            uint256 hashOther = hashMsg;
+            hashOther ^= 1;
+            CheckNativeVerify(vKeys[i], hashOther, vchSig);
+
+            // Every byte of the signature altered
+            for (unsigned int j = 0; j < vchSig.size(); j++)
+            {
+                vector<unsigned char> vchBad(vchSig);
+                vchBad[j] ^= (j * 13 + n) % 255 + 1;
+                CheckNativeVerify(vKeys[i], hashMsg, vchBad);
+            }
+
+            // Encodings left to OpenSSL: padded integers, trailing bytes, truncation
+            vector<unsigned char> vchPadded(vchSig);
+            vchPadded.insert(vchPadded.begin() + 4, 0);
+            vchPadded[1]++;
+            vchPadded[3]++;
+            BOOST_CHECK(Secp256k1Verify((const unsigned char*)&hashMsg, &vchPadded[0], vchPadded.size(), &vchPubKey[0], vchPubKey.size()) == -1);
+            CheckNativeVerify(vKeys[i], hashMsg, vchPadded);
+            vector<unsigned char> vchLong(vchSig);
+            vchLong.push_back(0);
+            CheckNativeVerify(vKeys[i], hashMsg, vchLong);
+            CheckNativeVerify(vKeys[i], hashMsg, vector<unsigned char>(vchSig.begin(), vchSig.end() - 1));
+            CheckNativeVerify(vKeys[i], hashMsg, vector<unsigned char>());
+
+            // R or S of 33 bytes with a non zero first byte is out of range,
+            // not reduced to its low 32 bytes
+            for (int k = 0; k < 2; k++)
+            {
+                vector<unsigned char> vchWide = WidenDERInteger(vchSig, k == 1);
+                BOOST_CHECK(Secp256k1Verify((const unsigned char*)&hashMsg, &vchWide[0], vchWide.size(), &vchPubKey[0], vchPubKey.size()) == 0);
+                BOOST_CHECK(!CPubKey(vchPubKey).Verify(hashMsg, vchWide));
+                CheckNativeVerify(vKeys[i], hashMsg, vchWide);
+            }
+
+            // Hybrid public keys are verified by OpenSSL only
+            if (!vKeys[i].IsCompressed())
+            {
+                vector<unsigned char> vchHybrid(vchPubKey);
+                vchHybrid[0] = 0x06 | (vchPubKey[64] & 1);
+                BOOST_CHECK(Secp256k1Verify((const unsigned char*)&hashMsg, &vchSig[0], vchSig.size(), &vchHybrid[0], vchHybrid.size()) == -1);
+                BOOST_CHECK(CPubKey(vchHybrid).Verify(hashMsg, vchSig));
+            }
+
+            // Public keys that are not on the curve
+            vector<unsigned char> vchBadKey(vchPubKey);
+            vchBadKey[vchBadKey.size() - 1] ^= 1;
+            if (vchBadKey.size() == 65)
+                BOOST_CHECK(Secp256k1Verify((const unsigned char*)&hashMsg, &vchSig[0], vchSig.size(), &vchBadKey[0], vchBadKey.size()) == -1);
+            BOOST_CHECK(!CPubKey(vchBadKey).Verify(hashMsg, vchSig));
+        }
+    }
+
+    // r is the x coordinate of R less the group order, which only happens for
+    // one signature in 2^128 but must be checked both ways
+    vector<unsigned char> vchHash = ParseHex("00000000000000000000000000000000000000000000000000000000deadbeef");
+    vector<unsigned char> vchSig = ParseHex("300d02010202081234567890abcdef");
+    vector<unsigned char> vchPubKey = ParseHex("0480acd0b2419ce9a1d06182f7b47786ee00f024c4370f119619ca004d71eab706d560b7a586c7b9056b9477dee6a95b59b1369c1e5e1ba8dfac899fe13d8613be");
+    BOOST_CHECK(Secp256k1Verify(&vchHash[0], &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size()) == 1);
+    vchHash[31] ^= 1;
+    BOOST_CHECK(Secp256k1Verify(&vchHash[0], &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size()) == 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
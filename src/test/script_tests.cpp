@@ -19,7 +19,7 @@ using namespace std;
 using namespace json_spirit;
 using namespace boost::algorithm;
 
-extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+extern uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 extern bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
                          int nHashType);
 
@@ -171,6 +171,40 @@ BOOST_AUTO_TEST_CASE(script_invalid)
     }
 }
 
+// Results of the scripts of a test file
+static vector<bool> RunScripts(const string& strFile)
+{
+    vector<bool> vResults;
+    Array tests = read_json(strFile);
+    BOOST_FOREACH(Value& tv, tests)
+    {
+        Array test = tv.get_array();
+        if (test.size() < 2)
+            continue;
+        CScript scriptSig = ParseScript(test[0].get_str());
+        CScript scriptPubKey = ParseScript(test[1].get_str());
+        CTransaction tx;
+        vResults.push_back(VerifyScript(scriptSig, scriptPubKey, tx, 0, true, SIGHASH_NONE));
+    }
+    return vResults;
+}
+
+BOOST_AUTO_TEST_CASE(script_native_ecdsa)
+{
+    // Every signature verified, with the built-in code and with OpenSSL only
+    InitSignatureCache(0);
+    const char* vpszFiles[] = { "script_valid.json", "script_invalid.json" };
+    for (int i = 0; i < 2; i++)
+    {
+        SetNativeECDSA(false);
+        vector<bool> vOpenSSL = RunScripts(vpszFiles[i]);
+        SetNativeECDSA(true);
+        vector<bool> vNative = RunScripts(vpszFiles[i]);
+        BOOST_CHECK(vNative == vOpenSSL);
+    }
+    InitSignatureCache(DEFAULT_MAX_SIG_CACHE_SIZE << 20);
+}
+
 BOOST_AUTO_TEST_CASE(script_PushData)
 {
     // Check that PUSHDATA1, PUSHDATA2, and PUSHDATA4 create the same value on
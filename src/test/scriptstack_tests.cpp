@@ -0,0 +1,103 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bignum.h"
+#include "scriptstack.h"
+#include "util.h"
+
+using namespace std;
+
+// The encoding and value of vch as the interpreter read numbers with CBigNum
+static vector<unsigned char> BigNumVch(const vector<unsigned char>& vch)
+{
+    return CBigNum(CBigNum(vch).getvch()).getvch();
+}
+
+static vector<unsigned char> RandomNumVch()
+{
+    vector<unsigned char> vch(insecure_rand() % (CScriptNum::nMaxNumSize + 1));
+    for (unsigned int i = 0; i < vch.size(); i++)
+        vch[i] = (insecure_rand() % 4 == 0) ? (insecure_rand() % 2) * 0x80 : insecure_rand();
+    return vch;
+}
+
+BOOST_AUTO_TEST_SUITE(scriptstack_tests)
+
+BOOST_AUTO_TEST_CASE(scriptnum_bignum)
+{
+    seed_insecure_rand(false);
+
+    for (int i = 0; i < 20000; i++)
+    {
+        vector<unsigned char> vch1 = RandomNumVch(), vch2 = RandomNumVch();
+        CScriptNum bn1(vch1), bn2(vch2);
+        CBigNum bbn1(BigNumVch(vch1)), bbn2(BigNumVch(vch2));
+
+        BOOST_CHECK(bn1.getvch() == BigNumVch(vch1));
+        BOOST_CHECK(bn1.getint() == bbn1.getint());
+        BOOST_CHECK((bn1 + bn2).getvch() == (bbn1 + bbn2).getvch());
+        BOOST_CHECK((bn1 - bn2).getvch() == (bbn1 - bbn2).getvch());
+        BOOST_CHECK((-bn1).getvch() == (-bbn1).getvch());
+        BOOST_CHECK((bn1 < bn2) == (bbn1 < bbn2));
+        BOOST_CHECK((bn1 <= bn2) == (bbn1 <= bbn2));
+        BOOST_CHECK((bn1 == bn2) == (bbn1 == bbn2));
+    }
+
+    // Results one byte longer than an operand are written, but not read back
+    CScriptNum bnMax(0x7fffffff);
+    BOOST_CHECK((bnMax + bnMax).getvch() == (CBigNum(0x7fffffff) + CBigNum(0x7fffffff)).getvch());
+    BOOST_CHECK((-bnMax - bnMax).getint() == numeric_limits<int>::min());
+    BOOST_CHECK_THROW(CScriptNum((bnMax + bnMax).getvch()), scriptnum_error);
+    BOOST_CHECK(CScriptNum(ParseHex("0080")).getvch().empty());
+    BOOST_CHECK(CScriptNum(ParseHex("80")).getint() == 0);
+    BOOST_CHECK(CScriptNum(ParseHex("ff00")).getint() == 255);
+    BOOST_CHECK(CScriptNum(ParseHex("ffffffff")).getint() == -0x7fffffff);
+}
+
+BOOST_AUTO_TEST_CASE(scriptstack_elements)
+{
+    CScriptArena arena;
+    CScriptStack stack(arena);
+
+    vector<unsigned char> vchSig(73, 0x30), vchLong(520, 0x5a);
+    stack.push_back(vchSig);
+    stack.push_back(vchLong);
+    stack.push_back(CScriptNum(-1));
+    BOOST_CHECK(stack.size() == 3);
+    BOOST_CHECK(stack.top(-3).getvch() == vchSig);
+    BOOST_CHECK(stack.top(-2).getvch() == vchLong);
+    BOOST_CHECK(stack.top(-1).getvch() == ParseHex("81"));
+    BOOST_CHECK_THROW(stack.top(-4), out_of_range);
+    BOOST_CHECK_THROW(stack.top(0), out_of_range);
+
+    // Grows past its first storage while pushing its own elements
+    for (int i = 0; i < 1000; i++)
+        stack.push_back(stack.top(-3));
+    BOOST_CHECK(stack.size() == 1003);
+    for (unsigned int i = 0; i < stack.size(); i++)
+        BOOST_CHECK(stack.begin()[i] == stack.begin()[i % 3]);
+    BOOST_CHECK(stack.top(-1).getvch() == vchSig);
+
+    stack.erase(stack.begin() + 2, stack.end() - 1);
+    BOOST_CHECK(stack.size() == 3);
+    stack.insert(stack.end() - 1, stack.top(-2));
+    stack.insert(stack.begin(), CScriptValue());
+    BOOST_CHECK(stack.size() == 5);
+    BOOST_CHECK(stack.top(-5).empty());
+    BOOST_CHECK(stack.top(-4).getvch() == vchSig);
+    BOOST_CHECK(stack.top(-3).getvch() == vchLong);
+    BOOST_CHECK(stack.top(-3) == stack.top(-2));
+    BOOST_CHECK(stack.top(-1).getvch() == vchSig);
+
+    // Copies to another stack of the arena and back to vectors
+    CScriptStack stackCopy(arena);
+    stackCopy.assign(stack);
+    stack.pop_back();
+    BOOST_CHECK(stackCopy.size() == 5);
+    vector<vector<unsigned char> > vStack;
+    stackCopy.get(vStack);
+    BOOST_CHECK(vStack.size() == 5 && vStack[0].empty() && vStack[1] == vchSig && vStack[3] == vchLong);
+    stack.assign(vStack);
+    BOOST_CHECK(stack.size() == 5 && stack.back().getvch() == vchSig);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
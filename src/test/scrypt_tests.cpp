@@ -0,0 +1,92 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "scrypt.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(scrypt_tests)
+
+BOOST_AUTO_TEST_CASE(scrypt_blockhash_multi_matches_scalar)
+{
+    static const unsigned int nHeaders = 19;
+    unsigned char pchHeaders[nHeaders][80];
+    const void* pinput[nHeaders];
+    uint256 hashScalar[nHeaders];
+    for (unsigned int i = 0; i < nHeaders; i++)
+    {
+        for (unsigned int j = 0; j < 80; j++)
+            pchHeaders[i][j] = insecure_rand();
+        pinput[i] = pchHeaders[i];
+        hashScalar[i] = scrypt_blockhash(pchHeaders[i]);
+    }
+
+    // Every lane count, falling back to narrower ones the CPU lacks, and partial groups
+    const unsigned int vLanes[] = { 0, 1, 4, 8 };
+    for (unsigned int l = 0; l < sizeof(vLanes) / sizeof(vLanes[0]); l++)
+        for (unsigned int nCount = 0; nCount <= nHeaders; nCount++)
+        {
+            uint256 hashMulti[nHeaders];
+            scrypt_blockhash_multi(pinput, hashMulti, nCount, vLanes[l]);
+            for (unsigned int i = 0; i < nCount; i++)
+                BOOST_CHECK(hashMulti[i] == hashScalar[i]);
+        }
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_blockhash_multi_block_headers)
+{
+    // Same header hashed in several lanes, and a header that differs in the nonce only
+    CBlock block;
+    block.nVersion = 6;
+    block.nTime = 1374395533;
+    block.nBits = 0x1e0fffff;
+    block.nNonce = 0;
+    CBlock blockNonce = block;
+    blockNonce.nNonce = 1;
+
+    const void* pinput[] = { CVOIDBEGIN(block.nVersion), CVOIDBEGIN(blockNonce.nVersion), CVOIDBEGIN(block.nVersion),
+                             CVOIDBEGIN(block.nVersion), CVOIDBEGIN(blockNonce.nVersion) };
+    uint256 hashes[5];
+    scrypt_blockhash_multi(pinput, hashes, 5);
+
+    BOOST_CHECK(hashes[0] == block.GetHash());
+    BOOST_CHECK(hashes[1] == blockNonce.GetHash());
+    BOOST_CHECK(hashes[0] != hashes[1]);
+    BOOST_CHECK(hashes[2] == hashes[0] && hashes[3] == hashes[0] && hashes[4] == hashes[1]);
+}
+
+BOOST_AUTO_TEST_CASE(block_hash_cache)
+{
+    CBlock block;
+    block.nVersion = 6;
+    block.nTime = 1374395533;
+    block.nBits = 0x1e0fffff;
+
+    uint64_t nComputed = nBlockHashComputed;
+    uint256 hash = block.GetHash();
+    BOOST_CHECK(hash == scrypt_blockhash(CVOIDBEGIN(block.nVersion)));
+    BOOST_CHECK(block.GetHash() == hash);
+    BOOST_CHECK(nBlockHashComputed == nComputed + 1);
+
+    // Copies keep the hash, any header change drops it
+    CBlock blockCopy = block;
+    BOOST_CHECK(blockCopy.GetHash() == hash);
+    BOOST_CHECK(nBlockHashComputed == nComputed + 1);
+
+    block.nNonce++;
+    BOOST_CHECK(block.GetHash() == scrypt_blockhash(CVOIDBEGIN(block.nVersion)));
+    BOOST_CHECK(block.GetHash() != hash);
+    block.hashMerkleRoot = 1;
+    BOOST_CHECK(block.GetHash() == scrypt_blockhash(CVOIDBEGIN(block.nVersion)));
+    BOOST_CHECK(nBlockHashComputed == nComputed + 3);
+
+    // Transactions and signature are not part of the hash
+    blockCopy.vchBlockSig.push_back(1);
+    BOOST_CHECK(blockCopy.GetHash() == hash);
+
+    blockCopy.SetNull();
+    BOOST_CHECK(blockCopy.GetHash() == scrypt_blockhash(CVOIDBEGIN(blockCopy.nVersion)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
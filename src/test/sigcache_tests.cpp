@@ -0,0 +1,122 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../main.h"
+#include "../script.h"
+#include "../keystore.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+// Transaction spending output 0 of txFrom to a new key
+static CTransaction SignedSpend(CBasicKeyStore& keystore, const CTransaction& txFrom)
+{
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+    CKey key;
+    key.MakeNewKey(true);
+    txTo.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    BOOST_CHECK(SignSignature(keystore, txFrom, txTo, 0));
+    return txTo;
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_hits)
+{
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+
+    CTransaction txFrom;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    CTransaction txTo = SignedSpend(keystore, txFrom);
+    const CScript& scriptSig = txTo.vin[0].scriptSig;
+    const CScript& scriptPubKey = txFrom.vout[0].scriptPubKey;
+
+    // Signing verified and stored the signature, start over without it
+    CSignatureCacheStats stats = GetSignatureCacheStats();
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, SCRIPT_VERIFY_NONE, 0));
+    BOOST_CHECK(GetSignatureCacheStats().nHits == stats.nHits + 1);
+    InitSignatureCache((size_t)DEFAULT_MAX_SIG_CACHE_SIZE << 20);
+    BOOST_CHECK(GetSignatureCacheStats().nEntries == 0);
+
+    // Not stored when asked not to, but looked up
+    stats = GetSignatureCacheStats();
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, SCRIPT_VERIFY_NOCACHE, 0));
+    CSignatureCacheStats statsAfter = GetSignatureCacheStats();
+    BOOST_CHECK(statsAfter.nMisses == stats.nMisses + 1 && statsAfter.nInserts == stats.nInserts);
+
+    // A miss stores the signature, verifying it again is a hit
+    stats = statsAfter;
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, SCRIPT_VERIFY_NONE, 0));
+    statsAfter = GetSignatureCacheStats();
+    BOOST_CHECK(statsAfter.nMisses == stats.nMisses + 1 && statsAfter.nInserts == stats.nInserts + 1);
+    BOOST_CHECK(statsAfter.nEntries == stats.nEntries + 1);
+
+    stats = statsAfter;
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, SCRIPT_VERIFY_NONE, 0));
+    statsAfter = GetSignatureCacheStats();
+    BOOST_CHECK(statsAfter.nHits == stats.nHits + 1 && statsAfter.nMisses == stats.nMisses);
+
+    // The cached signature does not validate another transaction
+    CTransaction txOther = txTo;
+    txOther.vout[0].nValue = 2;
+    BOOST_CHECK(!VerifyScript(scriptSig, scriptPubKey, txOther, 0, SCRIPT_VERIFY_NONE, 0));
+
+    // Nor the signature with another key
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    CScript scriptSigOther = scriptSig;
+    vector<unsigned char> vchSig;
+    CScript::const_iterator pc = scriptSig.begin();
+    opcodetype opcode;
+    BOOST_CHECK(scriptSig.GetOp(pc, opcode, vchSig));
+    scriptSigOther.clear();
+    scriptSigOther << vchSig << keyOther.GetPubKey();
+    CScript scriptPubKeyOther;
+    scriptPubKeyOther.SetDestination(keyOther.GetPubKey().GetID());
+    BOOST_CHECK(!VerifyScript(scriptSigOther, scriptPubKeyOther, txTo, 0, SCRIPT_VERIFY_NONE, 0));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_size)
+{
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    CTransaction txFrom;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+    // Disabled, nothing is stored
+    InitSignatureCache(0);
+    CTransaction txTo = SignedSpend(keystore, txFrom);
+    BOOST_CHECK(VerifyScript(txTo.vin[0].scriptSig, txFrom.vout[0].scriptPubKey, txTo, 0, SCRIPT_VERIFY_NONE, 0));
+    CSignatureCacheStats stats = GetSignatureCacheStats();
+    BOOST_CHECK(stats.nEntries == 0 && stats.nCapacity == 0 && stats.nBytes == 0);
+
+    // One bucket per shard, the cache fills up and evicts
+    InitSignatureCache(64 * 4 * sizeof(uint256));
+    stats = GetSignatureCacheStats();
+    BOOST_CHECK(stats.nEntries == 0 && stats.nCapacity == 256);
+    vector<CTransaction> vtx;
+    for (int i = 0; i < 400; i++)
+        vtx.push_back(SignedSpend(keystore, txFrom));
+    CSignatureCacheStats statsAfter = GetSignatureCacheStats();
+    BOOST_CHECK(statsAfter.nInserts == stats.nInserts + 400);
+    BOOST_CHECK(statsAfter.nEvictions >= stats.nEvictions + 400 - 256);
+    BOOST_CHECK(statsAfter.nEntries <= 256 && statsAfter.nEntries + statsAfter.nEvictions - stats.nEvictions == 400);
+    BOOST_CHECK(statsAfter.nBytes <= 64 * 4 * sizeof(uint256));
+
+    // Evicted or not, every signature still verifies
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        BOOST_CHECK(VerifyScript(vtx[i].vin[0].scriptSig, txFrom.vout[0].scriptPubKey, vtx[i], 0, SCRIPT_VERIFY_NONE, 0));
+
+    InitSignatureCache((size_t)DEFAULT_MAX_SIG_CACHE_SIZE << 20);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
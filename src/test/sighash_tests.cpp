@@ -0,0 +1,135 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+// The signature hash as computed by copying the transaction
+static uint256 SignatureHashOld(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    if (nIn >= txTo.vin.size())
+        return 1;
+    CTransaction txTmp(txTo);
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+        txTmp.vin[i].scriptSig = CScript();
+    txTmp.vin[nIn].scriptSig = scriptCode;
+
+    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    {
+        txTmp.vout.clear();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    {
+        unsigned int nOut = nIn;
+        if (nOut >= txTmp.vout.size())
+            return 1;
+        txTmp.vout.resize(nOut+1);
+        for (unsigned int i = 0; i < nOut; i++)
+            txTmp.vout[i].SetNull();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+
+    if (nHashType & SIGHASH_ANYONECANPAY)
+    {
+        txTmp.vin[0] = txTmp.vin[nIn];
+        txTmp.vin.resize(1);
+    }
+
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTmp << nHashType;
+    return Hash(ss.begin(), ss.end());
+}
+
+static void RandomScript(CScript &script)
+{
+    static const opcodetype oplist[] = { OP_FALSE, OP_1, OP_2, OP_3, OP_CHECKSIG, OP_IF, OP_VERIF, OP_RETURN, OP_CODESEPARATOR };
+    script = CScript();
+    int ops = (insecure_rand() % 10);
+    for (int i = 0; i < ops; i++)
+        script << oplist[insecure_rand() % (sizeof(oplist) / sizeof(oplist[0]))];
+}
+
+static void RandomTransaction(CTransaction &tx, bool fSingle)
+{
+    tx.nVersion = insecure_rand();
+    tx.nTime = insecure_rand();
+    tx.vin.clear();
+    tx.vout.clear();
+    tx.nLockTime = (insecure_rand() % 2) ? insecure_rand() : 0;
+    int ins = (insecure_rand() % 4) + 1;
+    int outs = fSingle ? ins : (insecure_rand() % 4) + 1;
+    for (int in = 0; in < ins; in++)
+    {
+        tx.vin.push_back(CTxIn());
+        CTxIn &txin = tx.vin.back();
+        txin.prevout.hash = GetRandHash();
+        txin.prevout.n = insecure_rand() % 4;
+        RandomScript(txin.scriptSig);
+        txin.nSequence = (insecure_rand() % 2) ? insecure_rand() : (unsigned int)-1;
+    }
+    for (int out = 0; out < outs; out++)
+    {
+        tx.vout.push_back(CTxOut());
+        CTxOut &txout = tx.vout.back();
+        txout.nValue = insecure_rand() % 100000000;
+        RandomScript(txout.scriptPubKey);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(sighash_tests)
+
+BOOST_AUTO_TEST_CASE(sighash_test)
+{
+    seed_insecure_rand(false);
+
+    for (int i = 0; i < 20000; i++)
+    {
+        int nHashType = insecure_rand();
+        CTransaction txTo;
+        RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        int nIn = insecure_rand() % txTo.vin.size();
+
+        uint256 sho = SignatureHashOld(scriptCode, txTo, nIn, nHashType);
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType) == sho);
+        BOOST_CHECK(CSignatureHashContext(txTo).SignatureHash(scriptCode, nIn, nHashType) == sho);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sighash_context)
+{
+    seed_insecure_rand(false);
+
+    // One context for every input and hash type, scriptSigs changed while
+    // it is used as they are in signing
+    for (int i = 0; i < 500; i++)
+    {
+        CTransaction txTo;
+        RandomTransaction(txTo, false);
+        CSignatureHashContext txContext(txTo);
+        for (unsigned int nIn = 0; nIn < txTo.vin.size() + 1; nIn++)
+        {
+            CScript scriptCode;
+            RandomScript(scriptCode);
+            const int vnHashTypes[] = { SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, 0, 0x1f,
+                SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_NONE | SIGHASH_ANYONECANPAY, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY };
+            for (unsigned int j = 0; j < sizeof(vnHashTypes) / sizeof(vnHashTypes[0]); j++)
+                BOOST_CHECK(txContext.SignatureHash(scriptCode, nIn, vnHashTypes[j]) == SignatureHashOld(scriptCode, txTo, nIn, vnHashTypes[j]));
+            if (nIn < txTo.vin.size())
+                RandomScript(txTo.vin[nIn].scriptSig);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,133 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bignum.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(target_tests)
+
+// Reference implementations on CBigNum, as the consensus code was written before
+
+static uint256 ReferenceBlockTrust(unsigned int nBits, bool fProofOfStake)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    if (bnTarget <= 0)
+        return 0;
+    if (fProofOfStake)
+        return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+    uint256 nPoWTrust = (CBigNum(~uint256(0) >> 20) / (bnTarget+1)).getuint256();
+    return nPoWTrust > 1 ? nPoWTrust : 1;
+}
+
+static unsigned int ReferenceRetarget(unsigned int nBits, int64_t nActualSpacing, int64_t nTargetSpacing, const CBigNum& bnTargetLimit)
+{
+    int64_t nInterval = (int64_t)(0.16 * 24 * 60 * 60) / nTargetSpacing;
+    CBigNum bnNew;
+    bnNew.SetCompact(nBits);
+    bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
+    bnNew /= ((nInterval + 1) * nTargetSpacing);
+    if (bnNew > bnTargetLimit)
+        bnNew = bnTargetLimit;
+    return bnNew.GetCompact();
+}
+
+// Valid targets of every size, plus negative and oversized ones
+static unsigned int RandomCompact()
+{
+    switch (insecure_rand() % 8)
+    {
+    case 0:
+        return insecure_rand();
+    case 1:
+        return (insecure_rand() % 0x23 << 24) | (insecure_rand() & 0xffffff);
+    default:
+        return (GetRandHash() >> (insecure_rand() % 257)).GetCompact();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(block_trust_matches_bignum)
+{
+    const unsigned int vBits[] = { 0x00000000, 0x01003456, 0x01803456, 0x03000000, 0x1c0a5d2b, 0x1d00ffff, 0x1e0fffff,
+                                   0x1e0ffff0, 0x1f00ffff, 0x207fffff, 0x20800000, 0x21000001, 0x2100ffff, 0x22000001, 0xff7fffff };
+    for (unsigned int i = 0; i < sizeof(vBits) / sizeof(vBits[0]) + 5000; i++)
+    {
+        CBlockIndex index;
+        index.nBits = i < sizeof(vBits) / sizeof(vBits[0]) ? vBits[i] : RandomCompact();
+        BOOST_CHECK(index.GetBlockTrust() == ReferenceBlockTrust(index.nBits, false));
+        index.SetProofOfStake();
+        BOOST_CHECK(index.GetBlockTrust() == ReferenceBlockTrust(index.nBits, true));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(next_target_matches_bignum)
+{
+    CBigNum bnProofOfWorkLimit(~uint256(0) >> 20);
+    CBigNum bnProofOfStakeLimit(~uint256(0) >> 24);
+
+    for (int i = 0; i < 5000; i++)
+    {
+        bool fProofOfStake = i % 2;
+        vector<CBlockIndex> vIndex(4);
+        for (unsigned int j = 0; j < vIndex.size(); j++)
+        {
+            vIndex[j].pprev = j ? &vIndex[j - 1] : NULL;
+            vIndex[j].nHeight = 20000 + j;
+            vIndex[j].nTime = VERSION1_5_SWITCH_TIME + 100000 + j * 60;
+            vIndex[j].nBits = RandomCompact();
+            if (fProofOfStake)
+                vIndex[j].SetProofOfStake();
+        }
+
+        // Spacing from a block far in the past to a block far ahead, as seen on the chain
+        int64_t nActualSpacing = (int64_t)(insecure_rand() % 40000) - 10000;
+        if (i % 8 == 0)
+            nActualSpacing = insecure_rand() % 10000000;
+        vIndex[3].nTime = vIndex[2].nTime + nActualSpacing;
+
+        const CBigNum& bnTargetLimit = fProofOfStake ? bnProofOfStakeLimit : bnProofOfWorkLimit;
+        int64_t nTargetSpacing = GetTargetSpacing();
+        BOOST_CHECK(GetNextTargetRequiredV1(&vIndex[3], fProofOfStake) == ReferenceRetarget(vIndex[3].nBits, nActualSpacing, nTargetSpacing, bnTargetLimit));
+        BOOST_CHECK(GetNextTargetRequiredV2(&vIndex[3], fProofOfStake) == ReferenceRetarget(vIndex[3].nBits, nActualSpacing < 0 ? nTargetSpacing : nActualSpacing, nTargetSpacing, bnTargetLimit));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(min_work_matches_bignum)
+{
+    CBigNum bnProofOfWorkLimit(~uint256(0) >> 20);
+    for (int i = 0; i < 5000; i++)
+    {
+        unsigned int nBase = RandomCompact();
+        int64_t nTime = (int64_t)(insecure_rand() % (60 * 24 * 60 * 60)) - 24 * 60 * 60;
+
+        CBigNum bnResult;
+        bnResult.SetCompact(nBase);
+        bnResult *= 2;
+        for (int64_t n = nTime; n > 0 && bnResult < bnProofOfWorkLimit; n -= 24 * 60 * 60)
+            bnResult *= 2;
+        if (bnResult > bnProofOfWorkLimit)
+            bnResult = bnProofOfWorkLimit;
+        BOOST_CHECK(ComputeMinWork(nBase, nTime) == bnResult.GetCompact());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(check_proof_of_work_matches_bignum)
+{
+    CBigNum bnProofOfWorkLimit(~uint256(0) >> 20);
+    for (int i = 0; i < 5000; i++)
+    {
+        unsigned int nBits = RandomCompact();
+        CBigNum bnTarget;
+        bnTarget.SetCompact(nBits);
+        uint256 hash = GetRandHash() >> (insecure_rand() % 257);
+        if (bnTarget > 0 && bnTarget.bitSize() <= 256 && i % 2)
+            hash = bnTarget.getuint256() + (insecure_rand() % 3) - 1;
+
+        bool fReference = !(bnTarget <= 0 || bnTarget > bnProofOfWorkLimit) && !(CBigNum(hash) > bnTarget);
+        BOOST_CHECK(CheckProofOfWork(hash, nBits) == fReference);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
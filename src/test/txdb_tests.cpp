@@ -0,0 +1,137 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+#ifdef USE_LEVELDB
+BOOST_AUTO_TEST_CASE(txdb_cache_batch)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vout.resize(2);
+    uint256 hash = tx.GetHash();
+    CDiskTxPos pos(1, 1000, 81);
+
+    LOCK(cs_main);
+    CTxDB txdb;
+    CTxIndex txindex;
+    BOOST_CHECK(!txdb.ContainsTx(hash));
+
+    // Aborted batches leave no trace
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.AddTxIndex(tx, pos, 1));
+    BOOST_CHECK(txdb.ReadTxIndex(hash, txindex) && txindex.pos == pos);
+    BOOST_CHECK(txdb.TxnAbort());
+    BOOST_CHECK(!txdb.ReadTxIndex(hash, txindex));
+
+    // Committed records are read back before and after they reach disk
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.AddTxIndex(tx, pos, 1));
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(txdb.ReadTxIndex(hash, txindex) && txindex.pos == pos && txindex.vSpent.size() == 2);
+
+    txindex.vSpent[1] = CDiskTxPos(1, 2000, 81);
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.UpdateTxIndex(hash, txindex));
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(txdb.Flush());
+    CTxIndex txindexRead;
+    BOOST_CHECK(CTxDB("r").ReadTxIndex(hash, txindexRead));
+    BOOST_CHECK(txindexRead.pos == pos && txindexRead.vSpent[1] == txindex.vSpent[1] && txindexRead.vSpent[0].IsNull());
+
+    // Erased records stay erased once flushed
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.EraseTxIndex(tx));
+    BOOST_CHECK(!txdb.ContainsTx(hash));
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(!txdb.ContainsTx(hash));
+    BOOST_CHECK(txdb.Flush());
+    BOOST_CHECK(!txdb.ContainsTx(hash));
+}
+
+// Access to the raw records of the database
+class CTestTxDB : public CTxDB
+{
+public:
+    template<typename K, typename T> bool TestRead(const K& key, T& value) { return Read(key, value); }
+    template<typename K, typename T> bool TestWrite(const K& key, const T& value) { return Write(key, value); }
+    template<typename K> bool TestErase(const K& key) { return Erase(key); }
+    template<typename K> bool TestExists(const K& key) { return Exists(key); }
+};
+
+// Reads during a transaction must see the latest write or erase of each key
+// in the batch, then the write-back cache, then the disk
+BOOST_AUTO_TEST_CASE(txdb_batch_reads)
+{
+    LOCK(cs_main);
+    CTestTxDB txdb;
+    int nValue;
+
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.TestWrite(make_pair(string("test"), 0), 0));
+    for (int i = 0; i < 2000; i++)
+        BOOST_CHECK(txdb.TestRead(make_pair(string("test"), 0), nValue) && nValue == 0);
+    BOOST_CHECK(txdb.TxnAbort());
+
+    BOOST_CHECK(txdb.TxnBegin());
+    for (int i = 0; i < 50000; i++)
+        BOOST_CHECK(txdb.TestWrite(make_pair(string("test"), i), i));
+    for (int i = 0; i < 50000; i += 7)
+        BOOST_CHECK(txdb.TestErase(make_pair(string("test"), i)));
+    for (int i = 0; i < 50000; i += 49)
+        BOOST_CHECK(txdb.TestWrite(make_pair(string("test"), i), -i));
+    for (int i = 0; i < 50000; i++)
+    {
+        bool fRead = txdb.TestRead(make_pair(string("test"), i), nValue);
+        BOOST_CHECK(txdb.TestExists(make_pair(string("test"), i)) == fRead);
+        if (i % 49 == 0)
+            BOOST_CHECK(fRead && nValue == -i);
+        else if (i % 7 == 0)
+            BOOST_CHECK(!fRead);
+        else
+            BOOST_CHECK(fRead && nValue == i);
+    }
+    BOOST_CHECK(txdb.TxnAbort());
+
+    // Aborted records are gone
+    BOOST_CHECK(!txdb.TestRead(make_pair(string("test"), 1), nValue));
+    BOOST_CHECK(!txdb.TestExists(make_pair(string("test"), 0)));
+
+    // A flushed record is overridden by the cache, the cache by the batch
+    pair<string, int> key(string("overlay"), 0);
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.TestWrite(key, 1));
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(txdb.Flush());
+    BOOST_CHECK(txdb.TestRead(key, nValue) && nValue == 1);
+
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.TestWrite(key, 2));
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(txdb.TestRead(key, nValue) && nValue == 2);
+
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.TestWrite(key, 3));
+    BOOST_CHECK(txdb.TestRead(key, nValue) && nValue == 3);
+    BOOST_CHECK(txdb.TestErase(key));
+    BOOST_CHECK(!txdb.TestExists(key) && !txdb.TestRead(key, nValue));
+    BOOST_CHECK(txdb.TxnAbort());
+    BOOST_CHECK(txdb.TestRead(key, nValue) && nValue == 2);
+
+    // An erase in the cache hides the flushed record until it is flushed too
+    BOOST_CHECK(txdb.TxnBegin());
+    BOOST_CHECK(txdb.TestErase(key));
+    BOOST_CHECK(txdb.TxnCommit());
+    BOOST_CHECK(!txdb.TestExists(key));
+    BOOST_CHECK(txdb.Flush());
+    BOOST_CHECK(!txdb.TestRead(key, nValue));
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,6 +1,8 @@
 #include <boost/test/unit_test.hpp>
 
+#include "bignum.h"
 #include "uint256.h"
+#include "util.h"
 
 BOOST_AUTO_TEST_SUITE(uint256_tests)
 
@@ -15,4 +17,64 @@ BOOST_AUTO_TEST_CASE(uint256_equality)
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+static uint256 RandomUint256(unsigned int nBits)
+{
+    uint256 n = GetRandHash();
+    return nBits < 256 ? n >> (256 - nBits) : n;
+}
+
+BOOST_AUTO_TEST_CASE(uint256_arithmetic_matches_bignum)
+{
+    for (int i = 0; i < 2000; i++)
+    {
+        uint256 a = RandomUint256(insecure_rand() % 257);
+        uint256 b = RandomUint256(insecure_rand() % 257);
+        uint32_t n = insecure_rand() >> (insecure_rand() % 32);
+
+        // Products are truncated to 256 bits
+        CBigNum bnModulus = CBigNum(1) << 256;
+        BOOST_CHECK(a * b == ((CBigNum(a) * CBigNum(b)) % bnModulus).getuint256());
+        BOOST_CHECK(a * n == ((CBigNum(a) * n) % bnModulus).getuint256());
+        BOOST_CHECK((a * n).bits() == (unsigned int)((CBigNum(a) * n) % bnModulus).bitSize());
+        if (b != 0)
+            BOOST_CHECK(a / b == (CBigNum(a) / CBigNum(b)).getuint256());
+        BOOST_CHECK(a / 1 == a && (a == 0 || a / a == 1));
+    }
+    BOOST_CHECK_THROW(uint256(1) / uint256(0), std::runtime_error);
+    BOOST_CHECK(uint256(0).bits() == 0 && uint256(1).bits() == 1 && (~uint256(0)).bits() == 256);
+}
+
+BOOST_AUTO_TEST_CASE(uint256_compact_matches_bignum)
+{
+    // Every exponent, with the sign bit, short mantissas and the edges of overflow
+    const unsigned int vMantissa[] = { 0x000000, 0x000001, 0x00007f, 0x000080, 0x0000ff, 0x00ffff, 0x010000,
+                                       0x123456, 0x7fffff, 0x800000, 0x800001, 0x812345, 0xffffff };
+    for (unsigned int nSize = 0; nSize < 40; nSize++)
+        for (unsigned int i = 0; i < sizeof(vMantissa) / sizeof(vMantissa[0]) + 20; i++)
+        {
+            unsigned int nMantissa = i < sizeof(vMantissa) / sizeof(vMantissa[0]) ? vMantissa[i] : insecure_rand() & 0xffffff;
+            unsigned int nCompact = (nSize << 24) | nMantissa;
+            CBigNum bn;
+            bn.SetCompact(nCompact);
+
+            bool fNegative, fOverflow;
+            uint256 n;
+            n.SetCompact(nCompact, &fNegative, &fOverflow);
+            BOOST_CHECK(fNegative == (bn < 0));
+            BOOST_CHECK(fOverflow == (bn.bitSize() > 256));
+            if (fOverflow)
+                continue;
+            CBigNum bnAbs = fNegative ? -bn : bn;
+            BOOST_CHECK(n == bnAbs.getuint256());
+            BOOST_CHECK(n.GetCompact(fNegative) == bn.GetCompact());
+        }
+
+    for (int i = 0; i < 1000; i++)
+    {
+        uint256 n = RandomUint256(insecure_rand() % 257);
+        BOOST_CHECK(n.GetCompact() == CBigNum(n).GetCompact());
+        BOOST_CHECK(n.GetCompact(true) == (-CBigNum(n)).GetCompact());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
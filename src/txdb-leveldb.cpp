@@ -8,6 +8,8 @@
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
@@ -25,11 +27,172 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// Write-back cache in front of LevelDB.
+//
+// Block connection reads and rewrites the transaction index record of every
+// input, these records are kept here together with the other records (block
+// index, best chain pointer...) committed since the last flush. Everything is
+// written to LevelDB in a single batch every TXDB_FLUSH_BLOCKS best chain
+// updates during initial download, on every commit once in sync and whenever
+// the cache outgrows its share of -dbcache. LevelDB thus always holds the state
+// after some commit, with hashBestChain matching the transaction index.
+class CTxDBCache
+{
+public:
+    mutable CCriticalSection cs;
+    std::map<uint256, CTxIndexCacheEntry> mapTxIndex;
+    std::map<std::string, std::pair<bool, std::string> > mapRecords;  // key => (erased, value), not flushed yet
+    size_t nMemoryUsage;
+    size_t nMaxMemoryUsage;
+    unsigned int nDirty;    // dirty entries of mapTxIndex
+    unsigned int nBlocks;   // best chain updates since the last flush
+    uint64_t nWrites;       // changes of mapTxIndex other than records read from disk
+
+    CTxDBCache() : nMemoryUsage(0), nMaxMemoryUsage(0), nDirty(0), nBlocks(0), nWrites(0) {}
+
+    static size_t GetUsage(const CTxIndexCacheEntry& entry)
+    {
+        return sizeof(std::pair<const uint256, CTxIndexCacheEntry>) + 4 * sizeof(void*) + entry.txindex.vSpent.capacity() * sizeof(CDiskTxPos);
+    }
+
+    static size_t GetUsage(const std::string& strKey, const std::string& strValue)
+    {
+        return sizeof(std::pair<const std::string, std::pair<bool, std::string> >) + 4 * sizeof(void*) + strKey.capacity() + strValue.capacity();
+    }
+
+    void SetTxIndex(const uint256& hash, const CTxIndexCacheEntry& entry)
+    {
+        std::map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndex.find(hash);
+        if (mi == mapTxIndex.end())
+            mi = mapTxIndex.insert(std::make_pair(hash, CTxIndexCacheEntry())).first;
+        else
+        {
+            nMemoryUsage -= GetUsage(mi->second);
+            nDirty -= mi->second.fDirty;
+        }
+        mi->second = entry;
+        nMemoryUsage += GetUsage(mi->second);
+        nDirty += entry.fDirty;
+    }
+
+    void EraseTxIndex(const uint256& hash)
+    {
+        std::map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndex.find(hash);
+        if (mi == mapTxIndex.end())
+            return;
+        nMemoryUsage -= GetUsage(mi->second);
+        nDirty -= mi->second.fDirty;
+        mapTxIndex.erase(mi);
+    }
+
+    void SetRecord(const std::string& strKey, bool fErased, const std::string& strValue)
+    {
+        EraseRecord(strKey);
+        mapRecords.insert(std::make_pair(strKey, std::make_pair(fErased, strValue)));
+        nMemoryUsage += GetUsage(strKey, strValue);
+    }
+
+    void EraseRecord(const std::string& strKey)
+    {
+        std::map<std::string, std::pair<bool, std::string> >::iterator mi = mapRecords.find(strKey);
+        if (mi == mapRecords.end())
+            return;
+        nMemoryUsage -= GetUsage(mi->first, mi->second.second);
+        mapRecords.erase(mi);
+    }
+
+    bool Flush(leveldb::DB *pdb);
+};
+
+static CTxDBCache txdbcache;
+
+// Copies the records of a committed batch into the write-back cache
+class CBatchCacheWriter : public leveldb::WriteBatch::Handler {
+public:
+    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
+        txdbcache.SetRecord(key.ToString(), false, value.ToString());
+    }
+
+    virtual void Delete(const leveldb::Slice& key) {
+        txdbcache.SetRecord(key.ToString(), true, std::string());
+    }
+};
+
+bool CTxDBCache::Flush(leveldb::DB *pdb)
+{
+    AssertLockHeld(cs);
+    if (nDirty > 0 || !mapRecords.empty())
+    {
+        int64_t nStart = GetTimeMillis();
+        leveldb::WriteBatch batch;
+        for (std::map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndex.begin(); mi != mapTxIndex.end(); ++mi)
+        {
+            if (!mi->second.fDirty)
+                continue;
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey << make_pair(string("tx"), mi->first);
+            if (mi->second.fErased)
+                batch.Delete(ssKey.str());
+            else
+            {
+                CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+                ssValue << mi->second.txindex;
+                batch.Put(ssKey.str(), ssValue.str());
+            }
+        }
+        for (std::map<std::string, std::pair<bool, std::string> >::iterator mi = mapRecords.begin(); mi != mapRecords.end(); ++mi)
+        {
+            if (mi->second.first)
+                batch.Delete(mi->first);
+            else
+                batch.Put(mi->first, mi->second.second);
+        }
+
+        leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+        if (!status.ok()) {
+            LogPrintf("LevelDB cache flush failure: %s\n", status.ToString());
+            return false;
+        }
+        LogPrint("db", "CTxDBCache::Flush() : %u tx index records, %u other records, %u blocks, %dms\n",
+            nDirty, mapRecords.size(), nBlocks, GetTimeMillis() - nStart);
+
+        for (std::map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndex.begin(); mi != mapTxIndex.end(); )
+        {
+            if (mi->second.fErased)
+            {
+                nMemoryUsage -= GetUsage(mi->second);
+                mapTxIndex.erase(mi++);
+                continue;
+            }
+            mi->second.fDirty = false;
+            ++mi;
+        }
+        while (!mapRecords.empty())
+            EraseRecord(mapRecords.begin()->first);
+        nDirty = 0;
+    }
+    nBlocks = 0;
+
+    // Everything is clean now, start over if the records read so far do not fit
+    if (nMemoryUsage > nMaxMemoryUsage)
+    {
+        mapTxIndex.clear();
+        nMemoryUsage = 0;
+        nWrites++;
+    }
+    return true;
+}
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
-    int nCacheSizeMB = GetArg("-dbcache", 25);
-    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
+    // A quarter of -dbcache for LevelDB, the rest for the write-back cache
+    int nCacheSizeMB = GetArg("-dbcache", 100);
+    options.block_cache = leveldb::NewLRUCache(max(nCacheSizeMB / 4, 1) * 1048576);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    {
+        LOCK(txdbcache.cs);
+        txdbcache.nMaxMemoryUsage = (size_t)max(nCacheSizeMB - nCacheSizeMB / 4, 1) * 1048576;
+    }
     return options;
 }
 
@@ -69,6 +232,7 @@ CTxDB::CTxDB(const char* pszMode)
 {
     assert(pszMode);
     activeBatch = NULL;
+    fBatchBestChain = false;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
 
     if (txdb) {
@@ -122,6 +286,12 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    Flush();
+    {
+        LOCK(txdbcache.cs);
+        txdbcache.mapTxIndex.clear();
+        txdbcache.nMemoryUsage = 0;
+    }
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
@@ -136,75 +306,185 @@ bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
     activeBatch = new leveldb::WriteBatch();
+    mapBatchTxIndex.clear();
+    mapBatchRecords.clear();
+    fBatchBestChain = false;
     return true;
 }
 
+// Commits go to the write-back cache, which is flushed to disk when due
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+
+    // IsInitialBlockDownload takes cs_main, which comes before the cache lock
+    bool fFlushAlways = !IsInitialBlockDownload();
+
+    LOCK(txdbcache.cs);
+    CBatchCacheWriter writer;
+    leveldb::Status status = activeBatch->Iterate(&writer);
     delete activeBatch;
     activeBatch = NULL;
+    mapBatchRecords.clear();
     if (!status.ok()) {
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
+        mapBatchTxIndex.clear();
         return false;
     }
+    for (map<uint256, CTxIndexCacheEntry>::iterator mi = mapBatchTxIndex.begin(); mi != mapBatchTxIndex.end(); ++mi)
+        txdbcache.SetTxIndex(mi->first, mi->second);
+    txdbcache.nWrites += !mapBatchTxIndex.empty();
+    mapBatchTxIndex.clear();
+    txdbcache.nBlocks += fBatchBestChain;
+    fBatchBestChain = false;
+
+    if (txdbcache.nBlocks >= TXDB_FLUSH_BLOCKS || txdbcache.nMemoryUsage > txdbcache.nMaxMemoryUsage || fFlushAlways)
+        return txdbcache.Flush(pdb);
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
-    }
+bool CTxDB::Flush()
+{
+    if (!pdb)
+        return true;
+    LOCK(txdbcache.cs);
+    return txdbcache.Flush(pdb);
+}
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
-        }
+// Writes outside of a batch go to disk at once, replacing any cached record
+bool CTxDB::WriteDirect(const CDataStream &key, const string *value)
+{
+    LOCK(txdbcache.cs);
+    txdbcache.EraseRecord(key.str());
+    leveldb::Status status = value ? pdb->Put(leveldb::WriteOptions(), key.str(), *value) : pdb->Delete(leveldb::WriteOptions(), key.str());
+    if (!status.ok()) {
+        LogPrintf("LevelDB write failure: %s\n", status.ToString());
+        return false;
     }
-};
+    return true;
+}
 
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. The batch is
+// mirrored by mapBatchRecords, so this is a hash table lookup.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
     assert(activeBatch);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
-    }
-    return scanner.foundEntry;
+    boost::unordered_map<string, pair<bool, string> >::const_iterator mi = mapBatchRecords.find(key.str());
+    if (mi == mapBatchRecords.end())
+        return false;
+    *deleted = mi->second.first;
+    if (!*deleted)
+        *value = mi->second.second;
+    return true;
 }
 
+bool CTxDB::ScanCache(const CDataStream &key, string *value, bool *deleted) const {
+    LOCK(txdbcache.cs);
+    map<string, pair<bool, string> >::const_iterator mi = txdbcache.mapRecords.find(key.str());
+    if (mi == txdbcache.mapRecords.end())
+        return false;
+    *deleted = mi->second.first;
+    if (!*deleted)
+        *value = mi->second.second;
+    return true;
+}
+
+// Transaction index records are looked up in the active batch, then in the
+// write-back cache and only then read from disk. The disk read is done without
+// the cache lock so readers do not wait for each other; the record read is
+// cached if no write came in meanwhile and the cache has room for it.
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+    if (activeBatch)
+    {
+        map<uint256, CTxIndexCacheEntry>::const_iterator mi = mapBatchTxIndex.find(hash);
+        if (mi != mapBatchTxIndex.end())
+        {
+            if (mi->second.fErased)
+                return false;
+            txindex = mi->second.txindex;
+            return true;
+        }
+    }
+
+    uint64_t nWrites;
+    {
+        LOCK(txdbcache.cs);
+        map<uint256, CTxIndexCacheEntry>::const_iterator mi = txdbcache.mapTxIndex.find(hash);
+        if (mi != txdbcache.mapTxIndex.end())
+        {
+            if (mi->second.fErased)
+                return false;
+            txindex = mi->second.txindex;
+            return true;
+        }
+        nWrites = txdbcache.nWrites;
+    }
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << make_pair(string("tx"), hash);
+    string strValue;
+    leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue);
+    if (!status.ok()) {
+        if (!status.IsNotFound())
+            LogPrintf("LevelDB read failure: %s\n", status.ToString());
+        return false;
+    }
+    try {
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> txindex;
+    }
+    catch (std::exception &e) {
+        return false;
+    }
+
+    CTxIndexCacheEntry entry(txindex, false, false);
+    LOCK(txdbcache.cs);
+    if (txdbcache.nWrites == nWrites && !txdbcache.mapTxIndex.count(hash) &&
+        txdbcache.nMemoryUsage + CTxDBCache::GetUsage(entry) <= txdbcache.nMaxMemoryUsage)
+        txdbcache.SetTxIndex(hash, entry);
+    return true;
+}
+
+// Writes outside of a batch go to disk at once, like WriteDirect
+bool CTxDB::WriteTxIndex(uint256 hash, const CTxIndex& txindex, bool fErase)
+{
+    if (fReadOnly)
+        assert(!"Write called on database in read-only mode");
+
+    if (activeBatch)
+    {
+        mapBatchTxIndex[hash] = CTxIndexCacheEntry(txindex, fErase, true);
+        return true;
+    }
+
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << make_pair(string("tx"), hash);
+    LOCK(txdbcache.cs);
+    txdbcache.EraseTxIndex(hash);
+    txdbcache.nWrites++;
+    leveldb::Status status;
+    if (fErase)
+        status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
+    else
+    {
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << txindex;
+        status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
+    }
+    if (!status.ok()) {
+        LogPrintf("LevelDB write failure: %s\n", status.ToString());
+        return false;
+    }
+    return true;
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
-    return Write(make_pair(string("tx"), hash), txindex);
+    return WriteTxIndex(hash, txindex, false);
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -212,19 +492,20 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return WriteTxIndex(hash, txindex, false);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
 {
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    return WriteTxIndex(hash, CTxIndex(), true);
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
-    return Exists(make_pair(string("tx"), hash));
+    CTxIndex txindex;
+    return ReadTxIndex(hash, txindex);
 }
 
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
@@ -264,6 +545,7 @@ bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 
 bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
 {
+    fBatchBestChain = (activeBatch != NULL);
     return Write(string("hashBestChain"), hashBestChain);
 }
 
@@ -303,7 +585,7 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
@@ -317,16 +599,229 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+// Block index snapshot.
+//
+// The in-memory block index, with the chain trust and stake modifier checksum
+// LoadBlockIndex would compute, is written to blkindex.snapshot on clean
+// shutdown as fixed size records sorted by height. The next start maps the
+// file and uses it if it is intact and ends at the best chain of the DB, the
+// file is removed once read so that it never outlives the state it was
+// written for.
+static const char pchSnapshotMagic[8] = { 'h', 'o', 'b', 'o', 'i', 'd', 'x', '\0' };
+static const unsigned int SNAPSHOT_VERSION = 1;
+
+class CBlockIndexSnapshotHeader
 {
-    if (mapBlockIndex.size() > 0) {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
-        return true;
+public:
+    char pchMagic[8];
+    uint32_t nVersion;
+    uint32_t nRecordSize;
+    uint64_t nCount;
+    uint256 hashBestChain;
+    uint256 hashChecksum;   // hash of the records
+};
+
+class CBlockIndexSnapshotRecord
+{
+public:
+    uint256 hashBlock;
+    uint256 hashPrev;
+    uint256 hashNext;
+    uint256 hashMerkleRoot;
+    uint256 hashProofOfStake;
+    uint256 nChainTrust;
+    uint256 hashPrevoutStake;
+    uint32_t nPrevoutStake;
+    uint32_t nFile;
+    uint32_t nBlockPos;
+    int32_t nHeight;
+    int64_t nMint;
+    int64_t nMoneySupply;
+    uint64_t nStakeModifier;
+    uint32_t nStakeModifierChecksum;
+    uint32_t nFlags;
+    uint32_t nStakeTime;
+    int32_t nVersion;
+    uint32_t nTime;
+    uint32_t nBits;
+    uint32_t nNonce;
+    uint32_t nReserved;
+};
+
+static filesystem::path GetSnapshotFile()
+{
+    return GetDataDir() / "blkindex.snapshot";
+}
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    if (pindexBest == NULL || hashBestChain == 0)
+        return false;
+
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    vector<CBlockIndexSnapshotRecord> vRecords(vSortedByHeight.size());
+    for (unsigned int i = 0; i < vSortedByHeight.size(); i++)
+    {
+        const CBlockIndex* pindex = vSortedByHeight[i].second;
+        CBlockIndexSnapshotRecord& record = vRecords[i];
+        record.hashBlock        = pindex->GetBlockHash();
+        record.hashPrev         = pindex->pprev ? pindex->pprev->GetBlockHash() : 0;
+        record.hashNext         = pindex->pnext ? pindex->pnext->GetBlockHash() : 0;
+        record.hashMerkleRoot   = pindex->hashMerkleRoot;
+        record.hashProofOfStake = pindex->hashProofOfStake;
+        record.nChainTrust      = pindex->nChainTrust;
+        record.hashPrevoutStake = pindex->prevoutStake.hash;
+        record.nPrevoutStake    = pindex->prevoutStake.n;
+        record.nFile            = pindex->nFile;
+        record.nBlockPos        = pindex->nBlockPos;
+        record.nHeight          = pindex->nHeight;
+        record.nMint            = pindex->nMint;
+        record.nMoneySupply     = pindex->nMoneySupply;
+        record.nStakeModifier   = pindex->nStakeModifier;
+        record.nStakeModifierChecksum = pindex->nStakeModifierChecksum;
+        record.nFlags           = pindex->nFlags;
+        record.nStakeTime       = pindex->nStakeTime;
+        record.nVersion         = pindex->nVersion;
+        record.nTime            = pindex->nTime;
+        record.nBits            = pindex->nBits;
+        record.nNonce           = pindex->nNonce;
+        record.nReserved        = 0;
     }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
+
+    CBlockIndexSnapshotHeader header;
+    memcpy(header.pchMagic, pchSnapshotMagic, sizeof(header.pchMagic));
+    header.nVersion = SNAPSHOT_VERSION;
+    header.nRecordSize = sizeof(CBlockIndexSnapshotRecord);
+    header.nCount = vRecords.size();
+    header.hashBestChain = hashBestChain;
+    header.hashChecksum = vRecords.empty() ? 0 : Hash(BEGIN(vRecords[0]), END(vRecords.back()));
+
+    // Write to a temporary file and move it in place
+    filesystem::path pathSnapshot = GetSnapshotFile();
+    filesystem::path pathTmp = GetDataDir() / "blkindex.snapshot.new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : open failed");
+    bool fOk = fwrite(&header, sizeof(header), 1, file) == 1 &&
+               (vRecords.empty() || fwrite(&vRecords[0], sizeof(vRecords[0]), vRecords.size(), file) == vRecords.size());
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+    if (!fOk || !RenameOver(pathTmp, pathSnapshot))
+    {
+        filesystem::remove(pathTmp);
+        return error("WriteBlockIndexSnapshot() : write failed");
+    }
+    LogPrintf("WriteBlockIndexSnapshot() : %u blocks\n", vRecords.size());
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    filesystem::path pathSnapshot = GetSnapshotFile();
+    if (!filesystem::exists(pathSnapshot))
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    bool fLoaded = false;
+    try {
+        interprocess::file_mapping mapping(pathSnapshot.string().c_str(), interprocess::read_only);
+        interprocess::mapped_region region(mapping, interprocess::read_only);
+        const unsigned char* pbegin = (const unsigned char*)region.get_address();
+        size_t nSize = region.get_size();
+
+        CBlockIndexSnapshotHeader header;
+        if (nSize >= sizeof(header))
+            memcpy(&header, pbegin, sizeof(header));
+        uint256 hashBestChainDB;
+        if (nSize < sizeof(header))
+            LogPrintf("LoadBlockIndexSnapshot() : snapshot truncated\n");
+        else if (memcmp(header.pchMagic, pchSnapshotMagic, sizeof(header.pchMagic)) != 0 ||
+                 header.nVersion != SNAPSHOT_VERSION || header.nRecordSize != sizeof(CBlockIndexSnapshotRecord))
+            LogPrintf("LoadBlockIndexSnapshot() : unknown snapshot format\n");
+        else if (nSize != sizeof(header) + header.nCount * sizeof(CBlockIndexSnapshotRecord) || header.nCount == 0 ||
+                 Hash(pbegin + sizeof(header), pbegin + nSize) != header.hashChecksum)
+            LogPrintf("LoadBlockIndexSnapshot() : snapshot corrupt\n");
+        else if (!ReadHashBestChain(hashBestChainDB) || hashBestChainDB != header.hashBestChain)
+            LogPrintf("LoadBlockIndexSnapshot() : snapshot stale\n");
+        else
+        {
+            mapBlockIndex.reserve(header.nCount);
+            const unsigned char* pnext = pbegin + sizeof(header);
+            bool fCheckpointFailed = false;
+            for (uint64_t i = 0; i < header.nCount; i++, pnext += sizeof(CBlockIndexSnapshotRecord))
+            {
+                CBlockIndexSnapshotRecord record;
+                memcpy(&record, pnext, sizeof(record));
+
+                CBlockIndex* pindexNew    = InsertBlockIndex(record.hashBlock);
+                pindexNew->pprev          = InsertBlockIndex(record.hashPrev);
+                pindexNew->pnext          = InsertBlockIndex(record.hashNext);
+                pindexNew->nFile          = record.nFile;
+                pindexNew->nBlockPos      = record.nBlockPos;
+                pindexNew->nChainTrust    = record.nChainTrust;
+                pindexNew->nHeight        = record.nHeight;
+                pindexNew->nMint          = record.nMint;
+                pindexNew->nMoneySupply   = record.nMoneySupply;
+                pindexNew->nFlags         = record.nFlags;
+                pindexNew->nStakeModifier = record.nStakeModifier;
+                pindexNew->nStakeModifierChecksum = record.nStakeModifierChecksum;
+                pindexNew->prevoutStake   = COutPoint(record.hashPrevoutStake, record.nPrevoutStake);
+                pindexNew->nStakeTime     = record.nStakeTime;
+                pindexNew->hashProofOfStake = record.hashProofOfStake;
+                pindexNew->nVersion       = record.nVersion;
+                pindexNew->hashMerkleRoot = record.hashMerkleRoot;
+                pindexNew->nTime          = record.nTime;
+                pindexNew->nBits          = record.nBits;
+                pindexNew->nNonce         = record.nNonce;
+
+                // Watch for genesis block
+                if (pindexGenesisBlock == NULL && record.hashBlock == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+                    pindexGenesisBlock = pindexNew;
+
+                if (pindexNew->IsProofOfStake())
+                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+
+                // Left to the DB scan, which fails on the same checkpoint
+                if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
+                {
+                    error("LoadBlockIndexSnapshot() : Failed stake modifier checkpoint height=%d, modifier=0x%016x", pindexNew->nHeight, pindexNew->nStakeModifier);
+                    fCheckpointFailed = true;
+                    break;
+                }
+            }
+            fLoaded = !fCheckpointFailed;
+        }
+    }
+    catch (std::exception &e) {
+        LogPrintf("LoadBlockIndexSnapshot() : %s\n", e.what());
+    }
+
+    // The snapshot only matches the DB it was written with
+    filesystem::remove(pathSnapshot);
+
+    if (!fLoaded)
+    {
+        // Start over from the DB
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+            delete item.second;
+        mapBlockIndex.clear();
+        setStakeSeen.clear();
+        pindexGenesisBlock = NULL;
+        return false;
+    }
+    LogPrintf("LoadBlockIndexSnapshot() : %u blocks in %dms\n", mapBlockIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+// Scan the block index out of the DB and into mapBlockIndex
+bool CTxDB::ScanBlockIndex()
+{
     leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
     // Seek to start key.
     CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
@@ -409,6 +904,26 @@ bool CTxDB::LoadBlockIndex()
             return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016x", pindex->nHeight, pindex->nStakeModifier);
     }
 
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    if (mapBlockIndex.size() > 0) {
+        // Already loaded once in this session. It can happen during migration
+        // from BDB.
+        return true;
+    }
+    // The block index is an in-memory structure that maps hashes to on-disk
+    // locations where the contents of the block can be found. It is taken from
+    // the snapshot of the last clean shutdown if there is a usable one, else
+    // scanned out of the DB.
+    if (!LoadBlockIndexSnapshot() && !ScanBlockIndex())
+        return false;
+
+    if (fRequestShutdown)
+        return true;
+
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
     {
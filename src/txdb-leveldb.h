@@ -12,9 +12,26 @@
 #include <string>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+// Best chain updates kept in the write-back cache during initial block download
+static const unsigned int TXDB_FLUSH_BLOCKS = 1000;
+
+// Transaction index record held in the write-back cache
+class CTxIndexCacheEntry
+{
+public:
+    CTxIndex txindex;
+    bool fErased;   // erased since the last flush, not to be read from disk
+    bool fDirty;    // differs from the record on disk
+
+    CTxIndexCacheEntry() : fErased(false), fDirty(false) {}
+    CTxIndexCacheEntry(const CTxIndex& txindexIn, bool fErasedIn, bool fDirtyIn) : txindex(txindexIn), fErased(fErasedIn), fDirty(fDirtyIn) {}
+};
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -50,12 +67,29 @@ private:
     bool fReadOnly;
     int nVersion;
 
+    // Transaction index records written by the active batch, kept out of
+    // activeBatch so they reach the write-back cache without serialization
+    std::map<uint256, CTxIndexCacheEntry> mapBatchTxIndex;
+    bool fBatchBestChain;   // the active batch moves the best chain pointer
+
+    // Latest write or delete of every key of activeBatch: key => (erased, value),
+    // so that reads during a transaction do not iterate the whole batch
+    boost::unordered_map<std::string, std::pair<bool, std::string> > mapBatchRecords;
+
+    bool WriteTxIndex(uint256 hash, const CTxIndex& txindex, bool fErase);
+    bool LoadBlockIndexSnapshot();
+    bool ScanBlockIndex();
+    bool WriteDirect(const CDataStream &key, const std::string *value);
+
 protected:
     // Returns true and sets (value,false) if activeBatch contains the given key
     // or leaves value alone and sets deleted = true if activeBatch contains a
     // delete for it.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
+    // Same for records committed to the write-back cache but not flushed yet
+    bool ScanCache(const CDataStream &key, std::string *value, bool *deleted) const;
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
@@ -74,6 +108,13 @@ protected:
                 return false;
             }
         }
+        if (readFromDb) {
+            bool deleted = false;
+            readFromDb = ScanCache(ssKey, &strValue, &deleted) == false;
+            if (deleted) {
+                return false;
+            }
+        }
         if (readFromDb) {
             leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
                                               ssKey.str(), &strValue);
@@ -111,15 +152,15 @@ protected:
         ssValue << value;
 
         if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
+            std::string strKey = ssKey.str();
+            std::pair<bool, std::string>& record = mapBatchRecords[strKey];
+            record.first = false;
+            record.second = ssValue.str();
+            activeBatch->Put(strKey, record.second);
             return true;
         }
-        leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
-        if (!status.ok()) {
-            LogPrintf("LevelDB write failure: %s\n", status.ToString());
-            return false;
-        }
-        return true;
+        std::string strValue = ssValue.str();
+        return WriteDirect(ssKey, &strValue);
     }
 
     template<typename K>
@@ -134,11 +175,14 @@ protected:
         ssKey.reserve(1000);
         ssKey << key;
         if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
+            std::string strKey = ssKey.str();
+            std::pair<bool, std::string>& record = mapBatchRecords[strKey];
+            record.first = true;
+            record.second.clear();
+            activeBatch->Delete(strKey);
             return true;
         }
-        leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
-        return (status.ok() || status.IsNotFound());
+        return WriteDirect(ssKey, NULL);
     }
 
     template<typename K>
@@ -151,11 +195,14 @@ protected:
 
         if (activeBatch) {
             bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
+            if (ScanBatch(ssKey, &unused, &deleted)) {
+                return !deleted;
             }
         }
-
+        bool deleted;
+        if (ScanCache(ssKey, &unused, &deleted)) {
+            return !deleted;
+        }
 
         leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
         return status.IsNotFound() == false;
@@ -169,9 +216,15 @@ public:
     {
         delete activeBatch;
         activeBatch = NULL;
+        mapBatchTxIndex.clear();
+        mapBatchRecords.clear();
+        fBatchBestChain = false;
         return true;
     }
 
+    // Write the records held by the write-back cache to disk
+    bool Flush();
+
     bool ReadVersion(int& nVersion)
     {
         nVersion = 0;
@@ -193,6 +246,7 @@ public:
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool WriteBlockIndexSnapshot();
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
@@ -413,6 +413,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                     LogPrintf("WalletUpdateSpent found spent coin %shbn %s\n", FormatMoney(wtx.GetCredit()), wtx.GetHash().ToString());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    MarkStakeCoinsDirty(txin.prevout.hash);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -431,6 +432,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
            {
               wtx.MarkUnspent(&txout - &tx.vout[0]);
               wtx.WriteToDisk();
+              MarkStakeCoinsDirty(hash);
            }
        }
 
@@ -536,8 +538,11 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 
         // Write to disk
         if (fInsertedNew || fUpdated)
+        {
             if (!wtx.WriteToDisk())
                 return false;
+            MarkStakeCoinsDirty(hash);
+        }
         if (!fHaveGUI) {
             // If default receiving address gets used, replace it with a new one
             if (vchDefaultKey.IsValid()) {
@@ -621,7 +626,10 @@ bool CWallet::EraseFromWallet(uint256 hash)
     {
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
+        {
             CWalletDB(strWalletFile).EraseTx(hash);
+            MarkStakeCoinsDirty(hash);
+        }
     }
     return true;
 }
@@ -955,6 +963,7 @@ void CWallet::ReacceptWalletTransactions()
                     LogPrintf("ReacceptWalletTransactions found spent coin %shbn %s\n", FormatMoney(wtx.GetCredit()), wtx.GetHash().ToString());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    MarkStakeCoinsDirty(wtx.GetHash());
                 }
             }
             else
@@ -1755,8 +1764,9 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
 
                 // Sign
                 int nIn = 0;
+                CSignatureHashContext txContext(wtxNew);
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++, SIGHASH_ALL, &txContext))
                         return false;
 
                 // Limit size
@@ -1802,82 +1812,425 @@ bool CWallet::GetStakeWeightFromValue(const int64_t& nTime, const int64_t& nValu
   return true;
 }
 
-bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight)
+void CStakeCandidates::clear()
 {
-    // Choose coins to use
-    int64_t nBalance = GetBalance();
+    vpTx.clear();
+    vnOut.clear();
+    vnValue.clear();
+    vnTxTime.clear();
+    vnBlockTime.clear();
+    vnTxOffset.clear();
+    vnStakeModifier.clear();
+}
+
+void CStakeCandidates::reserve(unsigned int n)
+{
+    vpTx.reserve(n);
+    vnOut.reserve(n);
+    vnValue.reserve(n);
+    vnTxTime.reserve(n);
+    vnBlockTime.reserve(n);
+    vnTxOffset.reserve(n);
+    vnStakeModifier.reserve(n);
+}
+
+void CStakeCandidates::push_back(const CWalletTx* ptx, unsigned int nOut, unsigned int nBlockTime, unsigned int nTxOffset, uint64_t nStakeModifier)
+{
+    vpTx.push_back(ptx);
+    vnOut.push_back(nOut);
+    vnValue.push_back(ptx->vout[nOut].nValue);
+    vnTxTime.push_back(ptx->nTime);
+    vnBlockTime.push_back(nBlockTime);
+    vnTxOffset.push_back(nTxOffset);
+    vnStakeModifier.push_back(nStakeModifier);
+}
+
+size_t CStakeCandidates::GetMemoryUsage() const
+{
+    return vpTx.capacity() * sizeof(const CWalletTx*) +
+           vnOut.capacity() * sizeof(unsigned int) +
+           vnValue.capacity() * sizeof(int64_t) +
+           vnTxTime.capacity() * sizeof(unsigned int) +
+           vnBlockTime.capacity() * sizeof(unsigned int) +
+           vnTxOffset.capacity() * sizeof(unsigned int) +
+           vnStakeModifier.capacity() * sizeof(uint64_t);
+}
+
+// Adds the outputs of wtx that may stake to mapStakeCoinInfo. Outputs still
+// in the same block keep their data from mapOld, so it is not read again.
+void CWallet::AddStakeCoins(const CWalletTx& wtx, const map<unsigned int, CStakeCoinInfo>& mapOld)
+{
+    if (wtx.GetDepthInMainChain() < 1)
+        return;
+    const CBlockIndex* pindex = mapBlockIndex[wtx.hashBlock];
+
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (wtx.IsSpent(i) || IsMine(wtx.vout[i]) != MINE_SPENDABLE || wtx.vout[i].nValue < nMinimumInputValue)
+            continue;
+
+        CStakeCoinInfo info;
+        map<unsigned int, CStakeCoinInfo>::const_iterator mi = mapOld.find(i);
+        if (mi != mapOld.end() && mi->second.hashBlock == wtx.hashBlock)
+            info = mi->second;
+        else
+        {
+            info.hashBlock = wtx.hashBlock;
+            info.nHeight = pindex->nHeight;
+            info.fMaturing = wtx.IsCoinBase() || wtx.IsCoinStake();
+            info.nTxTime = wtx.nTime;
+            info.nBlockTime = pindex->nTime;
+        }
+        mapStakeCoinInfo.insert(make_pair(COutPoint(hash, i), info));
+    }
+}
 
-    nMinWeight = nMaxWeight = nWeight = 0;
+void CWallet::MarkStakeCoinsDirty(const uint256& hash)
+{
+    AssertLockHeld(cs_wallet);
+    if (!fStakeCoinsLoaded)
+        return;
+    setStakeCoinsDirty.insert(hash);
+    fCoinsDataActual = false;
+}
 
+void CWallet::DisconnectStakeCoins(const CTransaction& tx, int nHeight)
+{
+    LOCK(cs_wallet);
+    if (!fStakeCoinsLoaded)
+        return;
+
+    uint256 hash = tx.GetHash();
+    if (mapWallet.count(hash))
+        MarkStakeCoinsDirty(hash);
+
+    // The rest is done once per block, each block starts with its coinbase
+    if (!tx.IsCoinBase())
+        return;
+
+    // A long reorganization is cheaper to handle with a single reload
+    if (++nStakeCoinsDisconnected > STAKE_COINS_REORG_DEPTH)
+    {
+        LogPrint("coinstake", "DisconnectStakeCoins : %d blocks disconnected, reloading stake coins of wallet %s\n",
+            nStakeCoinsDisconnected, strWalletFile.c_str());
+        mapStakeCoinInfo.clear();
+        setStakeCoinsDirty.clear();
+        fStakeCoinsLoaded = false;
+        fCoinsDataActual = false;
+        return;
+    }
+
+    // Outputs of the block lose their confirmation, modifiers taken from it or
+    // a later block are looked up again
+    for (map<COutPoint, CStakeCoinInfo>::iterator mi = mapStakeCoinInfo.begin(); mi != mapStakeCoinInfo.end(); ++mi)
+    {
+        if (mi->second.nHeight >= nHeight)
+            MarkStakeCoinsDirty(mi->first.hash);
+        else if (mi->second.fStakeModifier && mi->second.nStakeModifierHeight >= nHeight)
+        {
+            mi->second.fStakeModifier = false;
+            fCoinsDataActual = false;
+        }
+    }
+}
+
+bool CWallet::CacheStakeCandidates(CTxDB& txdb, int64_t nBalance)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (IsLocked())
+        return true;
+
+    // Bring the outputs up to date, only transactions that changed are visited
+    if (!fStakeCoinsLoaded)
+    {
+        mapStakeCoinInfo.clear();
+        map<unsigned int, CStakeCoinInfo> mapOld;
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            AddStakeCoins(it->second, mapOld);
+        setStakeCoinsDirty.clear();
+        fStakeCoinsLoaded = true;
+        fCoinsDataActual = false;
+    }
+    BOOST_FOREACH(const uint256& hash, setStakeCoinsDirty)
+    {
+        map<unsigned int, CStakeCoinInfo> mapOld;
+        map<COutPoint, CStakeCoinInfo>::iterator mi = mapStakeCoinInfo.lower_bound(COutPoint(hash, 0));
+        while (mi != mapStakeCoinInfo.end() && mi->first.hash == hash)
+        {
+            mapOld.insert(make_pair(mi->first.n, mi->second));
+            mapStakeCoinInfo.erase(mi++);
+        }
+
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end())
+            AddStakeCoins(it->second, mapOld);
+    }
+    setStakeCoinsDirty.clear();
+    nStakeCoinsDisconnected = 0;
+
+    // The table is only selected again when the outputs, the target or the
+    // minimum age changed, or an output passes maturity or the minimum age
+    int64_t nTarget = nBalance - nReserveBalance;
+    unsigned int nSpendTime = GetAdjustedTime();
+    unsigned int nMinAge = GetStakeMinAge();
+    if (fCoinsDataActual && nTarget == nStakeCandidatesTarget && nMinAge == nStakeCandidatesMinAge &&
+        nBestHeight < nStakeCandidatesNextHeight && nSpendTime < nStakeCandidatesNextTime)
+        return true;
+
+    // Positions of planned kernel hits refer to the previous table
+    mapStakePlan.clear();
+    nStakePlanTo = 0;
+
+    // Same selection as SelectCoinsForStaking, in the (txid, vout.n) order the
+    // kernel search has always used. Only outputs selected for the first time
+    // are read from disk.
+    boost::shared_ptr<CStakeCandidates> pcandidates(new CStakeCandidates());
+    int nNextHeight = std::numeric_limits<int>::max();
+    unsigned int nNextTime = std::numeric_limits<unsigned int>::max();
+    int64_t nValueIn = 0;
+    bool fSelected = false;
+    unsigned int nCoins = 0, nDiskReads = 0;
+    CTxIndex txindex;
+    for (map<COutPoint, CStakeCoinInfo>::iterator mi = mapStakeCoinInfo.begin(); mi != mapStakeCoinInfo.end(); ++mi)
+    {
+        const COutPoint& prevout = mi->first;
+        CStakeCoinInfo& info = mi->second;
+
+        // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
+        if (info.nTxTime + nMinAge > nSpendTime)
+        {
+            nNextTime = min(nNextTime, info.nTxTime + nMinAge);
+            continue;
+        }
+
+        int nMatureHeight = info.nHeight + nCoinbaseMaturity + 20 - 1;
+        if (info.fMaturing && nBestHeight < nMatureHeight)
+        {
+            nNextHeight = min(nNextHeight, nMatureHeight);
+            continue;
+        }
+
+        // Stop if we've chosen enough inputs
+        if (fSelected || nValueIn >= nTarget)
+        {
+            fSelected = true;
+            continue;
+        }
+        const CWalletTx* pcoin = &mapWallet[prevout.hash];
+        int64_t nValue = pcoin->vout[prevout.n].nValue;
+        nValueIn += nValue;
+        nCoins++;
+        if (nValue >= nTarget)
+            fSelected = true;
+
+        if (!info.fTxOffset)
+        {
+            nDiskReads++;
+            if (!txdb.ReadTxIndex(prevout.hash, txindex))
+                continue;
+            info.nTxOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+            info.fTxOffset = true;
+        }
+
+        // The modifier is not available until enough blocks follow the coin
+        if (!info.fStakeModifier)
+            info.fStakeModifier = GetKernelStakeModifier(info.hashBlock, info.nStakeModifier, info.nStakeModifierHeight);
+        if (!info.fStakeModifier)
+        {
+            nNextHeight = min(nNextHeight, nBestHeight + 1);
+            continue;
+        }
+
+        pcandidates->push_back(pcoin, prevout.n, info.nBlockTime, info.nTxOffset, info.nStakeModifier);
+    }
+
+    pstakeCandidates = pcandidates;
+    nStakeCandidatesTarget = nTarget;
+    nStakeCandidatesMinAge = nMinAge;
+    nStakeCandidatesNextHeight = nNextHeight;
+    nStakeCandidatesNextTime = nNextTime;
+
+    LogPrint("coinstake", "----CacheStakeCandidates: %u candidates (%u bytes) selected from %zu coins with %u disk reads for wallet %s-----\n",
+        pcandidates->size(), pcandidates->GetMemoryUsage(), mapStakeCoinInfo.size(), nDiskReads, strWalletFile.c_str());
+    ResetStakeWeight();
+    UpdateStakeWeight(GetTime());
+    fCoinsDataActual = true;
+    return nCoins > 0;
+}
+
+void CWallet::GetStakeCandidatesInfo(unsigned int& nCount, size_t& nMemoryUsage) const
+{
+    LOCK(cs_stakeweight);
+    nCount = nStakeCandidateCount;
+    nMemoryUsage = nStakeCandidateBytes;
+}
+
+// The kernel hits of the next STAKE_PLAN_AHEAD seconds are computed ahead of
+// time, so the stake miner only creates a block when one of them is due. A due
+// hit stays planned until ConsumeStakePlan is called for a block searched over
+// its timestamp; the coinstake search re-checks it against the target of the
+// block actually being built.
+bool CWallet::GetStakePlanDue(unsigned int nBits, int64_t& nTimeWake)
+{
+    // Kernel hits this old are outside the coinstake search interval
+    static const int64_t nMaxHitAge = 60;
+
+    int64_t nNow = GetAdjustedTime();
+    nTimeWake = nNow + nMaxHitAge;
+
+    int64_t nBalance = GetBalance();
     if (nBalance <= nReserveBalance)
+    {
+        ClearStakeWeight();
         return false;
+    }
 
+    unsigned int nPlanFrom, nPlanTo;
+    boost::shared_ptr<const CStakeCandidates> pcandidates;
     CTxDB txdb("r");
     {
         LOCK2(cs_main, cs_wallet);
-        // Cache outputs unless best block or wallet transaction set changed
-        if (!fCoinsDataActual && !IsLocked())
-        {
-            mapMeta.clear();
-            int64_t nValueIn = 0;
-            CoinsSet setCoins;
-            if (!SelectCoinsForStaking(nBalance - nReserveBalance, GetAdjustedTime(),setCoins, nValueIn))
-                return false;
+        if (!CacheStakeCandidates(txdb, nBalance))
+            return false;
 
-            if (setCoins.empty())
-                return false;
+        // Keep the stake weight snapshot current for the UI and RPC
+        if (nStakeWeightTime + STAKE_WEIGHT_REFRESH <= GetTime())
+            UpdateStakeWeight(GetTime());
 
-            {
-                CTxIndex txindex;
-                CBlock block;
-                for(CoinsSet::iterator pcoin = setCoins.begin(); pcoin != setCoins.end(); pcoin++)
-                {
-                    // Load transaction index item
-                    if (!txdb.ReadTxIndex(pcoin->first->GetHash(), txindex))
-                        continue;
+        if (nBits != nStakePlanBits)
+        {
+            mapStakePlan.clear();
+            nStakePlanBits = nBits;
+            nStakePlanTo = 0;
+        }
 
-                    // Read block header
-                    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                        continue;
+        mapStakePlan.erase(mapStakePlan.begin(), mapStakePlan.lower_bound(nNow - nMaxHitAge));
+        nPlanFrom = max((int64_t)nStakePlanTo + 1, nNow);
+        nPlanTo = nNow + STAKE_PLAN_AHEAD;
+        pcandidates = pstakeCandidates;
+    }
 
-                    uint64_t nStakeModifier = 0;
-                    if (!GetKernelStakeModifier(block.GetHash(), nStakeModifier))
-                        continue;
+    // Extend the schedule without holding the locks, like the coinstake search
+    if (nPlanFrom <= nPlanTo)
+    {
+        multimap<unsigned int, unsigned int> mapHits;
+        PlanStakeKernelHits(*pcandidates, nBits, nPlanFrom, nPlanTo, mapHits);
 
-                    // Add meta record
-                    // (txid, vout.n) => ((txindex, (tx, vout.n)), (block, modifier))
-                    mapMeta[make_pair(pcoin->first->GetHash(), pcoin->second)] = make_pair(make_pair(txindex, *pcoin), make_pair(block, nStakeModifier));
-                }
-            }
-            LogPrint("coinstake", "----GetStakeWeight: %zu meta items loaded for %zu coins for wallet %s-----\n", mapMeta.size(), setCoins.size(),strWalletFile.c_str());
-            fCoinsDataActual = true;
+        // Positions refer to pcandidates, so the hits are only kept if the
+        // table was not reloaded meanwhile
+        LOCK(cs_wallet);
+        if (pcandidates == pstakeCandidates && nBits == nStakePlanBits)
+        {
+            mapStakePlan.insert(mapHits.begin(), mapHits.end());
+            nStakePlanTo = nPlanTo;
+            nLastStakePlanInterval = nPlanTo - nPlanFrom + 1;
+            if (!mapHits.empty())
+                LogPrint("coinstake", "GetStakePlanDue : %zu kernel hits planned for %u-%u, first at %u\n",
+                    mapHits.size(), nPlanFrom, nPlanTo, mapHits.begin()->first);
         }
     }
 
-
-    // (txid, vout.n) => ((txindex, (tx, vout.n)), (block, modifier))
-    for(MetaMap::const_iterator meta_item = mapMeta.begin(); meta_item != mapMeta.end(); meta_item++)
+    LOCK(cs_wallet);
+    if (!mapStakePlan.empty() && mapStakePlan.begin()->first <= nNow)
     {
-        // Get coin
-        CoinsSet::value_type pcoin = meta_item->second.first.second;
+        // The first coinstake search starts just before the hit, not now
+        if (nLastCoinStakeSearchTime == 0)
+            nLastCoinStakeSearchTime = (int64_t)mapStakePlan.begin()->first - 1;
+        return true;
+    }
+
+    // Wake up for the next hit, or to extend the schedule halfway through
+    nTimeWake = (int64_t)nStakePlanTo - STAKE_PLAN_AHEAD / 2;
+    if (!mapStakePlan.empty())
+        nTimeWake = min(nTimeWake, (int64_t)mapStakePlan.begin()->first);
+    nTimeWake = max(nTimeWake, nNow + 1);
+    return false;
+}
+
+void CWallet::ConsumeStakePlan(int64_t nTimeSearched)
+{
+    LOCK(cs_wallet);
+    mapStakePlan.erase(mapStakePlan.begin(), mapStakePlan.upper_bound(nTimeSearched));
+}
+
+void CWallet::ResetStakeWeight()
+{
+    AssertLockHeld(cs_wallet);
+
+    const CStakeCandidates& candidates = *pstakeCandidates;
+    nStakeWeightMinAge = GetStakeMinAge();
+    vStakeWeightOrder.clear();
+    vStakeWeightOrder.reserve(candidates.size());
+    for (unsigned int i = 0; i < candidates.size(); i++)
+        vStakeWeightOrder.push_back(make_pair((int64_t)candidates.vnTxTime[i] + nStakeWeightMinAge, i));
+    sort(vStakeWeightOrder.begin(), vStakeWeightOrder.end());
 
-        int64_t nTimeWeight = GetWeight((int64_t)pcoin.first->nTime, (int64_t)GetTime());
-        CBigNum bnCoinDayWeight = CBigNum(pcoin.first->vout[pcoin.second].nValue) * nTimeWeight / COIN / (24 * 60 * 60);
+    nStakeWeightFull = nStakeWeightGrowing = 0;
+    bnStakeGrowingValue = 0;
+    bnStakeGrowingValueTime = 0;
+    nStakeFullWeight = 0;
+}
 
-        // Weight is greater than zero
-        if (nTimeWeight > 0)
-            nWeight += bnCoinDayWeight.getuint64();
+// The weight of a coin is zero until its growth start time, then grows by one
+// second a second up to nStakeMaxAge, as GetWeight after the 1.5 switch. The
+// growing coins are summed as one, so their weight may exceed the sum of the
+// per coin rounded weights by less than one per coin.
+void CWallet::UpdateStakeWeight(int64_t nTime)
+{
+    AssertLockHeld(cs_wallet);
 
-        // Weight is greater than zero, but the maximum value isn't reached yet
-        if (nTimeWeight > 0 && nTimeWeight < nStakeMaxAge)
-            nMinWeight += bnCoinDayWeight.getuint64();
+    // Start over if the clock went back or the minimum age changed
+    if (nTime < nStakeWeightTime || nStakeWeightMinAge != (int64_t)GetStakeMinAge())
+        ResetStakeWeight();
 
-        // Maximum weight was reached
-        if (nTimeWeight == nStakeMaxAge)
-            nMaxWeight += bnCoinDayWeight.getuint64();
+    const CStakeCandidates& candidates = *pstakeCandidates;
+    while (nStakeWeightGrowing < vStakeWeightOrder.size() && vStakeWeightOrder[nStakeWeightGrowing].first < nTime)
+    {
+        CBigNum bnValue(candidates.vnValue[vStakeWeightOrder[nStakeWeightGrowing].second]);
+        bnStakeGrowingValue += bnValue;
+        bnStakeGrowingValueTime += bnValue * vStakeWeightOrder[nStakeWeightGrowing].first;
+        nStakeWeightGrowing++;
+    }
+    while (nStakeWeightFull < nStakeWeightGrowing && vStakeWeightOrder[nStakeWeightFull].first + nStakeMaxAge <= nTime)
+    {
+        CBigNum bnValue(candidates.vnValue[vStakeWeightOrder[nStakeWeightFull].second]);
+        bnStakeGrowingValue -= bnValue;
+        bnStakeGrowingValueTime -= bnValue * vStakeWeightOrder[nStakeWeightFull].first;
+        CBigNum bnCoinDayWeight = bnValue * nStakeMaxAge / COIN / (24 * 60 * 60);
+        nStakeFullWeight += bnCoinDayWeight.getuint64();
+        nStakeWeightFull++;
     }
 
-    return true;
+    CBigNum bnGrowingWeight = (bnStakeGrowingValue * nTime - bnStakeGrowingValueTime) / COIN / (24 * 60 * 60);
+    uint64_t nMinWeight = bnGrowingWeight.getuint64();
+    uint64_t nMaxWeight = nStakeFullWeight;
+
+    LOCK(cs_stakeweight);
+    nStakeWeightMin = nMinWeight;
+    nStakeWeightMax = nMaxWeight;
+    nStakeWeightTotal = nMinWeight + nMaxWeight;
+    nStakeWeightTime = nTime;
+    nStakeCandidateCount = candidates.size();
+    nStakeCandidateBytes = candidates.GetMemoryUsage();
+}
+
+void CWallet::ClearStakeWeight()
+{
+    // nStakeWeightTime is left alone, it belongs to the cs_wallet side
+    LOCK(cs_stakeweight);
+    nStakeWeightMin = nStakeWeightMax = nStakeWeightTotal = 0;
+}
+
+int64_t CWallet::GetLastStakeWeight(uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight) const
+{
+    LOCK(cs_stakeweight);
+    nMinWeight = nStakeWeightMin;
+    nMaxWeight = nStakeWeightMax;
+    nWeight = nStakeWeightTotal;
+    return nStakeWeightTime;
 }
 
 bool CWallet::MergeCoins(const int64_t& nAmount, const int64_t& nMinValue, const int64_t& nOutputValue, std::list<uint256>& listMerged)
@@ -1941,11 +2294,12 @@ bool CWallet::MergeCoins(const int64_t& nAmount, const int64_t& nMinValue, const
         {
             wtxNew.vout[0].nValue -= nMinFee; // Set actual fee
 
+            CSignatureHashContext txContext(wtxNew);
             for (unsigned int i = 0; i < wtxNew.vin.size(); i++) {
                 const CWalletTx *txin = vwtxPrev[i];
 
                 // Sign all scripts
-                if (!SignSignature(*this, *txin, wtxNew, i))
+                if (!SignSignature(*this, *txin, wtxNew, i, SIGHASH_ALL, &txContext))
                     return false;
             }
 
@@ -1977,11 +2331,12 @@ bool CWallet::MergeCoins(const int64_t& nAmount, const int64_t& nMinValue, const
         if (wtxNew.vout[0].nValue <= 0)
             return false;
 
+        CSignatureHashContext txContext(wtxNew);
         for (unsigned int i = 0; i < wtxNew.vin.size(); i++) {
             const CWalletTx *txin = vwtxPrev[i];
 
             // Sign all scripts again
-            if (!SignSignature(*this, *txin, wtxNew, i))
+            if (!SignSignature(*this, *txin, wtxNew, i, SIGHASH_ALL, &txContext))
                 return false;
         }
 
@@ -2026,48 +2381,15 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 
     vector<const CWalletTx*> vwtxPrev;
 
+    boost::shared_ptr<const CStakeCandidates> pcandidates;
     CTxDB txdb("r");
     {
         LOCK2(cs_main, cs_wallet);
-        // Cache outputs unless best block or wallet transaction set changed
-        if (!fCoinsDataActual && !IsLocked())
-        {
-            mapMeta.clear();
-            int64_t nValueIn = 0;
-            CoinsSet setCoins;
-            if (!SelectCoinsForStaking(nBalance - nReserveBalance, GetAdjustedTime(),setCoins, nValueIn))
-                return false;
-
-            if (setCoins.empty())
-                return false;
-
-            {
-                CTxIndex txindex;
-                CBlock block;
-                for(CoinsSet::iterator pcoin = setCoins.begin(); pcoin != setCoins.end(); pcoin++)
-                {
-                    // Load transaction index item
-                    if (!txdb.ReadTxIndex(pcoin->first->GetHash(), txindex))
-                        continue;
-
-                    // Read block header
-                    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                        continue;
-
-                    uint64_t nStakeModifier = 0;
-                    if (!GetKernelStakeModifier(block.GetHash(), nStakeModifier))
-                        continue;
-
-                    // Add meta record
-                    // (txid, vout.n) => ((txindex, (tx, vout.n)), (block, modifier))
-                    mapMeta[make_pair(pcoin->first->GetHash(), pcoin->second)] = make_pair(make_pair(txindex, *pcoin), make_pair(block, nStakeModifier));
-                }
-            }
-
-            LogPrint("coinstake", "----CreateCoinStake: %zu meta items loaded for %zu coins for wallet %s-----\n", mapMeta.size(), setCoins.size(),strWalletFile.c_str());
-            fCoinsDataActual = true;
-        }
+        if (!CacheStakeCandidates(txdb, nBalance))
+            return false;
+        pcandidates = pstakeCandidates;
     }
+    const CStakeCandidates& candidates = *pcandidates;
 
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
@@ -2076,13 +2398,13 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     settings.nBits = nBits;
     settings.nTime = txNew.nTime;
     settings.nOffset = 0;
-    settings.nLimit = mapMeta.size();
+    settings.nLimit = candidates.size();
     settings.nSearchInterval = nSearchInterval;
 
     unsigned int nTimeTx, nBlockTime;
     CoinsSet::value_type kernelcoin;
 
-    if (ScanForStakeKernelHash(mapMeta, settings, kernelcoin, nTimeTx, nBlockTime, this))
+    if (ScanForStakeKernelHash(candidates, settings, kernelcoin, nTimeTx, nBlockTime, this))
     {
         // Found a kernel
         LogPrint("coinstake","CreateCoinStake : kernel found\n");
@@ -2142,11 +2464,10 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
 
-    // (txid, vout.n) => ((txindex, (tx, vout.n)), (block, modifier))
-    for(MetaMap::const_iterator meta_item = mapMeta.begin(); meta_item != mapMeta.end(); meta_item++)
+    for (unsigned int i = 0; i < candidates.size(); i++)
     {
         // Get coin
-        CoinsSet::value_type pcoin = meta_item->second.first.second;
+        CoinsSet::value_type pcoin = candidates.GetCoin(i);
 
         // Attempt to add more inputs
         // Only add coins of the same key/address as kernel
@@ -2200,9 +2521,10 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 
         // Sign
         int nIn = 0;
+        CSignatureHashContext txContext(txNew);
         BOOST_FOREACH(const CWalletTx* pcoin, vwtxPrev)
         {
-            if (!SignSignature(*this, *pcoin, txNew, nIn++))
+            if (!SignSignature(*this, *pcoin, txNew, nIn++, SIGHASH_ALL, &txContext))
                 return error("CreateCoinStake : failed to sign coinstake");
         }
 
@@ -2805,7 +3127,10 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, in
                 }
             }
             if (fUpdated)
+            {
+                MarkStakeCoinsDirty(hash);
                 NotifyTransactionChanged(this, hash, CT_UPDATED);
+            }
         }
 
         if((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetDepthInMainChain() < 0)
@@ -2838,6 +3163,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                MarkStakeCoinsDirty(txin.prevout.hash);
             }
         }
     }
@@ -2968,7 +3294,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        CBlockIndexMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
@@ -3349,13 +3675,9 @@ bool CWalletManager::LoadWalletFromFile(const string& strFile, string& strName,
         LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
     }
 
-    if ( !pWallet->IsCrypted() )
-    {
-       if (!NewThread(ThreadStakeMinter, pWallet))
-          LogPrintf("Error: NewThread(ThreadStakeMinter) failed\n");
-    }
-    else
-      LogPrintf("Skipped ThreadStakeMinter for wallet: %s due to encryption\n", pWallet->strWalletFile);
+    // The stake miner picks up the new wallet on its next round
+    if (!fStopStaking)
+        StartStakeMiner();
 
     return true;
 }
@@ -3374,29 +3696,50 @@ void CWalletManager::RestartStakeMiner()
        {
          fStopStaking = false;
          MilliSleep(500);
-         vector<string> vstrNames;
-         vector<boost::shared_ptr<CWallet> > vpWallets;
 
-         BOOST_FOREACH(const wallet_map::value_type& item, wallets)
-         {
-            vstrNames.push_back(item.first);
-            vpWallets.push_back(item.second);
-         }
-         for (unsigned int i = 0; i < vstrNames.size(); i++)
-         {
-             if ( !vpWallets[i].get()->IsCrypted() || !vpWallets[i].get()->IsLocked() )
-              {
-                 LogPrintf ("Restarting ThreadStakeMinter for: %s\n", vstrNames[i]);
-                 if (!NewThread(ThreadStakeMinter, vpWallets[i].get()))
-                    LogPrintf("Error: NewThread(ThreadStakeMinter) failed\n");
-              }
-              else
-                LogPrintf("Skipped ThreadStakeMinter for wallet: %s due to encryption\n", vstrNames[i]);
-         }
+         // One miner stakes for all wallets that are unlocked
+         LogPrintf ("Restarting ThreadStakeMinter for %d wallets\n", (int)wallets.size());
+         StartStakeMiner();
        }
     }
 }
 
+// A miner that was stopped but has not exited yet is kept on rather than
+// started again, so stop and start in quick succession leave one miner
+bool CWalletManager::StartStakeMiner()
+{
+    LOCK(cs_StakeMinerStart);
+
+    // Already staking for all wallets
+    if (nStakeMinerThreads > 0)
+    {
+        fStakeMinerWanted = true;
+        return true;
+    }
+
+    nStakeMinerThreads++;
+    fStakeMinerWanted = false;
+    if (!NewThread(ThreadStakeMinter, this))
+    {
+        nStakeMinerThreads--;
+        LogPrintf("Error: NewThread(ThreadStakeMinter) failed\n");
+        return false;
+    }
+    return true;
+}
+
+bool CWalletManager::StakeMinerExiting(bool fFailed)
+{
+    LOCK(cs_StakeMinerStart);
+    if (fStakeMinerWanted && !fFailed && !fStopStaking && !fShutdown)
+    {
+        fStakeMinerWanted = false;
+        return false;
+    }
+    nStakeMinerThreads--;
+    return true;
+}
+
 void CWalletManager::StakeForCharity()
 {
     {
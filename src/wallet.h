@@ -83,6 +83,70 @@ public:
     )
 };
 
+/** Kernel data of the coins available for staking.
+ * Kept as a structure of arrays in (txid, vout.n) order: the kernel search
+ * and the stake weight only touch a few 32-bit fields and the 64-bit stake
+ * modifier per coin, instead of a CTxIndex and a whole CBlock copy.
+ */
+class CStakeCandidates
+{
+public:
+    std::vector<const CWalletTx*> vpTx;     // transaction holding the coin
+    std::vector<unsigned int> vnOut;        // output index of the coin
+    std::vector<int64_t> vnValue;           // coin value
+    std::vector<unsigned int> vnTxTime;     // transaction timestamp
+    std::vector<unsigned int> vnBlockTime;  // timestamp of the block holding the transaction
+    std::vector<unsigned int> vnTxOffset;   // transaction offset inside its block
+    std::vector<uint64_t> vnStakeModifier;  // kernel stake modifier of the coin
+
+    unsigned int size() const { return vpTx.size(); }
+    bool empty() const { return vpTx.empty(); }
+
+    void clear();
+    void reserve(unsigned int n);
+    void push_back(const CWalletTx* ptx, unsigned int nOut, unsigned int nBlockTime, unsigned int nTxOffset, uint64_t nStakeModifier);
+
+    std::pair<const CWalletTx*, unsigned int> GetCoin(unsigned int nPos) const
+    {
+        return std::make_pair(vpTx[nPos], vnOut[nPos]);
+    }
+
+    // Heap memory held by the table, in bytes
+    size_t GetMemoryUsage() const;
+};
+
+// Seconds of future timestamps evaluated by the look-ahead stake schedule
+static const unsigned int STAKE_PLAN_AHEAD = 5 * 60;
+
+// Seconds the stake weight snapshot of a wallet is reused for
+static const int64_t STAKE_WEIGHT_REFRESH = 60;
+
+// Disconnected blocks after which the stake coins are reloaded instead of patched
+static const int STAKE_COINS_REORG_DEPTH = 10;
+
+/** Kernel data of a confirmed unspent output of the wallet.
+ * Kept for every such output whether it can stake yet or not, so a wallet
+ * change only rechecks the transactions involved and CStakeCandidates is
+ * built without walking mapWallet or reading the disk again.
+ */
+class CStakeCoinInfo
+{
+public:
+    uint256 hashBlock;           // block holding the transaction
+    int nHeight;                 // height of that block
+    bool fMaturing;              // coinbase or coinstake output, subject to maturity
+    unsigned int nTxTime;        // transaction timestamp
+    unsigned int nBlockTime;     // timestamp of the block
+    bool fTxOffset;              // whether nTxOffset was read from disk yet
+    unsigned int nTxOffset;      // transaction offset inside the block
+    bool fStakeModifier;         // whether the kernel stake modifier is known yet
+    int nStakeModifierHeight;    // height of the block the modifier was taken from
+    uint64_t nStakeModifier;
+
+    CStakeCoinInfo() : hashBlock(0), nHeight(0), fMaturing(false), nTxTime(0), nBlockTime(0), fTxOffset(false), nTxOffset(0),
+        fStakeModifier(false), nStakeModifierHeight(0), nStakeModifier(0) {}
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -106,8 +170,61 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
-    // selected coins metadata
-    std::map<std::pair<uint256, unsigned int>, std::pair<std::pair<CTxIndex, std::pair<const CWalletTx*,unsigned int> >, std::pair<CBlock, uint64_t> > > mapMeta;
+    // selected coins kernel data, replaced as a whole on reload so the stake
+    // miner can plan and search a copy of the pointer without cs_wallet
+    boost::shared_ptr<const CStakeCandidates> pstakeCandidates;
+
+    // confirmed unspent outputs that may stake, once fStakeCoinsLoaded; the
+    // transactions in setStakeCoinsDirty are to be checked again
+    std::map<COutPoint, CStakeCoinInfo> mapStakeCoinInfo;
+    std::set<uint256> setStakeCoinsDirty;
+    bool fStakeCoinsLoaded;
+    int nStakeCoinsDisconnected;      // blocks disconnected since the last update
+
+    // what pstakeCandidates was selected with, and the best height and time
+    // at which the next output passes maturity or the minimum age
+    int64_t nStakeCandidatesTarget;
+    unsigned int nStakeCandidatesMinAge;
+    int nStakeCandidatesNextHeight;
+    unsigned int nStakeCandidatesNextTime;
+
+    void AddStakeCoins(const CWalletTx& wtx, const std::map<unsigned int, CStakeCoinInfo>& mapOld);
+    void MarkStakeCoinsDirty(const uint256& hash);
+
+    // Update pstakeCandidates from the wallet changes since the last call
+    bool CacheStakeCandidates(CTxDB& txdb, int64_t nBalance);
+
+    // look-ahead stake schedule: nTimeTx => pstakeCandidates position of planned kernel hits
+    std::multimap<unsigned int, unsigned int> mapStakePlan;
+    unsigned int nStakePlanBits;  // target the schedule was computed for
+    unsigned int nStakePlanTo;    // last timestamp covered by the schedule
+
+    // stake weight of pstakeCandidates as of nStakeWeightTime, 0 if not computed yet
+    mutable CCriticalSection cs_stakeweight;
+    uint64_t nStakeWeightMin;
+    uint64_t nStakeWeightMax;
+    uint64_t nStakeWeightTotal;
+    int64_t nStakeWeightTime;
+    unsigned int nStakeCandidateCount;   // size of pstakeCandidates at that time
+    size_t nStakeCandidateBytes;         // and its memory usage
+
+    // pstakeCandidates positions by the time their weight starts to grow. Up to
+    // nStakeWeightFull they have the maximum weight, up to nStakeWeightGrowing
+    // their weight grows; coins only move forward as they age.
+    std::vector<std::pair<int64_t, unsigned int> > vStakeWeightOrder;
+    int64_t nStakeWeightMinAge;        // minimum stake age the order was built with
+    unsigned int nStakeWeightFull;
+    unsigned int nStakeWeightGrowing;
+    CBigNum bnStakeGrowingValue;       // total value of the growing coins
+    CBigNum bnStakeGrowingValueTime;   // total value * growth start time of the growing coins
+    uint64_t nStakeFullWeight;         // weight of the coins with the maximum weight
+
+    // Rebuild vStakeWeightOrder after pstakeCandidates was replaced
+    void ResetStakeWeight();
+    // Update the stake weight snapshot, only the coins that changed group are visited
+    void UpdateStakeWeight(int64_t nTime);
+    // Report no stake weight while the balance is within the reserve
+    void ClearStakeWeight();
 
 public:
     /// Main wallet lock.
@@ -129,6 +246,9 @@ public:
     CBitcoinAddress strStakeForCharityChangeAddress;
     std::string strWalletFile;
     int64_t nReserveBalance;
+
+    // end of the last coinstake search, see CBlock::SignPoSBlock
+    int64_t nLastCoinStakeSearchTime;
     bool fSplitBlock;
 
 
@@ -166,6 +286,23 @@ public:
         fWalletUnlockMintOnly = false;
         fStakeForCharity = false;
         fCoinsDataActual = false;
+        fStakeCoinsLoaded = false;
+        nStakeCoinsDisconnected = 0;
+        nStakeCandidatesTarget = 0;
+        nStakeCandidatesMinAge = 0;
+        nStakeCandidatesNextHeight = 0;
+        nStakeCandidatesNextTime = 0;
+        nStakePlanBits = 0;
+        nStakePlanTo = 0;
+        pstakeCandidates.reset(new CStakeCandidates());
+        nLastCoinStakeSearchTime = 0;
+        nStakeWeightMin = nStakeWeightMax = nStakeWeightTotal = 0;
+        nStakeWeightTime = 0;
+        nStakeCandidateCount = 0;
+        nStakeCandidateBytes = 0;
+        nStakeWeightMinAge = 0;
+        nStakeWeightFull = nStakeWeightGrowing = 0;
+        nStakeFullWeight = 0;
         nStakeForCharityPercent = 0;
         nStakeForCharityMin = MIN_TXOUT_AMOUNT;
         nStakeForCharityMax = MAX_MONEY;
@@ -268,8 +405,15 @@ public:
     bool CreateTransaction(const std::vector<std::pair<CScript, int64_t> >& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, int nSplitBlock, bool fAllowS4C=false, const CCoinControl *coinControl=NULL);
     bool CreateTransaction(CScript scriptPubKey, int64_t nValue, CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, bool fAllowS4C=false, const CCoinControl *coinControl=NULL);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
-    bool GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight);
+    // Stake weight snapshot as last computed, never blocks on cs_main or cs_wallet
+    int64_t GetLastStakeWeight(uint64_t& nMinWeight, uint64_t& nMaxWeight, uint64_t& nWeight) const;
     bool GetStakeWeightFromValue(const int64_t& nTime, const int64_t& nValue, uint64_t& nWeight);
+    // Stake candidates of the snapshot, never blocks on cs_main or cs_wallet
+    void GetStakeCandidatesInfo(unsigned int& nCount, size_t& nMemoryUsage) const;
+    // Whether a planned kernel hit for target nBits is due, otherwise nTimeWake is when to ask again
+    bool GetStakePlanDue(unsigned int nBits, int64_t& nTimeWake);
+    // Drop the planned kernel hits up to nTimeSearched, once a block was searched for them
+    void ConsumeStakePlan(int64_t nTimeSearched);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CTransaction& txNew, CKey& key);
     bool MergeCoins(const int64_t& nAmount, const int64_t& nMinValue, const int64_t& nMaxValue, std::list<uint256>& listMerged);
     std::string SendMoney(CScript scriptPubKey, int64_t nValue, CWalletTx& wtxNew, bool fAskFee=false, bool fAllowS4C=false);
@@ -395,6 +539,8 @@ public:
     int GetVersion() { LOCK(cs_wallet); return nWalletVersion; }
 
     void SetCoinsDataActual(bool fCoinsDataActualSet);
+    // The block at nHeight holding tx is being disconnected
+    void DisconnectStakeCoins(const CTransaction& tx, int nHeight);
     bool GetCoinsDataActual() { LOCK(cs_wallet); return fCoinsDataActual; }
 
     void FixSpentCoins(int& nMismatchSpent, int64_t& nBalanceInQuestion, int& nOrphansFound, bool fCheckOnly = false);
@@ -443,7 +589,13 @@ protected:
     mutable CCriticalSection cs_WalletManager;
     wallet_map wallets;
 
+    // Guards starting and exiting of the stake miner, so at most one runs
+    CCriticalSection cs_StakeMinerStart;
+    int nStakeMinerThreads;     // started and not exited, 0 or 1
+    bool fStakeMinerWanted;     // a start found the miner running, it is not to exit unless stopped
+
 public:
+    CWalletManager() : nStakeMinerThreads(0), fStakeMinerWanted(false) {}
     ~CWalletManager() { UnloadAllWallets(); }
 
     std::set<COutPoint> setLockedCoins;
@@ -453,6 +605,9 @@ public:
     bool UnloadWallet(const std::string& strName);
     void UnloadAllWallets();
     void RestartStakeMiner();
+    bool StartStakeMiner();
+    // Called by the stake miner thread when StakeMiner returned, false if it is to run again
+    bool StakeMinerExiting(bool fFailed = false);
     void StakeForCharity();
     int64_t GetTotalBalance();
 
@@ -461,7 +616,7 @@ public:
     boost::shared_ptr<CWallet> GetDefaultWallet() { return GetWallet(""); }
 
     int GetWalletCount() { return wallets.size(); }
-    wallet_map GetWalletMap() { return wallets; }
+    wallet_map GetWalletMap() { LOCK(cs_WalletManager); return wallets; }
     bool HaveWallet(const std::string& strName) { return (wallets.count(strName) > 0); }
 
     static bool IsValidName(const std::string& strName);